@@ -3,9 +3,29 @@
 // Default vertex shader for materials. Extend this to deal with bump mapping, defered rendering, shadows etc.
 //
 
-// matrices
-uniform mat4 modelToProjection;
-uniform mat4 modelToCamera;
+#ifdef GL_ARB_uniform_buffer_object
+  #extension GL_ARB_uniform_buffer_object : enable
+
+  // per draw parameters in a uniform buffer, in the order material creates them
+  layout(std140) uniform dynamic_uniforms {
+    mat4 modelToProjection;
+    mat4 modelToCamera;
+    vec4 lighting[17];
+    int num_lights;
+    mat4 cameraToProjection;
+    int instanced;
+  };
+#else
+  // matrices
+  uniform mat4 modelToProjection;
+  uniform mat4 modelToCamera;
+
+  // instanced draws take modelToCamera from a per instance attribute instead
+  uniform mat4 cameraToProjection;
+  uniform int instanced;
+#endif
+
+attribute mat4 instance_modelToCamera;
 
 // attributes from vertex buffer
 attribute vec4 pos;
@@ -21,9 +41,15 @@ varying vec3 model_pos_;
 varying vec3 camera_pos_;
 
 void main() {
-  gl_Position = modelToProjection * pos;
-  vec3 tnormal = (modelToCamera * vec4(normal, 0.0)).xyz;
-  vec3 tpos = (modelToCamera * pos).xyz;
+  mat4 toCamera = modelToCamera;
+  mat4 toProjection = modelToProjection;
+  if (instanced != 0) {
+    toCamera = instance_modelToCamera;
+    toProjection = cameraToProjection * instance_modelToCamera;
+  }
+  gl_Position = toProjection * pos;
+  vec3 tnormal = (toCamera * vec4(normal, 0.0)).xyz;
+  vec3 tpos = (toCamera * pos).xyz;
   normal_ = tnormal;
   uv_ = uv;
   color_ = color;
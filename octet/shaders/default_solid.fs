@@ -3,10 +3,29 @@
 // default frament shader for solid colours
 //
 
-// constant parameters
-uniform vec4 lighting[17];
-uniform int num_lights;
-uniform vec4 diffuse;
+#ifdef GL_ARB_uniform_buffer_object
+  #extension GL_ARB_uniform_buffer_object : enable
+
+  // per draw parameters in a uniform buffer, in the order material creates them
+  layout(std140) uniform dynamic_uniforms {
+    mat4 modelToProjection;
+    mat4 modelToCamera;
+    vec4 lighting[17];
+    int num_lights;
+    mat4 cameraToProjection;
+    int instanced;
+  };
+
+  // material parameters, uploaded once
+  layout(std140) uniform static_uniforms {
+    vec4 diffuse;
+  };
+#else
+  // constant parameters
+  uniform vec4 lighting[17];
+  uniform int num_lights;
+  uniform vec4 diffuse;
+#endif
 
 // inputs
 varying vec2 uv_;
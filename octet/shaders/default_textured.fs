@@ -3,9 +3,24 @@
 // default frament shader for textures
 //
 
-// constant parameters
-uniform vec4 lighting[17];
-uniform int num_lights;
+#ifdef GL_ARB_uniform_buffer_object
+  #extension GL_ARB_uniform_buffer_object : enable
+
+  // per draw parameters in a uniform buffer, in the order material creates them
+  layout(std140) uniform dynamic_uniforms {
+    mat4 modelToProjection;
+    mat4 modelToCamera;
+    vec4 lighting[17];
+    int num_lights;
+    mat4 cameraToProjection;
+    int instanced;
+  };
+#else
+  // constant parameters
+  uniform vec4 lighting[17];
+  uniform int num_lights;
+#endif
+
 uniform sampler2D diffuse_sampler;
 
 // inputs
@@ -54,6 +54,9 @@ namespace octet {
       helix->allocate(sizeof(my_vertex)* num_vertices, sizeof(uint32_t)* num_indices);
       helix->set_params(sizeof(my_vertex), num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
 
+      // the compute shader writes the vertices, so a CPU copy would be out of date.
+      helix->get_vertices()->set_shadowed(false);
+
       {
         // this step seems to be necessary on AMD drivers
         gl_resource::wolock vl(helix->get_vertices());
@@ -22,8 +22,6 @@ namespace octet {
         vec3p color;
       };
 
-      dynarray<my_vertex> vertices;
-
       std::vector<float> prev_density;
       std::vector<float> prev_vx;
       std::vector<float> prev_vy;
@@ -247,7 +245,17 @@ namespace octet {
         float sy = bb.get_half_extent().y()*(2.0f/dim.y());
         float cx = bb.get_center().x() - bb.get_half_extent().x();
         float cy = bb.get_center().y() - bb.get_half_extent().y();
-        vertices.resize((dim.x()+1)*(dim.y()+1));
+        // write the vertices straight into the next region of a streaming buffer.
+        unsigned num_vertices = (dim.x()+1)*(dim.y()+1);
+        if (!get_vertices()->is_streaming()) {
+          gl_resource *vbuf = new gl_resource();
+          vbuf->allocate_stream(GL_ARRAY_BUFFER, num_vertices * sizeof(my_vertex));
+          set_vertices(vbuf);
+          set_params(sizeof(my_vertex), get_num_indices(), num_vertices, get_mode(), get_index_type());
+        }
+
+        gl_resource::wolock vlock(get_vertices());
+        my_vertex *vertices = (my_vertex *)vlock.u8();
         int stride =(dim.x()+1);
         size_t d = 0;
         for (int i = 0; i <= dim.x(); ++i) {
@@ -258,8 +266,6 @@ namespace octet {
             vertices[d++] = v;
           }
         }
-
-        mesh::set_vertices<my_vertex>(vertices);
       }
     };
 
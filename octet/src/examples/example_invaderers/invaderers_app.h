@@ -14,6 +14,7 @@
 //   Basic Matrices
 //   Simple game mechanics
 //   Texture loaded from GIF file
+//   Texture atlas
 //   Audio
 //
 
@@ -28,37 +29,39 @@ namespace octet {
     // half the height of the sprite
     float halfHeight;
 
-    // what texture is on our sprite
-    int texture;
+    // where our sprite's image is in the texture atlas (u0, v0, u1, v1)
+    vec4 uv_rect;
+
+    // false for invisible sprites
+    bool visible;
 
     // true if this sprite is enabled.
     bool enabled;
   public:
     sprite() {
-      texture = 0;
+      visible = false;
       enabled = true;
     }
 
-    void init(int _texture, float x, float y, float w, float h) {
+    void init(const vec4 &_uv_rect, float x, float y, float w, float h) {
       modelToWorld.loadIdentity();//resets matrix position to origin, i.e. [0,0,0]
       modelToWorld.translate(x, y, 0);//translate by x,y and not at all on the z-plane
       halfWidth = w * 0.5f;//obvious
       halfHeight = h * 0.5f;
-      texture = _texture;//basically just the index of the texture; set in app init
+      uv_rect = _uv_rect;//the corners of our image in the atlas; set in app init
+      visible = true;
       enabled = true;
     }
 
     void render(texture_shader &shader, mat4t &cameraToWorld) {
       // invisible sprite... used for gameplay.
-      if (!texture) return;
+      if (!visible) return;
 
       // build a projection matrix: model -> world -> camera -> projection
       // the projection space is the cube -1 <= x/w, y/w, z/w <= 1
       mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld);
 
-      // set up opengl to draw textured triangles using sampler 0 (GL_TEXTURE0)
-      glActiveTexture(GL_TEXTURE0);//makes GL_TEXTURE0 the active (draw) texture
-      glBindTexture(GL_TEXTURE_2D, texture);//from openGL api, binds the texture under index texture to the active texture
+      // the atlas texture is bound once for all the sprites in draw_world
 
       // use "old skool" rendering
       //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
@@ -85,12 +88,12 @@ namespace octet {
 	  // ^ uses current vertex attrib (i.e. vertices) and enables their use for rendering texture
       // v this is an array of the positions of the corners of the texture in 2D
       
-	  static const float uvs[] = {
-         0,  0,
-         1,  0,
-         1,  1,
-         0,  1,
-      };//essentially vertices normalised relative to size of sprite on texture
+	  float uvs[] = {
+         uv_rect[0], uv_rect[1],
+         uv_rect[2], uv_rect[1],
+         uv_rect[2], uv_rect[3],
+         uv_rect[0], uv_rect[3],
+      };//the corners of the sprite's image in the atlas
 
       // attribute_uv is position in the texture of each corner
       // each corner (vertex) has 2 floats (x, y)
@@ -204,8 +207,8 @@ namespace octet {
     // random number generator
     class random randomizer;
 
-    // a texture for our text
-    GLuint font_texture;
+    // all our images packed into one texture
+    ref<texture_atlas> atlas;
 
     // information for our text
     bitmap_font font;
@@ -400,9 +403,6 @@ namespace octet {
       aabb bb(vec3(0, 0, 0), vec3(256, 256, 0));
 
       unsigned num_quads = font.build_mesh(bb, vertices, indices, max_quads, text, 0);
-      glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D, font_texture);
-
       shader.render(modelToProjection, 0);
 
       glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, sizeof(bitmap_font::vertex), (void*)&vertices[0].x );
@@ -428,15 +428,27 @@ namespace octet {
       cameraToWorld.loadIdentity();
       cameraToWorld.translate(0, 0, 3);
 
-      font_texture = resource_dict::get_texture_handle(GL_RGBA, "assets/big_0.gif");
-
-      GLuint ship = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/ship.gif");
+      // pack all the images into one texture so that we only need to bind it once.
+      atlas = new texture_atlas(1024, 512);
+      int font_image = atlas->add("assets/big_0.gif");
+      int ship_image = atlas->add("assets/invaderers/ship.gif");
+      int game_over_image = atlas->add("assets/invaderers/GameOver.gif");
+      int invaderer_image = atlas->add("assets/invaderers/invaderer.gif");
+      int missile_image = atlas->add("assets/invaderers/missile.gif");
+      int bomb_image = atlas->add("assets/invaderers/bomb.gif");
+      static const uint8_t white_pixel[] = { 0xff, 0xff, 0xff, 0xff };
+      int white_image = atlas->add(white_pixel, 1, 1, 4);
+      atlas->build();
+
+      font.set_uv_rect(atlas->get_uv_rect(font_image));
+
+      vec4 ship = atlas->get_uv_rect(ship_image);
       sprites[ship_sprite].init(ship, 0, -2.75f, 0.25f, 0.25f);
 
-      GLuint GameOver = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/GameOver.gif");
+      vec4 GameOver = atlas->get_uv_rect(game_over_image);
       sprites[game_over_sprite].init(GameOver, 20, 0, 3, 1.5f);
 
-      GLuint invaderer = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/invaderer.gif");
+      vec4 invaderer = atlas->get_uv_rect(invaderer_image);
       for (int j = 0; j != num_rows; ++j) {
         for (int i = 0; i != num_cols; ++i) {
           assert(first_invaderer_sprite + i + j*num_cols <= last_invaderer_sprite);
@@ -448,14 +460,14 @@ namespace octet {
       }
 
       // set the border to white for clarity
-      GLuint white = resource_dict::get_texture_handle(GL_RGB, "#ffffff");
+      vec4 white = atlas->get_uv_rect(white_image);
       sprites[first_border_sprite+0].init(white, 0, -3, 6, 0.2f);
       sprites[first_border_sprite+1].init(white, 0,  3, 6, 0.2f);
       sprites[first_border_sprite+2].init(white, -3, 0, 0.2f, 6);
       sprites[first_border_sprite+3].init(white, 3,  0, 0.2f, 6);
 
       // use the missile texture
-      GLuint missile = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/missile.gif");
+      vec4 missile = atlas->get_uv_rect(missile_image);
       for (int i = 0; i != num_missiles; ++i) {
         // create missiles off-screen
         sprites[first_missile_sprite+i].init(missile, 20, 0, 0.0625f, 0.25f);
@@ -463,7 +475,7 @@ namespace octet {
       }
 
       // use the bomb texture
-      GLuint bomb = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/bomb.gif");
+      vec4 bomb = atlas->get_uv_rect(bomb_image);
       for (int i = 0; i != num_bombs; ++i) {
         // create bombs off-screen
         sprites[first_bomb_sprite+i].init(bomb, 20, 0, 0.0625f, 0.25f);
@@ -529,8 +541,13 @@ namespace octet {
       glEnable(GL_BLEND);
       glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
+      // one texture for everything
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, atlas->get_gl_texture(0));
+
       // draw all the sprites
       for (int i = 0; i != num_sprites; ++i) {
+
         sprites[i].render(texture_shader_, cameraToWorld);
       }
 
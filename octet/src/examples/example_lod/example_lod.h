@@ -26,29 +26,16 @@ namespace octet {
       // material used by all spheres.
       material *mat = new material(vec4(1, 0, 0, 1));
 
-      // second material to show effect
-      material *mat2 = new material(vec4(0, 1, 0, 1));
+      // the simpler levels are made from one detailed sphere, each within an error in model units.
+      static const float errors[] = { 0.002f, 0.008f, 0.03f };
+      dynarray<ref<mesh> > lods;
+      dynarray<float> lod_errors;
+      mesh_simplifier::build_lod_chain(new mesh_sphere(vec3(0), 0.5f, 4), errors, 3, lods, lod_errors);
 
-      // four different LOD models
-      mesh_sphere *spheres[] = {
-        new mesh_sphere(vec3(0), 0.5f, 3),
-        new mesh_sphere(vec3(0), 0.5f, 2),
-        new mesh_sphere(vec3(0), 0.5f, 1),
-        new mesh_sphere(vec3(0), 0.5f, 0)
-      };
-
-      // distances where LOD values change
-      static const float distances[] = {
-        //-1e37f, 3, 6, 18, 1e37f   // high performance, low quality
-        //-1e37f, 3, 6, 18, 1e37f   // high performance, low quality
-        -1e37f, 5, 15, 45, 1e37f  // medium performance and quality
-        //-1e37f, 5, 25, 125, 1e37f // low performance, high quality
-      };
-
-      // materials for LODs (it is common to have simpler shaders for further objects).
-      material *mats[] = {
-        mat, mat, mat, mat  // show smallest lod in different cocalclour
-      };
+      dynarray<mesh*> lod_meshes;
+      for (unsigned i = 0; i != lods.size(); ++i) {
+        lod_meshes.push_back(lods[i]);
+      }
 
       int num_x = 10;
       int num_y = 5;
@@ -62,16 +49,10 @@ namespace octet {
             scene_node *node = new scene_node();
             node->translate(vec3((x-num_x*0.5f) * 2.0f, (y - num_y*0.5f) * 2.0f, -z * 2.0f));
             app_scene->add_child(node);
-            for (int k = 0; k != 4; ++k) {
-              // The mesh instance has a min and max distance.
-              // By choosing these carefully, we will draw only one of the four variants
-              // depending on distance.
-              mesh_instance *mi = new mesh_instance(node, spheres[k], mats[k]);
-              mi->set_min_draw_distance(distances[k]);
-              mi->set_max_draw_distance(distances[k+1]);
-              mi->set_flags(mesh_instance::flag_enabled|mesh_instance::flag_lod);
-              app_scene->add_mesh_instance(mi);
-            }
+
+            // One mesh instance per level. Each sphere draws the coarsest level
+            // that is less than a pixel out on the screen.
+            app_scene->add_lod_mesh_instances(node, mat, lod_meshes.data(), lod_errors.data(), lods.size(), 1.0f);
           }
         }
       }
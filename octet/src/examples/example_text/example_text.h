@@ -63,7 +63,7 @@ namespace octet {
 
       // write some text to the overlay
       char buf[3][256];
-      const mat4t &mx = node->access_nodeToParent();
+      const mat4t &mx = node->get_nodeToParent();
 
       text->clear();
 
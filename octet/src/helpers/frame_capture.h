@@ -0,0 +1,153 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// save frames from the back buffer as JPEG files
+
+namespace octet { namespace helpers {
+  /// Class for capturing screenshots and gameplay frames without stalling the frame.
+  ///
+  /// capture() starts a glReadPixels into a pixel pack buffer and returns straight away.
+  /// update() writes the file a couple of frames later, when the GPU has finished with it.
+  ///
+  /// Example
+  ///
+  ///     // in draw_world, after drawing the scene
+  ///     if (is_key_going_down(key_f12)) {
+  ///       capture.capture("screenshot.jpg", 0, 0, vx, vy);
+  ///     }
+  ///     capture.update();
+  class frame_capture {
+    // captures in flight
+    enum { num_slots = 3 };
+
+    struct slot {
+      ref<gl_resource> buffer;
+      string filename;
+      int width;
+      int height;
+      unsigned frame;
+      bool pending;
+    } slots[num_slots];
+
+    unsigned frame_number;
+    unsigned next_slot;
+    jpeg_encoder encoder;
+    dynarray<uint8_t> jpeg;
+
+    // encode bottom-up RGBA pixels from glReadPixels and write the file.
+    bool save(const char *filename, int width, int height, const uint8_t *pixels) {
+      int stride = width * 4;
+      if (!encoder.encode(jpeg, width, height, -stride, pixels + (height - 1) * stride, 4)) {
+        return false;
+      }
+
+      FILE *file = fopen(filename, "wb");
+      if (!file) {
+        log("warning: frame_capture: could not write %s\n", filename);
+        return false;
+      }
+      fwrite(jpeg.data(), 1, jpeg.size(), file);
+      fclose(file);
+      return true;
+    }
+
+    // map the pixel pack buffer of a finished capture.
+    void write(slot &s) {
+      #ifndef OCTET_GLES2
+        {
+          gl_resource::rolock lock(s.buffer);
+          save(s.filename.c_str(), s.width, s.height, lock.u8());
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      #endif
+      s.pending = false;
+    }
+
+  public:
+    /// quality is 1 (small) to 100 (best)
+    frame_capture(int quality = 90) : encoder(quality) {
+      frame_number = 0;
+      next_slot = 0;
+      for (unsigned i = 0; i != num_slots; ++i) {
+        slots[i].width = slots[i].height = 0;
+        slots[i].frame = 0;
+        slots[i].pending = false;
+      }
+    }
+
+    ~frame_capture() {
+      flush();
+    }
+
+    /// set the JPEG quality from 1 to 100
+    void set_quality(int value) {
+      encoder.set_quality(value);
+    }
+
+    /// read a rectangle of the back buffer. The file is written by a later update() or flush().
+    void capture(const char *filename, int x, int y, int width, int height) {
+      if (width <= 0 || height <= 0) return;
+
+      #ifdef OCTET_GLES2
+        // GLES2 has no pixel pack buffers, so read the pixels now.
+        dynarray<uint8_t> pixels(width * height * 4);
+        glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)pixels.data());
+        save(filename, width, height, pixels.data());
+      #else
+        slot &s = slots[next_slot];
+        next_slot = (next_slot + 1) % num_slots;
+
+        // all the slots are in use: finish the oldest capture now.
+        if (s.pending) write(s);
+
+        size_t size = (size_t)width * height * 4;
+        if (!s.buffer || s.buffer->get_size() < size) {
+          s.buffer = new gl_resource();
+          s.buffer->allocate(GL_PIXEL_PACK_BUFFER, size, GL_STREAM_READ);
+        }
+
+        // with a pack buffer bound, glReadPixels queues a copy and does not wait for the GPU.
+        s.buffer->bind();
+        glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        s.filename = filename;
+        s.width = width;
+        s.height = height;
+        s.frame = frame_number;
+        s.pending = true;
+      #endif
+    }
+
+    /// call once per frame to write captures that the GPU has finished.
+    void update() {
+      frame_number++;
+      for (unsigned i = 0; i != num_slots; ++i) {
+        slot &s = slots[(next_slot + i) % num_slots];
+        if (s.pending && frame_number - s.frame >= num_slots - 1) {
+          write(s);
+        }
+      }
+    }
+
+    /// write all outstanding captures, waiting for the GPU if necessary.
+    void flush() {
+      for (unsigned i = 0; i != num_slots; ++i) {
+        slot &s = slots[(next_slot + i) % num_slots];
+        if (s.pending) write(s);
+      }
+    }
+
+    /// number of captures that have not been written yet.
+    unsigned get_num_pending() const {
+      unsigned n = 0;
+      for (unsigned i = 0; i != num_slots; ++i) {
+        n += slots[i].pending;
+      }
+      return n;
+    }
+  };
+}}
@@ -18,6 +18,8 @@ namespace octet { namespace helpers {
     /// Create an empty text overlay.
     text_overlay() {
       image *page = new image("assets/courier_18_0.gif");
+      // glyph edges are sharper without block compression
+      page->set_block_compress(false);
       page->load();
       font = new bitmap_font(
         page->get_width(), page->get_height(), "assets/courier_18.fnt"
@@ -101,7 +101,7 @@ namespace octet { namespace loaders {
     }
 
     // convert a string like "1.2 3.4 43.12" into an array of float values
-    void atofv(dynarray<float> &values, const char *src) {  
+    static void atofv(dynarray<float> &values, const char *src) {  
       values.resize(0);
       if (!src) return;
 
@@ -132,7 +132,7 @@ namespace octet { namespace loaders {
     }
 
     // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, const char *src) {  
+    static void atoiv(dynarray<int> &values, const char *src) {  
       //values.resize(0);
       if (!src) return;
 
@@ -167,6 +167,19 @@ namespace octet { namespace loaders {
       }
     }
 
+    // an <input> tag resolved to its accessor.
+    // the xml is only read on the main thread, workers use the text pointers.
+    struct input_source {
+      const char *semantic;   // POSITION, NORMAL, JOINT, WEIGHT etc.
+      const char *text;       // text of the accessor's array
+      int type;               // 1 = float, 2 = float4x4, 3 = name
+      unsigned size;          // number of values per vertex
+      unsigned input_offset;  // offset of the index in <p> or <v>
+      unsigned attr_offset;   // offset in the vertex in floats
+      int accessor_offset;
+      int accessor_stride;
+    };
+
     // structure used when building a skin
     struct skin_state {
       // collada-style skin state
@@ -177,6 +190,12 @@ namespace octet { namespace loaders {
       dynarray<float> bind_shape_matrix; // from BIND_SHAPE_MATRIX element
       string joints;                     // from JOINT semantic - sids of affected nodes
 
+      // unparsed <vertex_weights>
+      const char *vcount_text;
+      dynarray<const char *> v_texts;
+      dynarray<input_source> sources;
+      unsigned input_stride;
+
       // OpenGL-style skin state
       enum { max_indices = 4 };
       dynarray<float> gl_weights;
@@ -186,20 +205,38 @@ namespace octet { namespace loaders {
     // a structure to keep track of the complex COLLADA <input> tags
     struct parse_input_state {
       mesh *s;
-      dynarray<int> p;
-      dynarray<float> vertices;
-      dynarray<unsigned> indices;
       unsigned attr_offset;
-      unsigned attr_stride;
       unsigned input_offset;
-      unsigned input_stride;
-      unsigned slot;
-      unsigned vertex_input_offset;
       int pass;
+      dynarray<input_source> *sources;
+    };
+
+    // a <triangles> or <polylist> element on its way to becoming a mesh.
+    // 1) prepare_mesh_component reads the xml and adds the attributes (main thread)
+    // 2) build_mesh_component makes the vertices and indices (any thread)
+    // 3) upload_mesh_component copies them to the mesh (main thread)
+    struct mesh_component_job {
+      mesh *msh;
       skin_state *skinst;
+
+      dynarray<const char *> p_texts;
+      const char *vcount_text;
+      dynarray<input_source> sources;
+      unsigned input_stride;
+      unsigned attr_stride;
+      unsigned vertex_input_offset;
+      unsigned blendweight_offset;
+      unsigned blendindices_offset;
+
+      dynarray<float> vertices;
+      dynarray<unsigned> indices;
+      unsigned num_vertices;
+      float bb_min[3];
+      float bb_max[3];
+      bool is_valid;
     };
 
-    // parse and <input> tag
+    // resolve an <input> tag and record it in state.sources
     void parse_input(parse_input_state &state, TiXmlElement *input) {
       const char *source = input->Attribute("source");
       const char *semantic = input->Attribute("semantic");
@@ -288,62 +325,56 @@ namespace octet { namespace loaders {
         return;
       }
 
-      unsigned p_size = state.p.size();
-      unsigned num_vertices = p_size / state.input_stride;
+      input_source src;
+      src.semantic = semantic;
+      src.text = NULL;
+      src.type = type;
+      src.size = size;
+      src.input_offset = state.input_offset;
+      src.attr_offset = state.attr_offset;
+      src.accessor_offset = accessor_offset_int;
+      src.accessor_stride = accessor_stride_int;
 
       if (state.pass == 1) {
-        // attribute metrics pass
+        // attribute pass: add the attribute now, fill it in later
+        if (!strcmp(accessor_source_elem->Value(), "float_array")) {
+          src.text = accessor_source_elem->GetText();
+        }
         unsigned attr = semantic_to_attr(semantic, set);
         state.s->add_attribute(attr, size, GL_FLOAT, state.attr_offset * 4);
         state.attr_offset += size;
-      } else if (state.pass == 2) {
-        dynarray<float> accessor_floats;
-        if (!strcmp(accessor_source_elem->Value(), "float_array")) {
-          atofv(accessor_floats, accessor_source_elem->GetText());
+        state.sources->push_back(src);
+      } else if (state.pass == 3) {
+        // skin pass
+        if (!strcmp(semantic, "JOINT") || !strcmp(semantic, "WEIGHT")) {
+          src.text = accessor_source_elem->GetText();
+          state.sources->push_back(src);
         }
+      }
+    }
 
-        // attribute building pass
-        for (unsigned i = 0; i != num_vertices; ++i) {
-          unsigned index = state.p[i * state.input_stride + state.input_offset];
-          //printf("%d ", index);
-          for (unsigned j = 0; j != size; ++j) {
-            //printf("i=%d j=%d idx=%d\n", i, j, index);
-            unsigned dest_idx = i * state.attr_stride + state.attr_offset + j;
-            unsigned src_idx = accessor_offset_int + index * accessor_stride_int + j;
-            if (dest_idx >= state.vertices.size()) {
-              printf("dest_idx >= state.vertices.size()\n");
-              return;
-            }
+    // copy the values of one input to the vertices using indices from the <p> array
+    static void expand_input(const input_source &src, const dynarray<int> &p, unsigned input_stride, unsigned attr_stride, dynarray<float> &vertices) {
+      dynarray<float> accessor_floats;
+      if (src.type == 1) {
+        atofv(accessor_floats, src.text);
+      }
 
-            if (type == 1) {
-              if (src_idx >= accessor_floats.size()) {
-                printf("src_idx >= accessor_floats.size()\n");
-                return;
-              }
-              state.vertices[dest_idx] = accessor_floats[src_idx];
-            } else {
-              state.vertices[dest_idx] = (float)src_idx;
+      unsigned num_vertices = p.size() / input_stride;
+      for (unsigned i = 0; i != num_vertices; ++i) {
+        unsigned index = p[i * input_stride + src.input_offset];
+        for (unsigned j = 0; j != src.size; ++j) {
+          unsigned dest_idx = i * attr_stride + src.attr_offset + j;
+          unsigned src_idx = src.accessor_offset + index * src.accessor_stride + j;
+
+          if (src.type == 1) {
+            if (src_idx >= accessor_floats.size()) {
+              printf("src_idx >= accessor_floats.size()\n");
+              return;
             }
-          }
-        }
-        state.slot++;
-        state.attr_offset += size;
-      } else if (state.pass == 3) {
-        // skin pass
-        if (!strcmp(semantic, "JOINT")) {
-          for (unsigned i = 0; i != num_vertices; ++i) {
-            unsigned index = state.p[i * state.input_stride + state.input_offset];
-            unsigned src_idx = accessor_offset_int + index * accessor_stride_int;
-            state.skinst->raw_indices[i] = src_idx;
-          }
-        } else if (!strcmp(semantic, "WEIGHT")) {
-          dynarray<float> accessor_floats;
-          atofv(accessor_floats, accessor_source_elem->GetText());
-          assert(state.skinst->raw_weights.size() >= num_vertices);
-          for (unsigned i = 0; i != num_vertices; ++i) {
-            unsigned index = state.p[i * state.input_stride + state.input_offset];
-            unsigned src_idx = accessor_offset_int + index * accessor_stride_int;
-            state.skinst->raw_weights[i] = accessor_floats[src_idx];
+            vertices[dest_idx] = accessor_floats[src_idx];
+          } else {
+            vertices[dest_idx] = (float)src_idx;
           }
         }
       }
@@ -636,7 +667,7 @@ namespace octet { namespace loaders {
     }
 
     // add a geometry element to the list of mesh states
-    void add_geometry(resource_dict &dict) {
+    void add_geometry(resource_dict &dict, dynarray<mesh_component_job *> &jobs) {
       TiXmlElement *lib_geom = doc.RootElement()->FirstChildElement("library_geometries");
       if (!lib_geom) return;
 
@@ -650,14 +681,15 @@ namespace octet { namespace loaders {
         ) {
           if (is_mesh_component(mesh_child->Value())) {
             mesh *msh = new mesh();
-            get_mesh_component(msh, id, mesh_child, NULL, dict);
+            mesh_component_job *job = prepare_mesh_component(msh, id, mesh_child, NULL, dict);
+            if (job) jobs.push_back(job);
           }
         }
       }
     }
 
     // add a geometry element to the list of mesh states
-    void add_controllers(resource_dict &dict) {
+    void add_controllers(resource_dict &dict, dynarray<skin_state *> &skins, dynarray<mesh_component_job *> &jobs) {
       TiXmlElement *lib_ctrl = doc.RootElement()->FirstChildElement("library_controllers");
       if (!lib_ctrl) return;
 
@@ -667,7 +699,11 @@ namespace octet { namespace loaders {
         TiXmlElement *geometry = find_id(attr(skin_elem, "source"));
         TiXmlElement *bind_shape_matrix = child(skin_elem, "bind_shape_matrix");
         TiXmlElement *joints_elem = child(skin_elem, "joints");
-        skin_state skinst;
+
+        // the skin outlives this loop as the mesh components are built later.
+        skin_state *skin_ptr = new skin_state();
+        skin_state &skinst = *skin_ptr;
+        skins.push_back(skin_ptr);
 
         if (bind_shape_matrix) {
           atofv(skinst.bind_shape_matrix, text(bind_shape_matrix));
@@ -711,8 +747,7 @@ namespace octet { namespace loaders {
         }
 
         TiXmlElement *vertex_weights = child(skin_elem, "vertex_weights");
-        if (vertex_weights && geometry) {
-          get_skin(controller, vertex_weights, &skinst);
+        if (vertex_weights && geometry && prepare_skin(vertex_weights, skin_ptr)) {
           TiXmlElement *mesh_elem = child(geometry, "mesh");
           //const char *id = geometry->Attribute("id");
 
@@ -722,7 +757,8 @@ namespace octet { namespace loaders {
           ) {
             if (is_mesh_component(mesh_child->Value())) {
               mesh *msh = new mesh(mesh_skin);
-              get_mesh_component(msh, controller_id, mesh_child, &skinst, dict);
+              mesh_component_job *job = prepare_mesh_component(msh, controller_id, mesh_child, skin_ptr, dict);
+              if (job) jobs.push_back(job);
             }
           }
         }
@@ -911,22 +947,22 @@ namespace octet { namespace loaders {
 
     // if we have a vcount element (polylist), we build polygons out of triangles
     // and hope they are convex!
-    unsigned convert_polygons_to_triangles(parse_input_state &state, dynarray<int> &vcount) {
+    static unsigned convert_polygons_to_triangles(dynarray<unsigned> &indices, dynarray<int> &vcount) {
       unsigned num_indices = 0;
       for (unsigned i = 0; i != vcount.size(); ++i) {
         unsigned nv = vcount[i];
         num_indices += (nv - 2) * 3;
       }
-      state.indices.resize(num_indices);
+      indices.resize(num_indices);
 
       unsigned j = 0;
       unsigned z = 0;
       for (unsigned i = 0; i != vcount.size(); ++i) {
         unsigned nv = vcount[i];
         for (unsigned k = 0; k != nv - 2; ++k) {
-          state.indices[j++] = z;
-          state.indices[j++] = z + k + 1;
-          state.indices[j++] = z + k + 2;
+          indices[j++] = z;
+          indices[j++] = z + k + 1;
+          indices[j++] = z + k + 2;
         }
         z += nv;
       }
@@ -950,13 +986,14 @@ namespace octet { namespace loaders {
       return input_stride;
     }
 
-    // get triangles from a trilist or polylist
-    void get_mesh_component(mesh *mesh, const char *id, TiXmlElement *mesh_child, skin_state *skinst, resource_dict &dict) {
+    // get the attributes of a trilist or polylist.
+    // the triangles themselves are built later by build_mesh_component.
+    mesh_component_job *prepare_mesh_component(mesh *mesh, const char *id, TiXmlElement *mesh_child, skin_state *skinst, resource_dict &dict) {
       TiXmlElement *pelem = child(mesh_child, "p");
 
       if (!pelem) {
         printf("warning: no <p>\n");
-        return;
+        return NULL;
       }
 
       // a geometry or controller is split up into its material groups
@@ -976,25 +1013,25 @@ namespace octet { namespace loaders {
 
       dict.set_resource(mesh_url, mesh);
 
-      parse_input_state state;
-      state.s = mesh;
+      mesh_component_job *job = new mesh_component_job();
+      job->msh = mesh;
+      job->skinst = skinst;
       while (pelem) {
-        atoiv(state.p, pelem->GetText());
+        job->p_texts.push_back(pelem->GetText());
         pelem = sibling(pelem, "p");
       }
-      state.input_stride = get_input_stride(mesh_child);
-      //unsigned implicit_offset = 0;
-      state.slot = 0;
-      state.attr_offset = 0;
-      state.skinst = skinst;
-
-      unsigned p_size = state.p.size();
-      if (p_size % state.input_stride != 0) {
-        printf("warning: expected multiple of %d indices\n", state.input_stride);
-        return;
-      }
+      TiXmlElement *vcount_elem = child(mesh_child, "vcount");
+      job->vcount_text = vcount_elem ? vcount_elem->GetText() : NULL;
+      job->input_stride = get_input_stride(mesh_child);
+      job->vertex_input_offset = 0;
+      job->num_vertices = 0;
+      job->is_valid = false;
 
-      unsigned num_vertices = p_size / state.input_stride;
+      parse_input_state state;
+      state.s = mesh;
+      state.attr_offset = 0;
+      state.pass = 1;
+      state.sources = &job->sources;
 
       // find the output size
       for (TiXmlElement *input = child(mesh_child, "input");
@@ -1003,147 +1040,247 @@ namespace octet { namespace loaders {
       ) {
         const char *offset = input->Attribute("offset");
         state.input_offset = offset ? atoi(offset) : 0;
-        state.pass = 1;
         parse_input(state, input);
+        const char *semantic = attr(input, "semantic");
+        if (semantic && !strcmp(semantic, "VERTEX")) {
+          job->vertex_input_offset = state.input_offset;
+        }
       }
 
-      int blendweight_offset = 0;
-      int blendindices_offset = 0;
-      int blendweight_stride = 3;
-      int blendindices_stride = 4;
+      int blendweight_stride = skin_state::max_indices - 1;
+      int blendindices_stride = skin_state::max_indices;
+      job->blendweight_offset = 0;
+      job->blendindices_offset = 0;
 
       if (skinst) {
         // skins need extra parameters for indices and weights
         // add extra attributes for blending
         // todo: use only max(vcount) indices
         state.s->add_attribute(attribute_blendweight, blendweight_stride, GL_FLOAT, state.attr_offset * 4);
-        blendweight_offset = state.attr_offset;
+        job->blendweight_offset = state.attr_offset;
         state.attr_offset += blendweight_stride;
         state.s->add_attribute(attribute_blendindices, blendindices_stride, GL_FLOAT, state.attr_offset * 4);
-        blendindices_offset = state.attr_offset;
+        job->blendindices_offset = state.attr_offset;
         state.attr_offset += blendindices_stride;
       }
 
-      state.attr_stride = state.attr_offset;
-      state.vertices.resize(state.attr_stride * num_vertices);
-      state.input_offset = 0;
-      state.attr_offset = 0;
-      state.vertex_input_offset = 0;
+      job->attr_stride = state.attr_offset;
+      return job;
+    }
+
+    // build the vertices and indices of a mesh component.
+    // this does not use the xml, the dictionary or OpenGL, so it can run on a worker thread.
+    static void build_mesh_component(mesh_component_job &job) {
+      dynarray<int> p;
+      for (unsigned i = 0; i != job.p_texts.size(); ++i) {
+        atoiv(p, job.p_texts[i]);
+      }
+
+      unsigned p_size = p.size();
+      if (p_size % job.input_stride != 0) {
+        printf("warning: expected multiple of %d indices\n", job.input_stride);
+        return;
+      }
+
+      unsigned num_vertices = p_size / job.input_stride;
+      unsigned attr_stride = job.attr_stride;
+      job.vertices.resize(attr_stride * num_vertices);
 
       // build the attributes
-      for (TiXmlElement *input = child(mesh_child, "input");
-        input != NULL;
-        input = input->NextSiblingElement("input")
-      ) {
-        const char *offset = input->Attribute("offset");
-        state.input_offset = offset ? atoi(offset) : 0;
-        state.pass = 2;
-        parse_input(state, input);
-        if (!strcmp(attr(input, "semantic"), "VERTEX")) {
-          state.vertex_input_offset = state.input_offset;
-        }
+      for (unsigned i = 0; i != job.sources.size(); ++i) {
+        expand_input(job.sources[i], p, job.input_stride, attr_stride, job.vertices);
       }
 
       // skins need extra parameters for indices and weights
       // copy the processed blend vertices to the gl attributes using indices from the <p> array
+      skin_state *skinst = job.skinst;
       if (skinst) {
-        unsigned p_size = state.p.size();
-        unsigned num_vertices = p_size / state.input_stride;
+        unsigned blendindices_stride = skin_state::max_indices;
+        unsigned blendweight_stride = blendindices_stride - 1;
+        unsigned num_skin_vertices = skinst->vcount.size();
         for (unsigned i = 0; i != num_vertices; ++i) {
-          unsigned index = state.p[i * state.input_stride + state.vertex_input_offset];
-          if (0) {
-            log("i%d\n", index);
+          unsigned index = p[i * job.input_stride + job.vertex_input_offset];
+          bool in_range = index < num_skin_vertices;
+          float *dest = &job.vertices[attr_stride * i];
+          for (unsigned j = 0; j != blendindices_stride; ++j) {
+            dest[job.blendindices_offset + j] = in_range ? (float)skinst->gl_indices[index * blendindices_stride + j] : 0.0f;
           }
-          for (int j = 0; j != blendindices_stride; ++j) {
-            state.vertices[state.attr_stride * i + blendindices_offset + j] = (float)state.skinst->gl_indices[index * blendindices_stride + j];
-          }
-          for (int j = 0; j != blendweight_stride; ++j) {
-            state.vertices[state.attr_stride * i + blendweight_offset + j] = state.skinst->gl_weights[index * blendweight_stride + j];
+          for (unsigned j = 0; j != blendweight_stride; ++j) {
+            dest[job.blendweight_offset + j] = in_range ? skinst->gl_weights[index * blendweight_stride + j] : 0.0f;
           }
         }
       }
 
-      TiXmlElement *vcount_elem = child(mesh_child, "vcount");
-
       // build an initial index based on the mesh_child value
-      // todo: optimise the mesh.
-      unsigned num_indices = 0;
-      if (vcount_elem) {
+      if (job.vcount_text) {
         // polygons
         dynarray<int> vcount;
-        atoiv(vcount, vcount_elem->GetText());
-        num_indices = convert_polygons_to_triangles(state, vcount);
+        atoiv(vcount, job.vcount_text);
+        convert_polygons_to_triangles(job.indices, vcount);
       } else {
         // just plain triangles
-        state.indices.resize(num_vertices);
-        num_indices = num_vertices;
+        job.indices.resize(num_vertices);
         for (unsigned i = 0; i != num_vertices; ++i) {
-          state.indices[i] = i;
+          job.indices[i] = i;
         }
       }
-      
-      unsigned isize = state.indices.size() * sizeof(state.indices[0]);
-      unsigned vsize = state.vertices.size() * sizeof(state.vertices[0]);
+
+      // every triangle corner is its own vertex so far: share the identical ones,
+      // then reorder for the vertex cache.
+      if (mesh_optimizer::optimize_on_load() && num_vertices) {
+        unsigned pos_offset = ~0u;
+        for (unsigned s = 0; s != job.sources.size(); ++s) {
+          const input_source &src = job.sources[s];
+          if (!strcmp(src.semantic, "POSITION") && src.size >= 3) pos_offset = src.attr_offset * 4;
+        }
+
+        uint8_t *vertices = (uint8_t*)job.vertices.data();
+        uint32_t *indices = (uint32_t*)job.indices.data();
+        unsigned num_indices = job.indices.size();
+        num_vertices = mesh_optimizer::weld(vertices, num_vertices, attr_stride * 4, indices, num_indices);
+        if (pos_offset != ~0u && num_indices % 3 == 0) {
+          mesh_optimizer::stats st;
+          num_vertices = mesh_optimizer::optimize(vertices, num_vertices, attr_stride * 4, pos_offset, indices, num_indices, &st);
+          if (debug > 0) mesh_optimizer::dump("mesh component", st);
+        }
+        job.vertices.resize(attr_stride * num_vertices);
+      }
+
+      // find the bounding box here rather than reading back the vertex buffer
+      for (unsigned j = 0; j != 3; ++j) {
+        job.bb_min[j] = job.bb_max[j] = 0;
+      }
+      for (unsigned s = 0; s != job.sources.size(); ++s) {
+        const input_source &src = job.sources[s];
+        if (strcmp(src.semantic, "POSITION") || num_vertices == 0) continue;
+        unsigned size = src.size < 3 ? src.size : 3;
+        for (unsigned j = 0; j != size; ++j) {
+          job.bb_min[j] = job.bb_max[j] = job.vertices[src.attr_offset + j];
+        }
+        for (unsigned i = 1; i != num_vertices; ++i) {
+          const float *pos = &job.vertices[i * attr_stride + src.attr_offset];
+          for (unsigned j = 0; j != size; ++j) {
+            job.bb_min[j] = pos[j] < job.bb_min[j] ? pos[j] : job.bb_min[j];
+            job.bb_max[j] = pos[j] > job.bb_max[j] ? pos[j] : job.bb_max[j];
+          }
+        }
+        break;
+      }
+
+      job.num_vertices = num_vertices;
+      job.is_valid = true;
+    }
+
+    // copy a built mesh component to its mesh. OpenGL calls, so main thread only.
+    static void upload_mesh_component(mesh_component_job &job) {
+      if (!job.is_valid) return;
+
+      unsigned isize = job.indices.size() * sizeof(job.indices[0]);
+      unsigned vsize = job.vertices.size() * sizeof(job.vertices[0]);
 
       if (debug > 0) {
-        log("mesh component loaded with %d indices and %d floats for vertices\n", state.indices.size(), state.vertices.size());
+        log("mesh component loaded with %d indices and %d floats for vertices\n", job.indices.size(), job.vertices.size());
       }
 
-      mesh->allocate(vsize, isize);
-      mesh->assign(vsize, isize, (unsigned char*)&state.vertices[0], (unsigned char*)&state.indices[0]);
-      mesh->set_params(state.attr_stride * 4, num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
-      mesh->calc_aabb();
-      if (debug > 1) mesh->dump(log("mesh\n"));
+      mesh *msh = job.msh;
+      msh->allocate(vsize, isize);
+      msh->assign(vsize, isize, (unsigned char*)job.vertices.data(), (unsigned char*)job.indices.data());
+      msh->set_params(job.attr_stride * 4, job.indices.size(), job.num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
+
+      vec3 vmin(job.bb_min[0], job.bb_min[1], job.bb_min[2]);
+      vec3 vmax(job.bb_max[0], job.bb_max[1], job.bb_max[2]);
+      msh->set_aabb(aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f));
+      if (debug > 1) msh->dump(log("mesh\n"));
     }
 
     // get blend weights and matrices from a skin
-    // after this we are still not home yet as the weights need to be indexed by the POSITION of the skinned mesh.
-    void get_skin(TiXmlElement *geometry, TiXmlElement *mesh_child, skin_state *skin) {
-      TiXmlElement *pelem = child(mesh_child, "v");
+    // the weights are converted later by build_skin.
+    bool prepare_skin(TiXmlElement *mesh_child, skin_state *skin) {
+      TiXmlElement *velem = child(mesh_child, "v");
 
-      if (!pelem) {
+      if (!velem) {
         printf("warning: no <v>\n");
-        return;
+        return false;
       }
 
       TiXmlElement *vcount_elem = child(mesh_child, "vcount");
       if (!vcount_elem) {
         printf("warning: no vcount element in skin\n");
+        return false;
       }
 
-      atoiv(skin->vcount, vcount_elem->GetText());
-
-      int num_vertices = 0;
-      int num_vcs = skin->vcount.size();
-      for (int i = 0; i != num_vcs; ++i) {
-        num_vertices += skin->vcount[i];
+      skin->vcount_text = vcount_elem->GetText();
+      while (velem) {
+        skin->v_texts.push_back(velem->GetText());
+        velem = sibling(velem, "v");
       }
-
-      skin->raw_indices.resize(num_vertices);
-      skin->raw_weights.resize(num_vertices);
+      skin->input_stride = get_input_stride(mesh_child);
 
       parse_input_state state;
       state.s = NULL;
-      while (pelem) {
-        atoiv(state.p, pelem->GetText());
-        pelem = sibling(pelem, "p");
-      }
-      state.input_stride = get_input_stride(mesh_child);
-      state.slot = 0;
       state.attr_offset = 0;
-      state.skinst = skin;
-      state.input_offset = 0;
+      state.pass = 3;
+      state.sources = &skin->sources;
 
-      // build the raw skin paramerters
+      // find the raw skin paramerters
       for (TiXmlElement *input = child(mesh_child, "input");
         input != NULL;
         input = input->NextSiblingElement("input")
       ) {
         const char *offset = input->Attribute("offset");
         state.input_offset = offset ? atoi(offset) : 0;
-        state.pass = 3;
         parse_input(state, input);
       }
+      return true;
+    }
+
+    // convert the raw skin parameters to gl parameters.
+    // after this we are still not home yet as the weights need to be indexed by the POSITION of the skinned mesh.
+    // like build_mesh_component, this can run on a worker thread.
+    static void build_skin(skin_state *skin) {
+      if (skin->v_texts.size() == 0) return;
+
+      atoiv(skin->vcount, skin->vcount_text);
+
+      dynarray<int> v;
+      for (unsigned i = 0; i != skin->v_texts.size(); ++i) {
+        atoiv(v, skin->v_texts[i]);
+      }
+
+      int num_vertices = 0;
+      int num_vcs = skin->vcount.size();
+      for (int i = 0; i != num_vcs; ++i) {
+        num_vertices += skin->vcount[i];
+      }
+
+      skin->raw_indices.resize(num_vertices);
+      skin->raw_weights.resize(num_vertices);
+      for (int i = 0; i != num_vertices; ++i) {
+        skin->raw_indices[i] = 0;
+        skin->raw_weights[i] = 0;
+      }
+
+      unsigned num_pairs = v.size() / skin->input_stride;
+      if (num_pairs > (unsigned)num_vertices) num_pairs = num_vertices;
+
+      // build the raw skin paramerters
+      dynarray<float> accessor_floats;
+      for (unsigned s = 0; s != skin->sources.size(); ++s) {
+        const input_source &src = skin->sources[s];
+        bool is_weight = !strcmp(src.semantic, "WEIGHT");
+        if (is_weight) {
+          atofv(accessor_floats, src.text);
+        }
+        for (unsigned i = 0; i != num_pairs; ++i) {
+          unsigned index = v[i * skin->input_stride + src.input_offset];
+          unsigned src_idx = src.accessor_offset + index * src.accessor_stride;
+          if (!is_weight) {
+            skin->raw_indices[i] = src_idx;
+          } else if (src_idx < accessor_floats.size()) {
+            skin->raw_weights[i] = accessor_floats[src_idx];
+          }
+        }
+      }
 
       // convert raw params into gl params (max 4 weights)
       int start = 0;
@@ -1153,16 +1290,48 @@ namespace octet { namespace loaders {
       skin->gl_weights.resize(num_vcs * weights_stride);
       for (int i = 0; i != num_vcs; ++i) {
         int vc = skin->vcount[i];
+        int *gl_indices = &skin->gl_indices[i * indices_stride];
+        float *gl_weights = &skin->gl_weights[i * weights_stride];
         // make exactly max_indices weights and indices for every vertex
-        // todo: get the four largest in cases where vc > max_indices
         // note that the first weight is expected to be 1 - (other weights)
-        for (int j = 0; j != indices_stride; ++j) {
-          int raw_index = j < vc ? skin->raw_indices[start + j] : 0;
-          skin->gl_indices[i * indices_stride + j] = raw_index;
-        }
-        for (int j = 0; j != weights_stride; ++j) {
-          float raw_weight = j + 1 < vc ? skin->raw_weights[start + j + 1] : 0;
-          skin->gl_weights[i * weights_stride + j] = raw_weight;
+        if (vc > indices_stride) {
+          // too many influences: keep the largest, sorted by weight, and renormalise them.
+          int best[skin_state::max_indices];
+          int num_best = 0;
+          for (int j = 0; j != vc; ++j) {
+            float weight = skin->raw_weights[start + j];
+            int k = num_best;
+            if (k == indices_stride) {
+              if (weight <= skin->raw_weights[start + best[k-1]]) continue;
+              k--;
+            } else {
+              num_best++;
+            }
+            for (; k > 0 && skin->raw_weights[start + best[k-1]] < weight; --k) {
+              best[k] = best[k-1];
+            }
+            best[k] = j;
+          }
+
+          float total = 0;
+          for (int j = 0; j != indices_stride; ++j) {
+            total += skin->raw_weights[start + best[j]];
+          }
+          float scale = total > 0 ? 1.0f / total : 0.0f;
+
+          for (int j = 0; j != indices_stride; ++j) {
+            gl_indices[j] = skin->raw_indices[start + best[j]];
+          }
+          for (int j = 0; j != weights_stride; ++j) {
+            gl_weights[j] = skin->raw_weights[start + best[j + 1]] * scale;
+          }
+        } else {
+          for (int j = 0; j != indices_stride; ++j) {
+            gl_indices[j] = j < vc ? skin->raw_indices[start + j] : 0;
+          }
+          for (int j = 0; j != weights_stride; ++j) {
+            gl_weights[j] = j + 1 < vc ? skin->raw_weights[start + j + 1] : 0;
+          }
         }
         start += vc;
       }
@@ -1183,6 +1352,30 @@ namespace octet { namespace loaders {
       }
     }
 
+    // the CPU work for each skin and mesh component is independent,
+    // so build them all on the worker threads, then upload on this thread.
+    void build_meshes(dynarray<skin_state *> &skins, dynarray<mesh_component_job *> &jobs) {
+      // skinned mesh components read the skins, so build them first
+      parallel_for(0, skins.size(), [&](unsigned i) {
+        build_skin(skins[i]);
+      });
+
+      parallel_for(0, jobs.size(), [&](unsigned i) {
+        build_mesh_component(*jobs[i]);
+      });
+
+      for (unsigned i = 0; i != jobs.size(); ++i) {
+        upload_mesh_component(*jobs[i]);
+        delete jobs[i];
+      }
+      jobs.reset();
+
+      for (unsigned i = 0; i != skins.size(); ++i) {
+        delete skins[i];
+      }
+      skins.reset();
+    }
+
     // does this thing have triangles in it?
     bool is_mesh_component(const char *value) {
       return (
@@ -1258,7 +1451,12 @@ namespace octet { namespace loaders {
         mesh_child = mesh_child->NextSiblingElement()
       ) {
         if (is_mesh_component(mesh_child->Value())) {
-          get_mesh_component(&s, id, mesh_child, NULL, dict);
+          mesh_component_job *job = prepare_mesh_component(&s, id, mesh_child, NULL, dict);
+          if (job) {
+            build_mesh_component(*job);
+            upload_mesh_component(*job);
+            delete job;
+          }
           return;
         }
       }
@@ -1277,9 +1475,14 @@ namespace octet { namespace loaders {
 
       add_materials(dict);
 
-      add_geometry(dict);
+      dynarray<skin_state *> skins;
+      dynarray<mesh_component_job *> mesh_jobs;
+
+      add_geometry(dict, mesh_jobs);
+
+      add_controllers(dict, skins, mesh_jobs);
 
-      add_controllers(dict);
+      build_meshes(skins, mesh_jobs);
 
       // scenes refer to all the above
       add_scenes(dict);
@@ -7,12 +7,16 @@
 //
 // DDS file decoder - direct draw surface
 //
+// Block compressed data (BC1-BC5, BC7) is kept compressed, with all its mip levels,
+// so that it can go straight to glCompressedTexImage2D.
+//
 
 namespace octet { namespace loaders {
   /// Class for loading DDS texture files
   class dds_decoder {
     // http://en.wikipedia.org/wiki/DirectDraw_Surface
     // http://www.mindcontrol.org/~hplus/graphics/dds-info/
+    // http://msdn.microsoft.com/en-us/library/windows/desktop/bb943991.aspx
     //
 
     enum {
@@ -49,10 +53,21 @@ namespace octet { namespace loaders {
       ddscaps2_cubemap_negativez = 0x00008000,
       ddscaps2_volume = 0x00200000,
 
-      COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0,
-      COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
-      COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
-      COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      // DXGI_FORMAT values from the DX10 header extension
+      dxgi_bc1_typeless = 70,
+      dxgi_bc1_unorm_srgb = 72,
+      dxgi_bc2_typeless = 73,
+      dxgi_bc2_unorm_srgb = 75,
+      dxgi_bc3_typeless = 76,
+      dxgi_bc3_unorm_srgb = 78,
+      dxgi_bc4_typeless = 79,
+      dxgi_bc4_unorm = 80,
+      dxgi_bc4_snorm = 81,
+      dxgi_bc5_typeless = 82,
+      dxgi_bc5_unorm = 83,
+      dxgi_bc5_snorm = 84,
+      dxgi_bc7_typeless = 97,
+      dxgi_bc7_unorm_srgb = 99,
     };
 
     struct dds_header {
@@ -89,6 +104,15 @@ namespace octet { namespace loaders {
       uint8_t reserved2[4];
     };
 
+    // follows the header if the fourcc is "DX10"
+    struct dds_header_dx10 {
+      uint8_t dxgi_format[4];
+      uint8_t resource_dimension[4];
+      uint8_t misc_flag[4];
+      uint8_t array_size[4];
+      uint8_t misc_flags2[4];
+    };
+
     // read a pair of bytes as a little-endian value
     // this will work on the PS3 and other big-endian machines
     int le2( uint8_t val[2] )
@@ -103,217 +127,435 @@ namespace octet { namespace loaders {
       return val[0] + val[1] * 0x100 + val[2] * 0x10000 + val[3] * 0x1000000;
     }
 
-    // rrrrrggggggbbbbb
-    // rrrrrggggggbbbbb
-    // 0011223344556677
-    // 8899aabbccddeeff
-    void hack_dxt1(uint8_t *dest, const uint8_t *src, unsigned stride, bool always_use_four_colours) {
-      uint16_t color0 = src[0] + src[1] * 256;
-      uint16_t color1 = src[2] + src[3] * 256;
-      src += 4;
-
-      uint8_t r0 = ( ( ( color0 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g0 = ( ( ( color0 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b0 = ( ( ( color0 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t r1 = ( ( ( color1 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g1 = ( ( ( color1 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b1 = ( ( ( color1 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-
-      // if it were not for the patent, some other code would go here
-      dest[0] = ( r0 + r1 ) >> 1;
-      dest[1] = ( g0 + g1 ) >> 1;
-      dest[2] = ( b0 + b1 ) >> 1;
-      dest[3] = 0xff;
+    static bool is_fourcc(const uint8_t *fourcc, const char *value) {
+      return !memcmp(fourcc, value, 4);
     }
 
-    // quantised alpha
-    void hack_dxt3(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    // map a fourcc code to a GL format
+    static unsigned fourcc_to_format(const uint8_t *fourcc) {
+      if (is_fourcc(fourcc, "DXT1")) return COMPRESSED_RGBA_S3TC_DXT1_EXT;
+      if (is_fourcc(fourcc, "DXT2") || is_fourcc(fourcc, "DXT3")) return COMPRESSED_RGBA_S3TC_DXT3_EXT;
+      if (is_fourcc(fourcc, "DXT4") || is_fourcc(fourcc, "DXT5")) return COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      if (is_fourcc(fourcc, "ATI1") || is_fourcc(fourcc, "BC4U")) return COMPRESSED_RED_RGTC1;
+      if (is_fourcc(fourcc, "BC4S")) return COMPRESSED_SIGNED_RED_RGTC1;
+      if (is_fourcc(fourcc, "ATI2") || is_fourcc(fourcc, "BC5U")) return COMPRESSED_RG_RGTC2;
+      if (is_fourcc(fourcc, "BC5S")) return COMPRESSED_SIGNED_RG_RGTC2;
+      return 0;
     }
 
-    // interpolated alpha
-    void hack_dxt5(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    // map a DX10 DXGI format to a GL format. sRGB variants are treated as linear.
+    static unsigned dxgi_to_format(unsigned dxgi_format) {
+      if (dxgi_format >= dxgi_bc1_typeless && dxgi_format <= dxgi_bc1_unorm_srgb) return COMPRESSED_RGBA_S3TC_DXT1_EXT;
+      if (dxgi_format >= dxgi_bc2_typeless && dxgi_format <= dxgi_bc2_unorm_srgb) return COMPRESSED_RGBA_S3TC_DXT3_EXT;
+      if (dxgi_format >= dxgi_bc3_typeless && dxgi_format <= dxgi_bc3_unorm_srgb) return COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      if (dxgi_format == dxgi_bc4_typeless || dxgi_format == dxgi_bc4_unorm) return COMPRESSED_RED_RGTC1;
+      if (dxgi_format == dxgi_bc4_snorm) return COMPRESSED_SIGNED_RED_RGTC1;
+      if (dxgi_format == dxgi_bc5_typeless || dxgi_format == dxgi_bc5_unorm) return COMPRESSED_RG_RGTC2;
+      if (dxgi_format == dxgi_bc5_snorm) return COMPRESSED_SIGNED_RG_RGTC2;
+      if (dxgi_format >= dxgi_bc7_typeless && dxgi_format <= dxgi_bc7_unorm_srgb) return COMPRESSED_RGBA_BPTC_UNORM;
+      return 0;
     }
 
-    // see http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
-    // a s3tc dirty hack.
-    void hack_s3(uint8_t *image, unsigned dxt, unsigned width, unsigned height, const uint8_t *src, const uint8_t *src_max) {
-      unsigned max_bytes = (width) * (height) * 8;
-      if (dxt != 1) max_bytes *= 2;
-      //if (src_max - src > max_bytes) return; // oops
-
-      for (unsigned y = 0; y != height; ++y) {
-        uint8_t *dest = (uint8_t *)( image + y * (width * 4) );
-        for (unsigned x = 0; x != width; ++x) {
-          if (dxt == 1) {
-            hack_dxt1(dest, src+8, width * 4, false);
-            src += 8;
-          } else if (dxt <= 3) {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt3(dest, src, width * 4);
-            src += 16;
-          } else {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt5(dest, src, width * 4);
-            src += 16;
-          }
-          dest += 4;
-        }
+    // Where the rows of pixels live in the two 64 bit halves of a block.
+    // Each half has four rows of row_bits starting at first_bit.
+    // BC7 rows depend on the block mode, so it cannot be flipped this way.
+    struct block_layout {
+      unsigned block_bytes;
+      unsigned first_bit[2];
+      unsigned row_bits[2];
+    };
+
+    static bool get_layout(block_layout &layout, unsigned format) {
+      // colour: 2 x 16 bit endpoints then 4 rows of 4 x 2 bit indices
+      // explicit alpha: 4 rows of 4 x 4 bit alpha
+      // interpolated alpha: 2 x 8 bit endpoints then 4 rows of 4 x 3 bit indices
+      static const block_layout colour = { 8, { 32, 32 }, { 8, 8 } };
+      static const block_layout explicit_alpha = { 16, { 0, 32 }, { 16, 8 } };
+      static const block_layout interpolated_alpha = { 16, { 16, 32 }, { 12, 8 } };
+      static const block_layout one_channel = { 8, { 16, 16 }, { 12, 12 } };
+      static const block_layout two_channel = { 16, { 16, 16 }, { 12, 12 } };
+
+      switch (format) {
+        case COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case COMPRESSED_RGBA_S3TC_DXT1_EXT: layout = colour; return true;
+        case COMPRESSED_RGBA_S3TC_DXT3_EXT: layout = explicit_alpha; return true;
+        case COMPRESSED_RGBA_S3TC_DXT5_EXT: layout = interpolated_alpha; return true;
+        case COMPRESSED_RED_RGTC1:
+        case COMPRESSED_SIGNED_RED_RGTC1: layout = one_channel; return true;
+        case COMPRESSED_RG_RGTC2:
+        case COMPRESSED_SIGNED_RG_RGTC2: layout = two_channel; return true;
       }
+      return false;
     }
 
-    static void swap(uint32_t &a, uint32_t &b) {
-      uint32_t t = a; a =  b; b = t;
+    static uint64_t get_u64(const uint8_t *src) {
+      uint64_t result;
+      memcpy(&result, src, sizeof(result));
+      return result;
     }
 
-    static void swap(uint8_t &a, uint8_t &b) {
-      uint8_t t = a; a =  b; b = t;
+    static void set_u64(uint8_t *dest, uint64_t value) {
+      memcpy(dest, &value, sizeof(value));
     }
 
-    static void swap3(uint8_t *p1, uint8_t *p2) {
-      // 00011122 23334445 55666777
-      // 44455566 67770001 11222333
-      unsigned s1 = p1[0] + p1[1] * 0x100 + p1[2] * 0x10000;
-      unsigned s2 = p2[0] + p2[1] * 0x100 + p2[2] * 0x10000;
-      s1 = ( s1 >> 12 ) | ( s1 << 12 );
-      s2 = ( s2 >> 12 ) | ( s2 << 12 );
-      p1[0] = (s2 >> 0) & 0xff;
-      p1[1] = (s2 >> 8) & 0xff;
-      p1[2] = (s2 >> 16) & 0xff;
-      p2[0] = (s1 >> 0) & 0xff;
-      p2[1] = (s1 >> 8) & 0xff;
-      p2[2] = (s1 >> 16) & 0xff;
+    // reverse the order of the first num_rows rows in a 64 bit half block
+    static uint64_t flip_rows(uint64_t x, unsigned first_bit, unsigned row_bits, unsigned num_rows) {
+      uint64_t mask = ((uint64_t)1 << row_bits) - 1;
+      uint64_t rows = 0;
+      uint64_t result = 0;
+      for (unsigned i = 0; i != num_rows; ++i) {
+        unsigned from = first_bit + i * row_bits;
+        unsigned to = first_bit + (num_rows - 1 - i) * row_bits;
+        rows |= mask << from;
+        result |= ((x >> from) & mask) << to;
+      }
+      return result | (x & ~rows);
     }
 
-    void flip_dxt1(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 8 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 8];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 8];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
-          }
+    #if OCTET_SSE
+      static __m128i set_u64x2(uint64_t lo, uint64_t hi) {
+        return _mm_set_epi32((int)(hi >> 32), (int)hi, (int)(lo >> 32), (int)lo);
+      }
+
+      // flip_rows with four rows for both halves of a register
+      static __m128i flip_rows(__m128i x, unsigned first_bit, unsigned row_bits) {
+        uint64_t mask = ((uint64_t)1 << row_bits) - 1;
+        uint64_t m0 = mask << first_bit;
+        uint64_t m1 = m0 << row_bits;
+        uint64_t m2 = m1 << row_bits;
+        uint64_t m3 = m2 << row_bits;
+        __m128i r1 = _mm_cvtsi32_si128(row_bits);
+        __m128i r3 = _mm_cvtsi32_si128(row_bits * 3);
+        __m128i keep = _mm_and_si128(x, set_u64x2(~(m0|m1|m2|m3), ~(m0|m1|m2|m3)));
+        __m128i t0 = _mm_and_si128(_mm_srl_epi64(x, r3), set_u64x2(m0, m0));
+        __m128i t1 = _mm_and_si128(_mm_srl_epi64(x, r1), set_u64x2(m1, m1));
+        __m128i t2 = _mm_and_si128(_mm_sll_epi64(x, r1), set_u64x2(m2, m2));
+        __m128i t3 = _mm_and_si128(_mm_sll_epi64(x, r3), set_u64x2(m3, m3));
+        return _mm_or_si128(_mm_or_si128(keep, t0), _mm_or_si128(_mm_or_si128(t1, t2), t3));
+      }
+
+      // flip a 16 byte register holding two 8 byte blocks or one 16 byte block
+      static __m128i flip_blocks(__m128i x, const block_layout &layout) {
+        __m128i lo = flip_rows(x, layout.first_bit[0], layout.row_bits[0]);
+        if (layout.first_bit[0] == layout.first_bit[1] && layout.row_bits[0] == layout.row_bits[1]) {
+          return lo;
+        }
+        __m128i hi = flip_rows(x, layout.first_bit[1], layout.row_bits[1]);
+        __m128i lo_mask = set_u64x2(~(uint64_t)0, 0);
+        return _mm_or_si128(_mm_and_si128(lo_mask, lo), _mm_andnot_si128(lo_mask, hi));
+      }
+    #endif
+
+    // flip one block with num_rows valid rows
+    static void flip_block(uint8_t *dest, const uint8_t *src, const block_layout &layout, unsigned num_rows) {
+      for (unsigned i = 0; i != layout.block_bytes / 8; ++i) {
+        uint64_t x = get_u64(src + i * 8);
+        set_u64(dest + i * 8, flip_rows(x, layout.first_bit[i], layout.row_bits[i], num_rows));
+      }
+    }
+
+    // flip two rows of blocks and exchange them. a and b may be the same row.
+    static void flip_block_rows(uint8_t *a, uint8_t *b, unsigned num_bytes, const block_layout &layout) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        for (; i + 16 <= num_bytes; i += 16) {
+          __m128i fa = flip_blocks(_mm_loadu_si128((__m128i*)(a + i)), layout);
+          __m128i fb = flip_blocks(_mm_loadu_si128((__m128i*)(b + i)), layout);
+          _mm_storeu_si128((__m128i*)(a + i), fb);
+          _mm_storeu_si128((__m128i*)(b + i), fa);
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 8;
+      #endif
+      for (; i != num_bytes; i += layout.block_bytes) {
+        uint8_t ta[16], tb[16];
+        flip_block(ta, a + i, layout, 4);
+        flip_block(tb, b + i, layout, 4);
+        memcpy(a + i, tb, layout.block_bytes);
+        memcpy(b + i, ta, layout.block_bytes);
       }
     }
 
-    void flip_dxt3(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap(p1[0], p2[6]);
-            swap(p1[1], p2[7]);
-            swap(p1[2], p2[4]);
-            swap(p1[3], p2[5]);
-            swap(p1[4], p2[2]);
-            swap(p1[5], p2[3]);
-            swap(p1[6], p2[0]);
-            swap(p1[7], p2[1]);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
+    // dds textures are upside down, flip one mip level in place without decompressing it.
+    // returns false if the level can't be flipped as blocks.
+    static bool flip_level(uint8_t *data, unsigned width, unsigned height, const block_layout &layout) {
+      unsigned xblocks = (width + 3) / 4;
+      unsigned yblocks = (height + 3) / 4;
+      unsigned row_bytes = xblocks * layout.block_bytes;
+
+      if (height < 4) {
+        // only the top rows of the blocks are used
+        for (unsigned x = 0; x != xblocks; ++x) {
+          uint8_t *p = data + x * layout.block_bytes;
+          flip_block(p, p, layout, height);
+        }
+        return true;
+      }
+
+      if (height % 4) {
+        // the last row of blocks is partly used, so a flipped block would need rows from two blocks.
+        return false;
+      }
+
+      for (unsigned y = 0; y < (yblocks + 1) / 2; ++y) {
+        uint8_t *a = data + y * row_bytes;
+        uint8_t *b = data + (yblocks - 1 - y) * row_bytes;
+        if (a == b) {
+          // the middle row of an odd number of rows
+          for (unsigned x = 0; x != xblocks; ++x) {
+            uint8_t *p = a + x * layout.block_bytes;
+            flip_block(p, p, layout, 4);
           }
+        } else {
+          flip_block_rows(a, b, row_bytes, layout);
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
       }
+      return true;
     }
 
-    void flip_dxt5(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            // swap alphas
-            swap(p1[0], p2[0]);
-            swap(p1[1], p2[1]);
-            // swap 3 bit indices
-            swap3(p1+2, p2+5);
-            swap3(p1+5, p2+2);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
-          }
+    // expand a 5:6:5 colour to 8 bits per component
+    static void rgb565(uint8_t *dest, unsigned colour) {
+      unsigned r = (colour >> 11) & 0x1f, g = (colour >> 5) & 0x3f, b = colour & 0x1f;
+      dest[0] = (uint8_t)((r << 3) | (r >> 2));
+      dest[1] = (uint8_t)((g << 2) | (g >> 4));
+      dest[2] = (uint8_t)((b << 3) | (b >> 2));
+      dest[3] = 0xff;
+    }
+
+    // decode the colour part of a block to 16 RGBA pixels
+    // see http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
+    static void decode_colour(uint8_t *dest, const uint8_t *src, bool always_use_four_colours) {
+      unsigned c0 = src[0] + src[1] * 256;
+      unsigned c1 = src[2] + src[3] * 256;
+      uint8_t pal[4][4];
+      rgb565(pal[0], c0);
+      rgb565(pal[1], c1);
+      for (unsigned i = 0; i != 3; ++i) {
+        if (c0 > c1 || always_use_four_colours) {
+          pal[2][i] = (uint8_t)((pal[0][i] * 2 + pal[1][i]) / 3);
+          pal[3][i] = (uint8_t)((pal[0][i] + pal[1][i] * 2) / 3);
+        } else {
+          pal[2][i] = (uint8_t)((pal[0][i] + pal[1][i]) / 2);
+          pal[3][i] = 0;
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
+      }
+      pal[2][3] = 0xff;
+      pal[3][3] = c0 > c1 || always_use_four_colours ? 0xff : 0;
+
+      for (unsigned i = 0; i != 16; ++i) {
+        unsigned index = (src[4 + i / 4] >> ((i & 3) * 2)) & 3;
+        memcpy(dest + i * 4, pal[index], 4);
       }
     }
+
+    // decode a BC3/BC4/BC5 interpolated channel to every fourth byte of dest
+    static void decode_channel(uint8_t *dest, const uint8_t *src, bool is_signed) {
+      int a0 = is_signed ? (int8_t)src[0] : src[0];
+      int a1 = is_signed ? (int8_t)src[1] : src[1];
+      int lo = is_signed ? -127 : 0, hi = is_signed ? 127 : 255;
+      int pal[8] = { a0, a1 };
+      for (int i = 1; i != 7; ++i) {
+        if (a0 > a1) {
+          pal[i+1] = ((7 - i) * a0 + i * a1) / 7;
+        } else if (i <= 4) {
+          pal[i+1] = ((5 - i) * a0 + i * a1) / 5;
+        }
+      }
+      if (a0 <= a1) {
+        pal[6] = lo;
+        pal[7] = hi;
+      }
+
+      uint64_t bits = get_u64(src) >> 16;
+      for (unsigned i = 0; i != 16; ++i) {
+        int value = pal[(bits >> (i * 3)) & 7];
+        // signed values are offset to fit in a byte
+        dest[i * 4] = (uint8_t)(is_signed ? value + 128 : value);
+      }
+    }
+
+    // decode one block to 16 RGBA pixels. returns false for unsupported formats
+    static bool decode_block(uint8_t *dest, const uint8_t *src, unsigned format) {
+      switch (format) {
+        case COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case COMPRESSED_RGBA_S3TC_DXT1_EXT: {
+          decode_colour(dest, src, false);
+        } break;
+        case COMPRESSED_RGBA_S3TC_DXT3_EXT: {
+          decode_colour(dest, src + 8, true);
+          for (unsigned i = 0; i != 16; ++i) {
+            dest[i * 4 + 3] = (uint8_t)(((src[i / 2] >> ((i & 1) * 4)) & 0x0f) * 0x11);
+          }
+        } break;
+        case COMPRESSED_RGBA_S3TC_DXT5_EXT: {
+          decode_colour(dest, src + 8, true);
+          decode_channel(dest + 3, src, false);
+        } break;
+        case COMPRESSED_RED_RGTC1:
+        case COMPRESSED_SIGNED_RED_RGTC1: {
+          memset(dest, 0, 64);
+          decode_channel(dest, src, format == COMPRESSED_SIGNED_RED_RGTC1);
+          for (unsigned i = 0; i != 16; ++i) dest[i * 4 + 3] = 0xff;
+        } break;
+        case COMPRESSED_RG_RGTC2:
+        case COMPRESSED_SIGNED_RG_RGTC2: {
+          memset(dest, 0, 64);
+          decode_channel(dest, src, format == COMPRESSED_SIGNED_RG_RGTC2);
+          decode_channel(dest + 1, src + 8, format == COMPRESSED_SIGNED_RG_RGTC2);
+          for (unsigned i = 0; i != 16; ++i) dest[i * 4 + 3] = 0xff;
+        } break;
+        default: return false;
+      }
+      return true;
+    }
   public:
-    // get an opengl texture from a file in memory
-    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
+    // these are here to avoid including glext.h which may be platform dependent.
+    enum {
+      COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0,
+      COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
+      COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
+      COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_SIGNED_RED_RGTC1 = 0x8DBC,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
+      COMPRESSED_SIGNED_RG_RGTC2 = 0x8DBE,
+      COMPRESSED_RGBA_BPTC_UNORM = 0x8E8C,
+    };
+
+    /// bytes in a 4x4 block of a compressed format, or zero if the format is not block compressed.
+    static unsigned get_block_bytes(unsigned format) {
+      switch (format) {
+        case COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        case COMPRESSED_RED_RGTC1:
+        case COMPRESSED_SIGNED_RED_RGTC1:
+          return 8;
+        case COMPRESSED_RGBA_S3TC_DXT3_EXT:
+        case COMPRESSED_RGBA_S3TC_DXT5_EXT:
+        case COMPRESSED_RG_RGTC2:
+        case COMPRESSED_SIGNED_RG_RGTC2:
+        case COMPRESSED_RGBA_BPTC_UNORM:
+          return 16;
+      }
+      return 0;
+    }
+
+    /// size in bytes of one mip level of a block compressed format
+    static unsigned get_level_size(unsigned format, unsigned width, unsigned height) {
+      return ((width + 3) / 4) * ((height + 3) / 4) * get_block_bytes(format);
+    }
+
+    /// Expand the top level of a block compressed image to RGBA.
+    /// Used when the GL implementation does not have the extension for the format.
+    /// BC7 is not supported.
+    static bool decompress(dynarray<uint8_t> &image, unsigned format, unsigned width, unsigned height, const uint8_t *src) {
+      unsigned block_bytes = get_block_bytes(format);
+      if (!block_bytes || format == COMPRESSED_RGBA_BPTC_UNORM) return false;
+
+      image.resize(width * height * 4);
+      for (unsigned by = 0; by < height; by += 4) {
+        for (unsigned bx = 0; bx < width; bx += 4) {
+          uint8_t pixels[16 * 4];
+          decode_block(pixels, src, format);
+          src += block_bytes;
+          for (unsigned y = 0; y != 4 && by + y < height; ++y) {
+            unsigned num_x = width - bx < 4 ? width - bx : 4;
+            memcpy(&image[((by + y) * width + bx) * 4], pixels + y * 16, num_x * 4);
+          }
+        }
+      }
+      return true;
+    }
+
+    // expand the top level to RGBA and flip that instead.
+    static void flip_top_level(dynarray<uint8_t> &image, uint16_t &format, unsigned width, unsigned height) {
+      dynarray<uint8_t> pixels;
+      if (!decompress(pixels, format, width, height, &image[0])) return;
+      unsigned row_bytes = width * 4;
+      for (unsigned y = 0; y != height / 2; ++y) {
+        uint8_t *a = &pixels[y * row_bytes];
+        std::swap_ranges(a, a + row_bytes, &pixels[(height - 1 - y) * row_bytes]);
+      }
+      image.resize(pixels.size());
+      memcpy(&image[0], &pixels[0], pixels.size());
+      format = 0x1908; // GL_RGBA
+    }
+
+    /// Get a block compressed image from a file in memory, keeping all the mip levels.
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, uint8_t &mip_levels, const uint8_t *src, const uint8_t *src_max) {
       // convert the data
       dds_header *header = (dds_header*)src;
 
-      if (le4(header->magic) != dds_magic) return;
+      if (src_max - src < (int)sizeof(dds_header) || le4(header->magic) != dds_magic) return;
 
       unsigned pf_flags = le4(header->pf.flags);
+      const uint8_t *data = src + sizeof(dds_header);
+      unsigned new_format = 0;
 
       if (pf_flags & ddpf_fourcc) {
-        uint8_t *fourcc = header->pf.fourcc;
-        if (fourcc[0] == 'D' && fourcc[1] == 'X' && fourcc[2] == 'T') {
-          width = le4(header->width);
-          height = le4(header->height);
-
-          format =
-            fourcc[3] == '1' ? COMPRESSED_RGB_S3TC_DXT1_EXT :
-            fourcc[3] == '3' ? COMPRESSED_RGBA_S3TC_DXT3_EXT :
-            fourcc[3] == '5' ? COMPRESSED_RGBA_S3TC_DXT5_EXT :
-            0
-          ;
-          unsigned size = (unsigned)(src_max - src - 128);
-          image.resize(size);
-          memcpy(&image[0], src + 128, size);
-
-          // dds textures are upside down, flip them!
-          switch (format) {
-            case COMPRESSED_RGB_S3TC_DXT1_EXT: flip_dxt1(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT3_EXT: flip_dxt3(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT5_EXT: flip_dxt5(image, width, height); break;
+        if (is_fourcc(header->pf.fourcc, "DX10")) {
+          dds_header_dx10 *dx10 = (dds_header_dx10*)data;
+          data += sizeof(dds_header_dx10);
+          if (data > src_max) return;
+          new_format = dxgi_to_format(le4(dx10->dxgi_format));
+        } else {
+          new_format = fourcc_to_format(header->pf.fourcc);
+        }
+      }
+
+      if (!new_format) {
+        printf("warning: DDS decoder only supports BC1-BC5 and BC7\n");
+        return;
+      }
+
+      format = (uint16_t)new_format;
+      width = le4(header->width);
+      height = le4(header->height);
+
+      // keep as many mip levels as there are in the file
+      unsigned max_levels = (le4(header->flags) & ddsd_mipmapcount) ? le4(header->mipmap_count) : 1;
+      if (max_levels == 0) max_levels = 1;
+
+      unsigned size = 0;
+      unsigned num_levels = 0;
+      for (unsigned w = width, h = height; num_levels != max_levels; ++num_levels) {
+        unsigned level_size = get_level_size(format, w, h);
+        if (data + size + level_size > src_max) break;
+        size += level_size;
+        if (w == 1 && h == 1) { ++num_levels; break; }
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+      mip_levels = (uint8_t)num_levels;
+
+      if (!size) {
+        printf("warning: DDS file is truncated\n");
+        return;
+      }
+
+      image.resize(size);
+      memcpy(&image[0], data, size);
+
+      // dds textures are upside down, flip them!
+      // BC7 textures stay as they are, their layout depends on the block mode.
+      block_layout layout;
+      if (get_layout(layout, format)) {
+        uint8_t *level = &image[0];
+        for (unsigned i = 0, w = width, h = height; i != num_levels; ++i) {
+          if (!flip_level(level, w, h, layout)) {
+            if (i) {
+              // drop this level and the smaller ones, the texture uses a partial mip chain.
+              image.resize((unsigned)(level - &image[0]));
+              mip_levels = (uint8_t)i;
+            } else {
+              flip_top_level(image, format, width, height);
+              mip_levels = 1;
+            }
+            break;
           }
-          return;
+          level += get_level_size(format, w, h);
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
         }
       }
-      printf("warning: DDS decoder only supports DXTn\n");
     }
   };
 }}
@@ -0,0 +1,344 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// BC1 (DXT1) and BC3 (DXT5) block compressor
+//
+// see http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
+//
+// Colour endpoints come from the principal axis of the block's colours,
+// found by power iteration on the covariance matrix. Optionally the endpoints
+// are then refined by least squares against the chosen palette indices.
+// Block rows are compressed on the worker threads.
+//
+namespace octet { namespace loaders {
+  /// Compress 8 bit RGB or RGBA mip chains to BC1 or BC3.
+  class dxt_encoder {
+    bool refine;
+
+    // colour distance, ignoring w
+    static float distance2(const vec4 &a, const vec4 &b) {
+      vec4 d = a - b;
+      return d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    }
+
+    // quantise a colour in 0..255 to 5:6:5
+    static unsigned to565(const vec4 &c) {
+      vec4 q = min(max(c, vec4(0, 0, 0, 0)), vec4(255, 255, 255, 255)) * vec4(31.0f / 255, 63.0f / 255, 31.0f / 255, 0) + vec4(0.5f, 0.5f, 0.5f, 0);
+      return ((unsigned)q[0] << 11) | ((unsigned)q[1] << 5) | (unsigned)q[2];
+    }
+
+    // expand 5:6:5 exactly as dds_decoder does
+    static vec4 from565(unsigned colour) {
+      unsigned r = (colour >> 11) & 0x1f, g = (colour >> 5) & 0x3f, b = colour & 0x1f;
+      return vec4((float)((r << 3) | (r >> 2)), (float)((g << 2) | (g >> 4)), (float)((b << 3) | (b >> 2)), 0);
+    }
+
+    // four colour palette for two endpoints, with the decoder's rounding.
+    static void make_palette(vec4 *pal, unsigned c0, unsigned c1) {
+      pal[0] = from565(c0);
+      pal[1] = from565(c1);
+      for (unsigned i = 0; i != 3; ++i) {
+        pal[2][i] = (float)(((int)pal[0][i] * 2 + (int)pal[1][i]) / 3);
+        pal[3][i] = (float)(((int)pal[0][i] + (int)pal[1][i] * 2) / 3);
+      }
+    }
+
+    // choose the nearest palette entry for each pixel. returns the total squared error.
+    static float choose_indices(uint8_t *indices, const vec4 *pixels, unsigned c0, unsigned c1) {
+      vec4 pal[4];
+      make_palette(pal, c0, c1);
+      float total = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        float best = distance2(pixels[i], pal[0]);
+        unsigned best_index = 0;
+        for (unsigned j = 1; j != 4; ++j) {
+          float d = distance2(pixels[i], pal[j]);
+          if (d < best) { best = d; best_index = j; }
+        }
+        indices[i] = (uint8_t)best_index;
+        total += best;
+      }
+      return total;
+    }
+
+    // least squares endpoints for a given set of indices. false if the system is singular.
+    static bool solve_endpoints(vec4 &e0, vec4 &e1, const uint8_t *indices, const vec4 *pixels) {
+      static const float weight0[4] = { 1.0f, 0.0f, 2.0f / 3, 1.0f / 3 };
+      float aa = 0, ab = 0, bb = 0;
+      vec4 ax(0, 0, 0, 0), bx(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        float a = weight0[indices[i]], b = 1.0f - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        ax += pixels[i] * a;
+        bx += pixels[i] * b;
+      }
+      float det = aa * bb - ab * ab;
+      if (fabsf(det) < 1e-6f) return false;
+      float inv_det = 1.0f / det;
+      e0 = (ax * bb - bx * ab) * inv_det;
+      e1 = (bx * aa - ax * ab) * inv_det;
+      return true;
+    }
+
+    // 16 pixels of colour (w = 0) to an 8 byte BC1 colour block.
+    void encode_colour(uint8_t *dest, const vec4 *pixels) const {
+      vec4 lo = pixels[0], hi = pixels[0], sum(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        lo = min(lo, pixels[i]);
+        hi = max(hi, pixels[i]);
+        sum += pixels[i];
+      }
+      vec4 mean = sum * (1.0f / 16);
+
+      // covariance matrix, one row per colour channel
+      vec4 cov_r(0, 0, 0, 0), cov_g(0, 0, 0, 0), cov_b(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        vec4 d = pixels[i] - mean;
+        cov_r += d * d[0];
+        cov_g += d * d[1];
+        cov_b += d * d[2];
+      }
+
+      // power iteration from the bounding box diagonal finds the principal axis
+      vec4 axis = hi - lo;
+      for (unsigned iter = 0; iter != 4; ++iter) {
+        axis = cov_r * axis[0] + cov_g * axis[1] + cov_b * axis[2];
+        float m = fabsf(axis[0]) > fabsf(axis[1]) ? fabsf(axis[0]) : fabsf(axis[1]);
+        m = m > fabsf(axis[2]) ? m : fabsf(axis[2]);
+        if (m < 1e-6f) break;
+        axis = axis * (1.0f / m);
+      }
+
+      vec4 e0 = hi, e1 = lo;
+      float len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+      if (len2 > 1e-6f) {
+        // extremes of the colours projected on the axis
+        float tmin = 0, tmax = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          vec4 d = pixels[i] - mean;
+          float t = d[0] * axis[0] + d[1] * axis[1] + d[2] * axis[2];
+          tmin = t < tmin ? t : tmin;
+          tmax = t > tmax ? t : tmax;
+        }
+        e0 = mean + axis * (tmax / len2);
+        e1 = mean + axis * (tmin / len2);
+      }
+
+      unsigned c0 = to565(e0), c1 = to565(e1);
+      uint8_t indices[16];
+      float error = choose_indices(indices, pixels, c0, c1);
+
+      for (unsigned iter = 0; refine && iter != 2 && error > 0; ++iter) {
+        vec4 r0, r1;
+        if (!solve_endpoints(r0, r1, indices, pixels)) break;
+        unsigned n0 = to565(r0), n1 = to565(r1);
+        if (n0 == c0 && n1 == c1) break;
+        uint8_t new_indices[16];
+        float new_error = choose_indices(new_indices, pixels, n0, n1);
+        if (new_error >= error) break;
+        c0 = n0;
+        c1 = n1;
+        error = new_error;
+        memcpy(indices, new_indices, 16);
+      }
+
+      // c0 > c1 selects the four colour palette
+      if (c0 < c1) {
+        unsigned t = c0; c0 = c1; c1 = t;
+        for (unsigned i = 0; i != 16; ++i) {
+          indices[i] ^= 1;
+        }
+      } else if (c0 == c1) {
+        memset(indices, 0, 16);
+      }
+
+      dest[0] = (uint8_t)c0;
+      dest[1] = (uint8_t)(c0 >> 8);
+      dest[2] = (uint8_t)c1;
+      dest[3] = (uint8_t)(c1 >> 8);
+      for (unsigned y = 0; y != 4; ++y) {
+        dest[4 + y] = (uint8_t)(indices[y*4+0] | (indices[y*4+1] << 2) | (indices[y*4+2] << 4) | (indices[y*4+3] << 6));
+      }
+    }
+
+    // BC3 alpha palette, as dds_decoder decodes it
+    static void make_alpha_palette(int *pal, int a0, int a1) {
+      pal[0] = a0;
+      pal[1] = a1;
+      for (int i = 1; i != 7; ++i) {
+        if (a0 > a1) {
+          pal[i+1] = ((7 - i) * a0 + i * a1) / 7;
+        } else if (i <= 4) {
+          pal[i+1] = ((5 - i) * a0 + i * a1) / 5;
+        }
+      }
+      if (a0 <= a1) {
+        pal[6] = 0;
+        pal[7] = 255;
+      }
+    }
+
+    static unsigned choose_alpha_indices(uint64_t &bits, const uint8_t *alpha, int a0, int a1) {
+      int pal[8];
+      make_alpha_palette(pal, a0, a1);
+      unsigned total = 0;
+      bits = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        int best = 256;
+        unsigned best_index = 0;
+        for (unsigned j = 0; j != 8; ++j) {
+          int d = pal[j] - alpha[i];
+          d = d < 0 ? -d : d;
+          if (d < best) { best = d; best_index = j; }
+        }
+        bits |= (uint64_t)best_index << (i * 3);
+        total += best * best;
+      }
+      return total;
+    }
+
+    // 16 alpha values to an 8 byte BC3 alpha block
+    static void encode_alpha(uint8_t *dest, const uint8_t *alpha) {
+      int lo = 255, hi = 0, inner_lo = 255, inner_hi = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        int a = alpha[i];
+        lo = a < lo ? a : lo;
+        hi = a > hi ? a : hi;
+        if (a != 0 && a != 255) {
+          inner_lo = a < inner_lo ? a : inner_lo;
+          inner_hi = a > inner_hi ? a : inner_hi;
+        }
+      }
+
+      // eight interpolated values between the extremes
+      uint64_t bits;
+      int a0 = hi, a1 = lo;
+      unsigned error = choose_alpha_indices(bits, alpha, a0, a1);
+
+      // six values between the inner extremes, plus exact 0 and 255. good for cutouts.
+      if (error && inner_lo <= inner_hi && (lo == 0 || hi == 255)) {
+        uint64_t bits6;
+        unsigned error6 = choose_alpha_indices(bits6, alpha, inner_lo, inner_hi);
+        if (error6 < error) {
+          a0 = inner_lo;
+          a1 = inner_hi;
+          bits = bits6;
+        }
+      }
+
+      dest[0] = (uint8_t)a0;
+      dest[1] = (uint8_t)a1;
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[2 + i] = (uint8_t)(bits >> (i * 8));
+      }
+    }
+
+    // compress one row of blocks
+    void encode_block_row(uint8_t *dest, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps, unsigned by, bool bc3) const {
+      unsigned xblocks = (width + 3) / 4;
+      vec4 pixels[16];
+      uint8_t alpha[16];
+      for (unsigned bx = 0; bx != xblocks; ++bx) {
+        // partial blocks repeat the edge pixels
+        for (unsigned i = 0; i != 16; ++i) {
+          unsigned x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+          x = x < width ? x : width - 1;
+          y = y < height ? y : height - 1;
+          const uint8_t *p = src + (y * width + x) * num_comps;
+          pixels[i] = vec4(p[0], p[1], p[2], 0);
+          alpha[i] = num_comps == 4 ? p[3] : 255;
+        }
+        if (bc3) {
+          encode_alpha(dest, alpha);
+          dest += 8;
+        }
+        encode_colour(dest, pixels);
+        dest += 8;
+      }
+    }
+
+  public:
+    enum {
+      COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0,
+      COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+
+      /// change this when the output changes so that cached results are rebuilt.
+      version = 1,
+    };
+
+    /// refine adds a least squares pass for better colour endpoints.
+    dxt_encoder(bool refine = true) {
+      this->refine = refine;
+    }
+
+    /// true if any pixel is not fully opaque.
+    static bool has_alpha(const uint8_t *src, unsigned width, unsigned height, unsigned num_comps) {
+      if (num_comps != 4) return false;
+      size_t count = (size_t)width * height;
+      for (size_t i = 0; i != count; ++i) {
+        if (src[i * 4 + 3] != 0xff) return true;
+      }
+      return false;
+    }
+
+    /// 64 bit hash of some bytes for keying cached results.
+    static uint64_t get_key(const uint8_t *src, size_t size, uint64_t seed) {
+      const uint64_t k1 = 0x9e3779b97f4a7c15ull, k2 = 0xc2b2ae3d27d4eb4full;
+      uint64_t h = seed ^ (size * k1);
+      size_t i = 0;
+      for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        word *= k2;
+        word = (word << 31) | (word >> 33);
+        h ^= word * k1;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+      }
+      for (; i != size; ++i) {
+        h = (h ^ src[i]) * k1;
+      }
+      h ^= h >> 33;
+      h *= k2;
+      h ^= h >> 29;
+      return h;
+    }
+
+    /// Compress mip_levels levels of an RGB or RGBA image to result.
+    /// Opaque images become BC1 (COMPRESSED_RGB_S3TC_DXT1_EXT), others BC3 (COMPRESSED_RGBA_S3TC_DXT5_EXT).
+    /// returns the format.
+    unsigned encode(dynarray<uint8_t> &result, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps, unsigned mip_levels) const {
+      bool bc3 = has_alpha(src, width, height, num_comps);
+      unsigned format = bc3 ? COMPRESSED_RGBA_S3TC_DXT5_EXT : COMPRESSED_RGB_S3TC_DXT1_EXT;
+      unsigned block_bytes = bc3 ? 16 : 8;
+
+      size_t total = 0;
+      for (unsigned level = 0, w = width, h = height; level != mip_levels; ++level) {
+        total += ((w + 3) / 4) * ((h + 3) / 4) * block_bytes;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+      result.resize((unsigned)total);
+
+      uint8_t *dest = &result[0];
+      unsigned w = width, h = height;
+      for (unsigned level = 0; level != mip_levels; ++level) {
+        unsigned row_bytes = ((w + 3) / 4) * block_bytes;
+        unsigned yblocks = (h + 3) / 4;
+        parallel_for(0, yblocks, [&](unsigned by) {
+          encode_block_row(dest + by * row_bytes, src, w, h, num_comps, by, bc3);
+        });
+        dest += row_bytes * yblocks;
+        src += w * h * num_comps;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+      return format;
+    }
+  };
+}}
@@ -6,205 +6,382 @@
 //
 //
 // gif file decoder - only the most common variants
-// 
+//
+// get_image() returns the first frame. Animations can be streamed a frame at a time
+// with begin() and next_frame(), or decoded in one go with get_animation().
+//
 namespace octet { namespace loaders {
   class gif_decoder {
-    uint16_t lzw_head[0x1001];
-    uint8_t lzw_tail[0x1001];
     enum { debug_gif = 0 };
 
-    // add a lzw string for a specific code.
-    // all strings consist of a head and a single byte tail.
-    // we follow the chains to get the whole string.
-    uint8_t add_lwz_string(unsigned code, uint8_t *&bytes, uint8_t *max_bytes, unsigned reset_code) {
-      unsigned i = code;
-      unsigned num_bytes = 1;
-      for (; i > reset_code; i = lzw_head[i]) {
-        num_bytes++;
-      }
+    enum {
+      // disposal methods from the graphics control extension
+      dispose_none = 1,
+      dispose_background = 2,
+      dispose_previous = 3,
+    };
 
-      uint8_t *dest = bytes += num_bytes;
-      if (bytes > max_bytes) return 0;
-      i = code;
-      for (; i > reset_code; i = lzw_head[i]) {
-        *--dest = lzw_tail[i];
-      }
-      *--dest = i;
+    // every lzw string has already been written to the output once.
+    // a new code is the previous string plus one byte, which is exactly what
+    // follows the previous string in the output, so we just remember where it was.
+    uint32_t lzw_offset[0x1001];
+    uint16_t lzw_length[0x1001];
 
-      if (debug_gif) {
-        for (unsigned i = 0; i != num_bytes; ++i) {
-          printf("out %02x\n", dest[i]);
-        }
-      }    
-      return i;
-    }
+    // the file we are streaming
+    const uint8_t *src_start;
+    const uint8_t *src_max;
+    const uint8_t *next_block;
+    const uint8_t *gct;
+    unsigned gct_size;
+    unsigned width_;
+    unsigned height_;
+
+    // graphics control extension for the next image
+    unsigned transparency_index;
+    unsigned delay;
+    unsigned disposal;
+
+    // disposal for the last frame drawn, done before drawing the next one.
+    bool first_frame;
+    unsigned last_disposal;
+    unsigned last_x0, last_y0, last_x1, last_y1;
+    dynarray<uint8_t> saved;
+
+    // palette indices for one frame
+    dynarray<uint8_t> indices;
 
     // decode image data from a gif file as a lzw coding of palette values
-    bool gif_decode_bytes(uint8_t *bytes, uint8_t *max_bytes, int min_lzw_size, const uint8_t *&srcref) {
+    bool gif_decode_bytes(uint8_t *bytes, uint8_t *max_bytes, unsigned min_lzw_size, const uint8_t *&srcref, const uint8_t *src_max) {
+      if (min_lzw_size < 2 || min_lzw_size > 11) return true;
+
       const uint8_t *src = srcref;
+      uint8_t *dest = bytes;
       unsigned lzw_size = min_lzw_size + 1;
       unsigned reset_code = ( 1 << min_lzw_size );
       unsigned mask = reset_code * 2 - 1;
-      unsigned cur_code = reset_code + 1;
+      unsigned next_code = reset_code + 2;
 
       unsigned acc = 0;
       unsigned bits = 0;
       unsigned prev_code = ~0;
+      unsigned prev_offset = 0;
+      unsigned prev_length = 0;
+      bool done = false;
 
-      while (*src) {
+      while (src < src_max && *src) {
         unsigned len = *src++;
-        do {
+        if (len > (unsigned)(src_max - src)) return true;
+        const uint8_t *block_end = src + len;
+        while (src != block_end) {
           unsigned byte = *src++;
           acc |= byte << bits;
           bits += 8;
           if (debug_gif) printf("byte %02x acc=%08x bits=%d\n", byte, acc, bits);
-          while (bits >= lzw_size) {
+          while (!done && bits >= lzw_size) {
             unsigned code = acc & mask;
             if (debug_gif) printf("code=%03x\n", code);
             bits -= lzw_size;
             acc >>= lzw_size;
-            if ((code & ~1) == reset_code) {
-              if (code == reset_code+1) {
-                // end
-                break;
-              } else {
-                // reset
-                lzw_size = min_lzw_size + 1;
-                cur_code = reset_code + 1;
-                mask = reset_code * 2 - 1;
-              }
-            } else {
-              if (
-                (prev_code == ~0 && code >= reset_code) ||
-                code > cur_code
-              ) {
-                return true;
-              }
+            if (code == reset_code) {
+              lzw_size = min_lzw_size + 1;
+              mask = reset_code * 2 - 1;
+              next_code = reset_code + 2;
+              prev_code = ~0;
+              continue;
+            } else if (code == reset_code + 1) {
+              // end
+              done = true;
+              break;
+            }
 
-              uint8_t tail = 0;
-              if (code == cur_code) {
-                *bytes++ = tail = add_lwz_string(prev_code, bytes, max_bytes-1, reset_code);
-                if (debug_gif) printf("out %02x\n", tail);
+            if (code > next_code || (prev_code == ~0u && code >= reset_code)) {
+              return true;
+            }
+
+            uint8_t *start = dest;
+            if (code < reset_code) {
+              if (dest == max_bytes) { done = true; break; }
+              *dest++ = (uint8_t)code;
+            } else {
+              // a code we have not seen yet (code == next_code) is the previous string
+              // plus its own first byte.
+              unsigned from_code = code == next_code ? prev_code : code;
+              unsigned length = from_code < reset_code ? 1 : lzw_length[from_code];
+              unsigned total = length + (code == next_code);
+              if (total > (unsigned)(max_bytes - dest)) { done = true; break; }
+              if (from_code < reset_code) {
+                dest[0] = (uint8_t)from_code;
               } else {
-                tail = add_lwz_string(code, bytes, max_bytes, reset_code);
+                memcpy(dest, bytes + lzw_offset[from_code], length);
               }
+              if (code == next_code) dest[length] = dest[0];
+              dest += total;
+            }
 
-              if (bytes > max_bytes) return true;
-
-              lzw_head[cur_code] = prev_code;
-              lzw_tail[cur_code] = tail;
-              prev_code = code;
-
-              cur_code++;
-              if (cur_code > mask) {
+            if (prev_code != ~0u && next_code < 0x1000) {
+              lzw_offset[next_code] = prev_offset;
+              lzw_length[next_code] = (uint16_t)(prev_length + 1);
+              next_code++;
+              if (next_code > mask && mask != 0xfff) {
                 if (debug_gif) printf("resize\n");
-                if (mask != 0xfff) {
-                  lzw_size++;
-                  mask = mask * 2 + 1;
-                } else {
-                  cur_code = 0x1000;
-                }
+                lzw_size++;
+                mask = mask * 2 + 1;
               }
             }
-          } 
-        } while( --len );
+            prev_code = code;
+            prev_offset = (unsigned)(start - bytes);
+            prev_length = (unsigned)(dest - start);
+          }
+        }
       }
-      src++;
+      if (src < src_max) src++;
       srcref = src;
+
+      // short images are padded with index zero.
+      memset(dest, 0, max_bytes - dest);
       return false;
     }
 
+    // skip a chain of data sub-blocks
+    const uint8_t *skip_sub_blocks(const uint8_t *src) const {
+      while (src < src_max && *src) {
+        if (debug_gif) printf("    len=%02x\n", *src);
+        src += *src + 1;
+      }
+      return src < src_max ? src + 1 : src_max;
+    }
+
+    // write one row of palette indices to the canvas, leaving transparent pixels alone.
+    static void expand_row(uint8_t *dest, const uint8_t *src, unsigned num_pixels, const uint32_t *palette, unsigned transparency_index) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        // four pixels at a time: look up the colours and blend in the old canvas where transparent.
+        __m128i transparent = _mm_set1_epi32((int)transparency_index);
+        for (; i + 4 <= num_pixels; i += 4) {
+          __m128i colours = _mm_set_epi32((int)palette[src[i+3]], (int)palette[src[i+2]], (int)palette[src[i+1]], (int)palette[src[i+0]]);
+          __m128i idx = _mm_set_epi32(src[i+3], src[i+2], src[i+1], src[i+0]);
+          __m128i keep = _mm_cmpeq_epi32(idx, transparent);
+          __m128i old = _mm_loadu_si128((const __m128i*)(dest + i * 4));
+          _mm_storeu_si128((__m128i*)(dest + i * 4), _mm_or_si128(_mm_and_si128(keep, old), _mm_andnot_si128(keep, colours)));
+        }
+      #endif
+      for (; i != num_pixels; ++i) {
+        unsigned idx = src[i];
+        if (idx != transparency_index) {
+          memcpy(dest + i * 4, &palette[idx], 4);
+        }
+      }
+    }
+
+    // copy a rectangle of the canvas (top down coordinates) to or from saved.
+    void copy_rect(uint8_t *canvas, unsigned x0, unsigned y0, unsigned x1, unsigned y1, bool save) {
+      if (x1 <= x0 || y1 <= y0) return;
+      unsigned row_bytes = (x1 - x0) * 4;
+      if (save) saved.resize(row_bytes * (y1 - y0));
+      for (unsigned y = y0; y < y1; ++y) {
+        uint8_t *row = canvas + ((height_ - 1 - y) * width_ + x0) * 4;
+        uint8_t *copy = &saved[0] + (y - y0) * row_bytes;
+        if (save) memcpy(copy, row, row_bytes); else memcpy(row, copy, row_bytes);
+      }
+    }
+
+    void clear_rect(uint8_t *canvas, unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+      for (unsigned y = y0; y < y1; ++y) {
+        memset(canvas + ((height_ - 1 - y) * width_ + x0) * 4, 0, (x1 - x0) * 4);
+      }
+    }
+
+    void reset_control() {
+      transparency_index = 0x100; // disable transparency
+      delay = 0;
+      disposal = 0;
+    }
+
   public:
-    // get an opengl texture from a file in memory
-    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
-      width = src[6] + src[7]*256;
-      height = src[8] + src[9]*256;
+    gif_decoder() {
+      src_start = src_max = next_block = gct = NULL;
+      gct_size = width_ = height_ = 0;
+      last_disposal = 0;
+      first_frame = true;
+      reset_control();
+    }
+
+    /// start streaming frames from a gif file in memory. The file must stay in memory while frames are read.
+    bool begin(const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < 13 || (memcmp(src, "GIF89a", 6) && memcmp(src, "GIF87a", 6))) {
+        printf("warning: not a gif file\n");
+        return false;
+      }
+      width_ = src[6] + src[7]*256;
+      height_ = src[8] + src[9]*256;
       unsigned flags = src[10];
-      unsigned gct_size = flags & 0x80 ? 1 << ((flags & 7)+1) : 0;
+      gct_size = flags & 0x80 ? 1 << ((flags & 7)+1) : 0;
       //unsigned background = src[11];
       //unsigned aspect = src[12];
-      unsigned transparency_index = 0x100; // disable transparency
+      gct = src + 13;
+      this->src_start = src;
+      this->src_max = src_max;
+      rewind();
+      return gct + gct_size * 3 <= src_max;
+    }
 
-      unsigned size = width * height * 4;
-      image.resize(size);
-      format = 0x1908; // GL_RGBA
+    /// go back to the first frame.
+    void rewind() {
+      next_block = gct + gct_size * 3;
+      last_disposal = 0;
+      first_frame = true;
+      reset_control();
+    }
+
+    unsigned get_width() const { return width_; }
+    unsigned get_height() const { return height_; }
 
-      memset(&image[0], 0xff, size);
-      src += 13;
-      const uint8_t *gct = src;
-      src += gct_size * 3;
-      while (src < src_max) {
+    /// draw the next frame onto an RGBA canvas (bottom row first, like get_image).
+    /// The canvas should be the one passed to the previous call as frames only update part of it.
+    /// delay_cs is the frame time in hundredths of a second. Returns false when there are no more frames.
+    bool next_frame(dynarray<uint8_t> &canvas, unsigned &delay_cs) {
+      unsigned size = width_ * height_ * 4;
+      if (canvas.size() != size) {
+        canvas.resize(size);
+        memset(&canvas[0], 0, size);
+      }
+
+      // dispose of the last frame.
+      if (last_disposal == dispose_background) {
+        clear_rect(&canvas[0], last_x0, last_y0, last_x1, last_y1);
+      } else if (last_disposal == dispose_previous) {
+        copy_rect(&canvas[0], last_x0, last_y0, last_x1, last_y1, false);
+      }
+      last_disposal = 0;
+
+      const uint8_t *src = next_block;
+      while (src && src < src_max) {
         unsigned code = *src++;
         if (code == 0x3b) {
           // end
           break;
         } else if (code == 0x21) {
-          if (*src == 0xf9) {
+          if (src + 6 <= src_max && src[0] == 0xf9) {
             // graphics control extension
             //unsigned block_size = src[1];
             unsigned flags = src[2];
-            //unsigned delay = src[3] + src[4] * 256;
+            delay = src[3] + src[4] * 256;
             transparency_index = flags & 1 ? src[5] : 0x100;
-
-            src++;
-            while (*src) {
-              if (debug_gif) printf("    len=%02x\n", *src);
-              src += *src + 1;
-            }
-            src++;
-          } else {
-            // unknown extension
-            src++;
-            while (*src) {
-              if (debug_gif) printf("    len=%02x\n", *src);
-              src += *src + 1;
-            }
-            src++;
+            disposal = (flags >> 2) & 7;
           }
+          // skip the extension label and data
+          src = skip_sub_blocks(src + 1);
         } else if (code == 0x2c) {
           // image descriptor
+          if (src + 10 > src_max) break;
           unsigned left = src[0] + src[1]*256;
           unsigned top = src[2] + src[3]*256;
           unsigned lwidth = src[4] + src[5]*256;
           unsigned lheight = src[6] + src[7]*256;
           unsigned flags = src[8];
           unsigned lct_size = ( flags & 0x80 ) ? 1 << ((flags & 7)+1) : 0;
+          bool interlaced = ( flags & 0x40 ) != 0;
           src += 9;
           const uint8_t *color_table = ( flags & 0x80 ) ? src : gct;
+          unsigned color_table_size = ( flags & 0x80 ) ? lct_size : gct_size;
           src += lct_size * 3;
+          if (src >= src_max) break;
           unsigned min_lzw_size = *src++;
 
-          dynarray<uint8_t> bytes(lwidth*lheight);
-          bool error = 
-            left + lwidth > width ||
-            top + lheight > height ||
-            gif_decode_bytes(&bytes[0], &bytes[lwidth*lheight], min_lzw_size, src)
-          ;
-          if (error) {
+          indices.resize(lwidth * lheight);
+          if (gif_decode_bytes(&indices[0], &indices[0] + lwidth * lheight, min_lzw_size, src, src_max)) {
             printf("warning: gif_decode_bytes - broken gif file\n");
-            goto fail;
-          } else {
-            uint8_t *src = &bytes[0];
-            for (unsigned j = 0; j != lheight; ++j) {
-              uint8_t *dest = &image[((height - 1 - j - top) * width + left) * 4];
-              for (unsigned i = 0; i != lwidth; ++i) {
-                unsigned idx = *src++;
-                dest[0] = color_table[idx*3+0];
-                dest[1] = color_table[idx*3+1];
-                dest[2] = color_table[idx*3+2];
-                dest[3] = idx == transparency_index ? 0x00 : 0xff;
-                //printf("%02x %02x %02x\n", dest[0], dest[1], dest[2]);
-                dest += 4;
+            break;
+          }
+
+          uint32_t palette[256];
+          memset(palette, 0, sizeof(palette));
+          for (unsigned i = 0; i != color_table_size; ++i) {
+            uint8_t rgba[4] = { color_table[i*3+0], color_table[i*3+1], color_table[i*3+2], 0xff };
+            memcpy(&palette[i], rgba, 4);
+          }
+
+          // the first frame has nothing under it, so transparent pixels keep their colour with zero alpha.
+          unsigned skip_index = transparency_index;
+          if (first_frame && transparency_index < 0x100) {
+            ((uint8_t*)&palette[transparency_index])[3] = 0;
+            skip_index = 0x100;
+          }
+
+          // frames are clipped to the canvas.
+          unsigned x0 = left < width_ ? left : width_;
+          unsigned y0 = top < height_ ? top : height_;
+          unsigned x1 = left + lwidth < width_ ? left + lwidth : width_;
+          unsigned y1 = top + lheight < height_ ? top + lheight : height_;
+          if (disposal == dispose_previous) {
+            copy_rect(&canvas[0], x0, y0, x1, y1, true);
+          }
+
+          // interlaced images store every 8th row, then rows 4 + 8n, 2 + 4n and 1 + 2n.
+          static const uint8_t pass_start[] = { 0, 4, 2, 1 };
+          static const uint8_t pass_step[] = { 8, 8, 4, 2 };
+          unsigned pass = 0, y = 0;
+          for (unsigned j = 0; j != lheight; ++j) {
+            if (interlaced) {
+              while (pass < 4 && pass_start[pass] + y * pass_step[pass] >= lheight) {
+                pass++;
+                y = 0;
               }
             }
+            unsigned row = interlaced ? pass_start[pass] + y * pass_step[pass] : j;
+            y++;
+            if (top + row >= height_ || x1 <= x0) continue;
+            uint8_t *dest = &canvas[((height_ - 1 - row - top) * width_ + x0) * 4];
+            expand_row(dest, &indices[j * lwidth], x1 - x0, palette, skip_index);
           }
+
+          first_frame = false;
+          last_disposal = disposal;
+          last_x0 = x0; last_y0 = y0; last_x1 = x1; last_y1 = y1;
+          delay_cs = delay;
+          reset_control();
+          next_block = src;
+          return true;
         } else {
           printf("warning: unknown gif file section type\n");
+          break;
         }
       }
-    fail:;
-      //num_components = transparency_index == 0x100 ? 3 : 4;
+      next_block = src_max;
+      return false;
+    }
+
+    /// decode every frame of an animation. frames holds num_frames canvases of width * height RGBA
+    /// back to back, delays the frame times in hundredths of a second.
+    unsigned get_animation(dynarray<uint8_t> &frames, dynarray<unsigned> &delays, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
+      if (!begin(src, src_max)) return 0;
+      width = width_;
+      height = height_;
+
+      dynarray<uint8_t> canvas;
+      unsigned frame_delay = 0;
+      unsigned num_frames = 0;
+      frames.resize(0);
+      delays.resize(0);
+      while (next_frame(canvas, frame_delay)) {
+        frames.resize(frames.size() + canvas.size());
+        memcpy(&frames[frames.size() - canvas.size()], &canvas[0], canvas.size());
+        delays.push_back(frame_delay);
+        num_frames++;
+      }
+      return num_frames;
+    }
+
+    // get an opengl texture from a file in memory
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
+      if (!begin(src, src_max)) return;
+      width = width_;
+      height = height_;
+      format = 0x1908; // GL_RGBA
+
+      image.resize(0);
+      unsigned frame_delay = 0;
+      next_frame(image, frame_delay);
     }
   };
 }}
-
@@ -32,6 +32,9 @@ namespace octet { namespace loaders {
     unsigned num_mcu_blocks;
     unsigned num_components_in_scan;
 
+    // number of MCUs between RSTn markers (DRI), 0 for none
+    unsigned restart_interval;
+
     // skip a number of bits in the file.
     // there is a special case where every 0xff byte is followed by 0x00
     static void skip_bits(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
@@ -119,6 +122,23 @@ namespace octet { namespace loaders {
     float dct_coeffs[8*64];
     float ycrcb_values[8*64];
 
+    // at the end of a restart interval, find the RSTn marker and start a fresh bit stream.
+    // the bit reader never reads past a marker, so it is only a byte or two away.
+    void restart(unsigned &acc, const uint8_t *&src, int &shift) {
+      for (unsigned i = 0; i != 4 && !(src[0] == 0xff && src[1] >= 0xd0 && src[1] <= 0xd7); ++i) {
+        src++;
+      }
+      if (src[0] == 0xff && src[1] >= 0xd0 && src[1] <= 0xd7) {
+        src += 2;
+      }
+      acc = 0;
+      shift = 0;
+      skip_bits(16, acc, src, shift);
+      for (unsigned i = 0; i != num_components_in_scan; ++i) {
+        scan_components[i].last_dc = 0;
+      }
+    }
+
     unsigned u2(const uint8_t *src) {
       return src[0] * 256 + src[1];
     }
@@ -314,38 +334,20 @@ namespace octet { namespace loaders {
     // convert from YCrCb to RGB
     // See http://en.wikipedia.org/wiki/YCbCr
     // The 0.125 scaling factor is because the DCT data has a scale of 8
+    // The four Y blocks tile the 16x16 MCU; Cb and Cr cover it at half resolution.
     void color_convert_411(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y0 = inptr[0x00];
-          float y1 = inptr[0x40];
-          float y2 = inptr[0x80];
-          float y3 = inptr[0xc0];
-          float cb = inptr[0x100];
-          float cr = inptr[0x140];
-          inptr++;
-          outptr[0] = clamp(128 + y0 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y0 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y0 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y1 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y1 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y1 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += stride - 4;
-          outptr[0] = clamp(128 + y2 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y2 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y2 * 0.125f + cb * (1.772f * 0.125f));
+      for (unsigned j = 0; j != 16; ++j) {
+        for (unsigned i = 0; i != 16; ++i) {
+          float y = inptr[(j >> 3) * 0x80 + (i >> 3) * 0x40 + (j & 7) * 8 + (i & 7)];
+          float cb = inptr[0x100 + (j >> 1) * 8 + (i >> 1)];
+          float cr = inptr[0x140 + (j >> 1) * 8 + (i >> 1)];
+          outptr[0] = clamp(128 + y * 0.125f + cr * (1.402f * 0.125f));
+          outptr[1] = clamp(128 + y * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
+          outptr[2] = clamp(128 + y * 0.125f + cb * (1.772f * 0.125f));
           outptr[3] = 0xff;
           outptr += 4;
-          outptr[0] = clamp(128 + y3 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y3 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y3 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += -stride + 4;
         }
-        outptr += stride*2 - 64;
+        outptr += stride - 64;
       }
     }
 
@@ -531,8 +533,16 @@ namespace octet { namespace loaders {
 
           uint8_t *image_base = image.data() + base;
 
+          unsigned mcus_to_restart = restart_interval;
           for (unsigned y = 0; y != ymax; ++y) {
             for (unsigned x = 0; x != xmax; ++x) {
+              if (restart_interval) {
+                if (mcus_to_restart == 0) {
+                  restart(acc, src, shift);
+                  mcus_to_restart = restart_interval;
+                }
+                mcus_to_restart--;
+              }
               float *coeffs = dct_coeffs;
               memset(coeffs, 0, 64 * num_mcu_blocks * sizeof(float));
               for (unsigned b = 0; b < num_mcu_blocks; ++b) {
@@ -556,6 +566,13 @@ namespace octet { namespace loaders {
           length = (unsigned)(src - src0);
         } break;
 
+        // restart interval
+        case 0xdd: {
+          length = u2(src + 2) + 2;
+          restart_interval = u2(src + 4);
+          if (debug) printf("DRI %d\n", restart_interval);
+        } break;
+
         // quantisation tables (the lossy bit)
         case 0xdb: {
           length = u2(src + 2) + 2;
@@ -588,6 +605,10 @@ namespace octet { namespace loaders {
       return length;
     }
   public:
+    jpeg_decoder() {
+      restart_interval = 0;
+    }
+
     // get an opengl texture from a file in memory
     void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
       while (src < src_max) {
@@ -8,72 +8,537 @@
 // jpeg file encoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
+// Baseline JPEG with the standard (Annex K) huffman tables.
+// Every row of MCUs is a restart interval, so the rows are encoded on the
+// worker threads and joined with RSTn markers.
+//
 namespace octet { namespace loaders {
+  /// Baseline JPEG encoder for screenshots and frame capture.
   class jpeg_encoder {
+    // huffman code and length for each symbol
+    struct huffman_table {
+      uint16_t code[256];
+      uint8_t length[256];
+    };
+
+    // the four standard huffman tables, built once.
+    struct huffman_tables {
+      huffman_table dc[2];
+      huffman_table ac[2];
+
+      huffman_tables() {
+        build(dc[0], get_dht(0));
+        build(ac[0], get_dht(1));
+        build(dc[1], get_dht(2));
+        build(ac[1], get_dht(3));
+      }
+
+      // canonical huffman codes from the DHT bit counts and symbols
+      static void build(huffman_table &table, const uint8_t *dht) {
+        memset(&table, 0, sizeof(table));
+        const uint8_t *bits = dht + 1;
+        const uint8_t *symbols = dht + 17;
+        unsigned code = 0;
+        for (unsigned length = 1; length <= 16; ++length) {
+          for (unsigned i = 0; i != bits[length-1]; ++i) {
+            uint8_t symbol = *symbols++;
+            table.code[symbol] = (uint16_t)code++;
+            table.length[symbol] = (uint8_t)length;
+          }
+          code <<= 1;
+        }
+      }
+    };
+
+    // collects the huffman codes of one restart interval with 0xff bytes stuffed.
+    class bit_writer {
+      uint32_t acc;
+      unsigned num_bits;
+    public:
+      dynarray<uint8_t> bytes;
+
+      bit_writer() {
+        acc = 0;
+        num_bits = 0;
+      }
+
+      // write up to 16 bits
+      void put(unsigned code, unsigned length) {
+        acc = (acc << length) | code;
+        num_bits += length;
+        while (num_bits >= 8) {
+          num_bits -= 8;
+          uint8_t byte = (uint8_t)(acc >> num_bits);
+          bytes.push_back(byte);
+          if (byte == 0xff) bytes.push_back(0);
+        }
+      }
+
+      // pad the last byte with ones before a marker.
+      void flush() {
+        if (num_bits) {
+          put((1 << (8 - num_bits)) - 1, 8 - num_bits);
+        }
+      }
+    };
+
+    // the JPEG is built in units of 8x8 blocks. Each block is 16 vec4s: two per row.
+    struct block {
+      vec4 rows[16];
+    };
+
+    int quality;
+    bool subsample;
+
+    // quantisation tables in zigzag order for the DQT marker.
+    uint8_t qtable[2][64];
+
+    // 1/q with the AAN scale factors folded in.
+    // stored transposed to match the output of fdct.
+    vec4 qscale[2][16];
+
+    uint32_t width;
+    uint32_t height;
+    int stride;
+    unsigned bytes_per_pixel;
+    const uint8_t *src;
+
+    // natural order index for each zigzag position
+    static const uint8_t *get_zigzag() {
+      static const uint8_t zigzag[64] = {
+         0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+      };
+      return zigzag;
+    }
+
+    // DHT payloads: class/id, 16 bit counts, symbols.
+    // 0: luminance DC, 1: luminance AC, 2: chrominance DC, 3: chrominance AC
+    static const uint8_t *get_dht(unsigned i) {
+      static const uint8_t luma_dc[] = {
+        0x00,
+        0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+      };
+      static const uint8_t luma_ac[] = {
+        0x10,
+        0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+      };
+      static const uint8_t chroma_dc[] = {
+        0x01,
+        0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+      };
+      static const uint8_t chroma_ac[] = {
+        0x11,
+        0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+      };
+      static const uint8_t *tables[] = { luma_dc, luma_ac, chroma_dc, chroma_ac };
+      return tables[i];
+    }
+
+    // total size of a DHT payload
+    static unsigned get_dht_size(const uint8_t *dht) {
+      unsigned size = 17;
+      for (unsigned i = 1; i <= 16; ++i) size += dht[i];
+      return size;
+    }
+
+    static const huffman_tables &get_huffman_tables() {
+      static huffman_tables tables;
+      return tables;
+    }
+
+    // scale the example tables from the JPEG standard (IJG quality scaling).
+    void make_quant_tables() {
+      static const uint8_t luma_q[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61,
+        12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56,
+        14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77,
+        24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,
+        72, 92, 95, 98, 112, 100, 103, 99,
+      };
+      static const uint8_t chroma_q[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99,
+        18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,
+        47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+      };
+      static const float aan_scale[8] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+        1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+      };
+
+      int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+      const uint8_t *zigzag = get_zigzag();
+      for (unsigned t = 0; t != 2; ++t) {
+        const uint8_t *base = t == 0 ? luma_q : chroma_q;
+        uint8_t natural[64];
+        for (unsigned i = 0; i != 64; ++i) {
+          int q = (base[i] * scale + 50) / 100;
+          natural[i] = (uint8_t)(q < 1 ? 1 : q > 255 ? 255 : q);
+        }
+        for (unsigned i = 0; i != 64; ++i) {
+          qtable[t][i] = natural[zigzag[i]];
+        }
+
+        // fdct leaves horizontal frequency u in the row and vertical frequency v in the lane.
+        for (unsigned u = 0; u != 8; ++u) {
+          for (unsigned v = 0; v != 8; ++v) {
+            qscale[t][u*2 + v/4][v%4] = 1.0f / (natural[v*8+u] * aan_scale[u] * aan_scale[v] * 8.0f);
+          }
+        }
+      }
+    }
+
+    // AAN forward DCT on eight values (from IJG jfdctflt.c).
+    // With vec4 this transforms four columns at once.
+    static void fdct_1d(vec4 *d) {
+      vec4 tmp0 = d[0*2] + d[7*2];
+      vec4 tmp7 = d[0*2] - d[7*2];
+      vec4 tmp1 = d[1*2] + d[6*2];
+      vec4 tmp6 = d[1*2] - d[6*2];
+      vec4 tmp2 = d[2*2] + d[5*2];
+      vec4 tmp5 = d[2*2] - d[5*2];
+      vec4 tmp3 = d[3*2] + d[4*2];
+      vec4 tmp4 = d[3*2] - d[4*2];
+
+      // even part
+      vec4 tmp10 = tmp0 + tmp3;
+      vec4 tmp13 = tmp0 - tmp3;
+      vec4 tmp11 = tmp1 + tmp2;
+      vec4 tmp12 = tmp1 - tmp2;
+
+      d[0*2] = tmp10 + tmp11;
+      d[4*2] = tmp10 - tmp11;
+
+      vec4 z1 = (tmp12 + tmp13) * 0.707106781f;
+      d[2*2] = tmp13 + z1;
+      d[6*2] = tmp13 - z1;
+
+      // odd part
+      tmp10 = tmp4 + tmp5;
+      tmp11 = tmp5 + tmp6;
+      tmp12 = tmp6 + tmp7;
+
+      vec4 z5 = (tmp10 - tmp12) * 0.382683433f;
+      vec4 z2 = tmp10 * 0.541196100f + z5;
+      vec4 z4 = tmp12 * 1.306562965f + z5;
+      vec4 z3 = tmp11 * 0.707106781f;
+
+      vec4 z11 = tmp7 + z3;
+      vec4 z13 = tmp7 - z3;
+
+      d[5*2] = z13 + z2;
+      d[3*2] = z13 - z2;
+      d[1*2] = z11 + z4;
+      d[7*2] = z11 - z4;
+    }
+
+    // transpose the 8x8 block so that the rows become the lanes.
+    static void transpose(block &dest, const block &b) {
+      for (unsigned x = 0; x != 8; ++x) {
+        unsigned lane = x % 4;
+        dest.rows[x*2+0] = vec4(b.rows[0*2+x/4][lane], b.rows[1*2+x/4][lane], b.rows[2*2+x/4][lane], b.rows[3*2+x/4][lane]);
+        dest.rows[x*2+1] = vec4(b.rows[4*2+x/4][lane], b.rows[5*2+x/4][lane], b.rows[6*2+x/4][lane], b.rows[7*2+x/4][lane]);
+      }
+    }
+
+    // transform and quantise a block of level shifted samples. coefs are in natural order.
+    void fdct_quantise(int *coefs, block &b, unsigned table) const {
+      // vertical pass: four columns per vec4
+      fdct_1d(b.rows + 0);
+      fdct_1d(b.rows + 1);
+
+      // horizontal pass on the transposed block
+      block t;
+      transpose(t, b);
+      fdct_1d(t.rows + 0);
+      fdct_1d(t.rows + 1);
+
+      // row u of t holds horizontal frequency u for vertical frequencies v in the lanes
+      const vec4 *scale = qscale[table];
+      for (unsigned i = 0; i != 16; ++i) {
+        vec4 q = t.rows[i] * scale[i];
+        unsigned u = i / 2, v0 = (i % 2) * 4;
+        for (unsigned j = 0; j != 4; ++j) {
+          // round to nearest with a positive bias so that the cast truncates correctly
+          coefs[(v0 + j) * 8 + u] = (int)(q[j] + 16384.5f) - 16384;
+        }
+      }
+    }
+
+    // number of bits needed for a magnitude
+    static unsigned get_category(unsigned value) {
+      unsigned n = 0;
+      while (value) { value >>= 1; ++n; }
+      return n;
+    }
+
+    static void encode_block(bit_writer &w, const int *coefs, int &dc_pred, const huffman_table &dc, const huffman_table &ac) {
+      const uint8_t *zigzag = get_zigzag();
+
+      int diff = coefs[0] - dc_pred;
+      dc_pred = coefs[0];
+      unsigned cat = get_category(diff < 0 ? -diff : diff);
+      w.put(dc.code[cat], dc.length[cat]);
+      if (cat) {
+        w.put((diff < 0 ? diff - 1 : diff) & ((1 << cat) - 1), cat);
+      }
+
+      unsigned run = 0;
+      for (unsigned i = 1; i != 64; ++i) {
+        int value = coefs[zigzag[i]];
+        if (value == 0) {
+          run++;
+        } else {
+          while (run > 15) {
+            w.put(ac.code[0xf0], ac.length[0xf0]);
+            run -= 16;
+          }
+          cat = get_category(value < 0 ? -value : value);
+          unsigned symbol = (run << 4) | cat;
+          w.put(ac.code[symbol], ac.length[symbol]);
+          w.put((value < 0 ? value - 1 : value) & ((1 << cat) - 1), cat);
+          run = 0;
+        }
+      }
+
+      if (run) {
+        w.put(ac.code[0x00], ac.length[0x00]);
+      }
+    }
+
+    // read a pixel, clamping to the image so that partial MCUs repeat the edge.
+    void get_rgb(float &r, float &g, float &b, unsigned x, unsigned y) const {
+      if (x >= width) x = width - 1;
+      if (y >= height) y = height - 1;
+      const uint8_t *p = src + (ptrdiff_t)y * stride + x * bytes_per_pixel;
+      r = p[0]; g = p[1]; b = p[2];
+    }
+
+    // encode one row of MCUs as a restart interval.
+    void encode_row(bit_writer &w, unsigned mcu_y) const {
+      const huffman_tables &tables = get_huffman_tables();
+      unsigned mcu_size = subsample ? 16 : 8;
+      unsigned mcus_x = (width + mcu_size - 1) / mcu_size;
+      int dc_pred[3] = { 0, 0, 0 };
+      int coefs[64];
+      block y_blocks[4], cb, cr;
+
+      for (unsigned mcu_x = 0; mcu_x != mcus_x; ++mcu_x) {
+        unsigned x0 = mcu_x * mcu_size, y0 = mcu_y * mcu_size;
+
+        // colour convert and level shift.
+        if (subsample) {
+          for (unsigned y = 0; y != 16; y += 2) {
+            for (unsigned x = 0; x != 16; x += 2) {
+              float r_sum = 0, g_sum = 0, b_sum = 0;
+              for (unsigned i = 0; i != 4; ++i) {
+                unsigned px = x + (i & 1), py = y + (i >> 1);
+                float r, g, b;
+                get_rgb(r, g, b, x0 + px, y0 + py);
+                block &yb = y_blocks[(py / 8) * 2 + px / 8];
+                yb.rows[(py % 8) * 2 + (px % 8) / 4][px % 4] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+                r_sum += r; g_sum += g; b_sum += b;
+              }
+              r_sum *= 0.25f; g_sum *= 0.25f; b_sum *= 0.25f;
+              unsigned cx = x / 2, cy = y / 2;
+              cb.rows[cy * 2 + cx / 4][cx % 4] = -0.168736f * r_sum - 0.331264f * g_sum + 0.5f * b_sum;
+              cr.rows[cy * 2 + cx / 4][cx % 4] = 0.5f * r_sum - 0.418688f * g_sum - 0.081312f * b_sum;
+            }
+          }
+          for (unsigned i = 0; i != 4; ++i) {
+            fdct_quantise(coefs, y_blocks[i], 0);
+            encode_block(w, coefs, dc_pred[0], tables.dc[0], tables.ac[0]);
+          }
+        } else {
+          for (unsigned y = 0; y != 8; ++y) {
+            for (unsigned x = 0; x != 8; ++x) {
+              float r, g, b;
+              get_rgb(r, g, b, x0 + x, y0 + y);
+              unsigned row = y * 2 + x / 4, lane = x % 4;
+              y_blocks[0].rows[row][lane] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+              cb.rows[row][lane] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+              cr.rows[row][lane] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+            }
+          }
+          fdct_quantise(coefs, y_blocks[0], 0);
+          encode_block(w, coefs, dc_pred[0], tables.dc[0], tables.ac[0]);
+        }
+
+        fdct_quantise(coefs, cb, 1);
+        encode_block(w, coefs, dc_pred[1], tables.dc[1], tables.ac[1]);
+        fdct_quantise(coefs, cr, 1);
+        encode_block(w, coefs, dc_pred[2], tables.dc[1], tables.ac[1]);
+      }
+      w.flush();
+    }
+
+    static void put16(dynarray<uint8_t> &data, unsigned value) {
+      data.push_back((uint8_t)(value >> 8));
+      data.push_back((uint8_t)value);
+    }
+
+    static void put_marker(dynarray<uint8_t> &data, unsigned marker, unsigned length) {
+      data.push_back(0xff);
+      data.push_back((uint8_t)marker);
+      put16(data, length);
+    }
+
+    void write_headers(dynarray<uint8_t> &data, unsigned restart_interval) const {
+      // SOI
+      data.push_back(0xff);
+      data.push_back(0xd8);
+
+      // APP0: JFIF 1.1, 72 dpi
+      static const uint8_t jfif[] = { 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x01, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00 };
+      put_marker(data, 0xe0, 2 + sizeof(jfif));
+      for (unsigned i = 0; i != sizeof(jfif); ++i) data.push_back(jfif[i]);
+
+      // DQT
+      for (unsigned t = 0; t != 2; ++t) {
+        put_marker(data, 0xdb, 2 + 1 + 64);
+        data.push_back((uint8_t)t);
+        for (unsigned i = 0; i != 64; ++i) data.push_back(qtable[t][i]);
+      }
+
+      // SOF0: 8 bit, three components
+      put_marker(data, 0xc0, 2 + 6 + 3 * 3);
+      data.push_back(8);
+      put16(data, height);
+      put16(data, width);
+      data.push_back(3);
+      static const uint8_t components[] = { 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1 };
+      for (unsigned i = 0; i != sizeof(components); ++i) {
+        data.push_back(i == 1 && subsample ? 0x22 : components[i]);
+      }
+
+      // DHT
+      for (unsigned i = 0; i != 4; ++i) {
+        const uint8_t *dht = get_dht(i);
+        unsigned size = get_dht_size(dht);
+        put_marker(data, 0xc4, 2 + size);
+        for (unsigned j = 0; j != size; ++j) data.push_back(dht[j]);
+      }
+
+      // DRI
+      put_marker(data, 0xdd, 4);
+      put16(data, restart_interval);
+
+      // SOS
+      static const uint8_t sos[] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+      put_marker(data, 0xda, 2 + sizeof(sos));
+      for (unsigned i = 0; i != sizeof(sos); ++i) data.push_back(sos[i]);
+    }
+
   public:
-    jpeg_encoder() {
+    /// quality is 1 (small) to 100 (best). subsample halves the chroma resolution (4:2:0).
+    jpeg_encoder(int quality = 90, bool subsample = true) {
+      width = height = 0;
+      stride = 0;
+      bytes_per_pixel = 4;
+      src = 0;
+      this->subsample = subsample;
+      set_quality(quality);
     }
 
-    bool encode(dynarray<uint8_t> data, uint32_t width, uint32_t height, int stride, const uint8_t *src) {
-      /*if ((height & 7) != 0 || (width & 7) != 0) {
+    /// set the quality from 1 to 100. 75 is the usual default for photographs.
+    void set_quality(int value) {
+      quality = value < 1 ? 1 : value > 100 ? 100 : value;
+      make_quant_tables();
+    }
+
+    /// set 4:2:0 chroma subsampling (true) or full resolution chroma (false).
+    void set_subsample(bool value) {
+      subsample = value;
+    }
+
+    /// encode RGB or RGBA pixels (bytes_per_pixel = 3 or 4) as a JPEG file in data.
+    /// stride is the byte offset from one row to the next and may be negative,
+    /// so bottom-up images such as glReadPixels output can be written with
+    /// src pointing at the last row and stride = -row_bytes.
+    bool encode(dynarray<uint8_t> &data, uint32_t width, uint32_t height, int stride, const uint8_t *src, unsigned bytes_per_pixel = 4) {
+      data.resize(0);
+      if (width == 0 || height == 0 || width > 65535 || height > 65535 || bytes_per_pixel < 3) {
+        log("warning: jpeg_encoder: can't encode %dx%d %d bytes per pixel\n", width, height, bytes_per_pixel);
         return false;
       }
 
-      // guess
-      data.reserve(width * height / 2);
-
-      static const uint8_t hdr[] = {
-        0xff, 0xd8, // SOI
-        0xff, 0xe0, 0x00, 0x10, // APP0
-          'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x01, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00,
-
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x00,
-          0x03, 0x02, 0x02, 0x03, 0x02, 0x02, 0x03, 0x03,
-          0x03, 0x03, 0x04, 0x03, 0x03, 0x04, 0x05, 0x08,
-          0x05, 0x05, 0x04, 0x04, 0x05, 0x0a, 0x07, 0x07,
-          0x06, 0x08, 0x0c, 0x0a, 0x0c, 0x0c, 0x0b, 0x0a,
-          0x0b, 0x0b, 0x0d, 0x0e, 0x12, 0x10, 0x0d, 0x0e,
-          0x11, 0x0e, 0x0b, 0x0b, 0x10, 0x16, 0x10, 0x11,
-          0x13, 0x14, 0x15, 0x15, 0x15, 0x0c, 0x0f, 0x17,
-          0x18, 0x16, 0x14, 0x18, 0x12, 0x14, 0x15, 0x14,
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x01,
-          0x03, 0x04, 0x04, 0x05, 0x04, 0x05, 0x09, 0x05,
-          0x05, 0x09, 0x14, 0x0d, 0x0b, 0x0d, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-        0xff, 0xc0, 0x00, 0x11, // SOF0
-          0x08, 0x02, 0x00, 0x02, 0x00, 0x03, 0x01, 0x11, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
-        0xff, 0xc4, 0x00, 0x1e, // DHT
-          0x00, 0x01, 0x00, 0x03, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x06, 0x05, 0x07, 0x09, 0x08, 0x0a,
-        0xff, 0xc4, 0x00, 0x55, // DHT
-          0x10, 0x00, 0x02, 0x00, 0x03, 0x04, 0x05, 0x08, 0x06, 0x06, 0x04, 0x0b, 0x05, 0x07, 0x05, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x61, 0x07,
-          0x14, 0x53, 0x71, 0x81, 0x92, 0xb1, 0xf0, 0x08, 0x13, 0x34, 0x72, 0x91, 0xa1, 0x09, 0x22, 0x32,
-          0x42, 0xc1, 0xd1, 0x23, 0x52, 0xe1, 0xf1, 0x15, 0x16, 0x17, 0x36, 0x43, 0x62, 0x73, 0x82, 0x94,
-          0xb2, 0xd2, 0x24, 0x55, 0x63, 0xa3, 0xc2, 0x18, 0x33, 0x35, 0x64, 0x74, 0x93, 0xa2, 0x25, 0x44,
-          0x45, 0x54, 0x83,
-        0xff, 0xc4, 0x00, 0x1d, // DHT
-          0x01, 0x01, 0x01, 0x01, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
-        0xff, 0xc4, 0x00, 0x43, // DHT
-          0x11, 0x01, 0x00, 0x01, 0x02, 0x03, 0x05, 0x02, 0x0b, 0x06, 0x04, 0x05, 0x04, 0x03, 0x01, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x11, 0x03, 0x04, 0x31, 0x05, 0x12, 0x21, 0x32, 0x51, 0x06, 0x41, 0x07,
-          0x13, 0x14, 0x22, 0x61, 0x71, 0x81, 0x91, 0xa1, 0xb1, 0xd1, 0x15, 0x34, 0x42, 0x53, 0x72, 0xf0,
-          0x52, 0x62, 0xc1, 0xe1, 0x23, 0x82, 0x92, 0xa2, 0xc2, 0x24, 0x43, 0xb2, 0xd2, 0x33, 0x63, 0x73,
-          0x93,
-        0xff, 0xda, 0x00, 0x0c, // SOS
-          0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00, 0xfd, 0x7f, 
-      };*/
-      return 0;
+      this->width = width;
+      this->height = height;
+      this->stride = stride;
+      this->src = src;
+      this->bytes_per_pixel = bytes_per_pixel;
+
+      unsigned mcu_size = subsample ? 16 : 8;
+      unsigned mcus_x = (width + mcu_size - 1) / mcu_size;
+      unsigned mcus_y = (height + mcu_size - 1) / mcu_size;
+
+      // each row of MCUs is independent because of the restart markers.
+      dynarray<bit_writer*> rows(mcus_y);
+      parallel_for(0, mcus_y, [&](unsigned mcu_y) {
+        bit_writer *w = new bit_writer();
+        w->bytes.reserve(mcus_x * mcu_size * mcu_size / 4 + 64);
+        encode_row(*w, mcu_y);
+        rows[mcu_y] = w;
+      });
+
+      size_t total = 1024;
+      for (unsigned i = 0; i != mcus_y; ++i) total += rows[i]->bytes.size() + 2;
+      data.reserve((unsigned)total);
+
+      write_headers(data, mcus_x);
+
+      for (unsigned i = 0; i != mcus_y; ++i) {
+        if (i) {
+          data.push_back(0xff);
+          data.push_back((uint8_t)(0xd0 + (i - 1) % 8));
+        }
+        dynarray<uint8_t> &bytes = rows[i]->bytes;
+        unsigned pos = data.size();
+        data.resize(pos + bytes.size());
+        if (bytes.size()) memcpy(&data[pos], bytes.data(), bytes.size());
+        delete rows[i];
+      }
+
+      // EOI
+      data.push_back(0xff);
+      data.push_back(0xd9);
+      this->src = 0;
+      return true;
     }
   };
 }}
-
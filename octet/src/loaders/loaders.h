@@ -28,11 +28,14 @@
 #define OCTET_LOADERS_INCLUDED
 
   #include "../loaders/zip_decoder.h"
+  #include "../loaders/png_decoder.h"
   #include "../loaders/gif_decoder.h"
   #include "../loaders/jpeg_decoder.h"
   #include "../loaders/jpeg_encoder.h"
   #include "../loaders/tga_decoder.h"
   #include "../loaders/dds_decoder.h"
   #include "../loaders/nifti_decoder.h"
+  #include "../loaders/mipmap_generator.h"
+  #include "../loaders/dxt_encoder.h"
 
 #endif
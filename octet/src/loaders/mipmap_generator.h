@@ -0,0 +1,294 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// mip chain generator for 8 bit RGB and RGBA images
+//
+// Pixels are filtered as vec4s in linear light and premultiplied alpha,
+// so mips do not darken or grow dark fringes. Each level is a separable
+// resample of the one before it: rows first, then columns, with the rows
+// of each pass spread across the worker threads.
+//
+namespace octet { namespace loaders {
+  /// Build mip levels for an image in memory.
+  ///
+  /// Any size works: each level is max(1, size/2) of the one before, as GL expects,
+  /// and odd sizes are filtered with fractional weights rather than dropping pixels.
+  class mipmap_generator {
+  public:
+    enum filter_t {
+      /// average of the source pixels under each destination pixel. cheap.
+      filter_box,
+
+      /// Kaiser windowed sinc. Sharper than box at a few more taps per pixel.
+      filter_kaiser,
+    };
+
+  private:
+    // resampling weights for one axis: taps source indices and weights per destination pixel.
+    struct axis_filter {
+      unsigned taps;
+      dynarray<unsigned> index;
+      dynarray<float> weight;
+    };
+
+    // sRGB conversion tables, built once.
+    struct srgb_tables {
+      // sRGB code to linear
+      float to_linear[256];
+
+      // linear value half way between code i and code i+1
+      float threshold[256];
+
+      // a code at or below the answer for each of coarse_size linear steps
+      enum { coarse_size = 4096 };
+      uint8_t coarse[coarse_size];
+
+      static float decode(float s) {
+        return s <= 0.04045f ? s * (1.0f / 12.92f) : powf((s + 0.055f) * (1.0f / 1.055f), 2.4f);
+      }
+
+      srgb_tables() {
+        for (unsigned i = 0; i != 256; ++i) {
+          to_linear[i] = decode(i * (1.0f / 255));
+          threshold[i] = i == 255 ? 2.0f : decode((i + 0.5f) * (1.0f / 255));
+        }
+        unsigned code = 0;
+        for (unsigned i = 0; i != coarse_size; ++i) {
+          float value = (float)i / (coarse_size - 1);
+          while (value >= threshold[code]) code++;
+          coarse[i] = (uint8_t)code;
+        }
+      }
+
+      // nearest sRGB code for a linear value in [0, 1]. exact, unlike a plain table.
+      uint8_t encode(float value) const {
+        unsigned code = coarse[(unsigned)(value * (coarse_size - 1))];
+        while (value >= threshold[code]) code++;
+        return (uint8_t)code;
+      }
+    };
+
+    filter_t filter;
+    bool srgb;
+
+    static const srgb_tables &get_srgb_tables() {
+      static srgb_tables tables;
+      return tables;
+    }
+
+    // zeroth order modified bessel function for the Kaiser window
+    static float bessel_i0(float x) {
+      float sum = 1, term = 1;
+      for (unsigned k = 1; k != 32; ++k) {
+        float t = x / (2.0f * k);
+        term *= t * t;
+        sum += term;
+        if (term < sum * 1e-7f) break;
+      }
+      return sum;
+    }
+
+    static float sinc(float x) {
+      if (fabsf(x) < 1e-5f) return 1.0f;
+      x *= 3.14159265f;
+      return sinf(x) / x;
+    }
+
+    // weights for resampling src_size pixels to dest_size pixels on one axis. Edges clamp.
+    void make_axis_filter(axis_filter &f, unsigned src_size, unsigned dest_size) const {
+      float scale = (float)src_size / dest_size;
+
+      if (src_size == dest_size) {
+        f.taps = 1;
+        f.index.resize(dest_size);
+        f.weight.resize(dest_size);
+        for (unsigned i = 0; i != dest_size; ++i) {
+          f.index[i] = i;
+          f.weight[i] = 1;
+        }
+        return;
+      }
+
+      // kaiser: three destination pixels either side
+      const float kaiser_width = 3.0f;
+      const float kaiser_alpha = 4.0f;
+      float radius = filter == filter_kaiser ? kaiser_width * scale : scale * 0.5f;
+      f.taps = (unsigned)ceilf(radius * 2) + 2;
+      f.index.resize(dest_size * f.taps);
+      f.weight.resize(dest_size * f.taps);
+
+      float inv_i0_alpha = 1.0f / bessel_i0(kaiser_alpha);
+      for (unsigned i = 0; i != dest_size; ++i) {
+        unsigned *index = &f.index[i * f.taps];
+        float *weight = &f.weight[i * f.taps];
+
+        // centre of the destination pixel in source pixels
+        float centre = (i + 0.5f) * scale;
+        int first = (int)floorf(centre - radius);
+        float total = 0;
+        for (unsigned k = 0; k != f.taps; ++k) {
+          int j = first + (int)k;
+          float w = 0;
+          if (filter == filter_kaiser) {
+            float x = (j + 0.5f - centre) / scale;
+            float r = x / kaiser_width;
+            w = r * r < 1 ? sinc(x) * bessel_i0(kaiser_alpha * sqrtf(1 - r * r)) * inv_i0_alpha : 0;
+          } else {
+            // overlap of source pixel [j, j+1] with the destination footprint
+            float lo = centre - radius, hi = centre + radius;
+            float a = j > lo ? (float)j : lo, b = j + 1 < hi ? (float)(j + 1) : hi;
+            w = b > a ? b - a : 0;
+          }
+          index[k] = j < 0 ? 0 : j >= (int)src_size ? src_size - 1 : (unsigned)j;
+          weight[k] = w;
+          total += w;
+        }
+
+        float inv_total = total != 0 ? 1.0f / total : 0;
+        for (unsigned k = 0; k != f.taps; ++k) {
+          weight[k] *= inv_total;
+        }
+      }
+    }
+
+    // 8 bit pixels to linear premultiplied vec4s.
+    void to_linear(vec4 *dest, const uint8_t *src, unsigned count, unsigned num_comps) const {
+      const float *lut = get_srgb_tables().to_linear;
+      for (unsigned i = 0; i != count; ++i) {
+        float a = num_comps == 4 ? src[3] * (1.0f / 255) : 1.0f;
+        if (srgb) {
+          dest[i] = vec4(lut[src[0]], lut[src[1]], lut[src[2]], 1.0f) * a;
+        } else {
+          dest[i] = vec4(src[0], src[1], src[2], 0.0f) * (a * (1.0f / 255));
+        }
+        dest[i][3] = a;
+        src += num_comps;
+      }
+    }
+
+    // linear premultiplied vec4s to 8 bit pixels.
+    void from_linear(uint8_t *dest, const vec4 *src, unsigned count, unsigned num_comps) const {
+      const srgb_tables &tables = get_srgb_tables();
+      for (unsigned i = 0; i != count; ++i) {
+        const vec4 &p = src[i];
+        float a = p[3];
+        float inv_a = a > 0 ? 1.0f / a : 0;
+        for (unsigned c = 0; c != 3; ++c) {
+          float v = p[c] * inv_a;
+          v = v < 0 ? 0 : v > 1 ? 1 : v;
+          dest[c] = srgb ? tables.encode(v) : (uint8_t)(v * 255 + 0.5f);
+        }
+        if (num_comps == 4) {
+          dest[3] = (uint8_t)(a * 255 + 0.5f);
+        }
+        dest += num_comps;
+      }
+    }
+
+    // one 2:1 (or less) reduction. dest is dest_w * dest_h, tmp is dest_w * src_h.
+    void reduce(vec4 *dest, vec4 *tmp, const vec4 *src, unsigned src_w, unsigned src_h, unsigned dest_w, unsigned dest_h) const {
+      axis_filter fx, fy;
+      make_axis_filter(fx, src_w, dest_w);
+      make_axis_filter(fy, src_h, dest_h);
+
+      // rows
+      parallel_for(0, src_h, [&](unsigned y) {
+        const vec4 *row = src + y * src_w;
+        vec4 *out = tmp + y * dest_w;
+        for (unsigned x = 0; x != dest_w; ++x) {
+          const unsigned *index = &fx.index[x * fx.taps];
+          const float *weight = &fx.weight[x * fx.taps];
+          vec4 sum = row[index[0]] * weight[0];
+          for (unsigned k = 1; k != fx.taps; ++k) {
+            sum += row[index[k]] * weight[k];
+          }
+          out[x] = sum;
+        }
+      });
+
+      // columns, clamping the Kaiser's overshoot so that alpha stays in range.
+      parallel_for(0, dest_h, [&](unsigned y) {
+        const unsigned *index = &fy.index[y * fy.taps];
+        const float *weight = &fy.weight[y * fy.taps];
+        vec4 *out = dest + y * dest_w;
+        for (unsigned x = 0; x != dest_w; ++x) {
+          vec4 sum = tmp[index[0] * dest_w + x] * weight[0];
+          for (unsigned k = 1; k != fy.taps; ++k) {
+            sum += tmp[index[k] * dest_w + x] * weight[k];
+          }
+          out[x] = min(max(sum, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
+        }
+      });
+    }
+
+  public:
+    mipmap_generator(filter_t filter = filter_box, bool srgb = true) {
+      this->filter = filter;
+      this->srgb = srgb;
+    }
+
+    /// number of levels in a full chain, including level 0.
+    static unsigned get_num_levels(unsigned width, unsigned height) {
+      unsigned levels = 1;
+      while (width > 1 || height > 1) {
+        width = width > 1 ? width >> 1 : 1;
+        height = height > 1 ? height >> 1 : 1;
+        levels++;
+      }
+      return levels;
+    }
+
+    /// bytes holds level 0 (width * height * num_comps). Append the rest of the chain down to 1x1.
+    /// returns the number of levels including level 0.
+    unsigned generate(dynarray<uint8_t> &bytes, unsigned width, unsigned height, unsigned num_comps) const {
+      if (num_comps != 3 && num_comps != 4) return 1;
+      if ((size_t)width * height * num_comps > bytes.size()) return 1;
+
+      unsigned num_levels = get_num_levels(width, height);
+
+      // size of the whole chain
+      size_t total = 0;
+      for (unsigned level = 0, w = width, h = height; level != num_levels; ++level) {
+        total += (size_t)w * h * num_comps;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+      bytes.resize(total);
+
+      // the current level in linear light, the next level and the row pass in between.
+      unsigned dest_w0 = width > 1 ? width >> 1 : 1;
+      dynarray<vec4> src(width * height);
+      dynarray<vec4> dest(dest_w0 * (height > 1 ? height >> 1 : 1));
+      dynarray<vec4> tmp(dest_w0 * height);
+
+      uint8_t *level_bytes = &bytes[0];
+      parallel_for(0, height, [&](unsigned y) {
+        to_linear(&src[y * width], level_bytes + y * width * num_comps, width, num_comps);
+      });
+
+      unsigned w = width, h = height;
+      for (unsigned level = 1; level != num_levels; ++level) {
+        level_bytes += w * h * num_comps;
+        unsigned dest_w = w > 1 ? w >> 1 : 1;
+        unsigned dest_h = h > 1 ? h >> 1 : 1;
+
+        reduce(&dest[0], &tmp[0], &src[0], w, h, dest_w, dest_h);
+
+        uint8_t *out = level_bytes;
+        parallel_for(0, dest_h, [&](unsigned y) {
+          from_linear(out + y * dest_w * num_comps, &dest[y * dest_w], dest_w, num_comps);
+        });
+
+        // the next level reads this one. dest is always big enough for the smaller level.
+        memcpy(&src[0], &dest[0], dest_w * dest_h * sizeof(vec4));
+        w = dest_w;
+        h = dest_h;
+      }
+      return num_levels;
+    }
+  };
+}}
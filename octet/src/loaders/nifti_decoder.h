@@ -9,9 +9,37 @@ namespace octet { namespace loaders {
   /// NIFTI NMR data decoder. ie. 3d textures.
   /// This loader only handles very simple NIFTI files.
   class nifti_decoder {
-    unsigned vox_offset;
-    unsigned layer_stride;
-    unsigned frame_stride;
+  public:
+    /// voxel data types
+    enum {
+      dt_uint8 = 2,
+      dt_int16 = 4,
+      dt_int32 = 8,
+      dt_float32 = 16,
+      dt_float64 = 64,
+      dt_rgb24 = 128,
+      dt_int8 = 256,
+      dt_uint16 = 512,
+      dt_uint32 = 768,
+      dt_rgba32 = 2304,
+    };
+
+  private:
+    size_t vox_offset;
+    size_t layer_stride;
+    size_t frame_stride;
+
+    // from the header
+    unsigned width_;
+    unsigned height_;
+    unsigned depth_;
+    unsigned frames_;
+    unsigned datatype;
+    unsigned bytes_per_voxel;
+    float slope;
+    float inter;
+    float cal_min;
+    float cal_max;
 
     struct nifti_header {
       int      sizeof_hdr;    /// MUST be 348
@@ -68,44 +96,147 @@ namespace octet { namespace loaders {
     };
 
   public:
+    nifti_decoder() {
+      vox_offset = layer_stride = frame_stride = 0;
+      width_ = height_ = depth_ = frames_ = 0;
+      datatype = bytes_per_voxel = 0;
+      slope = 1; inter = 0;
+      cal_min = cal_max = 0;
+    }
+
+    /// read the header only. The voxels stay where they are, so this works on mapped files.
+    bool get_header(const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < (int)sizeof(nifti_header)) {
+        log("warning: NIFTI header too small\n");
+        return false;
+      }
+      nifti_header header;
+      memcpy(&header, src, sizeof(header));
+
+      if (header.sizeof_hdr != 348) {
+        log("warning: NIFTI byte swapped files not supported\n");
+        return false;
+      }
+
+      if (header.dim[0] < 3 || header.dim[0] > 4) {
+        log("warning: NIFTI image type not supported (dim[0] = %d)\n", header.dim[0]);
+        return false;
+      }
+
+      width_ = header.dim[1];
+      height_ = header.dim[2];
+      depth_ = header.dim[3];
+      frames_ = header.dim[0] == 4 && header.dim[4] > 0 ? header.dim[4] : 1;
+      datatype = header.datatype;
+      bytes_per_voxel = header.bitpix / 8;
+      slope = header.scl_slope != 0 ? header.scl_slope : 1.0f;
+      inter = header.scl_slope != 0 ? header.scl_inter : 0.0f;
+      cal_min = header.cal_min;
+      cal_max = header.cal_max;
+
+      vox_offset = (size_t)header.vox_offset;
+      layer_stride = (size_t)width_ * height_ * bytes_per_voxel;
+      frame_stride = layer_stride * depth_;
+
+      if (!bytes_per_voxel || vox_offset + frame_stride * frames_ > (size_t)(src_max - src)) {
+        log("warning: NIFTI image too small\n");
+        return false;
+      }
+      return true;
+    }
+
     /// get data for a texture in memory.
     void get_image(dynarray<uint8_t> &bytes, uint16_t &format, uint16_t &width, uint16_t &height, uint16_t &depth, uint32_t &frames, const uint8_t *src, const uint8_t *src_max) {
-      // convert the data
-      nifti_header header = *(nifti_header*)src;
-    
       width = 0;
       height = 0;
       format = 0;
 
-      if (header.dim[0] != 4) {
-        log("warning: NIFTI image type not supported (dim[0] = %d)\n", header.dim[0]);
+      if (!get_header(src, src_max)) {
         return;
       }
 
-      width = header.dim[1];
-      height = header.dim[2];
-      depth = header.dim[3];
-      frames = 1; //header.dim[4];
-      vox_offset = (int)header.vox_offset;
-      layer_stride = width * height * header.bitpix / 8;
-      frame_stride = layer_stride * depth;
-      unsigned size = frame_stride * frames;
+      width = (uint16_t)width_;
+      height = (uint16_t)height_;
+      depth = (uint16_t)depth_;
+      frames = 1; //frames_;
 
-      if ((int)header.vox_offset + (int)size > src_max - src) {
-        log("warning: NIFTI image too small\n");
+      // get one frame (of 3D data)
+      const uint8_t *voxels = get_frame(src, 0);
+      if (is_colour()) {
+        format = bytes_per_voxel == 3 ? 0x1907 : 0x1908; // GL_RGB / GL_RGBA
+        bytes.resize(frame_stride);
+        memcpy(&bytes[0], voxels, frame_stride);
         return;
       }
 
-      format = header.bitpix == 24 ? 0x1907 : 0x1908; // GL_RGB / GL_RGBA
+      // scalar voxels become grey RGBA, scaled from the display range (or the value range) to 0..255
+      size_t num_voxels = (size_t)width_ * height_ * depth_;
+      float lo = cal_min, hi = cal_max;
+      if (hi <= lo) {
+        lo = 1e37f;
+        hi = -1e37f;
+        for (size_t i = 0; i != num_voxels; ++i) {
+          float value = get_value(voxels + i * bytes_per_voxel);
+          lo = value < lo ? value : lo;
+          hi = value > hi ? value : hi;
+        }
+      }
+      float scale = hi > lo ? 255.0f / (hi - lo) : 1.0f;
 
-      // get one frame (of 3D data)
-      bytes.resize(frame_stride);
-      memcpy(&bytes[0], src + vox_offset, frame_stride);
+      format = 0x1908; // GL_RGBA
+      bytes.resize(num_voxels * 4);
+      for (size_t i = 0; i != num_voxels; ++i) {
+        float value = (get_value(voxels + i * bytes_per_voxel) - lo) * scale;
+        uint8_t grey = value <= 0 ? 0 : value >= 255 ? 255 : (uint8_t)(value + 0.5f);
+        memset(&bytes[i * 4], grey, 4);
+      }
     }
 
     /// get the offset of a specific layer in a specific frame.
-    unsigned get_layer_offset(unsigned layer, unsigned frame) {
+    size_t get_layer_offset(unsigned layer, unsigned frame) {
       return vox_offset + layer * layer_stride + frame * frame_stride;
     }
+
+    /// get the voxels of one frame: x fastest, then y, then z.
+    const uint8_t *get_frame(const uint8_t *src, unsigned frame) const {
+      return src + vox_offset + frame * frame_stride;
+    }
+
+    /// true if voxels are colours rather than values.
+    bool is_colour() const {
+      return datatype == dt_rgb24 || datatype == dt_rgba32;
+    }
+
+    /// read a scalar voxel, with scl_slope and scl_inter applied.
+    /// colour voxels return their largest component (alpha for RGBA).
+    float get_value(const uint8_t *voxel) const {
+      float value = 0;
+      switch (datatype) {
+        case dt_uint8: value = voxel[0]; break;
+        case dt_int8: value = (int8_t)voxel[0]; break;
+        case dt_int16: { int16_t x; memcpy(&x, voxel, 2); value = x; } break;
+        case dt_uint16: { uint16_t x; memcpy(&x, voxel, 2); value = x; } break;
+        case dt_int32: { int32_t x; memcpy(&x, voxel, 4); value = (float)x; } break;
+        case dt_uint32: { uint32_t x; memcpy(&x, voxel, 4); value = (float)x; } break;
+        case dt_float32: { memcpy(&value, voxel, 4); } break;
+        case dt_float64: { double x; memcpy(&x, voxel, 8); value = (float)x; } break;
+        case dt_rgb24: {
+          uint8_t m = voxel[0] > voxel[1] ? voxel[0] : voxel[1];
+          return m > voxel[2] ? m : voxel[2];
+        }
+        case dt_rgba32: return voxel[3];
+      }
+      return value * slope + inter;
+    }
+
+    unsigned get_width() const { return width_; }
+    unsigned get_height() const { return height_; }
+    unsigned get_depth() const { return depth_; }
+    unsigned get_frames() const { return frames_; }
+    unsigned get_bytes_per_voxel() const { return bytes_per_voxel; }
+
+    /// display range from the header; cal_max <= cal_min if the file does not have one.
+    float get_cal_min() const { return cal_min; }
+    float get_cal_max() const { return cal_max; }
   };
 }}
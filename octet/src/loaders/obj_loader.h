@@ -6,6 +6,10 @@
 //
 // load an OBJ file.
 //
+// The file is split into chunks at line boundaries and the chunks are parsed on the worker threads.
+// Face corners with the same v/vt/vn indices are welded into a single indexed vertex
+// and the triangles are then reordered for the vertex cache (see mesh_optimizer).
+//
 namespace octet { namespace loaders {
   /// Class for loading OBJ files.
   class obj_loader {
@@ -20,233 +24,523 @@ namespace octet { namespace loaders {
       app_utils::get_url(file, url);
       if (file.size() == 0) return false;
 
-      const uint8_t *eof = file.data() + file.size();
-      this->dict = &dict;
-      material_index = 0;
-      
-      for (const uint8_t *src = file.data(); src != eof; ) {
-        while (*src == ' ' && src != eof) ++src;
-        const uint8_t *begin = src;
-        while (*src != '\n' && *src != '\r' && src != eof) ++src;
-        const uint8_t *end = src;
-        src += src != eof && *src == '\r';
-        src += src != eof && *src == '\n';
-        if (begin != end ) switch (begin[0]) {
-          case '#': {
-            fwrite(begin, 1, end-begin, stdout);
-          } break;
-          case 'o': {
-            flush();
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') obj_name.assign((const char*)begin + 2, (const char*)end);
-            node = new scene_node(mat4t(), atom_);
-          } break;
-          case 'g': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') group_name.assign((const char*)begin + 2, (const char*)end);
-          } break;
-          case 'v': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              atofv(values, begin+2, end);
-              if (values.size() == 3) {
-                src_vertices.push_back(vec3p(values[0], values[1], values[2]));
-              }
-            } else if (begin[1] == 't' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 2) {
-                src_uvs.push_back(vec2p(values[0], values[1]));
-              }
-            } else if (begin[1] == 'n' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 3) {
-                src_normals.push_back(vec3p(values[0], values[1], values[2]));
-              }
+      const char *src = (const char *)file.data();
+      const char *eof = src + file.size();
+
+      // split the file into chunks at line boundaries
+      // several chunks per thread to balance the load.
+      size_t num_threads = job_pool::get().get_num_threads();
+      size_t chunk_size = file.size() / (num_threads * 4) + 1;
+      if (chunk_size < min_chunk_size) chunk_size = min_chunk_size;
+
+      dynarray<chunk *> chunks;
+      while (src != eof) {
+        const char *end = (size_t)(eof - src) <= chunk_size ? eof : src + chunk_size;
+        while (end != eof && *end != '\n') ++end;
+        if (end != eof) ++end;
+        chunk *c = new chunk();
+        c->begin = src;
+        c->end = end;
+        chunks.push_back(c);
+        src = end;
+      }
+
+      // first pass: count the v, vt and vn lines so that every chunk knows where its values go
+      parallel_for(0, chunks.size(), [&](unsigned i) {
+        count_chunk(*chunks[i]);
+      });
+
+      unsigned num_pos = 0, num_uv = 0, num_normal = 0;
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        chunk &c = *chunks[i];
+        c.pos_base = num_pos;
+        c.uv_base = num_uv;
+        c.normal_base = num_normal;
+        num_pos += c.num_pos;
+        num_uv += c.num_uv;
+        num_normal += c.num_normal;
+      }
+
+      positions.resize(num_pos);
+      uvs.resize(num_uv);
+      normals.resize(num_normal);
+
+      // second pass: parse the values and faces
+      parallel_for(0, chunks.size(), [&](unsigned i) {
+        parse_chunk(*chunks[i]);
+      });
+
+      // o and usemtl lines change the state of the faces that follow, so this needs to be in order.
+      dynarray<mesh_group *> groups;
+      dynarray<string> objects;
+      dynarray<string> materials;
+      unsigned object_index = 0;
+      unsigned material_index = ~0;
+      objects.push_back(string(url));
+      unsigned num_bad_faces = 0;
+
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        chunk &c = *chunks[i];
+        num_bad_faces += c.num_bad_faces;
+        unsigned first_face = 0;
+        unsigned first_corner = 0;
+        for (unsigned e = 0; e <= c.events.size(); ++e) {
+          unsigned last_face = e == c.events.size() ? c.face_sizes.size() : c.events[e].face;
+          if (last_face != first_face) {
+            span s;
+            s.chunk_index = i;
+            s.first_face = first_face;
+            s.num_faces = last_face - first_face;
+            s.first_corner = first_corner;
+            get_group(groups, object_index, material_index)->spans.push_back(s);
+            for (unsigned f = first_face; f != last_face; ++f) {
+              first_corner += c.face_sizes[f];
             }
-          } break;
-          case 'f': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              unsigned slashes = 0;
-              mesh::vertex v[6];
-              atoiv(ivalues, slashes, begin + 2, end);
-              size_t num_values = ivalues.size() - slashes;
-              size_t num_comps = ivalues.size() / num_values;
-              size_t num_idx = ivalues.size() / num_comps;
-              if (num_idx > 4 || num_comps > 3) {
-                printf("warning: bad obj file face\n");
-                return false;
-              }
-              mesh::vertex vtx[4];
-              memset(vtx, 0, sizeof(vtx));
-              if (num_comps >= 1) {
-                size_t d = 0;
-                for (size_t i = 0; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].pos = src_vertices[iv < 0 ? src_vertices.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 2) {
-                size_t d = 0;
-                for (size_t i = 1; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].uv = src_uvs[iv < 0 ? src_uvs.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 3) {
-                size_t d = 0;
-                for (size_t i = 2; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].normal = src_normals[iv < 0 ? src_normals.size() + iv : iv];
-                }
-              }
+            first_face = last_face;
+          }
 
-              face f;
-              f.vtx[0] = vtx[0];
-              f.vtx[1] = vtx[1];
-              f.vtx[2] = vtx[2];
-              f.material_index = material_index;
-              faces.push_back(f);
-              if (num_idx == 4) {
-                f.vtx[0] = vtx[0];
-                f.vtx[1] = vtx[2];
-                f.vtx[2] = vtx[3];
-                f.material_index = material_index;
-                faces.push_back(f);
-              }
+          if (e != c.events.size()) {
+            const chunk_event &ev = c.events[e];
+            string name(ev.begin, (unsigned)(ev.end - ev.begin));
+            if (ev.kind == kind_object) {
+              object_index = objects.size();
+              objects.push_back(name);
+            } else {
+              material_index = find_or_add(materials, name);
             }
-          } break;
-          default: {
-            fwrite(begin, 1, end-begin, stdout);
-            printf("unknown\n");
-            return false;
-          } break;
-          case 'u': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin+7 < end && !memcmp(begin, "usemtl ", 7)) {
-              size_t len = end - (begin+7);
-              size_t i = 0;
-              for (; i != materials.size(); ++i) {
-                if (
-                  materials[i].size() == len &&
-                  !memcmp(materials[i].c_str(), begin+7, len)
-                ) {
-                  break;
-                }
-              }
+          }
+        }
+      }
 
-              if (i == materials.size()) {
-                materials.push_back(string((const char*)begin+7, (unsigned)len));
-              }
+      if (num_bad_faces) {
+        printf("warning: %d bad faces in obj file\n", num_bad_faces);
+      }
 
-              material_index = (uint32_t)i;
-            }
-          } break;
+      // weld the vertices of each mesh
+      parallel_for(0, groups.size(), [&](unsigned i) {
+        weld_group(*groups[i], chunks);
+      });
+
+      // OpenGL and ref counts are for the main thread only
+      dynarray<scene_node *> nodes(objects.size());
+      dynarray<material *> mats(materials.size() + 1);
+      for (unsigned i = 0; i != nodes.size(); ++i) nodes[i] = NULL;
+      for (unsigned i = 0; i != mats.size(); ++i) mats[i] = NULL;
+
+      for (unsigned i = 0; i != groups.size(); ++i) {
+        mesh_group &g = *groups[i];
+
+        scene_node *&node = nodes[g.object];
+        if (!node) {
+          node = new scene_node(mat4t(), app_utils::get_atom(objects[g.object]));
+          scene->add_scene_node(node);
+          dict.set_resource(objects[g.object], node);
+        }
+
+        unsigned mat_index = g.material == ~0u ? materials.size() : g.material;
+        material *&mat = mats[mat_index];
+        if (!mat) {
+          const char *name = g.material == ~0u ? NULL : materials[g.material].c_str();
+          mat = name ? dict.get_material(name) : NULL;
+          if (!mat) {
+            mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
+            dict.set_resource(name, mat);
+          }
         }
+
+        mesh *msh = new mesh();
+        msh->set_default_attributes();
+        msh->set_vertices(g.vertices);
+        msh->set_indices(g.indices);
+        vec3 vmin = g.bb_min, vmax = g.bb_max;
+        msh->set_aabb(aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f));
+
+        if (g.material != ~0u) {
+          string mesh_name;
+          mesh_name.format("%s+%s", objects[g.object].c_str(), materials[g.material].c_str());
+          dict.set_resource(mesh_name, msh);
+        } else {
+          dict.set_resource(objects[g.object], msh);
+        }
+
+        scene->add_mesh_instance(new mesh_instance(node, msh, mat));
       }
-      flush();
+
+      for (unsigned i = 0; i != groups.size(); ++i) {
+        delete groups[i];
+      }
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        delete chunks[i];
+      }
+      positions.reset();
+      uvs.reset();
+      normals.reset();
 
       return true;
     }
   private:
-    dynarray<vec3p> src_vertices;
-    dynarray<vec3p> src_normals;
-    dynarray<vec2p> src_uvs;
-    dynarray<uint32_t> src_material;
-    dynarray<string> materials;
+    enum {
+      // smaller chunks are not worth a thread
+      min_chunk_size = 64 * 1024,
 
-    string obj_name;
-    string group_name;
-    resource_dict *dict;
-    scene_node *node;
+      kind_other = 0,
+      kind_pos,
+      kind_uv,
+      kind_normal,
+      kind_face,
+      kind_object,
+      kind_material,
+    };
 
-    struct face {
-      mesh::vertex vtx[3];
-      int material_index;
+    // indices of a face corner, one-based. zero means not present.
+    struct corner {
+      unsigned pos;
+      unsigned uv;
+      unsigned normal;
 
-      bool operator <(const face &rhs) {
-        return material_index < rhs.material_index;
+      bool operator==(const corner &rhs) const {
+        return pos == rhs.pos && uv == rhs.uv && normal == rhs.normal;
       }
     };
 
-    dynarray<face> faces;
-    dynarray<uint32_t> indices;
-    dynarray<float> values;
-    dynarray<int> ivalues;
-    uint32_t material_index;
-
-    // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, unsigned &slashes, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-      slashes = 0;
-
-      while (src != end && *src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        int whole = 0, msign = 1;
-        if (src != end && *src == '-') { msign = -1; src++; }
-        while (src != end && *src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (src != end && *src > 0 && *src <= ' ') ++src;
-        if (src != end && *src == '/') { slashes++; src++; }
+    // hash_map support for corner keys
+    class corner_cmp {
+    public:
+      static unsigned get_hash(const corner &key) {
+        unsigned hash = key.pos * 0x9e3779b1 ^ key.uv * 0x85ebca6b ^ key.normal * 0xc2b2ae35;
+        return hash ^ (hash >> 16);
       }
+
+      static bool is_empty(const corner &key) {
+        return key.pos == 0;
+      }
+    };
+
+    // an o or usemtl line
+    struct chunk_event {
+      unsigned face;
+      unsigned kind;
+      const char *begin;
+      const char *end;
+    };
+
+    // a part of the file parsed by one thread
+    struct chunk {
+      const char *begin;
+      const char *end;
+
+      unsigned num_pos;
+      unsigned num_uv;
+      unsigned num_normal;
+      unsigned pos_base;
+      unsigned uv_base;
+      unsigned normal_base;
+
+      dynarray<corner> corners;
+      dynarray<unsigned> face_sizes;
+      dynarray<chunk_event> events;
+      unsigned num_bad_faces;
+    };
+
+    // a run of faces in a chunk
+    struct span {
+      unsigned chunk_index;
+      unsigned first_face;
+      unsigned num_faces;
+      unsigned first_corner;
+    };
+
+    // the faces of one object with one material, which become one mesh
+    struct mesh_group {
+      unsigned object;
+      unsigned material;
+      dynarray<span> spans;
+
+      dynarray<mesh::vertex> vertices;
+      dynarray<uint32_t> indices;
+      vec3p bb_min;
+      vec3p bb_max;
+    };
+
+    // values from all the chunks
+    dynarray<vec3p> positions;
+    dynarray<vec2p> uvs;
+    dynarray<vec3p> normals;
+
+    static bool is_space(char c) {
+      return c == ' ' || c == '\t';
+    }
+
+    // what kind of line is this?
+    static unsigned line_kind(const char *begin, const char *end) {
+      size_t len = end - begin;
+      if (len >= 2 && begin[0] == 'v' && is_space(begin[1])) return kind_pos;
+      if (len >= 3 && begin[0] == 'v' && begin[1] == 't' && is_space(begin[2])) return kind_uv;
+      if (len >= 3 && begin[0] == 'v' && begin[1] == 'n' && is_space(begin[2])) return kind_normal;
+      if (len >= 2 && begin[0] == 'f' && is_space(begin[1])) return kind_face;
+      if (len >= 2 && begin[0] == 'o' && is_space(begin[1])) return kind_object;
+      if (len >= 7 && !memcmp(begin, "usemtl", 6) && is_space(begin[6])) return kind_material;
+      return kind_other;
     }
 
-    void atofv(dynarray<float> &values, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-
-      while (*src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
+    // find the next line, skipping leading spaces
+    static const char *next_line(const char *src, const char *eof, const char *&end) {
+      while (src != eof && is_space(*src)) ++src;
+      end = src;
+      while (end != eof && *end != '\n' && *end != '\r') ++end;
+      return src;
+    }
+
+    // skip the end of a line
+    static const char *skip_eol(const char *src, const char *eof) {
+      src += src != eof && *src == '\r';
+      src += src != eof && *src == '\n';
+      return src;
+    }
+
+    // convert a number like "-1.25e3" to a float
+    // returns false if there is no number.
+    static bool parse_float(const char *&src, const char *end, float &result) {
+      static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+
+      while (src != end && is_space(*src)) ++src;
+
+      bool negative = false;
+      if (src != end && (*src == '-' || *src == '+')) negative = *src++ == '-';
+
+      // accumulate up to 19 digits in an integer, then scale once.
+      uint64_t mantissa = 0;
+      int exponent = 0;
+      int num_digits = 0;
+      const char *start = src;
+      for (; src != end && *src >= '0' && *src <= '9'; ++src) {
+        if (num_digits < 19) { mantissa = mantissa * 10 + (*src - '0'); num_digits += mantissa != 0; }
+        else exponent++;
+      }
+      if (src != end && *src == '.') {
+        for (++src; src != end && *src >= '0' && *src <= '9'; ++src) {
+          if (num_digits < 19) { mantissa = mantissa * 10 + (*src - '0'); num_digits += mantissa != 0; exponent--; }
         }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
+      }
+      if (src == start || (src == start + 1 && *start == '.')) return false;
+
+      if (src != end && (*src == 'e' || *src == 'E')) {
+        ++src;
+        int esign = 1;
+        if (src != end && (*src == '-' || *src == '+')) esign = *src++ == '-' ? -1 : 1;
+        int exp = 0;
+        for (; src != end && *src >= '0' && *src <= '9'; ++src) {
+          if (exp < 10000) exp = exp * 10 + (*src - '0');
         }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
+        exponent += exp * esign;
+      }
+
+      double value = (double)mantissa;
+      if (exponent < 0) {
+        value = -exponent <= 22 ? value / pow10[-exponent] : value * pow(10.0, exponent);
+      } else if (exponent > 0) {
+        value = exponent <= 22 ? value * pow10[exponent] : value * pow(10.0, exponent);
       }
+      result = (float)(negative ? -value : value);
+      return true;
     }
 
-    void flush() {
-      std::sort(faces.begin(), faces.end());
-      face *f = 0;
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, faces.size() * sizeof(f->vtx));
+    // read an integer index from a face. returns false if there is none.
+    static bool parse_index(const char *&src, const char *end, int &result) {
+      bool negative = false;
+      if (src != end && *src == '-') { negative = true; ++src; }
+      if (src == end || *src < '0' || *src > '9') return false;
+      int whole = 0;
+      for (; src != end && *src >= '0' && *src <= '9'; ++src) {
+        whole = whole * 10 + (*src - '0');
+      }
+      result = negative ? -whole : whole;
+      return true;
+    }
 
-      {
-        gl_resource::wolock vl(vertices);
-        for (size_t i = 0; i != faces.size(); ++i) {
-          memcpy(vl.u8() + i * sizeof(f->vtx), faces[i].vtx, sizeof(f->vtx));
+    // convert a relative or absolute index to a one-based index. zero if out of range.
+    static unsigned resolve_index(int index, unsigned num_so_far, unsigned num_total) {
+      int result = index < 0 ? (int)num_so_far + index + 1 : index;
+      return result >= 1 && (unsigned)result <= num_total ? (unsigned)result : 0;
+    }
+
+    // read up to max_values floats from a line
+    static void parse_floats(const char *src, const char *end, float *values, unsigned max_values) {
+      for (unsigned i = 0; i != max_values; ++i) {
+        values[i] = 0;
+      }
+      for (unsigned i = 0; i != max_values && parse_float(src, end, values[i]); ++i) {
+      }
+    }
+
+    // first pass: count the values in a chunk
+    static void count_chunk(chunk &c) {
+      c.num_pos = c.num_uv = c.num_normal = 0;
+      for (const char *src = c.begin; src != c.end; ) {
+        const char *end;
+        const char *begin = next_line(src, c.end, end);
+        switch (line_kind(begin, end)) {
+          case kind_pos: c.num_pos++; break;
+          case kind_uv: c.num_uv++; break;
+          case kind_normal: c.num_normal++; break;
         }
+        src = skip_eol(end, c.end);
       }
+    }
 
-      int prev_mi = -1;
-      for (size_t i = 0; i != faces.size(); ++i) {
-        if (faces[i].material_index != prev_mi) {
-          mesh *msh = new mesh();
-          msh->set_default_attributes();
-          msh->set_vertices(vertices);
-          material *mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
-          mesh_instance *mi = new mesh_instance(node, msh, mat);
+    // second pass: store the values and faces of a chunk
+    void parse_chunk(chunk &c) {
+      unsigned num_pos = c.pos_base;
+      unsigned num_uv = c.uv_base;
+      unsigned num_normal = c.normal_base;
+      c.num_bad_faces = 0;
+
+      for (const char *src = c.begin; src != c.end; ) {
+        const char *end;
+        const char *begin = next_line(src, c.end, end);
+        src = skip_eol(end, c.end);
+
+        switch (line_kind(begin, end)) {
+          case kind_pos: {
+            float v[3];
+            parse_floats(begin + 2, end, v, 3);
+            positions[num_pos++] = vec3p(v[0], v[1], v[2]);
+          } break;
+          case kind_uv: {
+            float v[2];
+            parse_floats(begin + 3, end, v, 2);
+            uvs[num_uv++] = vec2p(v[0], v[1]);
+          } break;
+          case kind_normal: {
+            float v[3];
+            parse_floats(begin + 3, end, v, 3);
+            normals[num_normal++] = vec3p(v[0], v[1], v[2]);
+          } break;
+          case kind_face: {
+            // v, v/vt, v//vn or v/vt/vn
+            unsigned first_corner = c.corners.size();
+            bool is_valid = true;
+            const char *p = begin + 2;
+            for (;;) {
+              while (p != end && is_space(*p)) ++p;
+              if (p == end) break;
+
+              int pos = 0, uv = 0, normal = 0;
+              if (!parse_index(p, end, pos)) { is_valid = false; break; }
+              if (p != end && *p == '/') {
+                ++p;
+                parse_index(p, end, uv);
+                if (p != end && *p == '/') {
+                  ++p;
+                  parse_index(p, end, normal);
+                }
+              }
+
+              corner cnr;
+              cnr.pos = resolve_index(pos, num_pos, positions.size());
+              cnr.uv = uv ? resolve_index(uv, num_uv, uvs.size()) : 0;
+              cnr.normal = normal ? resolve_index(normal, num_normal, normals.size()) : 0;
+              is_valid = is_valid && cnr.pos != 0 && (cnr.uv != 0) == (uv != 0) && (cnr.normal != 0) == (normal != 0);
+              c.corners.push_back(cnr);
+            }
+
+            unsigned num_corners = c.corners.size() - first_corner;
+            if (is_valid && num_corners >= 3) {
+              c.face_sizes.push_back(num_corners);
+            } else {
+              c.corners.resize(first_corner);
+              c.num_bad_faces++;
+            }
+          } break;
+          case kind_object:
+          case kind_material: {
+            unsigned kind = line_kind(begin, end);
+            chunk_event ev;
+            ev.face = c.face_sizes.size();
+            ev.kind = kind;
+            ev.begin = begin + (kind == kind_object ? 2 : 7);
+            ev.end = end;
+            while (ev.begin != ev.end && is_space(*ev.begin)) ++ev.begin;
+            while (ev.end != ev.begin && is_space(ev.end[-1])) --ev.end;
+            c.events.push_back(ev);
+          } break;
+          // comments, groups, smoothing groups, mtllib etc.
+          default: break;
         }
       }
+    }
+
+    // find an existing string or add a new one
+    static unsigned find_or_add(dynarray<string> &strings, const string &value) {
+      for (unsigned i = 0; i != strings.size(); ++i) {
+        if (strings[i] == value.c_str()) return i;
+      }
+      strings.push_back(value);
+      return strings.size() - 1;
+    }
+
+    // find the mesh for an object and material
+    static mesh_group *get_group(dynarray<mesh_group *> &groups, unsigned object, unsigned material) {
+      for (unsigned i = groups.size(); i-- != 0; ) {
+        if (groups[i]->object != object) break;
+        if (groups[i]->material == material) return groups[i];
+      }
+      mesh_group *g = new mesh_group();
+      g->object = object;
+      g->material = material;
+      groups.push_back(g);
+      return g;
+    }
+
+    // triangulate the faces of a group and share vertices with the same indices.
+    void weld_group(mesh_group &g, dynarray<chunk *> &chunks) {
+      hash_map<corner, unsigned, corner_cmp> vertex_map;
+      vec3 vmin(0, 0, 0), vmax(0, 0, 0);
+
+      for (unsigned s = 0; s != g.spans.size(); ++s) {
+        const span &sp = g.spans[s];
+        const chunk &c = *chunks[sp.chunk_index];
+        const corner *face = &c.corners[0] + sp.first_corner;
+        for (unsigned f = 0; f != sp.num_faces; ++f) {
+          unsigned num_corners = c.face_sizes[sp.first_face + f];
+          // n-gons become triangle fans, assumed convex.
+          for (unsigned k = 1; k + 1 < num_corners; ++k) {
+            const corner *tri[3] = { &face[0], &face[k], &face[k+1] };
+            for (unsigned j = 0; j != 3; ++j) {
+              // the map stores index+1 so that zero means a new vertex
+              unsigned &index = vertex_map[*tri[j]];
+              if (index == 0) {
+                const corner &cnr = *tri[j];
+                mesh::vertex vtx;
+                vtx.pos = positions[cnr.pos - 1];
+                if (cnr.uv) vtx.uv = uvs[cnr.uv - 1];
+                if (cnr.normal) vtx.normal = normals[cnr.normal - 1];
+                vec3 pos = vtx.pos;
+                vmin = g.vertices.size() ? min(vmin, pos) : pos;
+                vmax = g.vertices.size() ? max(vmax, pos) : pos;
+                g.vertices.push_back(vtx);
+                index = g.vertices.size();
+              }
+              g.indices.push_back(index - 1);
+            }
+          }
+          face += num_corners;
+        }
+      }
+
+      if (mesh_optimizer::optimize_on_load()) {
+        unsigned num_vertices = mesh_optimizer::optimize(
+          (uint8_t*)g.vertices.data(), g.vertices.size(), sizeof(mesh::vertex), 0,
+          g.indices.data(), g.indices.size()
+        );
+        g.vertices.resize(num_vertices);
+      }
 
-      faces.resize(0);
-      src_vertices.resize(0);
-      src_uvs.resize(0);
-      src_normals.resize(0);
+      g.bb_min = vmin;
+      g.bb_max = vmax;
     }
   };
 }}
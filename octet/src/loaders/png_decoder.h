@@ -0,0 +1,410 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// PNG file decoder
+//
+// The IDAT stream is inflated with zip_decoder, rows are unfiltered in place
+// and expanded straight to GL_RGB or GL_RGBA, bottom row first like the other decoders.
+// Three and four byte pixels unfilter with SSE2, everything else
+// (interlaced passes, palettes, 16 bit channels) uses the generic code.
+//
+
+namespace octet { namespace loaders {
+  /// Class for loading PNG image files
+  class png_decoder {
+    // http://www.w3.org/TR/PNG/
+    //
+
+    enum {
+      // colour types
+      ct_grey = 0,
+      ct_rgb = 2,
+      ct_palette = 3,
+      ct_grey_alpha = 4,
+      ct_rgba = 6,
+
+      // row filters
+      filter_none = 0,
+      filter_sub = 1,
+      filter_up = 2,
+      filter_average = 3,
+      filter_paeth = 4,
+
+      // SIMD loads may read this far past the end of a row.
+      row_padding = 16,
+    };
+
+    // IHDR
+    unsigned width_;
+    unsigned height_;
+    unsigned bit_depth;
+    unsigned colour_type;
+    unsigned interlace;
+
+    // PLTE and tRNS
+    uint8_t palette[256*4];
+    bool has_trns;
+    unsigned trns[3];
+
+    // read a big-endian value
+    static unsigned be2(const uint8_t *p) {
+      return p[0] * 0x100 + p[1];
+    }
+
+    static unsigned be4(const uint8_t *p) {
+      return p[0] * 0x1000000 + p[1] * 0x10000 + p[2] * 0x100 + p[3];
+    }
+
+    unsigned num_channels() const {
+      switch (colour_type) {
+        case ct_rgb: return 3;
+        case ct_grey_alpha: return 2;
+        case ct_rgba: return 4;
+        default: return 1;
+      }
+    }
+
+    bool valid_header() const {
+      if (width_ == 0 || height_ == 0 || width_ > 0xffff || height_ > 0xffff || interlace > 1) return false;
+      switch (colour_type) {
+        case ct_grey: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+        case ct_palette: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+        case ct_rgb: case ct_grey_alpha: case ct_rgba: return bit_depth == 8 || bit_depth == 16;
+        default: return false;
+      }
+    }
+
+    static uint8_t paeth(int a, int b, int c) {
+      int pa = b - c; pa = pa < 0 ? -pa : pa;
+      int pb = a - c; pb = pb < 0 ? -pb : pb;
+      int pc = a + b - 2 * c; pc = pc < 0 ? -pc : pc;
+      return (uint8_t)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+    }
+
+    // undo the row filter. prev is the previous unfiltered row (zeros for the first row).
+    static void unfilter_row_c(uint8_t *row, const uint8_t *prev, unsigned filter, unsigned stride, unsigned bpp) {
+      switch (filter) {
+        case filter_sub: {
+          for (unsigned i = bpp; i < stride; ++i) row[i] += row[i-bpp];
+        } break;
+        case filter_up: {
+          for (unsigned i = 0; i < stride; ++i) row[i] += prev[i];
+        } break;
+        case filter_average: {
+          for (unsigned i = 0; i < bpp; ++i) row[i] += prev[i] >> 1;
+          for (unsigned i = bpp; i < stride; ++i) row[i] += (row[i-bpp] + prev[i]) >> 1;
+        } break;
+        case filter_paeth: {
+          for (unsigned i = 0; i < bpp; ++i) row[i] += prev[i];
+          for (unsigned i = bpp; i < stride; ++i) row[i] += paeth(row[i-bpp], prev[i], prev[i-bpp]);
+        } break;
+      }
+    }
+
+    #if OCTET_SSE
+      // one pixel in the low four 16 bit lanes. reads four bytes even for three byte pixels.
+      static __m128i load_pixel(const uint8_t *src) {
+        int value;
+        memcpy(&value, src, 4);
+        return _mm_unpacklo_epi8(_mm_cvtsi32_si128(value), _mm_setzero_si128());
+      }
+
+      static void store_pixel(uint8_t *dest, __m128i x, unsigned bpp) {
+        int value = _mm_cvtsi128_si32(_mm_packus_epi16(x, x));
+        memcpy(dest, &value, bpp);
+      }
+
+      static __m128i abs16(__m128i x) {
+        return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+      }
+
+      static __m128i select(__m128i mask, __m128i a, __m128i b) {
+        return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+      }
+
+      // Up works on 16 bytes at a time; Sub, Average and Paeth on one 3 or 4 byte pixel at a time.
+      static void unfilter_row_sse2(uint8_t *row, const uint8_t *prev, unsigned filter, unsigned stride, unsigned bpp) {
+        if (filter == filter_up) {
+          unsigned i = 0;
+          for (; i + 16 <= stride; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+            _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(x, b));
+          }
+          for (; i < stride; ++i) row[i] += prev[i];
+          return;
+        }
+
+        __m128i mask = _mm_set1_epi16(0xff);
+        __m128i a = _mm_setzero_si128();
+        if (filter == filter_sub) {
+          for (unsigned i = 0; i < stride; i += bpp) {
+            a = _mm_and_si128(_mm_add_epi16(load_pixel(row + i), a), mask);
+            store_pixel(row + i, a, bpp);
+          }
+        } else if (filter == filter_average) {
+          for (unsigned i = 0; i < stride; i += bpp) {
+            __m128i b = load_pixel(prev + i);
+            a = _mm_and_si128(_mm_add_epi16(load_pixel(row + i), _mm_srli_epi16(_mm_add_epi16(a, b), 1)), mask);
+            store_pixel(row + i, a, bpp);
+          }
+        } else if (filter == filter_paeth) {
+          __m128i c = _mm_setzero_si128();
+          for (unsigned i = 0; i < stride; i += bpp) {
+            __m128i b = load_pixel(prev + i);
+            // p = a + b - c, so p-a = b-c, p-b = a-c and p-c = (b-c) + (a-c)
+            __m128i pa = _mm_sub_epi16(b, c);
+            __m128i pb = _mm_sub_epi16(a, c);
+            __m128i pc = abs16(_mm_add_epi16(pa, pb));
+            pa = abs16(pa);
+            pb = abs16(pb);
+            __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            __m128i pred = select(_mm_cmpeq_epi16(pb, smallest), b, c);
+            pred = select(_mm_cmpeq_epi16(pa, smallest), a, pred);
+            a = _mm_and_si128(_mm_add_epi16(load_pixel(row + i), pred), mask);
+            c = b;
+            store_pixel(row + i, a, bpp);
+          }
+        }
+      }
+    #endif
+
+    static void unfilter_row(uint8_t *row, const uint8_t *prev, unsigned filter, unsigned stride, unsigned bpp) {
+      if (filter == filter_none) return;
+      #if OCTET_SSE
+        if (bpp == 3 || bpp == 4 || filter == filter_up) {
+          unfilter_row_sse2(row, prev, filter, stride, bpp);
+          return;
+        }
+      #endif
+      unfilter_row_c(row, prev, filter, stride, bpp);
+    }
+
+    // get the index'th sample of a row at its original bit depth
+    unsigned get_sample(const uint8_t *row, unsigned index) const {
+      switch (bit_depth) {
+        case 16: return row[index*2] * 0x100 + row[index*2+1];
+        case 8: return row[index];
+        default: {
+          unsigned bit = index * bit_depth;
+          return ( row[bit >> 3] >> (8 - bit_depth - (bit & 7)) ) & ( (1 << bit_depth) - 1 );
+        }
+      }
+    }
+
+    // scale a sample to eight bits. 16 bit samples keep their high byte.
+    uint8_t to_u8(unsigned value) const {
+      switch (bit_depth) {
+        case 16: return (uint8_t)(value >> 8);
+        case 4: return (uint8_t)(value * 0x11);
+        case 2: return (uint8_t)(value * 0x55);
+        case 1: return (uint8_t)(value * 0xff);
+        default: return (uint8_t)value;
+      }
+    }
+
+    // expand an unfiltered row of num_pixels pixels to RGB or RGBA,
+    // writing one pixel every dest_step bytes.
+    void expand_row(uint8_t *dest, unsigned dest_step, const uint8_t *row, unsigned num_pixels, unsigned num_components) const {
+      unsigned row_bytes = num_pixels * num_components;
+      if (bit_depth == 8 && dest_step == num_components && (colour_type == ct_rgba || (colour_type == ct_rgb && !has_trns))) {
+        memcpy(dest, row, row_bytes);
+        return;
+      }
+
+      for (unsigned x = 0; x != num_pixels; ++x) {
+        uint8_t rgba[4] = { 0, 0, 0, 0xff };
+        switch (colour_type) {
+          case ct_grey: {
+            unsigned grey = get_sample(row, x);
+            rgba[0] = rgba[1] = rgba[2] = to_u8(grey);
+            if (has_trns && grey == trns[0]) rgba[3] = 0;
+          } break;
+          case ct_rgb: {
+            unsigned r = get_sample(row, x*3+0), g = get_sample(row, x*3+1), b = get_sample(row, x*3+2);
+            rgba[0] = to_u8(r);
+            rgba[1] = to_u8(g);
+            rgba[2] = to_u8(b);
+            if (has_trns && r == trns[0] && g == trns[1] && b == trns[2]) rgba[3] = 0;
+          } break;
+          case ct_palette: {
+            memcpy(rgba, palette + get_sample(row, x) * 4, 4);
+          } break;
+          case ct_grey_alpha: {
+            rgba[0] = rgba[1] = rgba[2] = to_u8(get_sample(row, x*2+0));
+            rgba[3] = to_u8(get_sample(row, x*2+1));
+          } break;
+          case ct_rgba: {
+            for (unsigned i = 0; i != 4; ++i) rgba[i] = to_u8(get_sample(row, x*4+i));
+          } break;
+        }
+        memcpy(dest, rgba, num_components);
+        dest += dest_step;
+      }
+    }
+  public:
+    png_decoder() {
+      width_ = height_ = 0;
+      bit_depth = colour_type = interlace = 0;
+      has_trns = false;
+    }
+
+    /// decode a PNG file in memory to GL_RGB or GL_RGBA bytes.
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
+      static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+      if (src_max - src < 8 || memcmp(src, signature, 8)) {
+        printf("warning: png_decoder - not a PNG file\n");
+        return;
+      }
+
+      for (unsigned i = 0; i != 256; ++i) {
+        palette[i*4+0] = palette[i*4+1] = palette[i*4+2] = 0;
+        palette[i*4+3] = 0xff;
+      }
+      has_trns = false;
+
+      // read the header chunks and find the size of the compressed data.
+      const uint8_t *chunks = src + 8;
+      size_t idat_size = 0;
+      for (const uint8_t *chunk = chunks; chunk + 12 <= src_max; ) {
+        unsigned length = be4(chunk);
+        const uint8_t *type = chunk + 4;
+        const uint8_t *data = chunk + 8;
+        if (length > (size_t)(src_max - data - 4)) break;
+
+        if (!memcmp(type, "IHDR", 4) && length >= 13) {
+          width_ = be4(data);
+          height_ = be4(data + 4);
+          bit_depth = data[8];
+          colour_type = data[9];
+          interlace = data[12];
+        } else if (!memcmp(type, "PLTE", 4)) {
+          unsigned num_entries = length / 3 < 256 ? length / 3 : 256;
+          for (unsigned i = 0; i != num_entries; ++i) {
+            memcpy(palette + i*4, data + i*3, 3);
+          }
+        } else if (!memcmp(type, "tRNS", 4)) {
+          has_trns = true;
+          if (colour_type == ct_palette) {
+            for (unsigned i = 0; i != length && i != 256; ++i) palette[i*4+3] = data[i];
+          } else if (colour_type == ct_grey && length >= 2) {
+            trns[0] = be2(data);
+          } else if (colour_type == ct_rgb && length >= 6) {
+            for (unsigned i = 0; i != 3; ++i) trns[i] = be2(data + i*2);
+          } else {
+            has_trns = false;
+          }
+        } else if (!memcmp(type, "IDAT", 4)) {
+          idat_size += length;
+        } else if (!memcmp(type, "IEND", 4)) {
+          break;
+        }
+        chunk = data + length + 4;
+      }
+
+      if (!valid_header() || idat_size < 2) {
+        printf("warning: png_decoder - unsupported or broken PNG file\n");
+        return;
+      }
+
+      // join the IDAT chunks. the padding lets zip_decoder peek past the end.
+      dynarray<uint8_t> idat(idat_size + 4);
+      size_t idat_pos = 0;
+      for (const uint8_t *chunk = chunks; chunk + 12 <= src_max; ) {
+        unsigned length = be4(chunk);
+        const uint8_t *data = chunk + 8;
+        if (length > (size_t)(src_max - data - 4)) break;
+        if (!memcmp(chunk + 4, "IDAT", 4)) {
+          memcpy(&idat[idat_pos], data, length);
+          idat_pos += length;
+        } else if (!memcmp(chunk + 4, "IEND", 4)) {
+          break;
+        }
+        chunk = data + length + 4;
+      }
+      memset(&idat[idat_size], 0, 4);
+
+      // zlib header: deflate, no preset dictionary.
+      unsigned cmf = idat[0], flg = idat[1];
+      if ((cmf & 0x0f) != 8 || (cmf * 0x100 + flg) % 31 != 0 || (flg & 0x20)) {
+        printf("warning: png_decoder - bad zlib header\n");
+        return;
+      }
+
+      // Adam7 passes as x, y, x step, y step. non-interlaced images are one pass.
+      static const uint8_t adam7[7][4] = {
+        { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+        { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 },
+      };
+      static const uint8_t single_pass[1][4] = { { 0, 0, 1, 1 } };
+      const uint8_t (*passes)[4] = interlace ? adam7 : single_pass;
+      unsigned num_passes = interlace ? 7 : 1;
+
+      unsigned bits_per_pixel = bit_depth * num_channels();
+      unsigned bpp = (bits_per_pixel + 7) / 8;
+      size_t raw_size = 0;
+      unsigned max_stride = 0;
+      for (unsigned pass = 0; pass != num_passes; ++pass) {
+        unsigned x0 = passes[pass][0], y0 = passes[pass][1], dx = passes[pass][2], dy = passes[pass][3];
+        unsigned pass_width = width_ > x0 ? (width_ - x0 + dx - 1) / dx : 0;
+        unsigned pass_height = height_ > y0 ? (height_ - y0 + dy - 1) / dy : 0;
+        if (!pass_width || !pass_height) continue;
+        unsigned stride = (unsigned)(((size_t)pass_width * bits_per_pixel + 7) / 8);
+        raw_size += (size_t)pass_height * (1 + stride);
+        if (max_stride < stride) max_stride = stride;
+      }
+
+      dynarray<uint8_t> raw(raw_size + row_padding);
+      memset(&raw[raw_size], 0, row_padding);
+      zip_decoder zip;
+      uint8_t *raw_end = zip.decode(&raw[0], &raw[0] + raw_size, &idat[2], &idat[0] + idat_size);
+      if (!raw_end) {
+        printf("warning: png_decoder - broken compressed data\n");
+        return;
+      }
+      if (raw_end != &raw[0] + raw_size) {
+        printf("warning: png_decoder - image data is truncated\n");
+        memset(raw_end, 0, &raw[0] + raw_size - raw_end);
+      }
+
+      bool has_alpha = colour_type == ct_grey_alpha || colour_type == ct_rgba || has_trns;
+      unsigned num_components = has_alpha ? 4 : 3;
+      format = has_alpha ? 0x1908 : 0x1907; // GL_RGBA / GL_RGB
+      width = (uint16_t)width_;
+      height = (uint16_t)height_;
+      image.resize(width_ * height_ * num_components);
+
+      dynarray<uint8_t> zero_row(max_stride + row_padding);
+      memset(&zero_row[0], 0, max_stride + row_padding);
+
+      uint8_t *row = &raw[0];
+      for (unsigned pass = 0; pass != num_passes; ++pass) {
+        unsigned x0 = passes[pass][0], y0 = passes[pass][1], dx = passes[pass][2], dy = passes[pass][3];
+        unsigned pass_width = width_ > x0 ? (width_ - x0 + dx - 1) / dx : 0;
+        unsigned pass_height = height_ > y0 ? (height_ - y0 + dy - 1) / dy : 0;
+        if (!pass_width || !pass_height) continue;
+        unsigned stride = (unsigned)(((size_t)pass_width * bits_per_pixel + 7) / 8);
+
+        const uint8_t *prev = &zero_row[0];
+        for (unsigned y = 0; y != pass_height; ++y) {
+          unsigned filter = *row++;
+          if (filter > filter_paeth) {
+            printf("warning: png_decoder - bad row filter %d\n", filter);
+            filter = filter_none;
+          }
+          unfilter_row(row, prev, filter, stride, bpp);
+
+          // the other decoders store the bottom row first.
+          unsigned dest_y = height_ - 1 - (y0 + y * dy);
+          expand_row(&image[(dest_y * width_ + x0) * num_components], dx * num_components, row, pass_width, num_components);
+          prev = row;
+          row += stride;
+        }
+      }
+    }
+  };
+}}
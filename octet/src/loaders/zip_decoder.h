@@ -9,7 +9,10 @@
 // 
 namespace octet { namespace loaders {
   class zip_decoder {
-    enum { debug = 1 };
+    enum { debug = 0 };
+
+    // codes up to this length are decoded with a single table lookup
+    enum { fast_bits = 9, fast_size = 1 << fast_bits };
 
     struct huffman_table {
       uint8_t min_lit_length;
@@ -21,15 +24,18 @@ namespace octet { namespace loaders {
       uint16_t lit_codes[288];
       uint16_t lit_limits[18];
       uint16_t lit_base[18];
+      uint16_t lit_fast[fast_size];
 
       //uint8_t dist_lengths[32];
       uint16_t dist_codes[32];
       uint16_t dist_limits[18];
       uint16_t dist_base[18];
+      uint16_t dist_fast[fast_size];
     };
 
     huffman_table fixed_;
     huffman_table var_;
+    uint8_t *dest_begin_;
 
     // on ARM we can do this faster with the "rev" instruction
     inline static uint16_t rev16(uint16_t value) {
@@ -81,7 +87,11 @@ namespace octet { namespace loaders {
       //return value;
     }
 
-    bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base) {
+    /// build the canonical huffman decode tables for a set of code lengths.
+    /// if fast is not NULL, it gets an entry (length << 9 | code) for every bit pattern
+    /// whose first fast_bits bits start a short code, and zero for longer codes.
+    bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base, uint16_t *fast = NULL) {
+      if (fast) memset(fast, 0, fast_size * sizeof(fast[0]));
       min_length = 16;
       max_length = 0;
       for (unsigned i = 0; i != num_lengths; ++i) {
@@ -108,6 +118,12 @@ namespace octet { namespace loaders {
           if (lengths[i] == length) {
             codes[code++] = i;
             //dump_bits(huffcode << (16-length), 16, "huffcode");
+            if (fast && length <= fast_bits) {
+              // the bitstream is lsb first, so index by the reversed code.
+              for (unsigned j = rev16((uint16_t)huffcode) >> (16-length); j < fast_size; j += 1 << length) {
+                fast[j] = (uint16_t)(length << 9 | i);
+              }
+            }
             huffcode++;
           }
         }
@@ -139,10 +155,30 @@ namespace octet { namespace loaders {
     unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
       unsigned i = bitptr >> 3, j = bitptr & 7;
       unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      if (name) dump_bits(value, bits, name);
+      if (debug && name) dump_bits(value, bits, name);
       return value;
     }
 
+    /// decode one huffman symbol: short codes come straight from the fast table,
+    /// longer ones fall back to searching the limits.
+    unsigned decode_symbol(const uint8_t *src, unsigned &bitptr, const uint16_t *fast, unsigned min_length, const uint16_t *codes, const uint16_t *limits, const uint16_t *base) {
+      unsigned peek16 = peek(src, bitptr, 16, NULL);
+      unsigned entry = fast[peek16 & (fast_size-1)];
+      if (entry) {
+        bitptr += entry >> 9;
+        return entry & 0x1ff;
+      }
+      unsigned value = rev16(peek16);
+      unsigned index = 0;
+      while (value > limits[index]) {
+        index++;
+      }
+      unsigned length = min_length + index;
+      unsigned offset = ( value >> ( 16 - length ) );
+      bitptr += length;
+      return codes[offset - base[index]];
+    }
+
     unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
       bitptr = ( bitptr + 7 ) & ~7;
       unsigned bytes_to_copy = peek(src, bitptr, 16, "bytes_to_copy");
@@ -162,17 +198,7 @@ namespace octet { namespace loaders {
     unsigned decode_lz77(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, huffman_table *table_) {
       for(;;) {
         if (src + bitptr/8 > src_max) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > table_->lit_limits[index]) {
-          index++;
-        }
-        unsigned length = table_->min_lit_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = table_->lit_codes[offset - table_->lit_base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "code");
+        unsigned code = decode_symbol(src, bitptr, table_->lit_fast, table_->min_lit_length, table_->lit_codes, table_->lit_limits, table_->lit_base);
 
         if (code < 256) {
           if (dest+1 > dest_max) return ~0;
@@ -194,23 +220,14 @@ namespace octet { namespace loaders {
               35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
               131-3, 163-3, 195-3, 227-3, 258-3,
             };
-            if (code-257 > sizeof(extra)) return ~0;
+            if (code-257 >= sizeof(extra)) return ~0;
             unsigned extra_length = extra[ code-257 ];
             block_length = base[ code-257 ] + 3 + peek(src, bitptr, extra_length, "extra");
             bitptr += extra_length;
           }
           {
             //if (src + (bitptr + table_->max_dist_length)/8 > src_max ) return ~0;
-            unsigned peek16 = peek(src, bitptr, 16, NULL);
-            unsigned value = rev16(peek16);
-            unsigned index = 0;
-            while (value > table_->dist_limits[index]) {
-              index++;
-            }
-            unsigned length = table_->min_dist_length + index;
-            unsigned offset = ( value >> ( 16 - length ) );
-            unsigned code = table_->dist_codes[offset - table_->dist_base[index]];
-            bitptr += length;
+            unsigned code = decode_symbol(src, bitptr, table_->dist_fast, table_->min_dist_length, table_->dist_codes, table_->dist_limits, table_->dist_base);
 
             if (debug) printf("{%d}\n", code);
             static const uint8_t extra[] = {
@@ -219,7 +236,7 @@ namespace octet { namespace loaders {
             static const uint16_t base[] = {
               1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
             };
-            if (code > sizeof(extra)) return ~0;
+            if (code >= sizeof(base)/sizeof(base[0])) return ~0;
             unsigned extra_length = extra[ code ];
             distance = base[ code ] + peek(src, bitptr, extra_length, "extra");
             bitptr += extra_length;
@@ -228,10 +245,18 @@ namespace octet { namespace loaders {
           if (debug) printf("length=%d distance=%d\n", block_length, distance);
 
           if (dest+block_length > dest_max) return ~0;
-
-          for(unsigned i = 0; i != block_length; ++i) {
-            dest[0] = dest[-(int)distance];
-            dest++;
+          if (distance > (unsigned)(dest - dest_begin_)) return ~0;
+
+          const uint8_t *from = dest - distance;
+          if (distance >= block_length) {
+            // no overlap
+            memcpy(dest, from, block_length);
+            dest += block_length;
+          } else {
+            // overlapping copies repeat the last "distance" bytes.
+            for(unsigned i = 0; i != block_length; ++i) {
+              *dest++ = *from++;
+            }
           }
         }
       }
@@ -309,8 +334,8 @@ namespace octet { namespace loaders {
       if (debug) printf("lengths done\n");
 
       if(
-        !build_huffman(lengths, num_lit_codes, var_.min_lit_length, var_.max_lit_length, var_.lit_codes, var_.lit_limits, var_.lit_base) ||
-        !build_huffman(lengths+num_lit_codes, num_dist_codes, var_.min_dist_length, var_.max_dist_length, var_.dist_codes, var_.dist_limits, var_.dist_base)
+        !build_huffman(lengths, num_lit_codes, var_.min_lit_length, var_.max_lit_length, var_.lit_codes, var_.lit_limits, var_.lit_base, var_.lit_fast) ||
+        !build_huffman(lengths+num_lit_codes, num_dist_codes, var_.min_dist_length, var_.max_dist_length, var_.dist_codes, var_.dist_limits, var_.dist_base, var_.dist_fast)
       ) {
         return ~0;
       }
@@ -318,6 +343,7 @@ namespace octet { namespace loaders {
     }
   public:
     zip_decoder() {
+      dest_begin_ = NULL;
       uint8_t lit_lengths[288];
       uint8_t dist_lengths[32];
       memset(lit_lengths +   0, 8, 144 - 0);
@@ -325,13 +351,16 @@ namespace octet { namespace loaders {
       memset(lit_lengths + 256, 7, 280-256);
       memset(lit_lengths + 280, 8, 288-280);
       memset(dist_lengths, 5, 32);
-      build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
-      build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base, fixed_.lit_fast);
+      build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base, fixed_.dist_fast);
     }
 
-    void decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
+    /// inflate a raw deflate stream (no zlib or gzip header).
+    /// returns the end of the decoded data, or NULL if the stream is broken.
+    uint8_t *decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
       unsigned bitptr = 0;
       unsigned is_last_block;
+      dest_begin_ = dest;
 
       // for each "deflate" block:
       do {
@@ -348,9 +377,10 @@ namespace octet { namespace loaders {
         case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
         case 1: bitptr = decode_fixed(dest, dest_max, src, src_max, bitptr); break;
         case 2: bitptr = decode_variable(dest, dest_max, src, src_max, bitptr); break;
-        default: return;
+        default: return NULL;
         }
       } while( !is_last_block && bitptr != ~0);
+      return bitptr == ~0u ? NULL : dest;
     }
   };
 }}
@@ -0,0 +1,85 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// view frustum for culling
+//
+
+namespace octet { namespace math {
+  /// The six planes of a view volume, taken from a world to projection matrix.
+  ///
+  /// Box tests work on four planes at a time: the planes are stored
+  /// transposed so that each vec4 holds one component of four planes.
+  class frustum {
+    // plane p is (x[p/4][p%4], y[p/4][p%4], z[p/4][p%4], w[p/4][p%4]). The last two are copies.
+    vec4 x[2], y[2], z[2], w[2];
+
+    void set_plane(int p, const vec4 &plane) {
+      // normalize so that distances are in world units.
+      float len = sqrtf(plane.x() * plane.x() + plane.y() * plane.y() + plane.z() * plane.z());
+      float r = len > 0 ? 1.0f / len : 0;
+      x[p >> 2][p & 3] = plane.x() * r;
+      y[p >> 2][p & 3] = plane.y() * r;
+      z[p >> 2][p & 3] = plane.z() * r;
+      w[p >> 2][p & 3] = plane.w() * r;
+    }
+
+  public:
+    enum {
+      /// completely outside
+      outside,
+      /// crosses at least one plane
+      intersecting,
+      /// completely inside
+      inside,
+    };
+
+    /// default frustum contains everything.
+    frustum() {
+      for (int i = 0; i != 2; ++i) {
+        x[i] = y[i] = z[i] = vec4(0, 0, 0, 0);
+        w[i] = vec4(1, 1, 1, 1);
+      }
+    }
+
+    /// extract the planes from a world to projection matrix (row vectors, GL clip space).
+    frustum(const mat4t &worldToProjection) {
+      vec4 cx = worldToProjection.colx();
+      vec4 cy = worldToProjection.coly();
+      vec4 cz = worldToProjection.colz();
+      vec4 cw = worldToProjection.colw();
+      set_plane(0, cw + cx); // left
+      set_plane(1, cw - cx); // right
+      set_plane(2, cw + cy); // bottom
+      set_plane(3, cw - cy); // top
+      set_plane(4, cw + cz); // near
+      set_plane(5, cw - cz); // far
+      set_plane(6, cw + cx);
+      set_plane(7, cw - cx);
+    }
+
+    /// outside, intersecting or inside.
+    int classify(const aabb &bb) const {
+      vec3 c = bb.get_center();
+      vec3 h = bb.get_half_extent();
+      vec4 cx(c.x()), cy(c.y()), cz(c.z());
+      vec4 hx(h.x()), hy(h.y()), hz(h.z());
+      vec4 zero(0.0f);
+      bool all_inside = true;
+      for (int i = 0; i != 2; ++i) {
+        vec4 distance = x[i] * cx + y[i] * cy + z[i] * cz + w[i];
+        vec4 radius = abs(x[i]) * hx + abs(y[i]) * hy + abs(z[i]) * hz;
+        if (any(distance + radius < zero)) return outside;
+        all_inside = all_inside && all(distance - radius >= zero);
+      }
+      return all_inside ? inside : intersecting;
+    }
+
+    /// true if any part of the box may be visible.
+    bool intersects(const aabb &bb) const {
+      return classify(bb) != outside;
+    }
+  };
+} }
@@ -82,7 +82,9 @@ namespace octet {
 #include "sphere.h"
 #include "plane.h"
 #include "half_space.h"
+#include "frustum.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "polygon.h"
 #include "zcylinder.h"
 #include "voxel_grid.h"
@@ -0,0 +1,81 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// four rays for packet traversal of bounding volume hierarchies
+//
+
+namespace octet { namespace math {
+  /// Four rays stored transposed, so that each vec4 holds one component of all four.
+  ///
+  /// A box is tested against the whole packet with one pass of vector arithmetic.
+  /// Lanes are selected with bit masks: bit l is lane l.
+  class ray_packet {
+  public:
+    /// start + dir * t for 0 <= t <= t_max
+    vec4 org_x, org_y, org_z;
+    vec4 dir_x, dir_y, dir_z;
+    vec4 inv_x, inv_y, inv_z;
+    vec4 t_max;
+
+    /// lanes with a ray in them
+    unsigned active;
+
+    ray_packet() {
+      active = 0;
+      for (unsigned l = 0; l != 4; ++l) {
+        set(l, vec3(0, 0, 0), vec3(0, 0, 1), 0);
+      }
+      active = 0;
+    }
+
+    /// put a ray in a lane.
+    void set(unsigned lane, const vec3 &start, const vec3 &dir, float t) {
+      org_x[lane] = start.x(); org_y[lane] = start.y(); org_z[lane] = start.z();
+      dir_x[lane] = dir.x(); dir_y[lane] = dir.y(); dir_z[lane] = dir.z();
+      inv_x[lane] = 1.0f / (fabsf(dir.x()) > 1e-30f ? dir.x() : 1e-30f);
+      inv_y[lane] = 1.0f / (fabsf(dir.y()) > 1e-30f ? dir.y() : 1e-30f);
+      inv_z[lane] = 1.0f / (fabsf(dir.z()) > 1e-30f ? dir.z() : 1e-30f);
+      t_max[lane] = t;
+      active |= 1 << lane;
+    }
+
+    vec3 get_start(unsigned lane) const {
+      return vec3(org_x[lane], org_y[lane], org_z[lane]);
+    }
+
+    vec3 get_dir(unsigned lane) const {
+      return vec3(dir_x[lane], dir_y[lane], dir_z[lane]);
+    }
+
+    /// the same rays in another space. t is unchanged as the matrix is affine.
+    ray_packet get_transform(const mat4t &mat) const {
+      ray_packet result;
+      for (unsigned l = 0; l != 4; ++l) {
+        vec3 start = (get_start(l).xyz1() * mat).xyz();
+        vec3 dir = (get_dir(l).xyz0() * mat).xyz();
+        result.set(l, start, dir, t_max[l]);
+      }
+      result.active = active;
+      return result;
+    }
+
+    /// which lanes of mask enter the box lo-hi before their t_max, and where.
+    unsigned intersects(const vec4 &lo, const vec4 &hi, unsigned mask, vec4 &t_enter) const {
+      vec4 x0 = (vec4(lo.x()) - org_x) * inv_x, x1 = (vec4(hi.x()) - org_x) * inv_x;
+      vec4 y0 = (vec4(lo.y()) - org_y) * inv_y, y1 = (vec4(hi.y()) - org_y) * inv_y;
+      vec4 z0 = (vec4(lo.z()) - org_z) * inv_z, z1 = (vec4(hi.z()) - org_z) * inv_z;
+      vec4 enter = x0.min(x1).max(y0.min(y1)).max(z0.min(z1)).max(vec4(0.0f));
+      vec4 exit = x0.max(x1).min(y0.max(y1)).min(z0.max(z1)).min(t_max);
+      t_enter = enter;
+
+      unsigned result = 0;
+      for (unsigned l = 0; l != 4; ++l) {
+        if (enter[l] <= exit[l]) result |= 1 << l;
+      }
+      return result & mask;
+    }
+  };
+} }
@@ -103,6 +103,9 @@
   #include "platform/machine_specific.h"
   #include "platform/args_parser.h"
 
+  // worker threads
+  #include "resources/job.h"
+
   // math library
   #include "math/math.h"
 
@@ -146,9 +149,11 @@
   #include "helpers/text_overlay.h"
   #include "helpers/object_picker.h"
   #include "helpers/helper_fps_controller.h"
+  #include "helpers/frame_capture.h"
 
   // asset loaders
   #include "loaders/collada_builder.h"
+  #include "loaders/obj_loader.h"
 
   // forward references
   #include "resources/resources.inl"
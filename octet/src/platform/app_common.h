@@ -22,6 +22,7 @@ namespace octet {
     attribute_blendindices = 7,
     attribute_texcoord = 8,
     attribute_uv = 8,
+    attribute_instance = 9, // 9-12: per instance model to camera matrix
     attribute_tangent = 14,
     attribute_bitangent = 15,
     attribute_binormal = 15,
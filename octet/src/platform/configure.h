@@ -54,9 +54,18 @@
 #include <numeric>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #if defined(WIN32)
   #include <direct.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/stat.h>
+  #include <sys/mman.h>
 #endif
 
 namespace octet {
@@ -669,6 +669,10 @@ enum {
   GL_MAP_INVALIDATE_BUFFER_BIT = 0x0008,
   GL_MAP_FLUSH_EXPLICIT_BIT = 0x0010,
   GL_MAP_UNSYNCHRONIZED_BIT = 0x0020,
+  GL_MAP_PERSISTENT_BIT = 0x0040,
+  GL_MAP_COHERENT_BIT = 0x0080,
+  GL_DYNAMIC_STORAGE_BIT = 0x0100,
+  GL_CLIENT_STORAGE_BIT = 0x0200,
   GL_RG = 0x8227,
   GL_RG_INTEGER = 0x8228,
   GL_R8 = 0x8229,
@@ -1278,6 +1282,9 @@ typedef void (GL_APIENTRY *glVertexAttribFormat_t)(GLuint attribindex, GLint siz
 typedef void (GL_APIENTRY *glVertexAttribIFormat_t)(GLuint attribindex, GLint size, GLenum type, GLuint relativeoffset);
 typedef void (GL_APIENTRY *glVertexAttribBinding_t)(GLuint attribindex, GLuint bindingindex);
 typedef void (GL_APIENTRY *glVertexBindingDivisor_t)(GLuint bindingindex, GLuint divisor);
+typedef void (GL_APIENTRY *glBufferStorage_t)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+typedef void (GL_APIENTRY *glMultiDrawElementsIndirect_t)(GLenum mode, GLenum type, const void *indirect, GLsizei drawcount, GLsizei stride);
+typedef void (GL_APIENTRY *glDrawElementsInstancedBaseVertex_t)(GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei instancecount, GLint basevertex);
 
 #ifdef WIN32
   glActiveTexture_t glActiveTexture;
@@ -1598,6 +1605,9 @@ typedef void (GL_APIENTRY *glVertexBindingDivisor_t)(GLuint bindingindex, GLuint
   glVertexAttribIFormat_t glVertexAttribIFormat;
   glVertexAttribBinding_t glVertexAttribBinding;
   glVertexBindingDivisor_t glVertexBindingDivisor;
+  glBufferStorage_t glBufferStorage;
+  glMultiDrawElementsIndirect_t glMultiDrawElementsIndirect;
+  glDrawElementsInstancedBaseVertex_t glDrawElementsInstancedBaseVertex;
 
 
   void *get_proc_address(int &num_checked, int &num_ok, const char *name) {
@@ -1937,6 +1947,9 @@ typedef void (GL_APIENTRY *glVertexBindingDivisor_t)(GLuint bindingindex, GLuint
     glVertexAttribIFormat = (glVertexAttribIFormat_t)get_proc_address(num_checked, num_ok, "glVertexAttribIFormat");
     glVertexAttribBinding = (glVertexAttribBinding_t)get_proc_address(num_checked, num_ok, "glVertexAttribBinding");
     glVertexBindingDivisor = (glVertexBindingDivisor_t)get_proc_address(num_checked, num_ok, "glVertexBindingDivisor");
+    glBufferStorage = (glBufferStorage_t)get_proc_address(num_checked, num_ok, "glBufferStorage");
+    glMultiDrawElementsIndirect = (glMultiDrawElementsIndirect_t)get_proc_address(num_checked, num_ok, "glMultiDrawElementsIndirect");
+    glDrawElementsInstancedBaseVertex = (glDrawElementsInstancedBaseVertex_t)get_proc_address(num_checked, num_ok, "glDrawElementsInstancedBaseVertex");
 
     //printf("OpenGL 3.1: nc/ok=%d/%d\n", num_checked, num_ok); num_checked = num_ok = 0;
   }
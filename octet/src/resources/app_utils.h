@@ -85,6 +85,22 @@ namespace octet { namespace resources {
       return path;
     }
 
+    /// Get the path of a file in the cache directory, making the directory if needed.
+    /// Derived data such as compressed textures is kept here between runs.
+    static const char *get_cache_path(const char *name) {
+      string dir;
+      dir.format("%scache", prefix() ? prefix() : "");
+      #ifdef WIN32
+        _mkdir(dir.c_str());
+      #else
+        mkdir(dir.c_str(), 0777);
+      #endif
+
+      static string path;
+      path.format("%s/%s", dir.c_str(), name);
+      return path;
+    }
+
     /// Get a file into a buffer, given a URL.
     static void get_url(dynarray<unsigned char> &buffer, const char *url) {
       if (!strncmp(url, "zip://", 6)) {
@@ -69,6 +69,9 @@ namespace octet { namespace resources {
     float uscale;
     float vscale;
 
+    // where the page is in a texture atlas (u0, v0, u1, v1). not saved.
+    vec4 uv_rect;
+
     // transient info, built by update()
     const info *finfo;
     const common *fcommon;
@@ -89,8 +92,8 @@ private:
       vtx->x = (float)xdraw;
       vtx->y = (float)ydraw;
       vtx->z = 0;
-      vtx->u = x * uscale;
-      vtx->v = 1.0f - y * vscale;
+      vtx->u = uv_rect[0] + x * uscale * (uv_rect[2] - uv_rect[0]);
+      vtx->v = uv_rect[1] + (1.0f - y * vscale) * (uv_rect[3] - uv_rect[1]);
       vtx->color = color;
       return vtx + 1;
     }
@@ -249,6 +252,7 @@ private:
 
       uscale = 1.0f / page_width;
       vscale = 1.0f / page_height;
+      uv_rect = vec4(0, 0, 1, 1);
       if (fnt_file) {
         app_utils::get_url(font_info, fnt_file);
         update();
@@ -263,6 +267,12 @@ private:
       if (v.is_reader()) update();
     }
 
+    /// Use a page that has been packed into a texture atlas.
+    /// uv_rect is texture_atlas::get_uv_rect() for the page.
+    void set_uv_rect(const vec4 &value) {
+      uv_rect = value;
+    }
+
     /// Build a mesh by combining the string with the bitmap font info.
     unsigned build_mesh(const aabb &bb, vertex *vtx, uint32_t *idx, unsigned max_quads, const char *text, const char *max_text) {
       // defensive coding
@@ -36,4 +36,5 @@ OCTET_CLASS(scene, mesh_voxel_grid)
 #endif
 OCTET_CLASS(scene, mesh_points)
 OCTET_CLASS(scene, mesh_cylinder)
+OCTET_CLASS(scene, volume_texture)
 //OCTET_CLASS(scene, value)
@@ -6,23 +6,80 @@
 //
 // a gl_resource can be stored in a gl buffer or allocated memory
 //
+// Static vertex and index buffers that are read back, for bounding boxes, ray casts and
+// physics shapes, keep a copy of their bytes in CPU memory (the "shadow") so that later read
+// locks do not map the GL buffer and stall the pipeline. The shadow is made by the first read
+// lock, so buffers that are only drawn never have one. Writes go to the shadow and only the
+// bytes that changed are uploaded with glBufferSubData.
+//
+// Streaming buffers (allocate_stream) are for data rewritten every frame, such as particles
+// and text. Each write lock hands out the next region of a fenced gl_ring_buffer, so the CPU
+// writes straight into memory the GPU has finished with; the ring grows if the GPU falls behind.
+// Meshes draw from get_offset() in the GL buffer.
+//
 
 namespace octet { namespace resources {
   /// Wrapper for an OpenGL resource.
   class gl_resource : public resource {
-    #ifdef OCTET_GLES2
-      // in GLES2, we need to have a second buffer containing the data
-      dynarray<uint8_t> bytes;
-    #else
+    // CPU copy of the buffer. In GLES2 we cannot map buffers, so this is always kept.
+    mutable dynarray<uint8_t> bytes;
+
+    #ifndef OCTET_GLES2
       size_t size;
+
+      // true if bytes is a copy of the buffer.
+      mutable bool shadowed;
+
+      // true if the first read lock should make the shadow.
+      bool shadow_on_read;
     #endif
 
+    // range of bytes changed in the shadow but not yet uploaded.
+    mutable size_t dirty_begin;
+    mutable size_t dirty_end;
+
+    // true for buffers made with allocate_stream()
+    bool streaming;
+
+    #ifndef OCTET_GLES2
+      // streaming buffers write each new version to the next region of this ring
+      ref<gl_ring_buffer> stream;
+    #endif
+
+    // where the current version starts in the GL buffer
+    mutable size_t stream_offset;
+
     // This buffer object contains the bytes in GPU memory
     GLuint buffer;
 
     // GL_ARRAY_BUFFER etc.
     GLuint target;
 
+    #ifndef OCTET_GLES2
+      // read the GL buffer back once into the shadow.
+      void read_shadow() const {
+        bytes.resize(size);
+        if (buffer && size) {
+          glBindBuffer(target, buffer);
+          #ifdef __APPLE__
+            const void *src = glMapBuffer(target, GL_READ_ONLY);
+          #else
+            const void *src = glMapBufferRange(target, 0, size, GL_MAP_READ_BIT);
+          #endif
+          memcpy(bytes.data(), src, size);
+          glUnmapBuffer(target);
+        }
+        shadowed = true;
+      }
+
+      // start a new version of a streaming buffer and return where to write it.
+      void *lock_stream() const {
+        if (!stream->get_mapped()) return (void*)bytes.data();
+        stream_offset = stream->alloc(size);
+        return stream->get_mapped() + stream_offset;
+      }
+    #endif
+
   public:
     /// Helper class to make a write-only lock
     class wolock {
@@ -70,6 +127,14 @@ namespace octet { namespace resources {
     /// Make a new OpenGL Resource
     gl_resource(unsigned target=0, unsigned size=0) {
       buffer = 0;
+      #ifndef OCTET_GLES2
+        this->size = 0;
+        shadowed = false;
+        shadow_on_read = false;
+      #endif
+      dirty_begin = dirty_end = 0;
+      streaming = false;
+      stream_offset = 0;
       this->target = target;
       if (size) {
         allocate(target, size);
@@ -85,7 +150,9 @@ namespace octet { namespace resources {
     }
 
     /// Allocate a new OpenGL object.
-    void allocate(GLuint target, size_t size, GLuint kind = GL_STATIC_DRAW) {
+    /// Static vertex and index buffers get a CPU shadow copy on their first read lock; see set_shadowed().
+    /// Pass shadow = false for buffers that are never read back.
+    void allocate(GLuint target, size_t size, GLuint kind = GL_STATIC_DRAW, bool shadow = true) {
       reset();
       glGenBuffers(1, &buffer);
       glBindBuffer(target, buffer);
@@ -94,22 +161,107 @@ namespace octet { namespace resources {
         bytes.resize(size);
       #else
         this->size = size;
+        shadow_on_read = shadow && kind == GL_STATIC_DRAW && (target == GL_ARRAY_BUFFER || target == GL_ELEMENT_ARRAY_BUFFER);
       #endif
       this->target = target;
       glBindBuffer(target, 0);
     }
 
+    /// Allocate a streaming buffer of size bytes for data that is rewritten every frame.
+    /// Every write lock starts a new version of the contents; the old contents are not kept.
+    void allocate_stream(GLuint target, size_t size) {
+      #ifdef OCTET_GLES2
+        // GLES2 has no fences: orphan the buffer on every upload instead.
+        allocate(target, size, GL_STREAM_DRAW);
+      #else
+        reset();
+        this->target = target;
+        this->size = size;
+
+        // one region per version, three versions in flight.
+        size_t region = (size + 255) & ~(size_t)255;
+        stream = new gl_ring_buffer(target, region * 3);
+        stream->allocate();
+        if (!stream->get_mapped()) bytes.resize(size);
+      #endif
+      streaming = true;
+    }
+
     /// Clear the OpenGL object
     void reset() {
       if (buffer != 0) {
         glDeleteBuffers(1, &buffer);
       }
-      #ifdef OCTET_GLES2
-        bytes.reset();
+      bytes.reset();
+      #ifndef OCTET_GLES2
+        shadowed = false;
+        shadow_on_read = false;
+        stream = 0;
       #endif
+      dirty_begin = dirty_end = 0;
+      streaming = false;
+      stream_offset = 0;
       buffer = 0;
     }
 
+    /// true for buffers made with allocate_stream().
+    bool is_streaming() const {
+      return streaming;
+    }
+
+    /// where the current contents start in the GL buffer. Always zero except for streaming buffers.
+    size_t get_offset() const {
+      return stream_offset;
+    }
+
+    /// Keep (or drop) the CPU copy of the buffer.
+    /// Turn it off for data that is read back but should not stay in memory; read locks will
+    /// then map the GL buffer. Turning it on reads the buffer back once.
+    void set_shadowed(bool value) {
+      #ifndef OCTET_GLES2
+        if (streaming) return;
+        shadow_on_read = value;
+        if (value == shadowed) return;
+        if (value) {
+          read_shadow();
+        } else {
+          flush();
+          bytes.reset();
+          shadowed = false;
+        }
+      #endif
+    }
+
+    /// true if read locks come from a CPU copy rather than the GL buffer.
+    bool is_shadowed() const {
+      #ifdef OCTET_GLES2
+        return true;
+      #else
+        return shadowed;
+      #endif
+    }
+
+    /// note that bytes [offset, offset + size) of the shadow have changed.
+    /// Used with a read-write lock to upload less than the whole buffer on unlock.
+    void mark_dirty(size_t offset, size_t size) const {
+      if (!size) return;
+      if (dirty_begin == dirty_end) {
+        dirty_begin = offset;
+        dirty_end = offset + size;
+      } else {
+        dirty_begin = std::min(dirty_begin, offset);
+        dirty_end = std::max(dirty_end, offset + size);
+      }
+    }
+
+    /// upload the changed part of the shadow to the GL buffer.
+    void flush() const {
+      if (dirty_begin == dirty_end) return;
+      glBindBuffer(target, buffer);
+      glBufferSubData(target, dirty_begin, dirty_end - dirty_begin, bytes.data() + dirty_begin);
+      dirty_begin = dirty_end = 0;
+    }
+
     /// Destructor
     ~gl_resource() {
       reset();
@@ -131,6 +283,9 @@ namespace octet { namespace resources {
 
     /// get the GL buffer object we are wrapping.
     GLuint get_buffer() const {
+      #ifndef OCTET_GLES2
+        if (stream) return stream->get_buffer();
+      #endif
       return buffer;
     }
 
@@ -140,6 +295,9 @@ namespace octet { namespace resources {
       #ifdef OCTET_GLES2
         return (const void*)&bytes[0];
       #else
+        if (stream) return stream->get_mapped() ? (const void*)(stream->get_mapped() + stream_offset) : (const void*)bytes.data();
+        if (!shadowed && shadow_on_read) read_shadow();
+        if (shadowed) return (const void*)bytes.data();
         glBindBuffer(target, buffer);
         #ifdef __APPLE__
           // OSX does not support glMapBufferRange 
@@ -154,6 +312,7 @@ namespace octet { namespace resources {
     /// deprecated
     void unlock_read_only() const {
       #ifndef OCTET_GLES2
+        if (shadowed || stream) return;
         glBindBuffer(target, buffer);
         glUnmapBuffer(target);
       #endif
@@ -165,26 +324,41 @@ namespace octet { namespace resources {
       #ifdef OCTET_GLES2
         return (void*)&bytes[0];
       #else
+        if (shadowed) return (void*)bytes.data();
+        if (stream) return lock_stream();
         glBindBuffer(target, buffer);
         #ifdef __APPLE__
           // OSX does not support glMapBufferRange 
           void *res = glMapBuffer(target, GL_READ_WRITE);
           return res;
         #else
-          return glMapBufferRange(target, 0, size, GL_MAP_WRITE_BIT|GL_MAP_WRITE_BIT);
+          return glMapBufferRange(target, 0, size, GL_MAP_READ_BIT|GL_MAP_WRITE_BIT);
         #endif
       #endif
     }
 
-    /// release a read-write lock
+    /// release a read-write lock, uploading the range given to mark_dirty() or else everything.
     /// deprecated
     void unlock() const {
       #ifdef OCTET_GLES2
-        glBindBuffer(target, buffer);
-        glBufferSubData(target, 0, bytes.size(), &bytes[0]);
+        if (streaming) {
+          glBindBuffer(target, buffer);
+          glBufferData(target, bytes.size(), NULL, GL_STREAM_DRAW);
+        }
       #else
-        glUnmapBuffer(target);
+        if (stream) {
+          // without a persistent mapping, the data was written to bytes.
+          if (!stream->get_mapped()) stream_offset = stream->write(bytes.data(), size);
+          return;
+        }
+        if (!shadowed) {
+          glBindBuffer(target, buffer);
+          glUnmapBuffer(target);
+          return;
+        }
       #endif
+      if (dirty_begin == dirty_end) mark_dirty(0, bytes.size());
+      flush();
     }
 
     /// get a read-write lock on this buffer
@@ -193,6 +367,8 @@ namespace octet { namespace resources {
       #ifdef OCTET_GLES2
         return (void*)&bytes[0];
       #else
+        if (shadowed) return (void*)bytes.data();
+        if (stream) return lock_stream();
         glBindBuffer(target, buffer);
         #ifdef __APPLE__
           // OSX does not support glMapBufferRange 
@@ -203,28 +379,35 @@ namespace octet { namespace resources {
       #endif
     }
 
-    /// release a read-write lock
+    /// release a write-only lock
     /// deprecated
     void unlock_write_only() const {
-      #ifdef OCTET_GLES2
-        glBindBuffer(target, buffer);
-        glBufferSubData(target, 0, bytes.size(), &bytes[0]);
-      #else
-        glUnmapBuffer(target);
-      #endif
+      unlock();
     }
 
     /// bind the resource to the target
     void bind() const {
-      glBindBuffer(target, buffer);
+      glBindBuffer(target, get_buffer());
     }
 
-    /// copy data into the resource
+    /// copy data into the resource. Only these bytes are uploaded.
     void assign(const void *ptr, size_t offset, size_t size) {
       assert(offset + size <= this->get_size());
+      if (!size) return;
 
-      memcpy((void*)((char*)lock_write_only() + offset), ptr, size);
-      unlock_write_only();
+      if (streaming) {
+        // a new version of the whole buffer.
+        assert(offset == 0 && size == this->get_size());
+        memcpy(lock_write_only(), ptr, size);
+        unlock_write_only();
+      } else if (is_shadowed()) {
+        memcpy(bytes.data() + offset, ptr, size);
+        mark_dirty(offset, size);
+        flush();
+      } else {
+        glBindBuffer(target, buffer);
+        glBufferSubData(target, offset, size, ptr);
+      }
     }
 
     /// copy data from another gl resource.
@@ -0,0 +1,229 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// ring buffer for data written every frame
+//
+// The buffer is split into regions. When writing moves on to a new region, a fence is put
+// after the commands that used the old one, and we wait for the fence of the region we are
+// about to overwrite. With three regions the CPU can be a frame or two ahead of the GPU.
+//
+// If the GPU is still using the region we are about to overwrite, usually because a big
+// frame has wrapped the ring, the buffer is made twice as big instead of waiting, so the
+// ring settles at a size that holds a few frames. Past max_size we wait as before.
+//
+// Where glBufferStorage is available, the buffer stays mapped and writes are plain memcpys.
+// Otherwise we fall back to glBufferSubData and orphan the buffer when we wrap.
+//
+
+namespace octet { namespace resources {
+  /// Persistently mapped, fence guarded ring of GPU memory for per draw data.
+  class gl_ring_buffer : public resource {
+    enum { num_regions = 3, max_size = 0x4000000 };
+
+    GLuint buffer;
+    GLuint target;
+    size_t size;
+    size_t alignment;
+
+    // next free byte
+    size_t head;
+
+    // persistent mapping, or NULL when using glBufferSubData
+    uint8_t *mapped;
+
+    // one fence per region, set when we move on from it
+    GLsync fences[num_regions];
+
+    // changes when writing moves on to another region or the buffer is made again
+    unsigned generation;
+
+    size_t region_size() const {
+      return (size / num_regions) & ~(alignment - 1);
+    }
+
+    // does the context have ARB_buffer_storage (OpenGL 4.4)?
+    static bool gl_supports_buffer_storage() {
+      #ifdef OCTET_GLES2
+        return false;
+      #else
+        #ifdef WIN32
+          if (!glBufferStorage) return false;
+        #endif
+        const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+        const char *version = (const char *)glGetString(GL_VERSION);
+        if (extensions && strstr(extensions, "GL_ARB_buffer_storage")) return true;
+        return version && atof(version) >= 4.4;
+      #endif
+    }
+
+    // fence the region we are leaving and wait for the one we are entering.
+    // returns false, without waiting, if the GPU is still using it and the ring can grow.
+    bool next_region(unsigned from, unsigned to) {
+      #ifndef OCTET_GLES2
+        if (fences[from]) glDeleteSync(fences[from]);
+        fences[from] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        if (fences[to]) {
+          GLenum status = glClientWaitSync(fences[to], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+          if (status == GL_TIMEOUT_EXPIRED && size * 2 <= max_size) return false;
+
+          GLbitfield flags = 0;
+          for (;;) {
+            GLenum result = glClientWaitSync(fences[to], flags, 1000000);
+            if (result != GL_TIMEOUT_EXPIRED) break;
+            flags = 0;
+          }
+          glDeleteSync(fences[to]);
+          fences[to] = 0;
+        }
+      #endif
+      return true;
+    }
+
+  public:
+    /// make a ring for target (eg. GL_UNIFORM_BUFFER). GL memory is allocated on first use.
+    gl_ring_buffer(GLuint target = GL_UNIFORM_BUFFER, size_t size = 0x100000) {
+      buffer = 0;
+      this->target = target;
+      this->size = size;
+      alignment = 16;
+      head = 0;
+      mapped = 0;
+      generation = 0;
+      for (unsigned i = 0; i != num_regions; ++i) {
+        fences[i] = 0;
+      }
+    }
+
+    ~gl_ring_buffer() {
+      reset();
+    }
+
+    /// free the GL buffer and fences.
+    void reset() {
+      #ifndef OCTET_GLES2
+        for (unsigned i = 0; i != num_regions; ++i) {
+          if (fences[i]) glDeleteSync(fences[i]);
+          fences[i] = 0;
+        }
+        if (mapped) {
+          glBindBuffer(target, buffer);
+          glUnmapBuffer(target);
+          mapped = 0;
+        }
+      #endif
+      if (buffer) glDeleteBuffers(1, &buffer);
+      buffer = 0;
+      head = 0;
+      generation++;
+    }
+
+    /// create the GL buffer. Called by alloc() if needed.
+    void allocate() {
+      reset();
+      glGenBuffers(1, &buffer);
+      glBindBuffer(target, buffer);
+
+      #ifndef OCTET_GLES2
+        if (target == GL_UNIFORM_BUFFER) {
+          GLint value = 0;
+          glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &value);
+          alignment = value > 0 ? value : 256;
+        }
+
+        if (gl_supports_buffer_storage()) {
+          GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+          // streamed vertices and indices may be read back (slowly) by gl_resource read locks.
+          if (target != GL_UNIFORM_BUFFER) flags |= GL_MAP_READ_BIT;
+          glBufferStorage(target, size, NULL, flags);
+          mapped = (uint8_t*)glMapBufferRange(target, 0, size, flags);
+        }
+      #endif
+
+      if (!mapped) {
+        glBufferData(target, size, NULL, GL_STREAM_DRAW);
+      }
+      glBindBuffer(target, 0);
+    }
+
+    /// reserve bytes in the ring and return their offset in the buffer.
+    size_t alloc(size_t bytes) {
+      if (!buffer) allocate();
+
+      bytes = (bytes + alignment - 1) & ~(alignment - 1);
+      if (bytes > region_size()) {
+        while (bytes > region_size()) size *= 2;
+        allocate();
+      }
+
+      // the region of the last byte written, so that filling a region exactly still fences it.
+      size_t offset = head;
+      size_t rsize = region_size();
+      unsigned from = offset ? (unsigned)((offset - 1) / rsize) : 0;
+      if (from >= num_regions) from = num_regions - 1;
+      if (offset + bytes > (from + 1) * rsize) {
+        // start of the next region, wrapping at the end.
+        unsigned to = from + 1 == num_regions ? 0 : from + 1;
+        offset = to * rsize;
+        generation++;
+        if (mapped) {
+          if (!next_region(from, to)) {
+            // make a bigger buffer; the GPU keeps the old one until it has finished with it.
+            size *= 2;
+            allocate();
+            offset = 0;
+          }
+        } else if (to == 0) {
+          // let the driver give us fresh memory rather than wait.
+          glBindBuffer(target, buffer);
+          glBufferData(target, size, NULL, GL_STREAM_DRAW);
+        }
+      }
+      head = offset + bytes;
+      return offset;
+    }
+
+    /// copy data into the ring and return its offset in the buffer.
+    size_t write(const void *data, size_t bytes) {
+      size_t offset = alloc(bytes);
+      if (mapped) {
+        memcpy(mapped + offset, data, bytes);
+      } else {
+        glBindBuffer(target, buffer);
+        glBufferSubData(target, offset, bytes, data);
+      }
+      return offset;
+    }
+
+    /// bind part of the ring to an indexed binding point (eg. a uniform block binding).
+    void bind_range(GLuint index, size_t offset, size_t bytes) const {
+      #ifndef OCTET_GLES2
+        glBindBufferRange(target, index, buffer, offset, bytes);
+      #endif
+    }
+
+    /// data written since the generation last changed is still in the ring and can be bound again.
+    unsigned get_generation() const {
+      return generation;
+    }
+
+    /// the persistent mapping of the whole buffer, or NULL when using glBufferSubData.
+    uint8_t *get_mapped() const {
+      return mapped;
+    }
+
+    /// the GL buffer object.
+    GLuint get_buffer() const {
+      return buffer;
+    }
+
+    /// true if writes go straight to mapped memory.
+    bool is_persistent() const {
+      return mapped != 0;
+    }
+  };
+} }
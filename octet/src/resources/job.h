@@ -4,52 +4,173 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// work in progress
+// worker threads for spreading CPU work across cores
+//
+// Only the main thread owns the OpenGL context, so kernels run on workers
+// must not call GL or change ref<> counts shared with other threads.
+// Do the CPU work in parallel and the GL upload afterwards on the main thread.
+//
 
 namespace octet { namespace resources {
-  class job : public resource {
-    ref<job> next;
-
-    enum state_t {
-      state_waiting,
-      state_running,
+  /// A fixed pool of worker threads that run batches of independent work items.
+  ///
+  /// Example
+  ///
+  ///     dynarray<float> results(1000);
+  ///     parallel_for(0, results.size(), [&](unsigned i) {
+  ///       results[i] = expensive_function(i);
+  ///     });
+  class job_pool {
+    // a batch of work items [next, end) all running the same kernel.
+    struct batch_t {
+      void (*kernel)(void *context, unsigned index);
+      void *context;
+      std::atomic<unsigned> next;
+      unsigned end;
     };
 
-    state_t state;
+    std::vector<std::thread> workers;
+
+    // guards batch, generation, num_busy and quitting.
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    batch_t *batch;
+    unsigned generation;
+    unsigned num_busy;
+    bool quitting;
 
-    class scheduler {
-      job *waiting;
-      job *running;
-    public:
-      scheduler() {
-        waiting = 0;
-        running = 0;
+    // only one batch runs at a time. Calls from other threads while it runs are done serially.
+    std::mutex submit_mutex;
+
+    // true while this thread is running items of a batch, so nested calls run serially
+    // rather than trying to lock submit_mutex again.
+    static bool &in_batch() {
+      static thread_local bool value = false;
+      return value;
+    }
+
+    // claim work items until the batch is exhausted.
+    static void run_batch(batch_t *b) {
+      bool was_in_batch = in_batch();
+      in_batch() = true;
+      for (;;) {
+        unsigned index = b->next.fetch_add(1);
+        if (index >= b->end) break;
+        b->kernel(b->context, index);
       }
+      in_batch() = was_in_batch;
+    }
 
-      void add_to_waiting(job *jb) {
-        jb->next = waiting;
-        waiting = this;
+    void worker_loop() {
+      unsigned seen = 0;
+      for (;;) {
+        batch_t *b = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!quitting && generation == seen) {
+            work_ready.wait(lock);
+          }
+          if (quitting) return;
+          seen = generation;
+          b = batch;
+          if (!b) continue;
+          num_busy++;
+        }
+
+        run_batch(b);
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (--num_busy == 0) work_done.notify_all();
+        }
       }
-    };
+    }
+
+    template <class fn_t> static void call_kernel(void *context, unsigned index) {
+      (*(fn_t*)context)(index);
+    }
+
+    job_pool() {
+      batch = 0;
+      generation = 0;
+      num_busy = 0;
+      quitting = false;
 
-    scheduler *get_scheduler() {
-      static scheduler sch;
-      return &sch;
+      // the calling thread also does work, so leave one core for it.
+      unsigned num_cores = std::thread::hardware_concurrency();
+      unsigned num_workers = num_cores > 1 ? num_cores - 1 : 0;
+      for (unsigned i = 0; i != num_workers; ++i) {
+        workers.push_back(std::thread(&job_pool::worker_loop, this));
+      }
+    }
+
+    ~job_pool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quitting = true;
+      }
+      work_ready.notify_all();
+      for (unsigned i = 0; i != workers.size(); ++i) {
+        workers[i].join();
+      }
     }
+
   public:
-    job() {
-      scheduler *sch = get_scheduler();
-      sch->add_to_waiting(this);
+    /// Get the shared pool. Threads are started on first use.
+    static job_pool &get() {
+      static job_pool instance;
+      return instance;
     }
 
-    virtual ~job() {
+    /// Number of threads that work on a batch, including the caller.
+    unsigned get_num_threads() const {
+      return (unsigned)workers.size() + 1;
     }
 
-    virtual void kernel() = 0;
-    virtual bool is_ready() = 0;
+    /// Call fn(i) for every i in [begin, end), spread across the pool.
+    /// Returns when all items are complete. Items may run in any order.
+    template <class fn_t> void parallel_for(unsigned begin, unsigned end, fn_t fn) {
+      if (begin >= end) return;
+
+      // not worth waking the workers, called from inside a batch or another thread's batch is running.
+      if (workers.empty() || end - begin == 1 || in_batch() || !submit_mutex.try_lock()) {
+        for (unsigned i = begin; i != end; ++i) {
+          fn(i);
+        }
+        return;
+      }
 
-    state_t get_state() {
-      return state;
+      batch_t b;
+      b.kernel = &call_kernel<fn_t>;
+      b.context = (void*)&fn;
+      b.next = begin;
+      b.end = end;
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch = &b;
+        generation++;
+      }
+      work_ready.notify_all();
+
+      run_batch(&b);
+
+      // wait for workers still running the last items.
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (num_busy != 0) {
+          work_done.wait(lock);
+        }
+        batch = 0;
+      }
+
+      submit_mutex.unlock();
     }
   };
+
+  /// Call fn(i) for every i in [begin, end) using the shared job pool.
+  template <class fn_t> void parallel_for(unsigned begin, unsigned end, fn_t fn) {
+    job_pool::get().parallel_for(begin, end, fn);
+  }
 } }
@@ -27,6 +27,7 @@
   #include "../resources/http_writer.h"
   #include "../resources/resource.h"
   #include "../resources/resource_dict.h"
+  #include "../resources/gl_ring_buffer.h"
   #include "../resources/gl_resource.h"
   #include "../resources/bitmap_font.h"
   #include "../resources/mesh_builder.h"
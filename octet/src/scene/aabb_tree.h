@@ -0,0 +1,372 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// dynamic bounding volume hierarchy
+//
+// A binary tree of boxes that is updated a leaf at a time, so moving objects only cost
+// a remove and insert when they leave their (slightly enlarged) box.
+// Insertion walks down the tree choosing the child that grows the least surface area.
+//
+
+namespace octet { namespace scene {
+  /// Dynamic AABB tree for culling and picking.
+  ///
+  /// Each leaf holds a user index (eg. a mesh instance) and a "fat" box a little larger
+  /// than the object, so that small movements do not change the tree.
+  class aabb_tree {
+    struct node {
+      // bounds: w is unused
+      vec4 lo;
+      vec4 hi;
+
+      // parent index, or next free node when on the free list
+      int parent;
+
+      // children, or -1 for leaves
+      int child[2];
+
+      // user index for leaves
+      int user;
+    };
+
+    dynarray<node> nodes;
+    dynarray<int> stack;
+    int root;
+    int free_list;
+
+    // fat boxes are this fraction of the object's size larger on each side
+    float margin;
+
+    static float area(const vec4 &lo, const vec4 &hi) {
+      vec4 d = hi - lo;
+      return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+    }
+
+    static float union_area(const node &a, const node &b) {
+      return area(min(a.lo, b.lo), max(a.hi, b.hi));
+    }
+
+    bool is_leaf(int index) const {
+      return nodes[index].child[0] < 0;
+    }
+
+    int alloc_node() {
+      if (free_list < 0) {
+        nodes.push_back(node());
+        free_list = (int)nodes.size() - 1;
+        nodes[free_list].parent = -1;
+      }
+      int index = free_list;
+      free_list = nodes[index].parent;
+      node &n = nodes[index];
+      n.parent = -1;
+      n.child[0] = n.child[1] = -1;
+      n.user = -1;
+      return index;
+    }
+
+    void free_node(int index) {
+      nodes[index].parent = free_list;
+      nodes[index].child[0] = nodes[index].child[1] = -1;
+      nodes[index].user = -1;
+      free_list = index;
+    }
+
+    // make the boxes of index and its parents fit their children again.
+    void refit(int index) {
+      while (index >= 0) {
+        node &n = nodes[index];
+        const node &a = nodes[n.child[0]], &b = nodes[n.child[1]];
+        n.lo = min(a.lo, b.lo);
+        n.hi = max(a.hi, b.hi);
+        index = n.parent;
+      }
+    }
+
+    void insert_leaf(int leaf) {
+      if (root < 0) {
+        root = leaf;
+        nodes[leaf].parent = -1;
+        return;
+      }
+
+      // find the cheapest sibling by surface area heuristic.
+      const node &l = nodes[leaf];
+      int index = root;
+      while (!is_leaf(index)) {
+        const node &n = nodes[index];
+        float self_area = area(n.lo, n.hi);
+        float combined = union_area(n, l);
+
+        // cost of a new parent here, and the growth every level below would pay.
+        float cost = 2 * combined;
+        float inherited = 2 * (combined - self_area);
+
+        float child_cost[2];
+        for (int i = 0; i != 2; ++i) {
+          const node &c = nodes[n.child[i]];
+          float grown = union_area(c, l);
+          child_cost[i] = (is_leaf(n.child[i]) ? grown : grown - area(c.lo, c.hi)) + inherited;
+        }
+
+        if (cost < child_cost[0] && cost < child_cost[1]) break;
+        index = n.child[child_cost[0] <= child_cost[1] ? 0 : 1];
+      }
+
+      int sibling = index;
+      int old_parent = nodes[sibling].parent;
+      int new_parent = alloc_node();
+      node &p = nodes[new_parent];
+      p.parent = old_parent;
+      p.child[0] = sibling;
+      p.child[1] = leaf;
+      nodes[sibling].parent = new_parent;
+      nodes[leaf].parent = new_parent;
+
+      if (old_parent < 0) {
+        root = new_parent;
+      } else {
+        node &op = nodes[old_parent];
+        op.child[op.child[0] == sibling ? 0 : 1] = new_parent;
+      }
+      refit(new_parent);
+    }
+
+    void remove_leaf(int leaf) {
+      if (leaf == root) {
+        root = -1;
+        return;
+      }
+
+      int parent = nodes[leaf].parent;
+      int grand_parent = nodes[parent].parent;
+      int sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+
+      if (grand_parent < 0) {
+        root = sibling;
+        nodes[sibling].parent = -1;
+      } else {
+        node &gp = nodes[grand_parent];
+        gp.child[gp.child[0] == parent ? 0 : 1] = sibling;
+        nodes[sibling].parent = grand_parent;
+        refit(grand_parent);
+      }
+      free_node(parent);
+    }
+
+    // slab test: entry distance of start + dir * t into a node, false if it misses before t_max.
+    static bool ray_box(const node &n, const vec4 &org, const vec4 &inv_dir, float t_max, float &t_enter) {
+      vec4 t0 = (n.lo - org) * inv_dir;
+      vec4 t1 = (n.hi - org) * inv_dir;
+      vec4 tmin = t0.min(t1), tmax = t0.max(t1);
+      float enter = std::max(std::max(tmin.x(), tmin.y()), std::max(tmin.z(), 0.0f));
+      float exit = std::min(std::min(tmax.x(), tmax.y()), std::min(tmax.z(), t_max));
+      t_enter = enter;
+      return enter <= exit;
+    }
+
+    void set_fat_box(int leaf, const aabb &bb) {
+      vec3 c = bb.get_center();
+      vec3 h = bb.get_half_extent() * (1 + margin) + vec3(1e-4f, 1e-4f, 1e-4f);
+      nodes[leaf].lo = (c - h).xyz1();
+      nodes[leaf].hi = (c + h).xyz1();
+    }
+
+  public:
+    /// margin is how much bigger than the object each leaf box is, as a fraction of its size.
+    aabb_tree(float margin = 0.1f) {
+      root = -1;
+      free_list = -1;
+      this->margin = margin;
+    }
+
+    /// remove everything.
+    void reset() {
+      nodes.reset();
+      root = -1;
+      free_list = -1;
+    }
+
+    /// add a box with a user index. returns a proxy for move and remove.
+    int insert(const aabb &bb, int user) {
+      int leaf = alloc_node();
+      nodes[leaf].user = user;
+      set_fat_box(leaf, bb);
+      insert_leaf(leaf);
+      return leaf;
+    }
+
+    /// remove a box added with insert.
+    void remove(int proxy) {
+      remove_leaf(proxy);
+      free_node(proxy);
+    }
+
+    /// update the box of a proxy. returns true if the tree had to change.
+    bool move(int proxy, const aabb &bb) {
+      const node &n = nodes[proxy];
+      vec4 lo = bb.get_min().xyz1(), hi = bb.get_max().xyz1();
+      if (all(lo >= n.lo) && all(hi <= n.hi)) {
+        return false;
+      }
+      remove_leaf(proxy);
+      set_fat_box(proxy, bb);
+      insert_leaf(proxy);
+      return true;
+    }
+
+    /// user index of a proxy.
+    int get_user(int proxy) const {
+      return nodes[proxy].user;
+    }
+
+    /// the enlarged box stored for a proxy.
+    aabb get_fat_aabb(int proxy) const {
+      vec3 lo = nodes[proxy].lo.xyz(), hi = nodes[proxy].hi.xyz();
+      return aabb((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+    }
+
+    /// call fn(user) for every box that may be inside the frustum.
+    /// once a box is wholly inside, its children are not tested.
+    template <class Fn> void query(const frustum &f, Fn fn) {
+      if (root < 0) return;
+      stack.resize(0);
+      stack.push_back(root * 2);
+      while (!stack.empty()) {
+        int entry = stack.back();
+        stack.pop_back();
+        int index = entry >> 1;
+        bool inside = (entry & 1) != 0;
+        const node &n = nodes[index];
+
+        if (!inside) {
+          vec3 lo = n.lo.xyz(), hi = n.hi.xyz();
+          int result = f.classify(aabb((lo + hi) * 0.5f, (hi - lo) * 0.5f));
+          if (result == frustum::outside) continue;
+          inside = result == frustum::inside;
+        }
+
+        if (n.child[0] < 0) {
+          fn(n.user);
+        } else {
+          stack.push_back(n.child[0] * 2 + inside);
+          stack.push_back(n.child[1] * 2 + inside);
+        }
+      }
+    }
+
+    /// call fn(user, t_max) for every box hit by start + dir * t for 0 <= t <= t_max, nearest boxes first.
+    /// fn may reduce t_max (eg. to the nearest hit so far) to skip boxes further away.
+    template <class Fn> void query(const vec3 &start, const vec3 &dir, float t_max, Fn fn) const {
+      if (root < 0) return;
+      vec4 org = start.xyz1();
+      vec4 inv_dir(
+        1.0f / (fabsf(dir.x()) > 1e-30f ? dir.x() : 1e-30f),
+        1.0f / (fabsf(dir.y()) > 1e-30f ? dir.y() : 1e-30f),
+        1.0f / (fabsf(dir.z()) > 1e-30f ? dir.z() : 1e-30f),
+        0
+      );
+
+      // entries are a node and its entry distance; far children are pushed first.
+      struct entry { int index; float t; };
+      dynarray<entry> ray_stack;
+      float t_enter;
+      if (!ray_box(nodes[root], org, inv_dir, t_max, t_enter)) return;
+      entry e = { root, t_enter };
+      ray_stack.push_back(e);
+      while (!ray_stack.empty()) {
+        entry top = ray_stack.back();
+        ray_stack.pop_back();
+        if (top.t > t_max) continue;
+
+        const node &n = nodes[top.index];
+        if (n.child[0] < 0) {
+          fn(n.user, t_max);
+          continue;
+        }
+
+        float t0, t1;
+        bool hit0 = ray_box(nodes[n.child[0]], org, inv_dir, t_max, t0);
+        bool hit1 = ray_box(nodes[n.child[1]], org, inv_dir, t_max, t1);
+        entry c0 = { n.child[0], t0 }, c1 = { n.child[1], t1 };
+        if (hit0 && hit1) {
+          ray_stack.push_back(t0 <= t1 ? c1 : c0);
+          ray_stack.push_back(t0 <= t1 ? c0 : c1);
+        } else if (hit0) {
+          ray_stack.push_back(c0);
+        } else if (hit1) {
+          ray_stack.push_back(c1);
+        }
+      }
+    }
+
+    /// call fn(user, mask) for every box hit by the lanes of a packet, where mask is the lanes that hit it.
+    /// fn may reduce packet.t_max or clear bits of packet.active to stop lanes early.
+    /// Boxes are visited nearest first for the first lane that hits both children.
+    template <class Fn> void query(ray_packet &packet, Fn fn) const {
+      if (root < 0) return;
+      struct entry { int index; unsigned mask; };
+      dynarray<entry> ray_stack;
+      vec4 t_enter;
+      unsigned mask = packet.intersects(nodes[root].lo, nodes[root].hi, packet.active, t_enter);
+      if (!mask) return;
+      entry e = { root, mask };
+      ray_stack.push_back(e);
+      while (!ray_stack.empty()) {
+        entry top = ray_stack.back();
+        ray_stack.pop_back();
+
+        // lanes may have finished or shortened since the box was tested.
+        const node &n = nodes[top.index];
+        top.mask = packet.intersects(n.lo, n.hi, top.mask & packet.active, t_enter);
+        if (!top.mask) continue;
+
+        if (n.child[0] < 0) {
+          fn(n.user, top.mask);
+          continue;
+        }
+
+        vec4 t0, t1;
+        unsigned m0 = packet.intersects(nodes[n.child[0]].lo, nodes[n.child[0]].hi, top.mask, t0);
+        unsigned m1 = packet.intersects(nodes[n.child[1]].lo, nodes[n.child[1]].hi, top.mask, t1);
+        bool near0 = true;
+        unsigned both = m0 & m1;
+        if (both) {
+          unsigned l = 0;
+          while (!(both & (1 << l))) ++l;
+          near0 = t0[l] <= t1[l];
+        }
+        entry c0 = { n.child[0], m0 }, c1 = { n.child[1], m1 };
+        if (near0) {
+          if (m1) ray_stack.push_back(c1);
+          if (m0) ray_stack.push_back(c0);
+        } else {
+          if (m0) ray_stack.push_back(c0);
+          if (m1) ray_stack.push_back(c1);
+        }
+      }
+    }
+
+    /// call fn(user) for every box that overlaps bb.
+    template <class Fn> void query(const aabb &bb, Fn fn) {
+      if (root < 0) return;
+      vec4 lo = bb.get_min().xyz1(), hi = bb.get_max().xyz1();
+      stack.resize(0);
+      stack.push_back(root);
+      while (!stack.empty()) {
+        const node &n = nodes[stack.back()];
+        stack.pop_back();
+        if (any(n.hi < lo) || any(n.lo > hi)) continue;
+        if (n.child[0] < 0) {
+          fn(n.user);
+        } else {
+          stack.push_back(n.child[0]);
+          stack.push_back(n.child[1]);
+        }
+      }
+    }
+  };
+}}
@@ -31,6 +31,13 @@ namespace octet { namespace scene {
     uint8_t mip_levels;
     uint8_t cube_faces;
 
+    // how to make mip levels
+    mipmap_generator::filter_t mip_filter;
+    bool srgb;
+
+    // compress to BC1/BC3 on upload when GL supports it
+    bool block_compress;
+
     // derived attributes (not for saving)
     // todo: use gl_resource
     GLuint gl_texture;
@@ -47,6 +54,63 @@ namespace octet { namespace scene {
       mip_levels = 1;
       cube_faces = is_cubemap ? 6 : 1;
       format = 0;
+      mip_filter = mipmap_generator::filter_box;
+      srgb = true;
+      block_compress = false;
+    }
+
+    // header of a compressed image in the cache
+    struct dxt_cache_header {
+      char magic[4];
+      uint32_t version;
+      uint64_t key;
+      uint32_t format;
+      uint32_t width;
+      uint32_t height;
+      uint32_t mip_levels;
+      uint32_t size;
+    };
+
+    bool load_dxt_cache(const char *path, uint64_t key) {
+      FILE *file = fopen(path, "rb");
+      if (!file) return false;
+
+      dxt_cache_header header;
+      bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+        !memcmp(header.magic, "ODXT", 4) && header.version == dxt_encoder::version && header.key == key &&
+        header.width == width && header.height == height && header.mip_levels == mip_levels;
+
+      dynarray<uint8_t> result;
+      if (ok) {
+        result.resize(header.size);
+        ok = header.size && fread(&result[0], 1, header.size, file) == header.size;
+      }
+      fclose(file);
+
+      if (ok) {
+        bytes.resize(result.size());
+        memcpy(&bytes[0], &result[0], result.size());
+        format = (uint16_t)header.format;
+      }
+      return ok;
+    }
+
+    void save_dxt_cache(const char *path, uint64_t key) {
+      FILE *file = fopen(path, "wb");
+      if (!file) return;
+
+      dxt_cache_header header;
+      memcpy(header.magic, "ODXT", 4);
+      header.version = dxt_encoder::version;
+      header.key = key;
+      header.format = format;
+      header.width = width;
+      header.height = height;
+      header.mip_levels = mip_levels;
+      header.size = bytes.size();
+      fwrite(&header, sizeof(header), 1, file);
+      fwrite(&bytes[0], 1, bytes.size(), file);
+      fclose(file);
     }
 
     // these are here to avoid including glext.h which may be platform dependent.
@@ -62,168 +126,92 @@ namespace octet { namespace scene {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      NUM_COMPRESSED_TEXTURE_FORMATS = 0x86A2,
+      COMPRESSED_TEXTURE_FORMATS = 0x86A3,
     };
 
-    /// Make mipmaps for this image.
+    /// does the GL implementation have the extension for this compressed format?
+    static bool gl_supports_format(unsigned format) {
+      const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+      if (!extensions) extensions = "";
+
+      switch (format) {
+        case dds_decoder::COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case dds_decoder::COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        case dds_decoder::COMPRESSED_RGBA_S3TC_DXT3_EXT:
+        case dds_decoder::COMPRESSED_RGBA_S3TC_DXT5_EXT:
+          if (strstr(extensions, "texture_compression_s3tc")) return true;
+          break;
+        case dds_decoder::COMPRESSED_RED_RGTC1:
+        case dds_decoder::COMPRESSED_SIGNED_RED_RGTC1:
+        case dds_decoder::COMPRESSED_RG_RGTC2:
+        case dds_decoder::COMPRESSED_SIGNED_RG_RGTC2:
+          if (strstr(extensions, "texture_compression_rgtc")) return true;
+          break;
+        case dds_decoder::COMPRESSED_RGBA_BPTC_UNORM:
+          if (strstr(extensions, "texture_compression_bptc")) return true;
+          break;
+      }
+
+      // some implementations only list the formats.
+      GLint num_formats = 0;
+      glGetIntegerv(NUM_COMPRESSED_TEXTURE_FORMATS, &num_formats);
+      dynarray<GLint> formats(num_formats);
+      if (num_formats) glGetIntegerv(COMPRESSED_TEXTURE_FORMATS, &formats[0]);
+      for (GLint i = 0; i != num_formats; ++i) {
+        if ((unsigned)formats[i] == format) return true;
+      }
+      return false;
+    }
+
+    /// Make the full mip chain for this image, down to 1x1.
+    /// mip_levels becomes the number of levels including level 0.
     void make_mipmaps() {
       if (format != RGB && format != RGBA) return;
+      if (gl_target != GL_TEXTURE_2D || mip_levels != 1) return;
 
-      bytes.resize(bytes.size() * 4 / 3);
-
-      unsigned num_comps = format == RGB ? 3 : 4;
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &bytes[width * height * num_comps];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      mip_levels = 0;
-      while (w > 1 && h > 1) {
-        for (unsigned y = 0; y < h/2; ++y) {
-          for (unsigned x = 0; x < w/2; ++x) {
-            // this is a rather dreadful box filter, it is simple to make, but introduces
-            // artifacts. We can do better than this.
-            for (unsigned i = 0; i != num_comps; ++i) {
-              *dest++ = ( src[0] + src[num_comps] + src[stride] + src[stride+num_comps] + 3 ) >> 2;
-              src++;
-            }
-            src += num_comps;
-          }
-          src += stride;
-        }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        mip_levels++;
-      }
-      assert(dest - &bytes[0] < (int)bytes.size());
-      //printf("%d %d\n", dest - &bytes[0], bytes.size());
+      mipmap_generator generator(mip_filter, srgb);
+      mip_levels = (uint8_t)generator.generate(bytes, width, height, format == RGB ? 3 : 4);
     }
 
-    /// DXT encode the image, making it smaller and grainier.
-    /// Todo: do standard error-diffusion and other improvements.
+    /// Block compress the image and its mips to BC1, or BC3 if it has alpha.
+    /// The result is cached on disk keyed by the pixels, so only the first load pays.
     void dxt_encode() {
       if (format != RGB && format != RGBA) return;
+      if (gl_target != GL_TEXTURE_2D || bytes.size() == 0) return;
 
       unsigned num_comps = format == RGB ? 3 : 4;
-      dynarray<uint8_t> result;
-      result.resize(bytes.size() / num_comps);
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &result[0];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      unsigned new_mip_levels = 0;
-      while (w > 4 && h > 4 && new_mip_levels < mip_levels) {
-        for (unsigned y = 0; y < h/4; ++y) {
-          log("w=%d y=%d src=%08x\n", w, y, src - &bytes[0]);
-          for (unsigned x = 0; x < w/4; ++x) {
-            // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
-            vec4 tot(0, 0, 0, 0);
-            vec4 colours[16];
-            for (unsigned j = 0; j != 4; ++j) {
-              for (unsigned i = 0; i != 4; ++i) {
-                //vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), (num_comps == 4 ? src[3] * (1.0f/255) : 1.0f));
-                vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), 1.0f);
-                colours[i+j*4] = colour;
-                tot += colour;
-                src += num_comps;
-              }
-              src += ( w - 4 ) * num_comps;
-            }
-            src -= ( w - 1 ) * 4 * num_comps;
-
-            // calculate the covariance matrix
-            vec4 mean = tot * 0.0625f;
-            mat4t covariance(0);
-            for (unsigned i = 0; i != 16; ++i) {
-              vec4 colour = colours[i] -= mean;
-              covariance += outer(colour, colour);
-            }
-
-            // power method to find largest eigenvector (axis)
-            vec4 axis = covariance.trace();
-            for (unsigned i = 0; i != 4; ++i) {
-              axis = axis * covariance;
-            }
-            float len = axis.length();
-            if (abs(len) >= 0.001f) axis = axis / len;
-            //if (y == 27) log("%s %s %s\n", mean.toString(), axis.toString(), covariance.toString(tmp, sizeof(tmp)));
-
-            // our colours all have to live on the axis.
-            // in practice, we can ignore "odd man out" colours
-            // for better compression. But for now, do all the colours.
-            float pmin = dot(colours[0], axis);
-            float pmax = pmin;
-            float projs[16];
-            projs[0] = pmin;
-            for (unsigned i = 1; i != 16; ++i) {
-              float proj = dot(colours[i], axis);
-              projs[i] = proj;
-              pmin = pmin < proj ? pmin : proj;
-              pmax = pmax > proj ? pmax : proj;
-            }
-            vec4 cmin = mean + axis * pmin;
-            vec4 cmax = mean + axis * pmax;
-            //if (y == 27) log("%s -> %s\n", cmin.toString(), cmax.toString(tmp, sizeof(tmp)));
-            cmin = min(max(cmin, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-            cmax = min(max(cmax, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-
-            unsigned c0 =
-              ( (unsigned)(cmin.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmin.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmin.z() * 31.999f) << 0 )
-            ;
-            unsigned c1 =
-              ( (unsigned)(cmax.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmax.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmax.z() * 31.999f) << 0 )
-            ;
-
-            if (c0 < c1) {
-              unsigned t = c0; c0 = c1; c1 = t;
-              float p = pmin; pmin = pmax; pmax = p;
-            }
-
-            float pscale = abs(pmax - pmin) > 0.001f ? 3.999f / (pmax - pmin) : 0;
-            uint8_t pal[16];
-            for (unsigned i = 0; i != 16; ++i) {
-              pal[i] = (unsigned)( ( projs[i] - pmin ) * pscale );
-            }
-
-            dest[0] = ( c0 >> 0 ) & 0xff;
-            dest[1] = ( c0 >> 8 ) & 0xff;
-            dest[2] = ( c1 >> 0 ) & 0xff;
-            dest[3] = ( c1 >> 8 ) & 0xff;
-            for (int i = 0; i != 4; ++i) {
-              dest[i+4] = pal[i*4+0] + pal[i*4+1] * 4 + pal[i*4+2] * 16 + pal[i*4+3] * 64;
-            }
-            dest += 8;
-          }
-          src += stride * 3;
-        }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        new_mip_levels++;
+      uint64_t seed = width | ((uint64_t)height << 16) | ((uint64_t)num_comps << 32) | ((uint64_t)mip_levels << 40) | ((uint64_t)dxt_encoder::version << 48);
+      uint64_t key = dxt_encoder::get_key(&bytes[0], bytes.size(), seed);
+
+      char name[32];
+      sprintf(name, "%016llx.dxt", (unsigned long long)key);
+      const char *path = app_utils::get_cache_path(name);
+      if (load_dxt_cache(path, key)) {
+        return;
       }
-      assert(dest - &result[0] < (int)result.size());
-      bytes.resize((int)(dest - &result[0]));
-      memcpy(&bytes[0], &result[0], dest - &result[0]);
-      format = COMPRESSED_RGB_S3TC_DXT1_EXT;
-      mip_levels = new_mip_levels;
+
+      dxt_encoder encoder;
+      dynarray<uint8_t> result;
+      format = (uint16_t)encoder.encode(result, &bytes[0], width, height, num_comps, mip_levels);
+      bytes.resize(result.size());
+      memcpy(&bytes[0], &result[0], result.size());
+      save_dxt_cache(path, key);
     }
 
     void add_texture() {
       glBindTexture(gl_target, gl_texture);
 
+      // RGB rows of odd widths are not four byte aligned.
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
       if (mip_levels == 1 || gl_target != GL_TEXTURE_2D) {
         if (gl_target == GL_TEXTURE_2D) {
           glTexImage2D(gl_target, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
           // this may not work on very old systems, comment it out.
           glGenerateMipmap(gl_target);
         } else if (gl_target == GL_TEXTURE_3D) {
-          glTexImage3D(gl_target, 0, format, width, height, 1, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
-          printf("err=%08x\n", glGetError());
+          glTexImage3D(gl_target, 0, format, width, height, depth, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
         } else if (gl_target == GL_TEXTURE_CUBE_MAP) {
           unsigned num_comps = format == RGBA ? 4 : 3;
           for (int i = 0; i != 6; ++i) {
@@ -239,14 +227,15 @@ namespace octet { namespace scene {
         unsigned w = width;
         unsigned h = height;
         uint8_t *src = &bytes[0];
-        unsigned level = 0;
-        while (w != 0 && h != 0) {
-          glTexImage2D(gl_target, level++, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
+        for (unsigned level = 0; level != mip_levels; ++level) {
+          glTexImage2D(gl_target, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
           src += w * h * num_comps;
-          w >>= 1;
-          h >>= 1;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
         }
       }
+
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
     }
 
   public:
@@ -264,6 +253,7 @@ namespace octet { namespace scene {
 
     /// generate an image from an opengl texture
     image(GLuint _target, GLuint _texture, unsigned _width, unsigned _height, unsigned _depth=1) {
+      init("");
       gl_target = _target;
       gl_texture = _texture;
       width = _width;
@@ -295,6 +285,42 @@ namespace octet { namespace scene {
       return gl_target;
     }
 
+    /// GL_RGB, GL_RGBA or a block compressed format
+    unsigned get_format() const {
+      return format;
+    }
+
+    /// pixels of all levels, loading the image if needed.
+    const dynarray<uint8_t> &get_bytes() {
+      if (bytes.size() == 0 && !gl_texture) {
+        load();
+      }
+      return bytes;
+    }
+
+    /// number of mip levels in bytes, including level 0.
+    unsigned get_mip_levels() const {
+      return mip_levels;
+    }
+
+    /// choose the filter for generated mip levels: mipmap_generator::filter_box (default)
+    /// or mipmap_generator::filter_kaiser. Call before the image is loaded.
+    void set_mip_filter(mipmap_generator::filter_t value) {
+      mip_filter = value;
+    }
+
+    /// colour images are sRGB and are filtered in linear light.
+    /// set this to false for normal maps, masks and other data before loading.
+    void set_srgb(bool value) {
+      srgb = value;
+    }
+
+    /// set this to true before loading to BC1/BC3 compress a colour texture on upload when GL supports S3TC.
+    /// Compression is lossy, keeps its results in a cache directory and stops reload() working.
+    void set_block_compress(bool value) {
+      block_compress = value;
+    }
+
     /// animated textures have multiple frames. eg. MPEG file. return ~0 for infinite.
     unsigned get_frames() const {
       return frames;
@@ -314,6 +340,7 @@ namespace octet { namespace scene {
     /// load the image from a url
     void load() {
       string x;
+      mip_levels = 1;
       if (cube_faces == 6) {
         bytes.resize(0);
         x.format(url, "left");
@@ -332,6 +359,8 @@ namespace octet { namespace scene {
         bytes.resize(0);
         load_part(url.c_str());
       }
+
+      make_mipmaps();
     }
 
     void load_part(const char *_url) {
@@ -339,7 +368,7 @@ namespace octet { namespace scene {
       app_utils::get_url(buffer, _url);
       const unsigned char *src = &buffer[0];
       const unsigned char *src_max = src + buffer.size();
-      if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
+      if (buffer.size() >= 6 && (!memcmp(&buffer[0], "GIF89a", 6) || !memcmp(&buffer[0], "GIF87a", 6))) {
         gif_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
       } else if (buffer.size() >= 6 && buffer[0] == 0xff && buffer[1] == 0xd8) {
@@ -348,9 +377,12 @@ namespace octet { namespace scene {
       } else if (buffer.size() >= 6 && buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 2) {
         tga_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
+      } else if (buffer.size() >= 8 && !memcmp(&buffer[0], "\x89PNG\r\n\x1a\n", 8)) {
+        png_decoder dec;
+        dec.get_image(bytes, format, width, height, src, src_max);
       } else if (buffer.size() >= 4 && buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' ') {
         dds_decoder dec;
-        dec.get_image(bytes, format, width, height, src, src_max);
+        dec.get_image(bytes, format, width, height, mip_levels, src, src_max);
       } else if (buffer.size() >= 348 && (!memcmp(&buffer[344], "ni1", 4) || !memcmp(&buffer[344], "n+1", 4))) {
         nifti_decoder dec;
         gl_target = GL_TEXTURE_3D;
@@ -360,7 +392,6 @@ namespace octet { namespace scene {
         return;
       }
 
-      make_mipmaps();
       //dxt_encode();
     }
 
@@ -375,27 +406,47 @@ namespace octet { namespace scene {
         glGenTextures(1, &gl_texture);
         glActiveTexture(GL_TEXTURE0);
 
-        // todo: handle compressed textures
+        // block compressed textures stay compressed unless GL can't take them.
+        if (dds_decoder::get_block_bytes(format) && !gl_supports_format(format)) {
+          dynarray<uint8_t> pixels;
+          if (dds_decoder::decompress(pixels, format, width, height, &bytes[0])) {
+            bytes.resize(pixels.size());
+            memcpy(&bytes[0], &pixels[0], pixels.size());
+            format = RGBA;
+            mip_levels = 1;
+          } else {
+            printf("warning: compressed texture format %04x not supported\n", format);
+          }
+        }
+
+        // compress colour textures when GL can draw them. mip levels are compressed too.
+        if (block_compress && (format == RGB || format == RGBA) && gl_target == GL_TEXTURE_2D &&
+          gl_supports_format(dxt_encoder::COMPRESSED_RGB_S3TC_DXT1_EXT) &&
+          gl_supports_format(dxt_encoder::COMPRESSED_RGBA_S3TC_DXT5_EXT)
+        ) {
+          dxt_encode();
+        }
+
         if (format == GL_RGB || format == GL_RGBA) {
           add_texture();
-        } else if (format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+        } else if (dds_decoder::get_block_bytes(format)) {
+          // upload every mip level we have.
           glBindTexture(gl_target, gl_texture);
           unsigned w = width;
           unsigned h = height;
           uint8_t *src = &bytes[0];
+          uint8_t *src_max = src + bytes.size();
           unsigned level = 0;
-          unsigned shift = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 1 : 0;
-          while (w != 0 && h != 0) {
-            unsigned wmin = w < 4 ? 4 : w;
-            unsigned hmin = h < 4 ? 4 : h;
-            unsigned size = ( wmin * hmin ) >> shift;
-            glCompressedTexImage2D(gl_target, level++, format, w, h, 0, size, (void*)src);
-            //printf("%d\n", glGetError());
+          for (; level != mip_levels; ++level) {
+            unsigned size = dds_decoder::get_level_size(format, w, h);
+            if (src + size > src_max) break;
+            glCompressedTexImage2D(gl_target, level, format, w, h, 0, size, (void*)src);
             src += size;
-            w >>= 1;
-            h >>= 1;
+            w = w > 1 ? w >> 1 : 1;
+            h = h > 1 ? h >> 1 : 1;
           }
-          //printf("%d %d\n", src - image_, size);
+          // a partial mip chain is incomplete without this.
+          glTexParameteri(gl_target, GL_TEXTURE_MAX_LEVEL, level ? level - 1 : 0);
         }
 
         glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -409,9 +460,13 @@ namespace octet { namespace scene {
       return gl_target;
     }
 
-    /// fast reload once get_gl_target has been called.
+    /// fast reload once get_gl_target has been called. Not for block compressed textures.
     void reload(GLuint format, GLuint type, void *pixels) {
       if (gl_target == 0) return;
+      if (dds_decoder::get_block_bytes(this->format)) {
+        printf("warning: can't reload a block compressed texture\n");
+        return;
+      }
 
       glBindTexture(gl_target, gl_texture);
       glTexSubImage2D(gl_target, 0, 0, 0, width, height, format, type, pixels);
@@ -0,0 +1,88 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// choice of level of detail by screen space error
+//
+// Each level has an error in model units (see mesh_simplifier). Its error on the screen is
+// that times the pixels covered by one model unit where it is drawn. The coarsest level whose
+// screen error is under the limit is drawn.
+//
+// Switching to a coarser level needs the error to be a fraction (hysteresis) under the limit,
+// so a camera sitting near a switching distance does not flicker between two levels.
+//
+
+namespace octet { namespace scene {
+  /// The levels of detail of one object, finest first, and the level that is being drawn.
+  class lod_group : public resource {
+    // model space error of each level, increasing
+    dynarray<float> errors;
+
+    // largest error allowed on the screen in pixels
+    float pixel_error;
+
+    // fraction under pixel_error needed to move to a coarser level
+    float hysteresis;
+
+    // level drawn last
+    unsigned level;
+
+  public:
+    lod_group(float pixel_error = 1.0f, float hysteresis = 0.25f) {
+      this->pixel_error = pixel_error;
+      this->hysteresis = hysteresis;
+      level = 0;
+    }
+
+    /// add a coarser level with this error in model units.
+    unsigned add_level(float error) {
+      errors.push_back(error);
+      return errors.size() - 1;
+    }
+
+    /// choose the level for pixels_per_unit (screen pixels covered by one model unit).
+    /// Calling this again with the same value gives the same level.
+    unsigned select(float pixels_per_unit) {
+      unsigned num_levels = errors.size();
+      float coarser_limit = pixel_error * (1.0f - hysteresis);
+      while (level + 1 < num_levels && errors[level + 1] * pixels_per_unit <= coarser_limit) {
+        level++;
+      }
+      while (level > 0 && errors[level] * pixels_per_unit > pixel_error) {
+        level--;
+      }
+      return level;
+    }
+
+    /// level chosen by the last select()
+    unsigned get_level() const {
+      return level;
+    }
+
+    unsigned get_num_levels() const {
+      return errors.size();
+    }
+
+    float get_error(unsigned index) const {
+      return errors[index];
+    }
+
+    float get_pixel_error() const {
+      return pixel_error;
+    }
+
+    void set_pixel_error(float value) {
+      pixel_error = value;
+    }
+
+    float get_hysteresis() const {
+      return hysteresis;
+    }
+
+    void set_hysteresis(float value) {
+      hysteresis = value;
+    }
+  };
+}}
@@ -24,15 +24,32 @@ namespace octet { namespace scene {
     //dynarray<uint8_t> static_buffer;
     dynarray<uint8_t> buffer;
 
+    // drawn after opaque materials, back to front
+    bool translucent;
+
+    // 1 if the shader can read matrices from attribute_instance, -1 until checked
+    int instancing;
+
+    // buffer object for the static uniform block, uploaded when the static params change
+    ref<gl_resource> static_uniforms;
+    bool static_dirty;
+
+    // the dynamic block as last written to the uniform ring, bound again while it is unchanged
+    dynarray<uint8_t> dynamic_copy;
+    size_t dynamic_offset;
+    unsigned dynamic_generation;
+
     // create the parameters that change frequently such as the matrices and lighting
     void create_dynamic_params() {
       buffer.reserve(0x200);
-      param_buffer_info dynamic_pbi(buffer);
+      param_buffer_info dynamic_pbi(buffer, 0);
 
       params.push_back(new param_uniform(dynamic_pbi, NULL, atom_modelToProjection, GL_FLOAT_MAT4, 1, param::stage_vertex));
       params.push_back(new param_uniform(dynamic_pbi, NULL, atom_modelToCamera, GL_FLOAT_MAT4, 1, param::stage_vertex));
       params.push_back(new param_uniform(dynamic_pbi, NULL, atom_lighting, GL_FLOAT_VEC4, ambient_size + max_lights * light_size, param::stage_fragment));
       params.push_back(new param_uniform(dynamic_pbi, NULL, atom_num_lights, GL_INT, 1, param::stage_fragment));
+      params.push_back(new param_uniform(dynamic_pbi, NULL, atom_cameraToProjection, GL_FLOAT_MAT4, 1, param::stage_vertex));
+      params.push_back(new param_uniform(dynamic_pbi, NULL, atom_instanced, GL_INT, 1, param::stage_vertex));
     }
 
     // create the attribute parameters
@@ -42,6 +59,102 @@ namespace octet { namespace scene {
       params.push_back(new param_attribute(atom_normal, GL_FLOAT_VEC3));
     }
 
+    // per draw uniform blocks of every material go in one ring buffer.
+    static gl_ring_buffer &get_uniform_ring() {
+      static gl_ring_buffer ring(GL_UNIFORM_BUFFER);
+      return ring;
+    }
+
+    // write the dynamic uniform block to the ring if it has changed and bind it.
+    void bind_dynamic_block() {
+      #ifndef OCTET_GLES2
+        unsigned size = custom_shader ? custom_shader->get_block_size(param_shader::dynamic_block) : 0;
+        if (!size) return;
+
+        unsigned start = custom_shader->get_block_start(param_shader::dynamic_block);
+        if (buffer.size() < start + size) buffer.resize(start + size);
+
+        // eg. instanced batches and repeated draws of the same object share one copy.
+        gl_ring_buffer &ring = get_uniform_ring();
+        const uint8_t *block = buffer.data() + start;
+        if (dynamic_generation != ring.get_generation() || dynamic_copy.size() != size || memcmp(dynamic_copy.data(), block, size)) {
+          dynamic_offset = ring.write(block, size);
+          dynamic_generation = ring.get_generation();
+          dynamic_copy.resize(size);
+          memcpy(dynamic_copy.data(), block, size);
+        }
+        ring.bind_range(param_shader::dynamic_block, dynamic_offset, size);
+      #endif
+    }
+
+    // upload the static uniform block if it has changed and bind it.
+    void bind_static_block() {
+      #ifndef OCTET_GLES2
+        unsigned size = custom_shader ? custom_shader->get_block_size(param_shader::static_block) : 0;
+        if (!size) return;
+
+        unsigned start = custom_shader->get_block_start(param_shader::static_block);
+        if (buffer.size() < start + size) buffer.resize(start + size);
+
+        if (!static_uniforms || static_uniforms->get_size() != size) {
+          static_uniforms = new gl_resource();
+          static_uniforms->allocate(GL_UNIFORM_BUFFER, size, GL_DYNAMIC_DRAW);
+          static_dirty = true;
+        }
+        if (static_dirty) {
+          static_uniforms->assign(buffer.data() + start, 0, size);
+          static_dirty = false;
+        }
+        glBindBufferBase(GL_UNIFORM_BUFFER, param_shader::static_block, static_uniforms->get_buffer());
+      #endif
+    }
+
+    // set the program, the uniform blocks and any uniforms not in blocks.
+    void render_params(const mat4t &modelToProjection, const mat4t &modelToCamera, const mat4t &cameraToProjection, int32_t instanced, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      /*char tmp[256];
+      log("lu[0] = %s\n", light_uniforms[0].toString(tmp, sizeof(tmp)));
+      log("lu[1] = %s\n", light_uniforms[1].toString(tmp, sizeof(tmp)));
+      log("lu[2] = %s\n", light_uniforms[2].toString(tmp, sizeof(tmp)));
+      log("lu[3] = %s\n", light_uniforms[3].toString(tmp, sizeof(tmp)));*/
+      {
+        // matrices and lighting go in the dynamic uniform buffer
+        param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
+        if (modelToProjection_param) modelToProjection_param->set_value(buffer.data(), modelToProjection.get(), sizeof(modelToProjection));
+
+        param_uniform *modelToCamera_param = get_param_uniform(atom_modelToCamera);
+        if (modelToCamera_param) modelToCamera_param->set_value(buffer.data(), modelToCamera.get(), sizeof(modelToCamera));
+
+        param_uniform *lighting_param = get_param_uniform(atom_lighting);
+        if (lighting_param) lighting_param->set_value(buffer.data(), light_uniforms, sizeof(vec4) * num_light_uniforms);
+
+        param_uniform *num_lights_param = get_param_uniform(atom_num_lights);
+        if (num_lights_param) num_lights_param->set_value(buffer.data(), &num_lights, sizeof(int32_t));
+
+        param_uniform *cameraToProjection_param = get_param_uniform(atom_cameraToProjection);
+        if (cameraToProjection_param) cameraToProjection_param->set_value(buffer.data(), cameraToProjection.get(), sizeof(cameraToProjection));
+
+        param_uniform *instanced_param = get_param_uniform(atom_instanced);
+        if (instanced_param) instanced_param->set_value(buffer.data(), &instanced, sizeof(int32_t));
+      }
+
+      custom_shader->render();
+
+      // parameters in uniform blocks have no location, so the loop below skips them.
+      bind_dynamic_block();
+      bind_static_block();
+
+      {
+        // colours and textures go in the static uniform buffer
+        for (unsigned i = 0; i != params.size(); ++i) {
+          param_uniform *pu = params[i]->get_param_uniform();
+          if (pu) {
+            //printf("%s: %d off=%x\n", app_utils::get_atom_name(pu->get_name()), pu->get_uniform_buffer_index(), pu->get_offset());
+            pu->render(buffer.data());
+          }
+        }
+      }
+    }
+
   public:
     RESOURCE_META(material)
 
@@ -53,6 +166,11 @@ namespace octet { namespace scene {
 
     /// Default constructor makes a blank material.
     material() {
+      translucent = false;
+      instancing = -1;
+      static_dirty = true;
+      dynamic_offset = 0;
+      dynamic_generation = ~0u;
     }
 
     /// Alternative constructor.
@@ -60,6 +178,11 @@ namespace octet { namespace scene {
       // materials are constructed from parameters which build the final shader.
       // this allows us to use OpenGLES2 (uniforms) and 3 (buffers) as well as new shader features.
       params.reserve(16);
+      translucent = false;
+      instancing = -1;
+      static_dirty = true;
+      dynamic_offset = 0;
+      dynamic_generation = ~0u;
 
       create_dynamic_params();
       create_attribute_params();
@@ -79,6 +202,11 @@ namespace octet { namespace scene {
       if (!smpl) smpl = new sampler();
 
       params.reserve(16);
+      translucent = false;
+      instancing = -1;
+      static_dirty = true;
+      dynamic_offset = 0;
+      dynamic_generation = ~0u;
 
       create_dynamic_params();
       create_attribute_params();
@@ -94,6 +222,11 @@ namespace octet { namespace scene {
     }
 
     material(param *diffuse, param *ambient, param *emission, param *specular, param *bump, param *shininess) {
+      translucent = false;
+      instancing = -1;
+      static_dirty = true;
+      dynamic_offset = 0;
+      dynamic_generation = ~0u;
     }
 
     /// Serialize.
@@ -102,38 +235,62 @@ namespace octet { namespace scene {
 
     /// Set the uniforms for this material.
     void render(const mat4t &modelToProjection, const mat4t &modelToCamera, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
-      /*char tmp[256];
-      log("lu[0] = %s\n", light_uniforms[0].toString(tmp, sizeof(tmp)));
-      log("lu[1] = %s\n", light_uniforms[1].toString(tmp, sizeof(tmp)));
-      log("lu[2] = %s\n", light_uniforms[2].toString(tmp, sizeof(tmp)));
-      log("lu[3] = %s\n", light_uniforms[3].toString(tmp, sizeof(tmp)));*/
-      {
-        // matrices and lighting go in the dynamic uniform buffer
-        param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
-        if (modelToProjection_param) modelToProjection_param->set_value(buffer.data(), modelToProjection.get(), sizeof(modelToProjection));
-
-        param_uniform *modelToCamera_param = get_param_uniform(atom_modelToCamera);
-        if (modelToCamera_param) modelToCamera_param->set_value(buffer.data(), modelToCamera.get(), sizeof(modelToCamera));
+      render_params(modelToProjection, modelToCamera, modelToProjection, 0, light_uniforms, num_light_uniforms, num_lights);
+    }
 
-        param_uniform *lighting_param = get_param_uniform(atom_lighting);
-        if (lighting_param) lighting_param->set_value(buffer.data(), light_uniforms, sizeof(vec4) * num_light_uniforms);
+    /// Set only the matrices, for another instance drawn straight after render() with this material.
+    /// The program and the other uniforms are still set from the last call.
+    void render_instance(const mat4t &modelToProjection, const mat4t &modelToCamera) {
+      param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
+      if (modelToProjection_param) {
+        modelToProjection_param->set_value(buffer.data(), modelToProjection.get(), sizeof(modelToProjection));
+        modelToProjection_param->render(buffer.data());
+      }
 
-        param_uniform *num_lights_param = get_param_uniform(atom_num_lights);
-        if (num_lights_param) num_lights_param->set_value(buffer.data(), &num_lights, sizeof(int32_t));
+      param_uniform *modelToCamera_param = get_param_uniform(atom_modelToCamera);
+      if (modelToCamera_param) {
+        modelToCamera_param->set_value(buffer.data(), modelToCamera.get(), sizeof(modelToCamera));
+        modelToCamera_param->render(buffer.data());
       }
 
-      custom_shader->render();
+      bind_dynamic_block();
+    }
 
-      {
-        // colours and textures go in the static uniform buffer
-        for (unsigned i = 0; i != params.size(); ++i) {
-          param_uniform *pu = params[i]->get_param_uniform();
-          if (pu) {
-            //printf("%s: %d off=%x\n", app_utils::get_atom_name(pu->get_name()), pu->get_uniform_buffer_index(), pu->get_offset());
-            pu->render(buffer.data());
-          }
-        }
+    /// Set the uniforms for a batch of instances drawn with glDrawElementsInstanced.
+    /// The model to camera matrices come from attribute_instance, one per instance.
+    void render_instanced(const mat4t &cameraToProjection, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      mat4t identity;
+      identity.loadIdentity();
+      render_params(cameraToProjection, identity, cameraToProjection, 1, light_uniforms, num_light_uniforms, num_lights);
+    }
+
+    /// true if the shader has the instanced path of shaders/default.vs.
+    bool supports_instancing() {
+      if (instancing < 0) {
+        param_uniform *cameraToProjection_param = get_param_uniform(atom_cameraToProjection);
+        param_uniform *instanced_param = get_param_uniform(atom_instanced);
+        instancing =
+          custom_shader && cameraToProjection_param && instanced_param &&
+          (custom_shader->get_block_size(param_shader::dynamic_block) || (cameraToProjection_param->get_uniform() >= 0 && instanced_param->get_uniform() >= 0)) &&
+          glGetAttribLocation(custom_shader->get_program(), "instance_modelToCamera") == attribute_instance
+        ;
       }
+      return instancing != 0;
+    }
+
+    /// the shader program, for sorting draws by shader.
+    GLuint get_program() const {
+      return custom_shader ? custom_shader->get_program() : 0;
+    }
+
+    /// translucent materials are drawn after opaque ones, furthest first.
+    bool is_translucent() const {
+      return translucent;
+    }
+
+    /// mark the material as translucent.
+    void set_translucent(bool value) {
+      translucent = value;
     }
 
     /// Set the uniforms for this material on skinned meshes.
@@ -162,11 +319,13 @@ namespace octet { namespace scene {
     void set_diffuse(const vec4 &color) {
       if (param *p = get_param_uniform(atom_diffuse)) {
         p->get_param_uniform()->set_value(buffer.data(), &color, sizeof(color));
+        static_dirty = true;
       }
     }
 
     void set_uniform(param_uniform *param, const void *data, size_t size) {
       memcpy(buffer.data() + param->get_offset(), data, size);
+      static_dirty = true;
     }
 
     dynarray<ref<param> > &get_params() {
@@ -177,7 +336,7 @@ namespace octet { namespace scene {
       param_buffer_info pbi(buffer);
       param_uniform *result = new param_uniform(pbi, data, name, _type, _repeat, _stage);
       params.push_back(result);
-
+
       param_bind_info pbind;
       pbind.program = custom_shader->get_program();
       result->bind(pbind);
@@ -189,7 +348,7 @@ namespace octet { namespace scene {
       pbi.texture_slot = texture_slot;
       param_sampler *result = new param_sampler(pbi, name, _image, _sampler, _stage);
       params.push_back(result);
-
+
       param_bind_info pbind;
       pbind.program = custom_shader->get_program();
       result->bind(pbind);
@@ -57,6 +57,35 @@ namespace octet { namespace scene {
     // bounding box
     aabb mesh_aabb;
 
+    // vertex array object holding the attribute setup, rebuilt when the layout or buffers change
+    GLuint vao;
+    GLuint vao_vertices;
+    GLuint vao_indices;
+    size_t vao_vertex_offset;
+    bool vao_dirty;
+
+    // triangle tree for ray casts, rebuilt like the vertex array object
+    ref<mesh_bvh> bvh;
+    GLuint bvh_vertices;
+    GLuint bvh_indices;
+    bool bvh_dirty;
+
+    // set the attribute pointers for the current vertex buffer.
+    void set_attribute_pointers() const {
+      vertices->bind();
+
+      unsigned n = normalized;
+      for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
+        unsigned size = get_size(slot);
+        unsigned kind = get_kind(slot);
+        unsigned attr = get_attr(slot);
+        size_t offset = get_offset(slot) + vertices->get_offset();
+        glVertexAttribPointer(attr, size, kind, n & 1, get_stride(), (void*)(offset));
+        glEnableVertexAttribArray(attr);
+        n >>= 1;
+      }
+    }
+
     struct general_vertex {
       const uint8_t *bytes;
       unsigned size;
@@ -150,10 +179,12 @@ namespace octet { namespace scene {
 
     /// make a new, empty, mesh.
     mesh(skin *_skin=0) {
+      vao = 0;
       init(_skin, 0, 0);
     }
 
     mesh(unsigned num_vertices, unsigned num_indices) {
+      vao = 0;
       init(0, num_vertices, num_indices);
     }
 
@@ -177,6 +208,10 @@ namespace octet { namespace scene {
       mode = rhs.mode;
 
       mesh_skin = rhs.mesh_skin;
+
+      vao = 0;
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     /// Init function used for aggregated meshes.
@@ -199,6 +234,8 @@ namespace octet { namespace scene {
       mode = GL_TRIANGLES;
 
       mesh_skin = _skin;
+      vao_dirty = true;
+      bvh_dirty = true;
 
       if (max_vertices || max_indices) {
         set_default_attributes();
@@ -221,10 +258,15 @@ namespace octet { namespace scene {
       v.visit(num_slots, atom_num_slots);
       v.visit(mesh_skin, atom_mesh_skin);
       v.visit(mesh_aabb, atom_aabb);
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     // Destructor
     ~mesh() {
+      #ifndef OCTET_GLES2
+        if (vao) glDeleteVertexArrays(1, &vao);
+      #endif
     }
 
     /// Set the defuault mesh parameters, used for boxes, spheres etc.
@@ -238,6 +280,8 @@ namespace octet { namespace scene {
     /// reset the mesh to empty.
     void clear_attributes() {
       num_slots = 0;
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     /// Add an extra attribute to the mesh. eg. add_attribute(attribute_pos, 3, GL_FLOAT, 0)
@@ -245,6 +289,8 @@ namespace octet { namespace scene {
       assert(num_slots < max_slots);
       format[num_slots] = (offset << 9) + (attr << 5) + ((size-1) << 3) + (kind - GL_BYTE);
       if (norm) normalized |= 1 << num_slots;
+      vao_dirty = true;
+      bvh_dirty = true;
       return num_slots++;
     }
 
@@ -372,6 +418,12 @@ namespace octet { namespace scene {
       return false;
     }
 
+    /// return true if rhs has the same vertex attributes and stride as this mesh.
+    bool same_layout(const mesh &rhs) const {
+      if (stride != rhs.stride || num_slots != rhs.num_slots || normalized != rhs.normalized) return false;
+      return memcmp(format, rhs.format, num_slots * sizeof(format[0])) == 0;
+    }
+
     #ifdef OCTET_BULLET
       /// Get a bullet shape object for this mesh
       virtual btCollisionShape *get_bullet_shape() {
@@ -433,10 +485,20 @@ namespace octet { namespace scene {
       indices->allocate(GL_ELEMENT_ARRAY_BUFFER, isize);
     }
 
+    /// Allocate streaming VBO and IBO objects for geometry that is rebuilt every frame.
+    /// Lock them for writing each time; see gl_resource::allocate_stream.
+    void allocate_stream(size_t vsize, size_t isize) {
+      vertices->allocate_stream(GL_ARRAY_BUFFER, vsize);
+      indices->allocate_stream(GL_ELEMENT_ARRAY_BUFFER, isize);
+      vao_dirty = true;
+      bvh_dirty = true;
+    }
+
     /// allocate and assign data to IBO and VBO
     void assign(size_t vsize, size_t isize, uint8_t *vsrc, uint8_t *isrc) {
       vertices->assign(vsrc, 0, vsize);
       indices->assign(isrc, 0, isize);
+      bvh_dirty = true;
     }
 
     /// set standard parameters of the mesh together.
@@ -446,6 +508,8 @@ namespace octet { namespace scene {
       num_vertices = (uint32_t)num_vertices_;
       mode = mode_;
       index_type = index_type_;
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     /// dump the mesh to a file in ASCII. Used to debug mesh transforms.
@@ -474,19 +538,32 @@ namespace octet { namespace scene {
 
     /// When rendering a mesh, call this first to enable the attributes.
     /// assume the shader, uniforms and render params are already set up.
-    void enable_attributes() const {
-      vertices->bind();
-
-      unsigned n = normalized;
-      for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
-        unsigned size = get_size(slot);
-        unsigned kind = get_kind(slot);
-        unsigned attr = get_attr(slot);
-        unsigned offset = get_offset(slot);
-        glVertexAttribPointer(attr, size, kind, n & 1, get_stride(), (void*)(offset));
-        glEnableVertexAttribArray(attr);
-        n >>= 1;
-      }
+    /// On OpenGL the attribute setup is recorded once in a vertex array object.
+    void enable_attributes() {
+      #ifdef OCTET_GLES2
+        set_attribute_pointers();
+      #else
+        // allocate() on a buffer makes a new GL buffer, so check the names as well.
+        // streaming buffers move to a new region each time they are written.
+        GLuint vbuf = vertices ? vertices->get_buffer() : 0;
+        GLuint ibuf = indices ? indices->get_buffer() : 0;
+        size_t voffset = vertices ? vertices->get_offset() : 0;
+        if (!vao || vao_dirty || vbuf != vao_vertices || ibuf != vao_indices || voffset != vao_vertex_offset) {
+          if (!vao) glGenVertexArrays(1, &vao);
+          glBindVertexArray(vao);
+          for (unsigned attr = 0; attr != max_slots; ++attr) {
+            glDisableVertexAttribArray(attr);
+          }
+          set_attribute_pointers();
+          if (indices) indices->bind();
+          vao_vertices = vbuf;
+          vao_indices = ibuf;
+          vao_vertex_offset = voffset;
+          vao_dirty = false;
+        } else {
+          glBindVertexArray(vao);
+        }
+      #endif
     }
 
     /// When rendering a mesh, call this next to draw the primitives.
@@ -494,18 +571,34 @@ namespace octet { namespace scene {
       //printf("de %04x %d %d\n", get_mode(), get_num_vertices(), get_index_type());
       if (get_index_type()) {
         indices->bind();
-        glDrawElements(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index));
+        glDrawElements(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index + indices->get_offset()));
       } else {
         glDrawArrays(get_mode(), 0, get_num_vertices());
       }
     }
 
+    #ifndef OCTET_GLES2
+      /// Draw count copies of the primitives. Per instance attributes are set up by the caller.
+      void draw_instanced(unsigned count) {
+        if (get_index_type()) {
+          indices->bind();
+          glDrawElementsInstanced(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index + indices->get_offset()), count);
+        } else {
+          glDrawArraysInstanced(get_mode(), 0, get_num_vertices(), count);
+        }
+      }
+    #endif
+
     /// When rendering a mesh, call this last to disable attributes.
     void disable_attributes() {
-      for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
-        unsigned attr = get_attr(slot);
-        glDisableVertexAttribArray(attr);
-      }
+      #ifdef OCTET_GLES2
+        for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
+          unsigned attr = get_attr(slot);
+          glDisableVertexAttribArray(attr);
+        }
+      #else
+        glBindVertexArray(0);
+      #endif
     }
 
     /// render in one pass.
@@ -531,94 +624,116 @@ namespace octet { namespace scene {
       for (unsigned i = 1; i < num_vertices; ++i) {
         vec3 pos = get_value(vtx_lock.u8(), slot, i).xyz();
         vmin = min(pos, vmin);
-        vmax = max(pos, vmin);
+        vmax = max(pos, vmax);
       }
       mesh_aabb = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
     }
 
-    /// *very* slow ray cast.
-    /// returns "barycentric" coordinates.
-    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
-    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
-    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+    /// Copy the positions and triangle indices of the mesh. Returns false unless it has
+    /// float positions and is drawn as GL_TRIANGLES.
+    bool get_triangles(dynarray<vec4> &positions, dynarray<uint32_t> &tri_indices) {
+      positions.resize(0);
+      tri_indices.resize(0);
+
       unsigned pos_slot = get_slot(attribute_pos);
-      if (get_index_type() != GL_UNSIGNED_INT) return false;
-      if (get_size(pos_slot) < 3) return false;
-      if (get_kind(pos_slot) != GL_FLOAT) return false;
+      if (pos_slot == ~0u || get_kind(pos_slot) != GL_FLOAT || get_size(pos_slot) < 3 || mode != GL_TRIANGLES) {
+        return false;
+      }
 
-      vec3 org = the_ray.get_start();
-      vec3 dir = the_ray.get_distance();
-      //log("ray_cast: org=%s dir=%s\n", org.toString(), dir.toString());
+      unsigned count = index_type ? num_indices : num_vertices;
+      tri_indices.resize(count - count % 3);
+      unsigned max_vertices = stride ? (unsigned)(vertices->get_size() / stride) : 0;
+      unsigned used_vertices = 0;
+      if (index_type) {
+        gl_resource::rolock idx_lock(indices);
+        for (unsigned i = 0; i != tri_indices.size(); ++i) {
+          unsigned index = get_index(idx_lock.u8(), i);
+          tri_indices[i] = index;
+          if (index >= used_vertices) used_vertices = index + 1;
+        }
+      } else {
+        for (unsigned i = 0; i != tri_indices.size(); ++i) {
+          tri_indices[i] = i;
+        }
+        used_vertices = tri_indices.size();
+      }
 
-      unsigned pos_offset = get_offset(pos_slot);
-      gl_resource::rolock idx_lock(get_indices());
-      gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *idx = idx_lock.u32() + first_index;
-      const uint8_t *vtx = vtx_lock.u8();
+      if (used_vertices > max_vertices) {
+        tri_indices.resize(0);
+        return false;
+      }
 
-      float best_denom = 0;
-      vec4 best_numer(0, 0, 0, 0);
-      for (unsigned i = 0; i != get_num_indices(); i += 3) {
-        vec3 a = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+0]) - org;
-        vec3 b = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+1]) - org;
-        vec3 c = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+2]) - org;
-        vec3 d = dir;
-
-        // solve [ba, bb, bc, bd] * [[ax, ay, az, 1], [bx, by, bz, 1], [cx, cy, cz, 1], [-dx, -dy, -dz, 0]] = [0, 0, 0, 1]
-        //
-        // ie. ba + bb + bc = 1  and  ba * a + bb * b + bc * c = bd * d
-        //
-        // [ba, bb, bc] are barycentric coordinates, bd is the distance along the vector
-
-        // The last line of the inverse matrix is the solution (vector triple products)
-
-        // numerator
-        vec4 numer(
-          dot(cross(b, c), d),
-          dot(cross(c, a), d),
-          dot(cross(a, b), d),
-          dot(cross(a, b), c)
-        );
-
-        // denominator
-        float denom = numer[0] + numer[1] + numer[2];
-
-        //log("a=%s b=%s c=%s d=%s denom=%f\n", a.toString(), b.toString(), c.toString(), d.toString(), denom);
-        //log("numer=%s\n", numer.toString());
-        //log("res=%s\n", (numer / denom).toString());
-
-        // using a multiply lets us check the sign without using a divide.
-        vec4 bary2 = numer * denom;
-
-        if (all(bary2 >= vec4(0, 0, 0, 0))) {
-          rational best_distance(best_numer[3], best_denom);
-          rational new_distance(numer[3], denom);
-          /*printf(
-            "t%d %9.3f %d %d %d  %s %s %s\n",
-            i, numer[3]/denom, idx[i+0], idx[i+1], idx[i+2],
-            (numer/denom).toString(), best_distance.toString(), new_distance.toString()
-          );*/
-
-          unsigned further = new_distance > best_distance;
-          if (!further) {
-            indices[0] = idx[i+0];
-            indices[1] = idx[i+1];
-            indices[2] = idx[i+2];
-            best_numer = numer;
-            best_denom = denom;
-          }
+      positions.resize(used_vertices);
+      if (used_vertices) {
+        unsigned offset = get_offset(pos_slot);
+        gl_resource::rolock vtx_lock(vertices);
+        for (unsigned i = 0; i != used_vertices; ++i) {
+          const float *src = (const float*)(vtx_lock.u8() + i * stride + offset);
+          positions[i] = vec4(src[0], src[1], src[2], 1);
         }
       }
+      return true;
+    }
+
+    /// Triangle BVH of the mesh for ray casts. Built on first use and again when the layout or
+    /// buffers change. Call invalidate_bvh() after writing to the vertices through a lock.
+    mesh_bvh *get_bvh() {
+      // streamed geometry changes without the mesh knowing, so it is always rebuilt.
+      GLuint vbuf = vertices ? vertices->get_buffer() : 0;
+      GLuint ibuf = indices ? indices->get_buffer() : 0;
+      bool streamed = (vertices && vertices->is_streaming()) || (indices && indices->is_streaming());
+      if (!bvh || bvh_dirty || streamed || vbuf != bvh_vertices || ibuf != bvh_indices) {
+        dynarray<vec4> positions;
+        dynarray<uint32_t> tri_indices;
+        if (!bvh) bvh = new mesh_bvh();
+        get_triangles(positions, tri_indices);
+        bvh->build(positions.data(), tri_indices.data(), tri_indices.size() / 3);
+        bvh_vertices = vbuf;
+        bvh_indices = ibuf;
+        bvh_dirty = false;
+      }
+      return bvh;
+    }
 
-      if (fabsf(best_denom) < 1e-6f) {
+    /// rebuild the BVH on the next ray cast.
+    void invalidate_bvh() {
+      bvh_dirty = true;
+    }
+
+    /// ray cast using the triangle BVH.
+    /// returns "barycentric" coordinates of the nearest hit as bary_numer / bary_denom.
+    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
+    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
+    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+      vec3 org = the_ray.get_start();
+      vec3 dir = the_ray.get_distance();
+      mesh_bvh::hit hit;
+      mesh_bvh *tree = get_bvh();
+      if (!tree->intersect(org, dir, 1e37f, hit)) {
         bary_numer = vec4(0, 0, 0, 0);
         bary_denom = 0;
         return false;
-      } else {
-        bary_numer = best_numer;
-        bary_denom = best_denom;
-        return true;
       }
+
+      tree->get_triangle(hit.triangle, indices);
+
+      // solve ba + bb + bc = 1  and  ba * a + bb * b + bc * c = bd * d for the hit triangle.
+      // [ba, bb, bc] are barycentric coordinates, bd is the distance along the vector.
+      // The numerators are vector triple products and their sum is the denominator.
+      unsigned pos_offset = get_offset(get_slot(attribute_pos));
+      gl_resource::rolock vtx_lock(get_vertices());
+      const uint8_t *vtx = vtx_lock.u8();
+      vec3 a = (vec3)*(const vec3p*)(vtx + pos_offset + stride * indices[0]) - org;
+      vec3 b = (vec3)*(const vec3p*)(vtx + pos_offset + stride * indices[1]) - org;
+      vec3 c = (vec3)*(const vec3p*)(vtx + pos_offset + stride * indices[2]) - org;
+      bary_numer = vec4(
+        dot(cross(b, c), dir),
+        dot(cross(c, a), dir),
+        dot(cross(a, b), dir),
+        dot(cross(a, b), c)
+      );
+      bary_denom = bary_numer[0] + bary_numer[1] + bary_numer[2];
+      return true;
     }
 
     /// access the vertex buffer (VBO) or memory buffer
@@ -634,6 +749,8 @@ namespace octet { namespace scene {
     /// set a new VBO object
     void set_vertices(gl_resource *value) {
       vertices = value;
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     /// assign a vector to the vertex buffer and set params
@@ -645,11 +762,15 @@ namespace octet { namespace scene {
       vertices->assign(rhs.data(), 0, rhs.size() * sizeof(elem_t));
       stride = sizeof(elem_t);
       set_num_vertices(rhs.size());
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     /// set a new IBO object
     void set_indices(gl_resource *value) {
       indices = value;
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     /// assign a vector to the index buffer and set params
@@ -662,6 +783,8 @@ namespace octet { namespace scene {
       set_index_type(sizeof(elem_t) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT);
       set_num_indices(rhs.size());
       set_first_index(0);
+      vao_dirty = true;
+      bvh_dirty = true;
     }
 
     /// Get all the edges in a hash map to avoid duplicates.
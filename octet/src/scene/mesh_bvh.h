@@ -0,0 +1,383 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// bounding volume hierarchy of a mesh's triangles for ray casting
+//
+// The tree is built top down with a binned surface area heuristic: the triangle centres
+// of a node are sorted into bins along each axis and the split with the smallest
+// (area * count) of the two halves is chosen.
+//
+// Leaves hold up to four triangles stored structure-of-arrays in vec4s, so a ray is
+// tested against all four with one pass of vector arithmetic.
+//
+
+namespace octet { namespace scene {
+  /// Triangle BVH in model space. Built from copies of the positions, so ray casts do not touch GL.
+  class mesh_bvh : public resource {
+  public:
+    /// closest (or any) hit of a ray cast.
+    struct hit {
+      /// triangle number (index in the index buffer / 3)
+      int triangle;
+
+      /// hit = start + dir * t
+      float t;
+
+      /// hit = pos0 * (1 - u - v) + pos1 * u + pos2 * v
+      float u;
+      float v;
+    };
+
+  private:
+    // past max_sah_depth, nodes are split in half so the tree is never deeper than stack_size.
+    enum { num_bins = 16, max_leaf_size = 4, max_sah_depth = 48, stack_size = 96 };
+
+    // leaves have count > 0 and use block "first". Others have children first and first + 1.
+    struct node {
+      vec4 lo;
+      vec4 hi;
+      int first;
+      int count;
+    };
+
+    // four triangles as a vertex and two edges, with unused lanes left degenerate.
+    struct tri4 {
+      vec4 v0x, v0y, v0z;
+      vec4 e1x, e1y, e1z;
+      vec4 e2x, e2y, e2z;
+      int32_t triangle[4];
+    };
+
+    dynarray<node> nodes;
+    dynarray<tri4> blocks;
+
+    // three vertex indices per triangle
+    dynarray<uint32_t> indices;
+
+    static float area(const vec4 &lo, const vec4 &hi) {
+      vec4 d = hi - lo;
+      return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+    }
+
+    // entry distance of a ray into a box, or false if it misses before t_max.
+    static bool ray_box(const node &n, const vec4 &org, const vec4 &inv_dir, float t_max, float &t_enter) {
+      vec4 t0 = (n.lo - org) * inv_dir;
+      vec4 t1 = (n.hi - org) * inv_dir;
+      vec4 tmin = t0.min(t1), tmax = t0.max(t1);
+      float enter = std::max(std::max(tmin.x(), tmin.y()), std::max(tmin.z(), 0.0f));
+      float exit = std::min(std::min(tmax.x(), tmax.y()), std::min(tmax.z(), t_max));
+      t_enter = enter;
+      return enter <= exit;
+    }
+
+    // test a ray against four triangles. Updates result if any is nearer than result.t.
+    // with any_hit, stops at the first one found.
+    static bool ray_tri4(const tri4 &b, const vec3 &org, const vec3 &dir, hit &result, bool any_hit) {
+      vec4 dx(dir.x()), dy(dir.y()), dz(dir.z());
+
+      // Moller-Trumbore, four lanes at once.
+      vec4 px = dy * b.e2z - dz * b.e2y;
+      vec4 py = dz * b.e2x - dx * b.e2z;
+      vec4 pz = dx * b.e2y - dy * b.e2x;
+      vec4 det = b.e1x * px + b.e1y * py + b.e1z * pz;
+
+      vec4 tx = vec4(org.x()) - b.v0x;
+      vec4 ty = vec4(org.y()) - b.v0y;
+      vec4 tz = vec4(org.z()) - b.v0z;
+      vec4 u = tx * px + ty * py + tz * pz;
+
+      vec4 qx = ty * b.e1z - tz * b.e1y;
+      vec4 qy = tz * b.e1x - tx * b.e1z;
+      vec4 qz = tx * b.e1y - ty * b.e1x;
+      vec4 v = dx * qx + dy * qy + dz * qz;
+      vec4 t = b.e2x * qx + b.e2y * qy + b.e2z * qz;
+
+      bool found = false;
+      for (unsigned l = 0; l != 4; ++l) {
+        if (fabsf(det[l]) < 1e-12f) continue;
+        float r = 1.0f / det[l];
+        float lu = u[l] * r, lv = v[l] * r, lt = t[l] * r;
+        if (lu >= 0 && lv >= 0 && lu + lv <= 1 && lt >= 0 && lt < result.t) {
+          result.triangle = b.triangle[l];
+          result.t = lt;
+          result.u = lu;
+          result.v = lv;
+          found = true;
+          if (any_hit) break;
+        }
+      }
+      return found;
+    }
+
+  public:
+    mesh_bvh() {
+    }
+
+    /// build from positions (w ignored) and three indices per triangle.
+    void build(const vec4 *positions, const uint32_t *tri_indices, unsigned num_tris) {
+      nodes.resize(0);
+      blocks.resize(0);
+      indices.resize(num_tris * 3);
+      if (num_tris) memcpy(indices.data(), tri_indices, num_tris * 3 * sizeof(uint32_t));
+      if (!num_tris) return;
+
+      // per triangle bounds and centres
+      dynarray<vec4> tri_lo(num_tris), tri_hi(num_tris), centre(num_tris);
+      dynarray<int> order(num_tris);
+      for (unsigned i = 0; i != num_tris; ++i) {
+        const vec4 &a = positions[tri_indices[i*3+0]];
+        const vec4 &b = positions[tri_indices[i*3+1]];
+        const vec4 &c = positions[tri_indices[i*3+2]];
+        tri_lo[i] = a.min(b).min(c).xyz0();
+        tri_hi[i] = a.max(b).max(c).xyz0();
+        centre[i] = (tri_lo[i] + tri_hi[i]) * 0.5f;
+        order[i] = (int)i;
+      }
+
+      struct task { int node; unsigned begin, end, depth; };
+      dynarray<task> tasks;
+      nodes.resize(1);
+      task root = { 0, 0, num_tris, 0 };
+      tasks.push_back(root);
+
+      while (!tasks.empty()) {
+        task tk = tasks.back();
+        tasks.pop_back();
+
+        vec4 lo = tri_lo[order[tk.begin]], hi = tri_hi[order[tk.begin]];
+        vec4 clo = centre[order[tk.begin]], chi = clo;
+        for (unsigned i = tk.begin + 1; i != tk.end; ++i) {
+          int tri = order[i];
+          lo = lo.min(tri_lo[tri]); hi = hi.max(tri_hi[tri]);
+          clo = clo.min(centre[tri]); chi = chi.max(centre[tri]);
+        }
+        nodes[tk.node].lo = lo;
+        nodes[tk.node].hi = hi;
+
+        unsigned count = tk.end - tk.begin;
+        if (count <= max_leaf_size) {
+          // pack the triangles into one block, padding with degenerate lanes.
+          tri4 b;
+          memset(&b, 0, sizeof(b));
+          for (unsigned l = 0; l != 4; ++l) {
+            b.triangle[l] = -1;
+            if (l >= count) continue;
+            int tri = order[tk.begin + l];
+            const vec4 &p0 = positions[tri_indices[tri*3+0]];
+            vec4 e1 = positions[tri_indices[tri*3+1]] - p0;
+            vec4 e2 = positions[tri_indices[tri*3+2]] - p0;
+            b.v0x[l] = p0.x(); b.v0y[l] = p0.y(); b.v0z[l] = p0.z();
+            b.e1x[l] = e1.x(); b.e1y[l] = e1.y(); b.e1z[l] = e1.z();
+            b.e2x[l] = e2.x(); b.e2y[l] = e2.y(); b.e2z[l] = e2.z();
+            b.triangle[l] = tri;
+          }
+          nodes[tk.node].first = (int)blocks.size();
+          nodes[tk.node].count = (int)count;
+          blocks.push_back(b);
+          continue;
+        }
+
+        // find the cheapest split over all three axes.
+        int best_axis = -1, best_bin = 0;
+        float best_cost = 1e37f;
+        vec4 extent = chi - clo;
+        for (int axis = 0; axis != 3 && tk.depth < max_sah_depth; ++axis) {
+          if (extent[axis] <= 1e-12f) continue;
+          float scale = num_bins / extent[axis];
+
+          unsigned bin_count[num_bins] = { 0 };
+          vec4 bin_lo[num_bins], bin_hi[num_bins];
+          for (unsigned i = tk.begin; i != tk.end; ++i) {
+            int tri = order[i];
+            int bin = std::min((int)((centre[tri][axis] - clo[axis]) * scale), num_bins - 1);
+            if (bin_count[bin]++ == 0) {
+              bin_lo[bin] = tri_lo[tri]; bin_hi[bin] = tri_hi[tri];
+            } else {
+              bin_lo[bin] = bin_lo[bin].min(tri_lo[tri]); bin_hi[bin] = bin_hi[bin].max(tri_hi[tri]);
+            }
+          }
+
+          // sweep from the right to get the cost of every right hand side, then from the left.
+          float right_cost[num_bins];
+          unsigned n = 0;
+          vec4 rlo, rhi;
+          for (int bin = num_bins - 1; bin > 0; --bin) {
+            if (bin_count[bin]) {
+              rlo = n ? rlo.min(bin_lo[bin]) : bin_lo[bin];
+              rhi = n ? rhi.max(bin_hi[bin]) : bin_hi[bin];
+              n += bin_count[bin];
+            }
+            right_cost[bin] = n ? area(rlo, rhi) * n : 0;
+          }
+
+          n = 0;
+          vec4 llo, lhi;
+          for (int bin = 0; bin != num_bins - 1; ++bin) {
+            if (bin_count[bin]) {
+              llo = n ? llo.min(bin_lo[bin]) : bin_lo[bin];
+              lhi = n ? lhi.max(bin_hi[bin]) : bin_hi[bin];
+              n += bin_count[bin];
+            }
+            if (n == 0 || n == count) continue;
+            float cost = area(llo, lhi) * n + right_cost[bin + 1];
+            if (cost < best_cost) {
+              best_cost = cost;
+              best_axis = axis;
+              best_bin = bin;
+            }
+          }
+        }
+
+        unsigned mid = tk.begin + count / 2;
+        if (best_axis >= 0) {
+          // triangles in bins up to best_bin go left.
+          float scale = num_bins / extent[best_axis];
+          float base = clo[best_axis];
+          int *split = std::partition(order.data() + tk.begin, order.data() + tk.end, [&](int tri) {
+            return std::min((int)((centre[tri][best_axis] - base) * scale), num_bins - 1) <= best_bin;
+          });
+          mid = (unsigned)(split - order.data());
+        }
+
+        int left = (int)nodes.size();
+        nodes.resize(nodes.size() + 2);
+        nodes[tk.node].first = left;
+        nodes[tk.node].count = 0;
+        task l = { left, tk.begin, mid, tk.depth + 1 }, r = { left + 1, mid, tk.end, tk.depth + 1 };
+        tasks.push_back(l);
+        tasks.push_back(r);
+      }
+    }
+
+    /// find the nearest triangle hit by start + dir * t for 0 <= t < t_max.
+    /// with any_hit, return the first hit found, which is cheaper for shadow and visibility tests.
+    bool intersect(const vec3 &start, const vec3 &dir, float t_max, hit &result, bool any_hit = false) const {
+      result.triangle = -1;
+      result.t = t_max;
+      result.u = result.v = 0;
+      if (nodes.empty()) return false;
+
+      vec4 org = start.xyz0();
+      vec4 inv_dir(
+        1.0f / (fabsf(dir.x()) > 1e-30f ? dir.x() : 1e-30f),
+        1.0f / (fabsf(dir.y()) > 1e-30f ? dir.y() : 1e-30f),
+        1.0f / (fabsf(dir.z()) > 1e-30f ? dir.z() : 1e-30f),
+        0
+      );
+
+      float t_enter;
+      if (!ray_box(nodes[0], org, inv_dir, result.t, t_enter)) return false;
+
+      int stack[stack_size];
+      int sp = 0;
+      stack[sp++] = 0;
+      while (sp) {
+        const node &n = nodes[stack[--sp]];
+        if (n.count) {
+          if (ray_tri4(blocks[n.first], start, dir, result, any_hit) && any_hit) return true;
+          continue;
+        }
+
+        // visit the nearer child first.
+        float t0, t1;
+        bool hit0 = ray_box(nodes[n.first], org, inv_dir, result.t, t0);
+        bool hit1 = ray_box(nodes[n.first + 1], org, inv_dir, result.t, t1);
+        if (hit0 && hit1) {
+          bool near0 = t0 <= t1;
+          stack[sp++] = n.first + (near0 ? 1 : 0);
+          stack[sp++] = n.first + (near0 ? 0 : 1);
+        } else if (hit0 || hit1) {
+          stack[sp++] = n.first + (hit0 ? 0 : 1);
+        }
+      }
+      return result.triangle >= 0;
+    }
+
+    /// intersect the lanes of mask in a packet, which all share one walk of the tree.
+    /// Returns the lanes that hit something; results[l] is the hit for lane l.
+    unsigned intersect(const ray_packet &packet, unsigned mask, hit results[4], bool any_hit = false) const {
+      ray_packet rays = packet;
+      for (unsigned l = 0; l != 4; ++l) {
+        results[l].triangle = -1;
+        results[l].t = packet.t_max[l];
+        results[l].u = results[l].v = 0;
+      }
+      if (nodes.empty()) return 0;
+
+      vec4 t_enter;
+      if (!rays.intersects(nodes[0].lo, nodes[0].hi, mask, t_enter)) return 0;
+
+      // lanes that found something, and lanes still looking.
+      unsigned found = 0;
+      unsigned live = mask;
+
+      struct entry { int index; unsigned mask; };
+      entry stack[stack_size];
+      int sp = 0;
+      entry root = { 0, mask };
+      stack[sp++] = root;
+      while (sp) {
+        entry e = stack[--sp];
+        e.mask &= live;
+        if (!e.mask) continue;
+
+        const node &n = nodes[e.index];
+        if (n.count) {
+          // four triangles against one ray at a time.
+          const tri4 &b = blocks[n.first];
+          for (unsigned l = 0; l != 4; ++l) {
+            if (!(e.mask & (1 << l))) continue;
+            if (ray_tri4(b, rays.get_start(l), rays.get_dir(l), results[l], any_hit)) {
+              found |= 1 << l;
+              rays.t_max[l] = results[l].t;
+              if (any_hit) live &= ~(1 << l);
+            }
+          }
+          if (!live) break;
+          continue;
+        }
+
+        // boxes against all four rays at once, nearer child (for the first lane that hits both) first.
+        vec4 t0, t1;
+        unsigned m0 = rays.intersects(nodes[n.first].lo, nodes[n.first].hi, e.mask, t0);
+        unsigned m1 = rays.intersects(nodes[n.first + 1].lo, nodes[n.first + 1].hi, e.mask, t1);
+        bool near0 = true;
+        unsigned both = m0 & m1;
+        if (both) {
+          unsigned l = 0;
+          while (!(both & (1 << l))) ++l;
+          near0 = t0[l] <= t1[l];
+        }
+        entry c0 = { n.first, m0 }, c1 = { n.first + 1, m1 };
+        if (near0) {
+          if (m1) stack[sp++] = c1;
+          if (m0) stack[sp++] = c0;
+        } else {
+          if (m0) stack[sp++] = c0;
+          if (m1) stack[sp++] = c1;
+        }
+      }
+      return found;
+    }
+
+    /// the three vertex indices of a triangle.
+    void get_triangle(int triangle, int vertex_indices[3]) const {
+      for (unsigned i = 0; i != 3; ++i) {
+        vertex_indices[i] = (int)indices[triangle * 3 + i];
+      }
+    }
+
+    /// number of triangles in the tree.
+    unsigned get_num_triangles() const {
+      return indices.size() / 3;
+    }
+
+    /// number of nodes in the tree.
+    unsigned get_num_nodes() const {
+      return nodes.size();
+    }
+  };
+}}
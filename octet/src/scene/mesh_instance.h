@@ -11,7 +11,9 @@ namespace octet { namespace scene {
   /// Instance of a mesh in a game world; node, mesh, material and skin.
   class mesh_instance : public resource {
   public:
-    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2 };
+    /// flag_static: the mesh's vertices and indices never change, so it may be drawn from shared buffers.
+    /// flag_occluder: draw the mesh into the occlusion buffer to hide the instances behind it.
+    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2, flag_static = 1 << 3, flag_occluder = 1 << 4 };
 
   private:
     // which scene_node (model to world matrix) to use in the scene
@@ -35,6 +37,13 @@ namespace octet { namespace scene {
     // if the object is further than this from the camera, do not draw.
     float max_draw_distance;
 
+    // draw order group: lower layers are drawn first.
+    unsigned layer;
+
+    // if set, flag_lod draws this instance when the group chooses lod_level, instead of by distance.
+    ref<lod_group> lod;
+    unsigned lod_level;
+
   public:
     RESOURCE_META(mesh_instance)
 
@@ -47,6 +56,8 @@ namespace octet { namespace scene {
       flags = flag_enabled;
       min_draw_distance = -8.507059e37f;
       max_draw_distance = 8.507059e37f;
+      layer = 0;
+      lod_level = 0;
     }
 
     /// metadata visitor. Used for serialisation and script interface.
@@ -130,6 +141,15 @@ namespace octet { namespace scene {
     /// Get the LOD max distance
     float get_max_draw_distance() const { return max_draw_distance; }
 
+    /// Get the draw order group
+    unsigned get_layer() const { return layer; }
+
+    /// Get the level of detail group (or null)
+    lod_group *get_lod_group() const { return lod; }
+
+    /// Get the level of this instance in its level of detail group
+    unsigned get_lod_level() const { return lod_level; }
+
     /// Set the transformation for this instance.
     void set_node(scene_node *value) { node = value; }
 
@@ -150,6 +170,13 @@ namespace octet { namespace scene {
 
     /// Set the flags for this instance.
     void set_max_draw_distance(float value) { max_draw_distance = value; }
+
+    /// Set the draw order group (0-15). Lower layers are drawn first, eg. sky before world before HUD.
+    void set_layer(unsigned value) { layer = value; }
+
+    /// With flag_lod, draw this instance only when the group chooses this level.
+    void set_lod(lod_group *group, unsigned level) { lod = group; lod_level = level; }
+
   };
 }}
 
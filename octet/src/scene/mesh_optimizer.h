@@ -0,0 +1,548 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// triangle and vertex reordering for faster drawing
+//
+// Three passes, each keeping the previous one's gains:
+//
+// 1) Vertex cache: Tom Forsyth's "Linear-Speed Vertex Cache Optimisation". Triangles are
+//    emitted greedily by a score that favours vertices near the front of a modelled LRU
+//    cache and vertices with few triangles left.
+// 2) Overdraw: the reordered triangles are cut into clusters where the cache would start
+//    afresh anyway (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality
+//    and Reduced Overdraw"), and the clusters facing out from the middle of the mesh go first.
+// 3) Vertex fetch: vertices are renumbered in the order they are first used, so the
+//    vertex buffer is read front to back.
+//
+// The array functions touch no GL or shared state, so loaders call them from worker threads.
+//
+
+namespace octet { namespace scene {
+  /// Reorders triangles and vertices for the post-transform vertex cache, overdraw and fetch.
+  class mesh_optimizer {
+  public:
+    /// Cache efficiency before and after optimisation.
+    /// ACMR is cache misses per triangle: 3 is the worst, about 0.5 is the best for a regular grid.
+    /// ATVR is cache misses per vertex: 1 is the best.
+    struct stats {
+      float acmr_before;
+      float atvr_before;
+      float acmr_after;
+      float atvr_after;
+      unsigned num_triangles;
+      unsigned num_vertices;
+    };
+
+    enum {
+      /// size of the LRU cache modelled by the scores
+      cache_size = 32,
+
+      /// size of the FIFO cache used to measure ACMR and ATVR
+      measure_cache_size = 16,
+    };
+
+  private:
+    enum { max_valence = 32 };
+
+    // Forsyth's scores for a position in the cache and a number of remaining triangles.
+    struct score_table {
+      float cache[cache_size];
+      float valence[max_valence + 1];
+
+      score_table() {
+        for (unsigned i = 0; i != cache_size; ++i) {
+          // the last triangle's vertices score the same, so its winding does not matter.
+          cache[i] = i < 3 ? 0.75f : powf(1.0f - (i - 3) * (1.0f / (cache_size - 3)), 1.5f);
+        }
+        valence[0] = 0;
+        for (unsigned i = 1; i <= max_valence; ++i) {
+          valence[i] = 2.0f * powf((float)i, -0.5f);
+        }
+      }
+    };
+
+    static float vertex_score(int cache_pos, unsigned valence) {
+      static const score_table table;
+      if (valence == 0) return -1.0f;
+      float score = cache_pos < 0 ? 0.0f : table.cache[cache_pos];
+      return score + table.valence[valence < (unsigned)max_valence ? valence : (unsigned)max_valence];
+    }
+
+    // FIFO cache simulation: a vertex is in the cache if it was added in the last
+    // measure_cache_size misses. Returns the number of misses for one triangle.
+    static unsigned cache_misses(const uint32_t *tri, dynarray<unsigned> &added, unsigned &time) {
+      unsigned misses = 0;
+      for (unsigned k = 0; k != 3; ++k) {
+        unsigned v = tri[k];
+        if (time - added[v] >= measure_cache_size) {
+          added[v] = ++time;
+          misses++;
+        }
+      }
+      return misses;
+    }
+
+    static vec3 get_position(const uint8_t *vertices, unsigned stride, unsigned pos_offset, unsigned index) {
+      float pos[3];
+      memcpy(pos, vertices + index * stride + pos_offset, sizeof(pos));
+      return vec3(pos[0], pos[1], pos[2]);
+    }
+
+    // a vertex as a key for welding.
+    struct vertex_key {
+      const uint8_t *bytes;
+      unsigned size;
+
+      bool operator ==(const vertex_key &rhs) const {
+        return size == rhs.size && memcmp(bytes, rhs.bytes, size) == 0;
+      }
+    };
+
+    class vertex_key_cmp : public hash_map_cmp {
+    public:
+      static unsigned get_hash(const vertex_key &key) {
+        unsigned hash = 0;
+        for (unsigned i = 0; i != key.size; ++i) {
+          hash = ( hash * 7 ) + ( hash >> 13 ) + key.bytes[i];
+        }
+        return fuzz_hash(hash);
+      }
+      static bool is_empty(const vertex_key &key) { return key.bytes == 0; }
+    };
+
+  public:
+    /// Do the loaders optimise meshes as they build them? On by default.
+    static bool &optimize_on_load() {
+      static bool value = true;
+      return value;
+    }
+
+    /// Measure ACMR and ATVR for a FIFO cache of measure_cache_size vertices.
+    static void measure(const uint32_t *indices, unsigned num_indices, unsigned num_vertices, float &acmr, float &atvr) {
+      unsigned num_tris = num_indices / 3;
+      dynarray<unsigned> added(num_vertices);
+      dynarray<uint8_t> used(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        added[v] = 0;
+        used[v] = 0;
+      }
+
+      // start the clock past the cache size so that no vertex starts in the cache.
+      unsigned time = measure_cache_size, misses = 0, num_used = 0;
+      for (unsigned t = 0; t != num_tris; ++t) {
+        misses += cache_misses(indices + t * 3, added, time);
+      }
+      for (unsigned i = 0; i != num_tris * 3; ++i) {
+        if (!used[indices[i]]) {
+          used[indices[i]] = 1;
+          num_used++;
+        }
+      }
+      acmr = num_tris ? (float)misses / num_tris : 0;
+      atvr = num_used ? (float)misses / num_used : 0;
+    }
+
+    /// Share identical vertices. Returns the new number of vertices, which are at the front of vertices.
+    static unsigned weld(uint8_t *vertices, unsigned num_vertices, unsigned stride, uint32_t *indices, unsigned num_indices) {
+      hash_map<vertex_key, unsigned, vertex_key_cmp> vertex_to_index;
+      dynarray<uint32_t> remap(num_vertices);
+      dynarray<uint8_t> result(num_vertices * stride);
+      unsigned count = 0;
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        vertex_key key = { vertices + v * stride, stride };
+        // the map stores index + 1 so that zero means a new vertex
+        unsigned &index = vertex_to_index[key];
+        if (index == 0) {
+          memcpy(result.data() + count * stride, vertices + v * stride, stride);
+          index = ++count;
+        }
+        remap[v] = index - 1;
+      }
+      for (unsigned i = 0; i != num_indices; ++i) {
+        indices[i] = remap[indices[i]];
+      }
+      if (count) memcpy(vertices, result.data(), count * stride);
+      return count;
+    }
+
+    /// Reorder triangles for the post-transform vertex cache (Forsyth).
+    static void optimize_vertex_cache(uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      unsigned num_tris = num_indices / 3;
+      if (num_tris < 2) return;
+
+      // triangles using each vertex: adjacency[first[v], first[v] + valence[v]) are the live ones.
+      dynarray<unsigned> valence(num_vertices);
+      dynarray<unsigned> first(num_vertices + 1);
+      dynarray<unsigned> adjacency(num_tris * 3);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        valence[v] = 0;
+      }
+      for (unsigned i = 0; i != num_tris * 3; ++i) {
+        valence[indices[i]]++;
+      }
+      first[0] = 0;
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        first[v + 1] = first[v] + valence[v];
+        valence[v] = 0;
+      }
+      for (unsigned i = 0; i != num_tris * 3; ++i) {
+        unsigned v = indices[i];
+        adjacency[first[v] + valence[v]++] = i / 3;
+      }
+
+      dynarray<int> cache_pos(num_vertices);
+      dynarray<float> score(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        cache_pos[v] = -1;
+        score[v] = vertex_score(-1, valence[v]);
+      }
+
+      dynarray<uint8_t> emitted(num_tris);
+      for (unsigned t = 0; t != num_tris; ++t) {
+        emitted[t] = 0;
+      }
+
+      // the cache holds three extra entries for the vertices of the triangle just added.
+      unsigned cache[cache_size + 3];
+      unsigned cache_count = 0;
+
+      dynarray<uint32_t> result(num_tris * 3);
+      unsigned next_unemitted = 0;
+      int best = -1;
+      for (unsigned n = 0; n != num_tris; ++n) {
+        if (best < 0) {
+          // nothing in the cache has triangles left: start again in the input order.
+          while (emitted[next_unemitted]) ++next_unemitted;
+          best = (int)next_unemitted;
+        }
+
+        const uint32_t *tri = indices + best * 3;
+        memcpy(result.data() + n * 3, tri, sizeof(uint32_t) * 3);
+        emitted[best] = 1;
+
+        // take the triangle off its vertices' lists.
+        for (unsigned k = 0; k != 3; ++k) {
+          unsigned v = tri[k];
+          unsigned *adj = adjacency.data() + first[v];
+          unsigned count = valence[v];
+          for (unsigned j = 0; j != count; ++j) {
+            if (adj[j] == (unsigned)best) {
+              adj[j] = adj[count - 1];
+              valence[v] = count - 1;
+              break;
+            }
+          }
+        }
+
+        // move the triangle's vertices to the front of the cache.
+        unsigned new_cache[cache_size + 3];
+        unsigned new_count = 0;
+        for (unsigned k = 0; k != 3; ++k) {
+          if (k == 0 || (tri[k] != tri[0] && (k == 1 || tri[k] != tri[1]))) {
+            new_cache[new_count++] = tri[k];
+          }
+        }
+        for (unsigned i = 0; i != cache_count; ++i) {
+          unsigned v = cache[i];
+          if (v != tri[0] && v != tri[1] && v != tri[2]) new_cache[new_count++] = v;
+        }
+        for (unsigned i = cache_size; i < new_count; ++i) {
+          unsigned v = new_cache[i];
+          cache_pos[v] = -1;
+          score[v] = vertex_score(-1, valence[v]);
+        }
+        cache_count = new_count < (unsigned)cache_size ? new_count : (unsigned)cache_size;
+        for (unsigned i = 0; i != cache_count; ++i) {
+          unsigned v = new_cache[i];
+          cache[i] = v;
+          cache_pos[v] = (int)i;
+          score[v] = vertex_score((int)i, valence[v]);
+        }
+
+        // the next triangle is the best one using a vertex in the cache.
+        best = -1;
+        float best_score = -1e37f;
+        for (unsigned i = 0; i != cache_count; ++i) {
+          unsigned v = cache[i];
+          const unsigned *adj = adjacency.data() + first[v];
+          for (unsigned j = 0; j != valence[v]; ++j) {
+            const uint32_t *t = indices + adj[j] * 3;
+            float s = score[t[0]] + score[t[1]] + score[t[2]];
+            if (s > best_score) {
+              best_score = s;
+              best = (int)adj[j];
+            }
+          }
+        }
+      }
+
+      memcpy(indices, result.data(), num_tris * 3 * sizeof(uint32_t));
+    }
+
+    /// Reorder clusters of triangles so that those facing out from the centre are drawn first.
+    /// Call after optimize_vertex_cache. threshold is how much worse the ACMR may get (1.05 = 5%).
+    static void optimize_overdraw(uint32_t *indices, unsigned num_indices, const uint8_t *vertices, unsigned num_vertices, unsigned stride, unsigned pos_offset, float threshold = 1.05f) {
+      unsigned num_tris = num_indices / 3;
+      if (num_tris < 2) return;
+
+      dynarray<unsigned> added(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        added[v] = 0;
+      }
+
+      // hard boundaries: triangles whose vertices all miss the cache.
+      dynarray<unsigned> hard;
+      unsigned time = measure_cache_size;
+      for (unsigned t = 0; t != num_tris; ++t) {
+        if (cache_misses(indices + t * 3, added, time) == 3) hard.push_back(t);
+      }
+      hard.push_back(num_tris);
+
+      // soft boundaries: split a hard cluster wherever the cache has done well enough so far.
+      dynarray<unsigned> clusters;
+      for (unsigned h = 0; h + 1 < hard.size(); ++h) {
+        unsigned begin = hard[h], end = hard[h + 1];
+
+        time += measure_cache_size + 1;
+        unsigned misses = 0;
+        for (unsigned t = begin; t != end; ++t) {
+          misses += cache_misses(indices + t * 3, added, time);
+        }
+        float limit = threshold * misses / (end - begin);
+
+        time += measure_cache_size + 1;
+        misses = 0;
+        unsigned start = begin;
+        clusters.push_back(begin);
+        for (unsigned t = begin; t != end; ++t) {
+          misses += cache_misses(indices + t * 3, added, time);
+          if (t + 1 != end && (float)misses / (t - start + 1) <= limit) {
+            clusters.push_back(t + 1);
+            start = t + 1;
+            misses = 0;
+            time += measure_cache_size + 1;
+          }
+        }
+      }
+      unsigned num_clusters = clusters.size();
+      clusters.push_back(num_tris);
+      if (num_clusters < 2) return;
+
+      // area weighted centre and normal of each cluster and of the whole mesh.
+      dynarray<vec3> centre(num_clusters), normal(num_clusters);
+      vec3 mesh_centre(0, 0, 0);
+      float mesh_area = 0;
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        vec3 sum(0, 0, 0), n(0, 0, 0);
+        float area = 0;
+        for (unsigned t = clusters[c]; t != clusters[c + 1]; ++t) {
+          vec3 p0 = get_position(vertices, stride, pos_offset, indices[t * 3 + 0]);
+          vec3 p1 = get_position(vertices, stride, pos_offset, indices[t * 3 + 1]);
+          vec3 p2 = get_position(vertices, stride, pos_offset, indices[t * 3 + 2]);
+          vec3 cross_product = cross(p1 - p0, p2 - p0);
+          float a = length(cross_product);
+          sum += (p0 + p1 + p2) * (a * (1.0f / 3));
+          n += cross_product;
+          area += a;
+        }
+        mesh_centre += sum;
+        mesh_area += area;
+        centre[c] = area > 0 ? sum / area : sum;
+        float len = length(n);
+        normal[c] = len > 0 ? n / len : n;
+      }
+      if (mesh_area > 0) mesh_centre = mesh_centre / mesh_area;
+
+      // outward facing clusters first; ties keep their order.
+      struct cluster_key { float key; unsigned index; };
+      dynarray<cluster_key> order(num_clusters);
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        order[c].key = dot(centre[c] - mesh_centre, normal[c]);
+        order[c].index = c;
+      }
+      std::sort(order.data(), order.data() + num_clusters, [](const cluster_key &a, const cluster_key &b) {
+        return a.key != b.key ? a.key > b.key : a.index < b.index;
+      });
+
+      dynarray<uint32_t> result(num_tris * 3);
+      unsigned n = 0;
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        unsigned begin = clusters[order[c].index], end = clusters[order[c].index + 1];
+        memcpy(result.data() + n * 3, indices + begin * 3, (end - begin) * 3 * sizeof(uint32_t));
+        n += end - begin;
+      }
+      memcpy(indices, result.data(), num_tris * 3 * sizeof(uint32_t));
+    }
+
+    /// Renumber vertices in the order the triangles use them, dropping unused ones.
+    /// Returns the new number of vertices.
+    static unsigned optimize_vertex_fetch(uint8_t *vertices, unsigned num_vertices, unsigned stride, uint32_t *indices, unsigned num_indices) {
+      dynarray<uint32_t> remap(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        remap[v] = ~0u;
+      }
+      dynarray<uint8_t> result(num_vertices * stride);
+      unsigned count = 0;
+      for (unsigned i = 0; i != num_indices; ++i) {
+        unsigned v = indices[i];
+        if (remap[v] == ~0u) {
+          memcpy(result.data() + count * stride, vertices + v * stride, stride);
+          remap[v] = count++;
+        }
+        indices[i] = remap[v];
+      }
+      if (count) memcpy(vertices, result.data(), count * stride);
+      return count;
+    }
+
+    /// All three passes on triangle lists in memory. Returns the new number of vertices.
+    /// pos_offset is the byte offset of three float positions in each vertex.
+    /// If the authored order already suits the cache better, the triangles keep it.
+    static unsigned optimize(uint8_t *vertices, unsigned num_vertices, unsigned stride, unsigned pos_offset, uint32_t *indices, unsigned num_indices, stats *result = 0) {
+      num_indices -= num_indices % 3;
+      stats st;
+      measure(indices, num_indices, num_vertices, st.acmr_before, st.atvr_before);
+
+      dynarray<uint32_t> authored(num_indices);
+      if (num_indices) memcpy(authored.data(), indices, num_indices * sizeof(uint32_t));
+
+      optimize_vertex_cache(indices, num_indices, num_vertices);
+      optimize_overdraw(indices, num_indices, vertices, num_vertices, stride, pos_offset);
+
+      measure(indices, num_indices, num_vertices, st.acmr_after, st.atvr_after);
+      if (st.acmr_after > st.acmr_before && num_indices) {
+        memcpy(indices, authored.data(), num_indices * sizeof(uint32_t));
+      }
+      num_vertices = optimize_vertex_fetch(vertices, num_vertices, stride, indices, num_indices);
+
+      if (result) {
+        measure(indices, num_indices, num_vertices, st.acmr_after, st.atvr_after);
+        st.num_triangles = num_indices / 3;
+        st.num_vertices = num_vertices;
+        *result = st;
+      }
+      return num_vertices;
+    }
+
+    /// Copy the vertices and indices of an indexed triangle list with float positions.
+    /// GL calls, so main thread only. Returns false for meshes that cannot be read this way.
+    static bool read_triangles(mesh *msh, dynarray<uint8_t> &vertices, dynarray<uint32_t> &indices, unsigned &pos_offset) {
+      unsigned pos_slot = msh ? msh->get_slot(attribute_pos) : ~0u;
+      if (pos_slot == ~0u || msh->get_kind(pos_slot) != GL_FLOAT || msh->get_size(pos_slot) < 3) return false;
+      if (msh->get_mode() != GL_TRIANGLES || !msh->get_index_type() || msh->get_vertices()->is_streaming()) return false;
+
+      unsigned stride = msh->get_stride();
+      unsigned num_vertices = msh->get_num_vertices();
+      unsigned num_indices = msh->get_num_indices();
+      if (!stride || (size_t)num_vertices * stride > msh->get_vertices()->get_size()) return false;
+
+      indices.resize(num_indices);
+      bool in_range = true;
+      {
+        gl_resource::rolock idx_lock(msh->get_indices());
+        for (unsigned i = 0; i != num_indices; ++i) {
+          indices[i] = msh->get_index(idx_lock.u8(), i);
+          in_range = in_range && indices[i] < num_vertices;
+        }
+      }
+      if (!in_range) return false;
+
+      vertices.resize(num_vertices * stride);
+      {
+        gl_resource::rolock vtx_lock(msh->get_vertices());
+        memcpy(vertices.data(), vtx_lock.u8(), vertices.size());
+      }
+      pos_offset = msh->get_offset(pos_slot);
+      return true;
+    }
+
+    /// Give a mesh new buffers holding these vertices (in its layout) and indices.
+    /// 16 bit meshes stay 16 bit. GL calls, so main thread only.
+    static void write_triangles(mesh *msh, const uint8_t *vertices, unsigned num_vertices, const uint32_t *indices, unsigned num_indices) {
+      unsigned vsize = num_vertices * msh->get_stride();
+      gl_resource *vtx = new gl_resource(GL_ARRAY_BUFFER, vsize);
+      if (vsize) vtx->assign(vertices, 0, vsize);
+
+      gl_resource *idx;
+      if (msh->get_index_type() == GL_UNSIGNED_SHORT) {
+        dynarray<uint16_t> short_indices(num_indices);
+        for (unsigned i = 0; i != num_indices; ++i) {
+          short_indices[i] = (uint16_t)indices[i];
+        }
+        idx = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, num_indices * 2);
+        if (num_indices) idx->assign(short_indices.data(), 0, num_indices * 2);
+      } else {
+        idx = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, num_indices * 4);
+        if (num_indices) idx->assign(indices, 0, num_indices * 4);
+        msh->set_index_type(GL_UNSIGNED_INT);
+      }
+
+      msh->set_vertices(vtx);
+      msh->set_indices(idx);
+      msh->set_first_index(0);
+      msh->set_num_vertices(num_vertices);
+      msh->set_num_indices(num_indices);
+    }
+
+    /// Optimise meshes in place, sharing the work between the job pool.
+    /// Reading and writing the buffers is done on this thread. Meshes that are not indexed
+    /// float-position triangle lists are skipped. results, if given, has one entry per mesh.
+    static void optimize(mesh *const *meshes, unsigned num_meshes, stats *results = 0) {
+      struct work {
+        dynarray<uint8_t> vertices;
+        dynarray<uint32_t> indices;
+        unsigned num_vertices;
+        unsigned pos_offset;
+        bool ok;
+      };
+      dynarray<work> works(num_meshes);
+
+      for (unsigned m = 0; m != num_meshes; ++m) {
+        work &w = works[m];
+        if (results) memset(&results[m], 0, sizeof(stats));
+        w.ok = read_triangles(meshes[m], w.vertices, w.indices, w.pos_offset);
+        w.num_vertices = w.ok ? meshes[m]->get_num_vertices() : 0;
+      }
+
+      parallel_for(0, num_meshes, [&](unsigned m) {
+        work &w = works[m];
+        if (!w.ok) return;
+        unsigned stride = meshes[m]->get_stride();
+        stats st;
+        measure(w.indices.data(), w.indices.size() - w.indices.size() % 3, w.num_vertices, st.acmr_before, st.atvr_before);
+
+        // meshes built without an index buffer in mind often repeat every vertex.
+        w.num_vertices = weld(w.vertices.data(), w.num_vertices, stride, w.indices.data(), w.indices.size());
+        float acmr_before = st.acmr_before, atvr_before = st.atvr_before;
+        w.num_vertices = optimize(w.vertices.data(), w.num_vertices, stride, w.pos_offset, w.indices.data(), w.indices.size(), &st);
+        st.acmr_before = acmr_before;
+        st.atvr_before = atvr_before;
+        if (results) results[m] = st;
+      });
+
+      for (unsigned m = 0; m != num_meshes; ++m) {
+        work &w = works[m];
+        if (w.ok) write_triangles(meshes[m], w.vertices.data(), w.num_vertices, w.indices.data(), w.indices.size());
+      }
+    }
+
+    /// Optimise one mesh in place. Returns false if the mesh could not be optimised.
+    static bool optimize(mesh *msh, stats *result = 0) {
+      stats st;
+      optimize(&msh, 1, &st);
+      if (result) *result = st;
+      return st.num_triangles != 0;
+    }
+
+    /// print the statistics.
+    static void dump(const char *name, const stats &st) {
+      printf(
+        "%s: %d triangles %d vertices ACMR %.3f -> %.3f ATVR %.3f -> %.3f\n",
+        name, st.num_triangles, st.num_vertices, st.acmr_before, st.acmr_after, st.atvr_before, st.atvr_after
+      );
+    }
+  };
+}}
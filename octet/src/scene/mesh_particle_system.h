@@ -101,7 +101,7 @@ namespace octet { namespace scene {
 
       unsigned vsize = (bbcap * 4 + tpcap * 2) * sizeof(vertex);
       unsigned isize = (bbcap * 6 + tpcap * 6) * sizeof(uint32_t);
-      mesh::allocate(vsize, isize);
+      mesh::allocate_stream(vsize, isize);
     }
 
     // pool allocation of particles.
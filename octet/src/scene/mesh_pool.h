@@ -0,0 +1,312 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// shared vertex and index buffers for static meshes
+//
+// Static meshes with the same vertex layout are copied into one large vertex buffer and
+// one large 32 bit index buffer. Each mesh is then just a first index, a count and a base
+// vertex, so any number of them can be drawn with a single glMultiDrawElementsIndirect.
+//
+
+namespace octet { namespace scene {
+  /// Sub-allocates static meshes from a few large shared buffers, one set per vertex layout.
+  ///
+  /// Meshes are copied the first time they are added and are assumed not to change after that.
+  /// If a mesh gets new GL buffers, it is copied again and its old space is reused by later copies.
+  class mesh_pool {
+  public:
+    /// One record of a glMultiDrawElementsIndirect command buffer (DrawElementsIndirectCommand).
+    struct draw_command {
+      uint32_t count;
+      uint32_t instance_count;
+      uint32_t first_index;
+      int32_t base_vertex;
+      uint32_t base_instance;
+    };
+
+    /// where a mesh's vertices and indices are in its pool.
+    struct entry {
+      ref<mesh> src;
+      int pool;
+      uint32_t first_index;
+      uint32_t num_indices;
+      int32_t base_vertex;
+      uint32_t num_vertices;
+
+      // buffers copied from, to spot meshes that have been given new ones
+      GLuint vertex_buffer;
+      GLuint index_buffer;
+    };
+
+  private:
+    // a run of vertices or indices in a pool
+    struct range {
+      uint32_t first;
+      uint32_t count;
+    };
+
+    struct pool {
+      // has the layout of the pooled meshes, but draws from the shared buffers
+      ref<mesh> msh;
+      uint32_t num_vertices;
+      uint32_t num_indices;
+
+      // space given back by meshes that were copied again, sorted by first
+      dynarray<range> free_vertices;
+      dynarray<range> free_indices;
+    };
+
+    dynarray<pool> pools;
+    dynarray<entry> entries;
+
+    // mesh to entry index + 1
+    hash_map<void *, int> entry_map;
+
+    // make sure buf has room for bytes, keeping the first used bytes.
+    static void reserve(ref<gl_resource> &buf, GLuint target, size_t used, size_t bytes) {
+      #ifndef OCTET_GLES2
+        size_t old_size = buf ? buf->get_size() : 0;
+        if (bytes <= old_size) return;
+
+        size_t new_size = old_size ? old_size : 0x10000;
+        while (new_size < bytes) new_size *= 2;
+
+        // only drawn from, so no CPU shadow.
+        gl_resource *new_buf = new gl_resource();
+        new_buf->allocate(target, new_size, GL_STATIC_DRAW, false);
+        if (used) copy_bytes(new_buf, 0, buf, 0, used);
+        buf = new_buf;
+      #endif
+    }
+
+    // copy bytes between GL buffers on the GPU, so that neither needs a CPU shadow.
+    static void copy_bytes(gl_resource *dest, size_t dest_offset, gl_resource *src, size_t src_offset, size_t bytes) {
+      #ifdef OCTET_GLES2
+        gl_resource::rolock lock(src);
+        dest->assign(lock.u8() + src_offset, dest_offset, bytes);
+      #else
+        glBindBuffer(GL_COPY_READ_BUFFER, src->get_buffer());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, dest->get_buffer());
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src->get_offset() + src_offset, dest_offset, bytes);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+      #endif
+    }
+
+    // take count items from the first free range that fits, or from the end of the used space.
+    static uint32_t alloc_range(dynarray<range> &free_list, uint32_t &used, uint32_t count) {
+      for (unsigned i = 0; i != free_list.size(); ++i) {
+        range &r = free_list[i];
+        if (r.count >= count) {
+          uint32_t first = r.first;
+          r.first += count;
+          r.count -= count;
+          if (!r.count) free_list.erase(i);
+          return first;
+        }
+      }
+      uint32_t first = used;
+      used += count;
+      return first;
+    }
+
+    // give back a range, joining it to its neighbours and to the end of the used space.
+    static void free_range(dynarray<range> &free_list, uint32_t &used, uint32_t first, uint32_t count) {
+      if (!count) return;
+
+      unsigned i = 0;
+      while (i != free_list.size() && free_list[i].first < first) ++i;
+      if (i && free_list[i-1].first + free_list[i-1].count == first) {
+        free_list[--i].count += count;
+      } else {
+        range r = { first, count };
+        free_list.push_back(r);
+        for (unsigned j = free_list.size() - 1; j != i; --j) {
+          free_list[j] = free_list[j-1];
+        }
+        free_list[i] = r;
+      }
+
+      if (i + 1 != free_list.size() && free_list[i].first + free_list[i].count == free_list[i+1].first) {
+        free_list[i].count += free_list[i+1].count;
+        free_list.erase(i + 1);
+      }
+
+      if (i + 1 == free_list.size() && free_list[i].first + free_list[i].count == used) {
+        used = free_list[i].first;
+        free_list.resize(i);
+      }
+    }
+
+    // find or make a pool for meshes laid out like msh.
+    int find_pool(mesh *msh) {
+      for (unsigned i = 0; i != pools.size(); ++i) {
+        if (pools[i].msh->same_layout(*msh)) return (int)i;
+      }
+
+      pools.resize(pools.size() + 1);
+      pool &p = pools.back();
+      p.msh = new mesh(*msh);
+      p.msh->set_vertices((gl_resource*)0);
+      p.msh->set_indices((gl_resource*)0);
+      p.msh->set_index_type(GL_UNSIGNED_INT);
+      p.msh->set_first_index(0);
+      p.num_vertices = 0;
+      p.num_indices = 0;
+      return (int)pools.size() - 1;
+    }
+
+    // copy a mesh's vertices and indices into free space in its pool.
+    bool copy_mesh(entry &e, mesh *msh) {
+      unsigned num_indices = msh->get_num_indices();
+      unsigned stride = msh->get_stride();
+      gl_resource *src_vertices = msh->get_vertices();
+      gl_resource *src_indices = msh->get_indices();
+      if (!num_indices || !stride || !src_vertices || !src_indices || !src_vertices->get_size()) return false;
+
+      dynarray<uint32_t> indices(num_indices);
+      unsigned num_vertices = 0;
+      {
+        gl_resource::rolock idx_lock(src_indices);
+        for (unsigned i = 0; i != num_indices; ++i) {
+          unsigned index = msh->get_index(idx_lock.u8(), i);
+          indices[i] = index;
+          if (index >= num_vertices) num_vertices = index + 1;
+        }
+      }
+      if (num_vertices * stride > src_vertices->get_size()) return false;
+
+      int pi = find_pool(msh);
+      pool &p = pools[pi];
+      uint32_t old_vertices = p.num_vertices;
+      uint32_t old_indices = p.num_indices;
+      uint32_t base_vertex = alloc_range(p.free_vertices, p.num_vertices, num_vertices);
+      uint32_t first_index = alloc_range(p.free_indices, p.num_indices, num_indices);
+
+      ref<gl_resource> vertices = p.msh->get_vertices();
+      ref<gl_resource> pool_indices = p.msh->get_indices();
+      reserve(vertices, GL_ARRAY_BUFFER, old_vertices * stride, p.num_vertices * stride);
+      reserve(pool_indices, GL_ELEMENT_ARRAY_BUFFER, old_indices * 4, p.num_indices * 4);
+
+      copy_bytes(vertices, base_vertex * stride, src_vertices, 0, num_vertices * stride);
+      pool_indices->assign(indices.data(), first_index * 4, num_indices * 4);
+
+      // set_* also marks the pool mesh's vertex array object for rebuilding.
+      p.msh->set_vertices(vertices);
+      p.msh->set_indices(pool_indices);
+
+      e.pool = pi;
+      e.first_index = first_index;
+      e.num_indices = num_indices;
+      e.base_vertex = (int32_t)base_vertex;
+      e.num_vertices = num_vertices;
+      e.vertex_buffer = src_vertices->get_buffer();
+      e.index_buffer = src_indices->get_buffer();
+
+      p.msh->set_num_vertices(p.num_vertices);
+      p.msh->set_num_indices(p.num_indices);
+      return true;
+    }
+
+    // give a mesh's space back to its pool.
+    void release(entry &e) {
+      if (e.pool < 0) return;
+      pool &p = pools[e.pool];
+      free_range(p.free_vertices, p.num_vertices, (uint32_t)e.base_vertex, e.num_vertices);
+      free_range(p.free_indices, p.num_indices, e.first_index, e.num_indices);
+      p.msh->set_num_vertices(p.num_vertices);
+      p.msh->set_num_indices(p.num_indices);
+      e.pool = -1;
+      e.num_indices = e.num_vertices = 0;
+    }
+
+  public:
+    mesh_pool() {
+    }
+
+    /// does the context have ARB_multi_draw_indirect (OpenGL 4.3) and ARB_base_instance (OpenGL 4.2)?
+    /// The draw commands use base_instance to find their instance matrices.
+    static bool gl_supports_multi_draw_indirect() {
+      #ifdef OCTET_GLES2
+        return false;
+      #else
+        #ifdef WIN32
+          if (!glMultiDrawElementsIndirect) return false;
+        #endif
+        const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+        const char *version = (const char *)glGetString(GL_VERSION);
+        double gl_version = version ? atof(version) : 0;
+        bool multi_draw = gl_version >= 4.3 || (extensions && strstr(extensions, "GL_ARB_multi_draw_indirect"));
+        bool base_instance = gl_version >= 4.2 || (extensions && strstr(extensions, "GL_ARB_base_instance"));
+        return multi_draw && base_instance;
+      #endif
+    }
+
+    /// free all the pools.
+    void reset() {
+      pools.reset();
+      entries.reset();
+      entry_map.clear();
+    }
+
+    /// add a mesh to the pools if it is not already there and return its entry, or -1.
+    /// Only indexed, unskinned meshes can be pooled.
+    int add(mesh *msh) {
+      #ifdef OCTET_GLES2
+        return -1;
+      #else
+        int &index = entry_map[(void*)msh];
+        if (index < 0) return -1;
+
+        if (index) {
+          // if the mesh has new buffers, copy it again.
+          entry &e = entries[index - 1];
+          if (e.vertex_buffer == msh->get_vertices()->get_buffer() && e.index_buffer == msh->get_indices()->get_buffer()) {
+            return index - 1;
+          }
+          release(e);
+          return copy_mesh(e, msh) ? index - 1 : -1;
+        }
+
+        if (msh->get_skin() || !msh->get_index_type() || msh->get_mode() != GL_TRIANGLES || msh->get_vertices()->is_streaming()) {
+          index = -1;
+          return -1;
+        }
+
+        entries.resize(entries.size() + 1);
+        entry &e = entries.back();
+        e.src = msh;
+        if (!copy_mesh(e, msh)) {
+          entries.resize(entries.size() - 1);
+          index = -1;
+          return -1;
+        }
+        index = (int)entries.size();
+        return index - 1;
+      #endif
+    }
+
+    /// where a pooled mesh is.
+    const entry &get_entry(int index) const {
+      return entries[index];
+    }
+
+    /// a mesh that draws from the shared buffers of a pool.
+    mesh *get_pool_mesh(int pool) const {
+      return pools[pool].msh;
+    }
+
+    /// number of vertex layouts in use.
+    unsigned get_num_pools() const {
+      return pools.size();
+    }
+
+    /// number of meshes in the pools.
+    unsigned get_num_entries() const {
+      return entries.size();
+    }
+  };
+}}
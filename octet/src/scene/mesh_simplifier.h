@@ -0,0 +1,422 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// quadric error simplification for levels of detail
+//
+// Garland and Heckbert, "Surface Simplification Using Quadric Error Metrics".
+//
+// Each position sums the squared distances to the planes of its triangles. An edge collapse
+// moves one end onto the other (a half edge collapse), so no new vertices are made and the
+// normals, uvs and skin weights of the remaining vertices stay as authored.
+//
+// Vertices are classified before simplifying:
+//   manifold: one vertex at this position, inside the surface. May collapse onto any neighbour.
+//   border:   one vertex on an open edge of the mesh. May only slide along the border.
+//   seam:     two vertices at one position, split by a uv or normal discontinuity.
+//             Both slide along the seam together, so the two sides stay joined.
+//   locked:   anything else (corners of seams, non-manifold points). Never moves.
+// Open edges also add planes at right angles to their triangles, so borders and seams keep their shape.
+//
+
+namespace octet { namespace scene {
+  /// Makes simpler versions of triangle meshes within an error limit.
+  class mesh_simplifier {
+    enum { kind_manifold, kind_border, kind_seam, kind_locked };
+
+    // relative weight of the planes that hold open edges in place
+    static float edge_weight() { return 10.0f; }
+
+    // sum of area * (squared distance to a plane): p.A.p + 2 b.p + c
+    // doubles, as the terms are large and nearly cancel far from the origin.
+    struct quadric {
+      double a00, a11, a22, a10, a20, a21;
+      double b0, b1, b2, c;
+      double w;
+
+      void add_plane(vec3_in n, float d, float weight) {
+        double x = n.x(), y = n.y(), z = n.z();
+        a00 += weight * x * x; a11 += weight * y * y; a22 += weight * z * z;
+        a10 += weight * y * x; a20 += weight * z * x; a21 += weight * z * y;
+        b0 += weight * x * d; b1 += weight * y * d; b2 += weight * z * d;
+        c += (double)weight * d * d;
+        w += weight;
+      }
+
+      void add(const quadric &rhs) {
+        a00 += rhs.a00; a11 += rhs.a11; a22 += rhs.a22;
+        a10 += rhs.a10; a20 += rhs.a20; a21 += rhs.a21;
+        b0 += rhs.b0; b1 += rhs.b1; b2 += rhs.b2;
+        c += rhs.c;
+        w += rhs.w;
+      }
+
+      // mean squared distance of p from the planes
+      float error(vec3_in p) const {
+        double x = p.x(), y = p.y(), z = p.z();
+        double r = a00 * x * x + a11 * y * y + a22 * z * z + 2 * (a10 * x * y + a20 * x * z + a21 * y * z);
+        r += 2 * (b0 * x + b1 * y + b2 * z) + c;
+        return w > 0 ? (float)(fabs(r) / w) : 0;
+      }
+    };
+
+    struct collapse {
+      unsigned from;
+      unsigned to;
+      float error;
+
+      bool operator <(const collapse &rhs) const { return error < rhs.error; }
+    };
+
+    // a position in the vertex buffer as a key for finding the vertices that share it
+    struct position_key {
+      const uint8_t *bytes;
+
+      bool operator ==(const position_key &rhs) const {
+        return memcmp(bytes, rhs.bytes, sizeof(float) * 3) == 0;
+      }
+    };
+
+    class position_key_cmp : public hash_map_cmp {
+    public:
+      static unsigned get_hash(const position_key &key) {
+        unsigned hash = 0;
+        for (unsigned i = 0; i != sizeof(float) * 3; ++i) {
+          hash = ( hash * 7 ) + ( hash >> 13 ) + key.bytes[i];
+        }
+        return fuzz_hash(hash);
+      }
+      static bool is_empty(const position_key &key) { return key.bytes == 0; }
+    };
+
+    static uint64_t edge_key(unsigned from, unsigned to) {
+      return ((uint64_t)(from + 1) << 32) | to;
+    }
+
+    // the default 64 bit hash folds the two vertices together, so neighbouring edges collide.
+    class edge_key_cmp : public hash_map_cmp {
+    public:
+      static unsigned get_hash(uint64_t key) { return fuzz_hash((unsigned)((key * 0x9E3779B97F4A7C15ull) >> 32)); }
+      static bool is_empty(uint64_t key) { return !key; }
+    };
+
+    // follow a border or seam loop through a collapse.
+    static void remap_loop(dynarray<unsigned> &loop, const dynarray<unsigned> &collapse_remap) {
+      for (unsigned i = 0; i != loop.size(); ++i) {
+        unsigned target = loop[i];
+        if (target == ~0u) continue;
+        unsigned r = collapse_remap[target];
+        loop[i] = r == i ? loop[target] : r;
+      }
+    }
+
+  public:
+    /// Remove triangles until there are at most target_indices indices or no collapse is within target_error.
+    /// target_error is a distance in model units. The result uses the original vertices; dest needs num_indices room.
+    /// Returns the number of indices written to dest. result_error, if given, is the largest error used.
+    static unsigned simplify(
+      uint32_t *dest, const uint32_t *indices, unsigned num_indices,
+      const uint8_t *vertices, unsigned num_vertices, unsigned stride, unsigned pos_offset,
+      unsigned target_indices, float target_error, float *result_error = 0
+    ) {
+      num_indices -= num_indices % 3;
+      if (result_error) *result_error = 0;
+      if (num_indices) memcpy(dest, indices, num_indices * sizeof(uint32_t));
+      if (num_indices <= target_indices) return num_indices;
+
+      // remap[v] is the first vertex with v's position. wedge[v] cycles through the vertices at v's position.
+      dynarray<vec3> pos(num_vertices);
+      dynarray<unsigned> remap(num_vertices), wedge(num_vertices);
+      {
+        hash_map<position_key, unsigned, position_key_cmp> position_to_vertex;
+        for (unsigned v = 0; v != num_vertices; ++v) {
+          float p[3];
+          memcpy(p, vertices + v * stride + pos_offset, sizeof(p));
+          pos[v] = vec3(p[0], p[1], p[2]);
+
+          // the map stores vertex + 1 so that zero means a new position
+          position_key key = { vertices + v * stride + pos_offset };
+          unsigned &first = position_to_vertex[key];
+          if (first == 0) {
+            first = v + 1;
+            remap[v] = v;
+            wedge[v] = v;
+          } else {
+            unsigned r = first - 1;
+            remap[v] = r;
+            wedge[v] = wedge[r];
+            wedge[r] = v;
+          }
+        }
+      }
+
+      // open edges have no twin going the other way: loop[v] follows them forwards, loopback[v] backwards.
+      hash_map<uint64_t, unsigned, edge_key_cmp> edges;
+      for (unsigned i = 0; i != num_indices; ++i) {
+        unsigned a = indices[i], b = indices[i % 3 == 2 ? i - 2 : i + 1];
+        edges[edge_key(a, b)] = 1;
+      }
+
+      dynarray<unsigned> open_out(num_vertices), open_in(num_vertices), loop(num_vertices), loopback(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        open_out[v] = open_in[v] = 0;
+        loop[v] = loopback[v] = ~0u;
+      }
+      for (unsigned i = 0; i != num_indices; ++i) {
+        unsigned a = indices[i], b = indices[i % 3 == 2 ? i - 2 : i + 1];
+        if (edges.contains(edge_key(b, a))) continue;
+        open_out[a]++;
+        open_in[b]++;
+        loop[a] = b;
+        loopback[b] = a;
+      }
+
+      dynarray<uint8_t> kind(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        if (remap[v] != v) continue;
+        unsigned w = wedge[v], k = kind_locked;
+        if (w == v) {
+          if (open_out[v] == 0 && open_in[v] == 0) {
+            k = kind_manifold;
+          } else if (open_out[v] == 1 && open_in[v] == 1) {
+            k = kind_border;
+          }
+        } else if (wedge[w] == v) {
+          // the open edges of each side must run to the same positions as the other side's.
+          bool simple = open_out[v] == 1 && open_in[v] == 1 && open_out[w] == 1 && open_in[w] == 1;
+          if (simple && remap[loop[v]] == remap[loopback[w]] && remap[loopback[v]] == remap[loop[w]]) {
+            k = kind_seam;
+          }
+        }
+        unsigned x = v;
+        do {
+          kind[x] = (uint8_t)k;
+          x = wedge[x];
+        } while (x != v);
+      }
+
+      // plane quadrics of the triangles and open edges, summed for each position.
+      dynarray<quadric> quadrics(num_vertices);
+      memset(quadrics.data(), 0, num_vertices * sizeof(quadric));
+      for (unsigned i = 0; i != num_indices; i += 3) {
+        vec3 p0 = pos[indices[i]], p1 = pos[indices[i + 1]], p2 = pos[indices[i + 2]];
+        vec3 normal = cross(p1 - p0, p2 - p0);
+        float area = length(normal);
+        if (area == 0) continue;
+        normal = normal / area;
+        for (unsigned k = 0; k != 3; ++k) {
+          quadrics[remap[indices[i + k]]].add_plane(normal, -dot(normal, p0), area);
+        }
+
+        for (unsigned k = 0; k != 3; ++k) {
+          unsigned a = indices[i + k], b = indices[i + (k + 1) % 3];
+          if (loop[a] != b || kind[a] == kind_manifold) continue;
+          vec3 edge = pos[b] - pos[a];
+          float len = length(edge);
+          vec3 side = cross(edge, normal);
+          float side_len = length(side);
+          if (side_len == 0) continue;
+          side = side / side_len;
+          float d = -dot(side, pos[a]);
+          quadrics[remap[a]].add_plane(side, d, len * len * edge_weight());
+          quadrics[remap[b]].add_plane(side, d, len * len * edge_weight());
+        }
+      }
+
+      float max_error = target_error * target_error;
+      float used_error = 0;
+      unsigned count = num_indices;
+
+      dynarray<unsigned> collapse_remap(num_vertices);
+      dynarray<uint8_t> locked(num_vertices);
+      dynarray<unsigned> first_tri(num_vertices + 1), tri_count(num_vertices), adjacency;
+      dynarray<collapse> collapses;
+
+      while (count > target_indices) {
+        unsigned num_tris = count / 3;
+
+        // triangles around each position.
+        for (unsigned v = 0; v != num_vertices; ++v) {
+          tri_count[v] = 0;
+        }
+        for (unsigned i = 0; i != count; ++i) {
+          tri_count[remap[dest[i]]]++;
+        }
+        first_tri[0] = 0;
+        for (unsigned v = 0; v != num_vertices; ++v) {
+          first_tri[v + 1] = first_tri[v] + tri_count[v];
+          tri_count[v] = 0;
+        }
+        adjacency.resize(count);
+        for (unsigned i = 0; i != count; ++i) {
+          unsigned r = remap[dest[i]];
+          adjacency[first_tri[r] + tri_count[r]++] = i / 3;
+        }
+
+        // the cheaper direction of each edge that may collapse.
+        collapses.resize(0);
+        for (unsigned i = 0; i != count; ++i) {
+          unsigned a = dest[i], b = dest[i % 3 == 2 ? i - 2 : i + 1];
+          if (remap[a] == remap[b]) continue;
+          collapse c = { ~0u, ~0u, 1e37f };
+          for (unsigned dir = 0; dir != 2; ++dir) {
+            unsigned from = dir ? b : a, to = dir ? a : b;
+            unsigned k = kind[from];
+            bool ok = k == kind_manifold || (
+              (k == kind_border || k == kind_seam) && kind[to] == k &&
+              (loop[from] == to || loopback[from] == to)
+            );
+            if (!ok) continue;
+            float error = quadrics[remap[from]].error(pos[to]);
+            if (error < c.error) {
+              c.from = from;
+              c.to = to;
+              c.error = error;
+            }
+          }
+          if (c.from != ~0u && c.error <= max_error) collapses.push_back(c);
+        }
+        if (collapses.empty()) break;
+        std::sort(collapses.data(), collapses.data() + collapses.size());
+
+        for (unsigned v = 0; v != num_vertices; ++v) {
+          collapse_remap[v] = v;
+          locked[v] = 0;
+        }
+
+        // do the cheapest collapses that do not touch each other's triangles.
+        unsigned num_collapsed = 0, tris_left = num_tris, target_tris = target_indices / 3;
+        for (unsigned j = 0; j != collapses.size() && tris_left > target_tris; ++j) {
+          const collapse &c = collapses[j];
+          unsigned ra = remap[c.from], rb = remap[c.to];
+          if (locked[ra] || locked[rb]) continue;
+
+          // the other side of a seam follows its own open edge to rb.
+          unsigned other = wedge[c.from], other_to = ~0u;
+          if (kind[c.from] == kind_seam) {
+            if (loop[other] != ~0u && remap[loop[other]] == rb) {
+              other_to = loop[other];
+            } else if (loopback[other] != ~0u && remap[loopback[other]] == rb) {
+              other_to = loopback[other];
+            } else {
+              continue;
+            }
+          }
+
+          // reject collapses that turn triangles over.
+          bool flips = false;
+          unsigned removed = 0;
+          for (unsigned t = first_tri[ra]; t != first_tri[ra + 1] && !flips; ++t) {
+            const uint32_t *tri = dest + adjacency[t] * 3;
+            unsigned r0 = remap[tri[0]], r1 = remap[tri[1]], r2 = remap[tri[2]];
+            if (r0 == rb || r1 == rb || r2 == rb) {
+              removed++;
+              continue;
+            }
+            vec3 p0 = pos[r0], p1 = pos[r1], p2 = pos[r2];
+            vec3 before = cross(p1 - p0, p2 - p0);
+            p0 = r0 == ra ? pos[rb] : p0;
+            p1 = r1 == ra ? pos[rb] : p1;
+            p2 = r2 == ra ? pos[rb] : p2;
+            vec3 after = cross(p1 - p0, p2 - p0);
+            flips = dot(before, after) <= 0;
+          }
+          if (flips) continue;
+
+          collapse_remap[c.from] = c.to;
+          if (other_to != ~0u) collapse_remap[other] = other_to;
+          quadrics[rb].add(quadrics[ra]);
+
+          for (unsigned t = first_tri[ra]; t != first_tri[ra + 1]; ++t) {
+            const uint32_t *tri = dest + adjacency[t] * 3;
+            locked[remap[tri[0]]] = locked[remap[tri[1]]] = locked[remap[tri[2]]] = 1;
+          }
+          locked[rb] = 1;
+
+          used_error = c.error > used_error ? c.error : used_error;
+          tris_left = tris_left > removed ? tris_left - removed : 0;
+          num_collapsed++;
+        }
+        if (num_collapsed == 0) break;
+
+        // move the collapsed corners and drop the triangles that have become lines.
+        unsigned new_count = 0;
+        for (unsigned i = 0; i != count; i += 3) {
+          unsigned a = collapse_remap[dest[i]], b = collapse_remap[dest[i + 1]], c = collapse_remap[dest[i + 2]];
+          unsigned ra = remap[a], rb = remap[b], rc = remap[c];
+          if (ra == rb || rb == rc || rc == ra) continue;
+          dest[new_count++] = a;
+          dest[new_count++] = b;
+          dest[new_count++] = c;
+        }
+        count = new_count;
+        remap_loop(loop, collapse_remap);
+        remap_loop(loopback, collapse_remap);
+      }
+
+      if (result_error) *result_error = sqrtf(used_error);
+      return count;
+    }
+
+    /// Build simpler versions of a mesh, one for each error limit (model units, smallest first).
+    /// lods[0] is src itself with error 0. A level is left out if it has as many triangles as the one before.
+    /// The levels are simplified from src in parallel and optimised with mesh_optimizer.
+    /// GL calls, so main thread only. Returns the number of meshes in lods.
+    static unsigned build_lod_chain(mesh *src, const float *target_errors, unsigned num_levels, dynarray<ref<mesh> > &lods, dynarray<float> &errors) {
+      lods.resize(0);
+      errors.resize(0);
+      lods.push_back(src);
+      errors.push_back(0.0f);
+
+      dynarray<uint8_t> vertices;
+      dynarray<uint32_t> indices;
+      unsigned pos_offset = 0;
+      if (!mesh_optimizer::read_triangles(src, vertices, indices, pos_offset)) {
+        printf("warning: mesh_simplifier needs indexed triangles with float positions\n");
+        return lods.size();
+      }
+
+      // repeated vertices would lock their positions.
+      unsigned stride = src->get_stride();
+      unsigned num_indices = indices.size();
+      unsigned num_vertices = mesh_optimizer::weld(vertices.data(), src->get_num_vertices(), stride, indices.data(), num_indices);
+
+      struct level {
+        dynarray<uint8_t> vertices;
+        dynarray<uint32_t> indices;
+        unsigned num_vertices;
+        float error;
+      };
+      dynarray<level> levels(num_levels);
+
+      parallel_for(0, num_levels, [&](unsigned l) {
+        level &lv = levels[l];
+        lv.indices.resize(num_indices);
+        unsigned count = simplify(
+          lv.indices.data(), indices.data(), num_indices, vertices.data(), num_vertices, stride, pos_offset,
+          0, target_errors[l], &lv.error
+        );
+        lv.indices.resize(count);
+        lv.vertices.resize(vertices.size());
+        memcpy(lv.vertices.data(), vertices.data(), vertices.size());
+        lv.num_vertices = mesh_optimizer::optimize(lv.vertices.data(), num_vertices, stride, pos_offset, lv.indices.data(), count);
+      });
+
+      unsigned prev_indices = num_indices;
+      for (unsigned l = 0; l != num_levels; ++l) {
+        level &lv = levels[l];
+        if (lv.indices.size() >= prev_indices || lv.indices.size() == 0) continue;
+        prev_indices = lv.indices.size();
+
+        mesh *msh = new mesh(*src);
+        mesh_optimizer::write_triangles(msh, lv.vertices.data(), lv.num_vertices, lv.indices.data(), lv.indices.size());
+        msh->set_aabb(src->get_aabb());
+        lods.push_back(msh);
+        errors.push_back(lv.error);
+      }
+      return lods.size();
+    }
+  };
+}}
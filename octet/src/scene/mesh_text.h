@@ -54,7 +54,7 @@ namespace octet { namespace scene {
 	      unsigned max_indices = max_quads * 6;
 	      unsigned vsize = sizeof(vertex) * max_vertices;
 	      unsigned isize = sizeof(uint32_t) * max_indices;
-	      allocate(vsize, isize);
+	      allocate_stream(vsize, isize);
       }
 
       vertex *vtx = (vertex *)get_vertices()->lock();
@@ -34,6 +34,9 @@ namespace octet { namespace scene {
 
     dynarray<ref<mesh_voxel_subcube> > subcubes;
 
+    // faces that fit in the streaming buffers
+    unsigned max_faces;
+
     struct kd_node {
       int axis;
       int kids[2];
@@ -73,7 +76,11 @@ namespace octet { namespace scene {
         }
       }
 
-      allocate(sizeof(vertex)*count.num_faces*4, sizeof(uint32_t)*count.num_faces*6);
+      // grow the streaming buffers with room to spare; otherwise just write the next region.
+      if (count.num_faces > max_faces || !get_vertices()->is_streaming()) {
+        max_faces = std::max(count.num_faces + count.num_faces / 2, 256u);
+        allocate_stream(sizeof(vertex)*max_faces*4, sizeof(uint32_t)*max_faces*6);
+      }
       set_num_indices(count.num_faces*6);
       set_num_vertices(count.num_faces*4);
 
@@ -166,6 +173,7 @@ namespace octet { namespace scene {
       set_default_attributes();
       voxel_size = voxel_size_in;
       size = size_in;
+      max_faces = 0;
       //set_aabb(aabb(vec3(0, 0, 0), size));
 
       subcubes.resize(size.x() * size.y() * size.z());
@@ -0,0 +1,405 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// software occlusion culling
+//
+// A few large occluder meshes (walls, floors, big crates) are drawn on the CPU into a small
+// depth buffer. Triangles are set up on the worker threads, binned into screen tiles and then
+// each tile is rasterised by one worker, four pixels at a time. The depth buffer is reduced to
+// a pyramid of the farthest depth in each 2x2 block, so a box can be tested against a handful
+// of texels: if its nearest point is behind all of them, it is hidden.
+//
+// Nothing is read back from the GPU, so this also works without a window.
+//
+
+namespace octet { namespace scene {
+  /// CPU depth buffer and depth pyramid for occlusion culling.
+  ///
+  /// Depths are clip space z/w, with 1 (the far plane) where no occluder has been drawn.
+  class occlusion_buffer {
+    enum { tile_width = 32, tile_height = 16 };
+
+    // triangle soup from an occluder mesh, read from the GL buffers once, or from add_occluder_mesh().
+    struct occluder_mesh {
+      ref<mesh> msh;
+      dynarray<vec4> positions;
+      dynarray<uint32_t> indices;
+    };
+
+    // an occluder added this frame
+    struct occluder {
+      int mesh_index;
+      unsigned first_tri;
+      mat4t modelToProjection;
+    };
+
+    // a triangle in pixel coordinates ready to rasterise.
+    struct screen_tri {
+      // edge i is a[i] * x + b[i] * y + c[i], positive inside.
+      float a[3], b[3], c[3];
+
+      // depth is z0 + dzdx * x + dzdy * y
+      float z0, dzdx, dzdy;
+
+      // pixels whose centres may be inside, empty (x0 > x1) if the triangle is skipped.
+      int x0, y0, x1, y1;
+    };
+
+    unsigned width;
+    unsigned height;
+    unsigned tiles_x;
+    unsigned tiles_y;
+
+    // all levels of the pyramid, level 0 is the depth buffer.
+    dynarray<float> pyramid;
+    dynarray<unsigned> level_offset;
+    dynarray<unsigned> level_width;
+    dynarray<unsigned> level_height;
+
+    dynarray<occluder_mesh> meshes;
+    hash_map<void *, int> mesh_map;
+
+    dynarray<occluder> occluders;
+    dynarray<screen_tri> tris;
+
+    // triangles overlapping each tile: bin_tris[bin_start[t]] to bin_tris[bin_start[t+1]]
+    dynarray<unsigned> bin_start;
+    dynarray<unsigned> bin_tris;
+
+    mat4t worldToProjection;
+
+    // copy the positions and indices of an occluder mesh. returns -1 if it can't be used.
+    int find_mesh(mesh *msh) {
+      int &index = mesh_map[(void*)msh];
+      if (index < 0) return -1;
+      if (index) return index - 1;
+
+      if (msh->get_skin()) {
+        index = -1;
+        return -1;
+      }
+
+      meshes.resize(meshes.size() + 1);
+      occluder_mesh &om = meshes.back();
+      om.msh = msh;
+      if (!msh->get_triangles(om.positions, om.indices) || om.indices.empty()) {
+        meshes.resize(meshes.size() - 1);
+        index = -1;
+        return -1;
+      }
+
+      index = (int)meshes.size();
+      return index - 1;
+    }
+
+    // transform one triangle to pixels and set up its edges and depth plane.
+    void setup_tri(screen_tri &t, const vec4 &c0, const vec4 &c1, const vec4 &c2) const {
+      t.x0 = 0; t.x1 = -1; t.y0 = 0; t.y1 = -1;
+
+      // skip triangles that cross the near plane; losing part of an occluder is safe.
+      const vec4 *clip[3] = { &c0, &c1, &c2 };
+      float x[3], y[3], z[3];
+      for (unsigned i = 0; i != 3; ++i) {
+        const vec4 &c = *clip[i];
+        if (c.w() < 1e-5f || c.z() < -c.w()) return;
+        float r = 1.0f / c.w();
+        x[i] = (c.x() * r * 0.5f + 0.5f) * width;
+        y[i] = (c.y() * r * 0.5f + 0.5f) * height;
+        z[i] = c.z() * r;
+      }
+
+      float det = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+      if (fabsf(det) < 1e-8f) return;
+
+      // both windings are drawn; flip the edges of clockwise triangles.
+      float sign = det > 0 ? 1.0f : -1.0f;
+      for (unsigned i = 0; i != 3; ++i) {
+        unsigned j = i == 2 ? 0 : i + 1;
+        t.a[i] = (y[i] - y[j]) * sign;
+        t.b[i] = (x[j] - x[i]) * sign;
+        t.c[i] = (x[i] * y[j] - y[i] * x[j]) * sign;
+      }
+
+      float rdet = 1.0f / det;
+      t.dzdx = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) * rdet;
+      t.dzdy = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) * rdet;
+      t.z0 = z[0] - t.dzdx * x[0] - t.dzdy * y[0];
+
+      // pixel centres are at +0.5
+      float xmin = std::min(x[0], std::min(x[1], x[2])), xmax = std::max(x[0], std::max(x[1], x[2]));
+      float ymin = std::min(y[0], std::min(y[1], y[2])), ymax = std::max(y[0], std::max(y[1], y[2]));
+      t.x0 = std::max((int)ceilf(xmin - 0.5f), 0);
+      t.y0 = std::max((int)ceilf(ymin - 0.5f), 0);
+      t.x1 = std::min((int)floorf(xmax - 0.5f), (int)width - 1);
+      t.y1 = std::min((int)floorf(ymax - 0.5f), (int)height - 1);
+    }
+
+    // draw the triangles binned to one tile.
+    void rasterize_tile(unsigned tile) {
+      int left = (tile % tiles_x) * tile_width;
+      int bottom = (tile / tiles_x) * tile_height;
+      int right = left + tile_width - 1;
+      int top = bottom + tile_height - 1;
+      float *depth = pyramid.data();
+      vec4 lane_offset(0.5f, 1.5f, 2.5f, 3.5f);
+
+      for (unsigned k = bin_start[tile]; k != bin_start[tile+1]; ++k) {
+        const screen_tri &t = tris[bin_tris[k]];
+        int x0 = std::max(t.x0, left) & ~3;
+        int x1 = std::min(t.x1, right);
+        int y0 = std::max(t.y0, bottom);
+        int y1 = std::min(t.y1, top);
+
+        for (int y = y0; y <= y1; ++y) {
+          float py = y + 0.5f;
+          float e0_row = t.b[0] * py + t.c[0];
+          float e1_row = t.b[1] * py + t.c[1];
+          float e2_row = t.b[2] * py + t.c[2];
+          float z_row = t.dzdy * py + t.z0;
+          float *row = depth + y * width;
+
+          // four pixels at a time; the buffer width is a multiple of four.
+          for (int x = x0; x <= x1; x += 4) {
+            vec4 px = vec4((float)x) + lane_offset;
+            vec4 e0 = px * t.a[0] + e0_row;
+            vec4 e1 = px * t.a[1] + e1_row;
+            vec4 e2 = px * t.a[2] + e2_row;
+            vec4 z = px * t.dzdx + z_row;
+            vec4 inside = e0.min(e1).min(e2);
+            for (int l = 0; l != 4; ++l) {
+              if (inside[l] >= 0 && z[l] < row[x + l]) row[x + l] = z[l];
+            }
+          }
+        }
+      }
+    }
+
+    // each texel of a level is the farthest of the 2x2 texels below it.
+    // above an odd sized level, the last column or row only covers one column or row below it.
+    void build_pyramid() {
+      for (unsigned level = 1; level != level_offset.size(); ++level) {
+        const float *src = pyramid.data() + level_offset[level-1];
+        float *dest = pyramid.data() + level_offset[level];
+        unsigned sw = level_width[level-1], sh = level_height[level-1];
+        unsigned dw = level_width[level], dh = level_height[level];
+        parallel_for(0, dh, [&](unsigned y) {
+          unsigned y0 = std::min(y * 2, sh - 1), y1 = std::min(y * 2 + 1, sh - 1);
+          for (unsigned x = 0; x != dw; ++x) {
+            unsigned x0 = std::min(x * 2, sw - 1), x1 = std::min(x * 2 + 1, sw - 1);
+            float a = std::max(src[y0 * sw + x0], src[y0 * sw + x1]);
+            float b = std::max(src[y1 * sw + x0], src[y1 * sw + x1]);
+            dest[y * dw + x] = std::max(a, b);
+          }
+        });
+      }
+    }
+
+  public:
+    /// width must be a multiple of 32 and height a multiple of 16.
+    occlusion_buffer(unsigned width = 256, unsigned height = 128) {
+      set_size(width, height);
+      worldToProjection.loadIdentity();
+    }
+
+    /// change the resolution of the depth buffer.
+    void set_size(unsigned new_width, unsigned new_height) {
+      width = std::max((new_width + tile_width - 1) & ~(tile_width - 1), (unsigned)tile_width);
+      height = std::max((new_height + tile_height - 1) & ~(tile_height - 1), (unsigned)tile_height);
+      tiles_x = width / tile_width;
+      tiles_y = height / tile_height;
+
+      level_offset.resize(0);
+      level_width.resize(0);
+      level_height.resize(0);
+      unsigned total = 0;
+      // round up, so the last column or row of an odd sized level is not lost.
+      for (unsigned w = width, h = height; ; w = (w + 1) / 2, h = (h + 1) / 2) {
+        level_offset.push_back(total);
+        level_width.push_back(w);
+        level_height.push_back(h);
+        total += w * h;
+        if (w == 1 && h == 1) break;
+      }
+      pyramid.resize(total);
+      for (unsigned i = 0; i != total; ++i) pyramid[i] = 1.0f;
+    }
+
+    /// forget cached occluder meshes.
+    void reset() {
+      meshes.reset();
+      mesh_map.clear();
+      occluders.reset();
+    }
+
+    /// start a new frame.
+    void begin(const mat4t &worldToProjection) {
+      this->worldToProjection = worldToProjection;
+      occluders.resize(0);
+    }
+
+    /// add occluder geometry that is not in a GL mesh, eg. for runs without a window.
+    /// Returns an index for add_occluder().
+    int add_occluder_mesh(const vec4 *positions, unsigned num_positions, const uint32_t *indices, unsigned num_indices) {
+      meshes.resize(meshes.size() + 1);
+      occluder_mesh &om = meshes.back();
+      om.positions.resize(num_positions);
+      memcpy(om.positions.data(), positions, num_positions * sizeof(vec4));
+      om.indices.resize(num_indices);
+      memcpy(om.indices.data(), indices, num_indices * sizeof(uint32_t));
+      return (int)meshes.size() - 1;
+    }
+
+    /// add an occluder for this frame. Call from the main thread; the first time a mesh
+    /// is seen its vertices and indices are read from GL.
+    bool add_occluder(mesh *msh, const mat4t &modelToWorld) {
+      int mesh_index = find_mesh(msh);
+      if (mesh_index < 0) return false;
+      add_occluder(mesh_index, modelToWorld);
+      return true;
+    }
+
+    /// add an occluder from add_occluder_mesh() for this frame.
+    void add_occluder(int mesh_index, const mat4t &modelToWorld) {
+      occluder o;
+      o.mesh_index = mesh_index;
+      o.first_tri = 0;
+      o.modelToProjection = modelToWorld * worldToProjection;
+      occluders.push_back(o);
+    }
+
+    /// draw the occluders and build the depth pyramid.
+    void render() {
+      unsigned num_tris = 0;
+      for (unsigned i = 0; i != occluders.size(); ++i) {
+        occluders[i].first_tri = num_tris;
+        num_tris += meshes[occluders[i].mesh_index].indices.size() / 3;
+      }
+      tris.resize(num_tris);
+
+      // transform and set up the triangles of each occluder.
+      parallel_for(0, occluders.size(), [&](unsigned i) {
+        const occluder &o = occluders[i];
+        const occluder_mesh &om = meshes[o.mesh_index];
+        const uint32_t *idx = om.indices.data();
+        const vec4 *pos = om.positions.data();
+        screen_tri *dest = tris.data() + o.first_tri;
+        for (unsigned t = 0; t != om.indices.size() / 3; ++t) {
+          vec4 c0 = pos[idx[t*3+0]] * o.modelToProjection;
+          vec4 c1 = pos[idx[t*3+1]] * o.modelToProjection;
+          vec4 c2 = pos[idx[t*3+2]] * o.modelToProjection;
+          setup_tri(dest[t], c0, c1, c2);
+        }
+      });
+
+      // bin the triangles into tiles: count, then prefix sum, then fill.
+      unsigned num_tiles = tiles_x * tiles_y;
+      bin_start.resize(num_tiles + 1);
+      for (unsigned i = 0; i != num_tiles + 1; ++i) bin_start[i] = 0;
+      for (unsigned pass = 0; pass != 2; ++pass) {
+        for (unsigned i = 0; i != num_tris; ++i) {
+          const screen_tri &t = tris[i];
+          if (t.x0 > t.x1 || t.y0 > t.y1) continue;
+          for (int ty = t.y0 / tile_height; ty <= t.y1 / tile_height; ++ty) {
+            for (int tx = t.x0 / tile_width; tx <= t.x1 / tile_width; ++tx) {
+              unsigned tile = ty * tiles_x + tx;
+              if (pass == 0) {
+                bin_start[tile + 1]++;
+              } else {
+                bin_tris[bin_start[tile]++] = i;
+              }
+            }
+          }
+        }
+        if (pass == 0) {
+          for (unsigned t = 0; t != num_tiles; ++t) bin_start[t + 1] += bin_start[t];
+          bin_tris.resize(bin_start[num_tiles]);
+        } else {
+          // filling moved each start to the next tile's start.
+          for (unsigned t = num_tiles; t != 0; --t) bin_start[t] = bin_start[t - 1];
+          bin_start[0] = 0;
+        }
+      }
+
+      float *depth = pyramid.data();
+      for (unsigned i = 0; i != width * height; ++i) depth[i] = 1.0f;
+
+      parallel_for(0, num_tiles, [&](unsigned tile) {
+        rasterize_tile(tile);
+      });
+
+      build_pyramid();
+    }
+
+    /// false if the box is certainly hidden behind the occluders. Safe to call from several threads.
+    bool is_visible(const aabb &bb) const {
+      if (occluders.empty()) return true;
+
+      vec3 lo = bb.get_min(), hi = bb.get_max();
+      float xmin = 1e37f, ymin = 1e37f, xmax = -1e37f, ymax = -1e37f, zmin = 1e37f;
+      for (unsigned i = 0; i != 8; ++i) {
+        vec4 corner(i & 1 ? hi.x() : lo.x(), i & 2 ? hi.y() : lo.y(), i & 4 ? hi.z() : lo.z(), 1);
+        vec4 c = corner * worldToProjection;
+
+        // boxes crossing the camera plane are always visible.
+        if (c.w() < 1e-5f) return true;
+        float r = 1.0f / c.w();
+        float x = (c.x() * r * 0.5f + 0.5f) * width;
+        float y = (c.y() * r * 0.5f + 0.5f) * height;
+        xmin = std::min(xmin, x); xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y); ymax = std::max(ymax, y);
+        zmin = std::min(zmin, c.z() * r);
+      }
+
+      // every pixel the box touches, clamped to the screen.
+      if (xmax < 0 || ymax < 0 || xmin >= width || ymin >= height) return true;
+      int x0 = std::max((int)floorf(xmin), 0), x1 = std::min((int)floorf(xmax), (int)width - 1);
+      int y0 = std::max((int)floorf(ymin), 0), y1 = std::min((int)floorf(ymax), (int)height - 1);
+
+      // go up the pyramid until the box covers only a few texels.
+      unsigned level = 0;
+      while (level + 1 != level_offset.size() && (x1 - x0 > 3 || y1 - y0 > 3)) {
+        x0 >>= 1; x1 >>= 1; y0 >>= 1; y1 >>= 1;
+        level++;
+      }
+
+      const float *src = pyramid.data() + level_offset[level];
+      unsigned w = level_width[level];
+      x1 = std::min(x1, (int)w - 1);
+      y1 = std::min(y1, (int)level_height[level] - 1);
+      for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+          if (zmin <= src[y * w + x]) return true;
+        }
+      }
+      return false;
+    }
+
+    /// number of occluders added since begin().
+    unsigned get_num_occluders() const {
+      return occluders.size();
+    }
+
+    /// number of occluder triangles in the last render().
+    unsigned get_num_triangles() const {
+      return tris.size();
+    }
+
+    /// width of the depth buffer in pixels.
+    unsigned get_width() const {
+      return width;
+    }
+
+    /// height of the depth buffer in pixels.
+    unsigned get_height() const {
+      return height;
+    }
+
+    /// depth of a pixel from the last render(), for debugging.
+    float get_depth(unsigned x, unsigned y) const {
+      return pyramid[y * width + x];
+    }
+  };
+}}
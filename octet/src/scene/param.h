@@ -90,10 +90,14 @@ namespace octet { namespace scene {
 
   struct param_buffer_info {
     GLint texture_slot;
+    uint8_t uniform_buffer;
     dynarray<uint8_t> &buffer;
 
-    param_buffer_info(dynarray<uint8_t> &buffer) : buffer(buffer) {
+    /// each group of parameters starts on a 16 byte boundary, so it can be a std140 uniform block.
+    param_buffer_info(dynarray<uint8_t> &buffer, uint8_t uniform_buffer = 1) : buffer(buffer) {
       texture_slot = 0;
+      this->uniform_buffer = uniform_buffer;
+      buffer.resize((buffer.size() + 15) & ~15);
     }
   };
 
@@ -104,11 +108,37 @@ namespace octet { namespace scene {
   /// For OpenGL ES2 we keep uniforms in a dynarray and use glUniform* to copy them to OpenGL.
   /// For OpenGL ES3 we keep uniforms in a uniform buffer and use the buffer.
   /// The parameter uniform records the location, name and type of the uniform as well as the repeat count for arrays.
+  ///
+  /// Offsets follow the std140 rules, so a shader that declares the parameters in the same order
+  /// in a uniform block can read the buffer directly (see param_shader).
   class param_uniform : public param {
     GLint uniform;           // uniform index
     uint16_t offset;         // offset in uniform buffer
     uint16_t repeat;         // how many in array?
     uint8_t uniform_buffer;  // Which uniform buffer? 0 = dynamic, 1 = static.
+
+    // std140 base alignment and size of the type
+    static void get_layout(uint16_t type, uint16_t repeat, unsigned &align, unsigned &size) {
+      unsigned lanes = 4;
+      switch (type) {
+        case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_BOOL_VEC2: lanes = 2; break;
+        case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_BOOL_VEC3: lanes = 3; break;
+        case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_BOOL_VEC4: lanes = 4; break;
+        case GL_FLOAT_MAT2: case GL_FLOAT_MAT3: case GL_FLOAT_MAT4: lanes = 4; break;
+        default: lanes = 1; break;
+      }
+
+      // in arrays and matrices, everything is in units of 16 bytes
+      // matrices are repeats of vec4s
+      unsigned columns = type == GL_FLOAT_MAT2 ? 2 : type == GL_FLOAT_MAT3 ? 3 : type == GL_FLOAT_MAT4 ? 4 : 0;
+      if (repeat > 1 || columns) {
+        align = 16;
+        size = repeat * 16 * (columns ? columns : 1);
+      } else {
+        align = lanes == 3 ? 16 : lanes * 4;
+        size = lanes * 4;
+      }
+    }
   public:
     RESOURCE_META(param_uniform)
 
@@ -121,18 +151,13 @@ namespace octet { namespace scene {
       param(name, _type, _stage)
     {
       repeat = _repeat;
+      uniform_buffer = pbi.uniform_buffer;
 
-      // in uniform buffers, everything is in units of 16 bytes
-      // matrices are repeats of vec4s
-      unsigned size = _repeat * 16;
-      switch (_type) {
-        case GL_FLOAT_MAT2: size *= 2; break;
-        case GL_FLOAT_MAT3: size *= 3; break;
-        case GL_FLOAT_MAT4: size *= 4; break;
-      }
+      unsigned align = 16, size = 16;
+      get_layout(_type, _repeat, align, size);
 
       //pbi.size += size;
-      offset = pbi.buffer.size();
+      offset = (pbi.buffer.size() + align - 1) & ~(align - 1);
       pbi.buffer.resize(offset + size);
 
       // if data is non-null, we add to the "buffer" part of pbi. (eg. colors)
@@ -197,6 +222,21 @@ namespace octet { namespace scene {
       return uniform_buffer;
     }
 
+    /// number of array elements
+    unsigned get_repeat() const {
+      return repeat;
+    }
+
+    /// true if the bytes in the buffer are laid out as std140 expects.
+    /// glUniform* wants arrays of scalars and small matrices packed, so those are not.
+    bool is_std140() {
+      switch (get_gl_type()) {
+        case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_BOOL_VEC4: case GL_FLOAT_MAT4: return true;
+        case GL_FLOAT_MAT2: case GL_FLOAT_MAT3: return false;
+        default: return repeat == 1;
+      }
+    }
+
     /// for OpenGL ES2, call glUniform* to copy the uniform to the GPU command buffer.
     /// for OpenGL ES3, we can use the uniform buffer directly and so don't need this.
     void render(const uint8_t *buffer) {
@@ -298,17 +338,77 @@ namespace octet { namespace scene {
   };
 
   /// Shader that uses parameters.
+  ///
+  /// If the shader declares "layout(std140) uniform dynamic_uniforms" or "static_uniforms",
+  /// the parameters of that uniform buffer are read from a buffer object instead of glUniform*.
+  /// The block must list the parameters in the order the material creates them.
   class param_shader : public shader {
+  public:
+    enum { dynamic_block, static_block, num_blocks };
+
+  private:
     std::string vertex_shader;
     std::string fragment_shader;
 
+    // for each block: 0 if unused, else size in bytes and start in the material's buffer.
+    GLint block_size[num_blocks];
+    unsigned block_start[num_blocks];
+
+    // find the block in the program and check the offsets GL gives agree with the params.
+    void bind_block(dynarray<ref<param> > &params, unsigned block) {
+      #ifndef OCTET_GLES2
+        static const char *names[] = { "dynamic_uniforms", "static_uniforms" };
+        GLuint program = get_program();
+        GLuint index = glGetUniformBlockIndex(program, names[block]);
+        if (index == GL_INVALID_INDEX) return;
+
+        glUniformBlockBinding(program, index, block);
+        GLint size = 0;
+        glGetActiveUniformBlockiv(program, index, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+
+        int start = -1;
+        for (unsigned i = 0; i != params.size(); ++i) {
+          param_uniform *pu = params[i]->get_param_uniform();
+          if (!pu || pu->get_uniform_buffer_index() != block) continue;
+
+          const char *name = pu->get_atom_name();
+          GLuint uniform_index = GL_INVALID_INDEX;
+          glGetUniformIndices(program, 1, &name, &uniform_index);
+          if (uniform_index == GL_INVALID_INDEX) continue;
+
+          GLint uniform_block = -1, offset = 0;
+          glGetActiveUniformsiv(program, 1, &uniform_index, GL_UNIFORM_BLOCK_INDEX, &uniform_block);
+          glGetActiveUniformsiv(program, 1, &uniform_index, GL_UNIFORM_OFFSET, &offset);
+          if (uniform_block != (GLint)index) continue;
+
+          if (start == -1) start = (int)pu->get_offset() - offset;
+          if (start < 0 || (start & 15) || (int)pu->get_offset() - offset != start || !pu->is_std140()) {
+            printf("warning: %s in %s does not match the std140 layout of the material\n", name, names[block]);
+            return;
+          }
+        }
+
+        block_size[block] = size;
+        block_start[block] = start < 0 ? 0 : start;
+      #endif
+    }
+
   public:
     RESOURCE_META(param_shader)
 
     param_shader() {
+      for (unsigned i = 0; i != num_blocks; ++i) {
+        block_size[i] = 0;
+        block_start[i] = 0;
+      }
     }
 
     param_shader(const char *vs_url, const char *fs_url) {
+      for (unsigned i = 0; i != num_blocks; ++i) {
+        block_size[i] = 0;
+        block_start[i] = 0;
+      }
+
       dynarray<uint8_t> vs;
       dynarray<uint8_t> fs;
       app_utils::get_url(vs, vs_url);
@@ -327,6 +427,22 @@ namespace octet { namespace scene {
       for (unsigned i = 0; i != params.size(); ++i) {
         params[i]->bind(pbi);
       }
+
+      for (unsigned i = 0; i != num_blocks; ++i) {
+        block_size[i] = 0;
+        block_start[i] = 0;
+        bind_block(params, i);
+      }
+    }
+
+    /// size in bytes of a uniform block (dynamic_block or static_block), or 0 if the shader does not use it.
+    unsigned get_block_size(unsigned block) const {
+      return (unsigned)block_size[block];
+    }
+
+    /// offset of the start of a uniform block in the material's buffer.
+    unsigned get_block_start(unsigned block) const {
+      return block_start[block];
     }
   };
 }}
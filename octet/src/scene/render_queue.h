@@ -0,0 +1,151 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// render queue: draws sorted by 64 bit keys
+//
+// Key layout, high bits first:
+//
+//   opaque:       layer:4 | 0 | shader:10 | material:14 | mesh:14 | depth:16 | 0:5
+//   translucent:  layer:4 | 1 | ~depth:16 | shader:10 | material:14 | mesh:14 | 0:5
+//
+// Opaque draws group by state and then go front to back; translucent draws go back to front.
+// Shaders, materials and meshes get small ids in the order they are first seen in a frame.
+//
+
+namespace octet { namespace scene {
+  /// Sort draws to minimise state changes.
+  class render_queue {
+    struct item {
+      uint64_t key;
+      unsigned index;
+    };
+
+    enum {
+      layer_bits = 4,
+      shader_bits = 10,
+      material_bits = 14,
+      mesh_bits = 14,
+      depth_bits = 16,
+    };
+
+    dynarray<item> items;
+    dynarray<item> scratch;
+
+    // per frame ids for shaders, materials and meshes
+    hash_map<void *, unsigned> ids[3];
+    unsigned num_ids[3];
+
+    unsigned get_id(unsigned kind, void *ptr, unsigned bits) {
+      if (!ptr) return 0;
+      unsigned &id = ids[kind][ptr];
+      if (id == 0) {
+        id = ++num_ids[kind];
+      }
+      unsigned max_id = (1 << bits) - 1;
+      return id < max_id ? id : max_id;
+    }
+
+    // the top bits of a positive float sort in the same order as the float.
+    static uint64_t quantize_depth(float depth) {
+      if (!(depth > 0)) return 0;
+      union { float f; uint32_t u; } u;
+      u.f = depth;
+      return u.u >> (32 - depth_bits);
+    }
+
+  public:
+    enum { shader_id, material_id, mesh_id };
+
+    render_queue() {
+      reset();
+    }
+
+    /// start a new frame.
+    void reset() {
+      items.resize(0);
+      for (unsigned i = 0; i != 3; ++i) {
+        ids[i].clear();
+        num_ids[i] = 0;
+      }
+
+    }
+
+    /// add a draw. index is returned by get_index() after sorting.
+    /// depth is the distance in front of the camera.
+    void add(unsigned index, unsigned layer, bool translucent, void *shader, void *mat, void *msh, float depth) {
+      uint64_t l = layer < (1 << layer_bits) ? layer : (1 << layer_bits) - 1;
+      uint64_t s = get_id(shader_id, shader, shader_bits);
+      uint64_t m = get_id(material_id, mat, material_bits);
+      uint64_t g = get_id(mesh_id, msh, mesh_bits);
+      uint64_t d = quantize_depth(depth);
+
+      uint64_t key = l << 60;
+      if (!translucent) {
+        key |= s << 49 | m << 35 | g << 21 | d << 5;
+      } else {
+        uint64_t far_first = (1 << depth_bits) - 1 - d;
+        key |= (uint64_t)1 << 59 | far_first << 43 | s << 33 | m << 19 | g << 5;
+      }
+
+      item it = { key, index };
+      items.push_back(it);
+    }
+
+    /// LSD radix sort, a byte at a time. Bytes that are the same for every key are skipped.
+    void sort() {
+      unsigned n = items.size();
+      if (n < 2) return;
+      scratch.resize(n);
+
+      unsigned counts[8][256];
+      memset(counts, 0, sizeof(counts));
+      for (unsigned i = 0; i != n; ++i) {
+        uint64_t key = items[i].key;
+        for (unsigned b = 0; b != 8; ++b) {
+          counts[b][(key >> (b * 8)) & 0xff]++;
+        }
+      }
+
+      item *src = items.data();
+      item *dest = scratch.data();
+      for (unsigned b = 0; b != 8; ++b) {
+        unsigned *count = counts[b];
+        unsigned shift = b * 8;
+        if (count[(src[0].key >> shift) & 0xff] == n) continue;
+
+        unsigned offset = 0;
+        for (unsigned i = 0; i != 256; ++i) {
+          unsigned c = count[i];
+          count[i] = offset;
+          offset += c;
+        }
+        for (unsigned i = 0; i != n; ++i) {
+          dest[count[(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+        item *tmp = src; src = dest; dest = tmp;
+      }
+
+      if (src != items.data()) {
+        memcpy(items.data(), src, n * sizeof(item));
+      }
+    }
+
+    /// number of draws
+    unsigned size() const {
+      return items.size();
+    }
+
+    /// index passed to add() of the i'th draw in sorted order
+    unsigned get_index(unsigned i) const {
+      return items[i].index;
+    }
+
+    /// sort key of the i'th draw
+    uint64_t get_key(unsigned i) const {
+      return items[i].key;
+    }
+  };
+}}
@@ -11,17 +11,28 @@
 #define OCTET_SCENE_INCLUDED
 
 #include "../scene/scene_node.h"
+#include "../scene/transform_hierarchy.h"
+#include "../scene/aabb_tree.h"
+#include "../scene/render_queue.h"
 #include "../scene/skin.h"
 #include "../scene/skeleton.h"
 #include "../scene/animation.h"
+#include "../scene/mesh_bvh.h"
 #include "../scene/mesh.h"
+#include "../scene/mesh_pool.h"
+#include "../scene/mesh_optimizer.h"
+#include "../scene/mesh_simplifier.h"
+#include "../scene/occlusion_buffer.h"
 #include "../scene/image.h"
+#include "../scene/texture_atlas.h"
+#include "../scene/volume_texture.h"
 #include "../scene/sampler.h"
 #include "../scene/param.h"
 #include "../scene/material.h"
 #include "../scene/light.h"
 #include "../scene/camera_instance.h"
 #include "../scene/light_instance.h"
+#include "../scene/lod_group.h"
 #include "../scene/mesh_instance.h"
 #include "../scene/animation_instance.h"
 #include "../scene/visual_scene.h"
@@ -27,6 +27,38 @@ namespace octet { namespace scene {
     // is this node and all its children renderable?
     bool enabled;
 
+    // nodeToParent * parent's nodeToWorld and whether all the parents are enabled.
+    // valid when world_dirty is false. A dirty node's children are always dirty too.
+    mat4t nodeToWorld;
+    bool world_enabled;
+    bool world_dirty;
+
+    // counts changes to nodeToWorld, so that users of the world box can tell when to refresh it.
+    unsigned world_version;
+
+    // invalidate the cached transforms of this node and its children.
+    void mark_dirty() {
+      if (world_dirty) return;
+      world_dirty = true;
+      for (int i = 0; i != children.size(); ++i) {
+        children[i]->mark_dirty();
+      }
+    }
+
+    // recompute the cached transform. The parent is made clean first.
+    void update_world() {
+      if (parent) {
+        if (parent->world_dirty) parent->update_world();
+        nodeToWorld = nodeToParent * parent->nodeToWorld;
+        world_enabled = enabled && parent->world_enabled;
+      } else {
+        nodeToWorld = nodeToParent;
+        world_enabled = enabled;
+      }
+      world_dirty = false;
+      world_version++;
+    }
+
   public:
     RESOURCE_META(scene_node)
 
@@ -35,6 +67,8 @@ namespace octet { namespace scene {
       nodeToParent.loadIdentity();
       sid = atom_;
       enabled = true;
+      world_dirty = true;
+      world_version = 0;
       if (parent) {
         parent->add_child(this);
       }
@@ -45,6 +79,8 @@ namespace octet { namespace scene {
       this->nodeToParent = nodeToParent;
       this->sid = sid;
       enabled = true;
+      world_dirty = true;
+      world_version = 0;
     }
 
     /// the virtual add_ref on animation_target gets passed to here and we pass iton (delegate it) to the resource
@@ -60,6 +96,7 @@ namespace octet { namespace scene {
     /// animation input: for now, we only support skeleton animation
     void set_value(atom_t sid, atom_t sub_target, atom_t component, float *value) {
       if (sub_target == atom_transform) {
+        mark_dirty();
         nodeToParent.init_transpose(value);
       }
     }
@@ -73,6 +110,11 @@ namespace octet { namespace scene {
       //log("visit scene_node nodeToParent\n");
       v.visit(nodeToParent, atom_nodeToParent);
       v.visit(sid, atom_sid);
+      if (v.is_reader()) {
+        get_topology_version()++;
+        world_dirty = false;
+        mark_dirty();
+      }
     }
 
 
@@ -80,6 +122,9 @@ namespace octet { namespace scene {
     void add_child(scene_node *new_node) {
       new_node->parent = this;
       children.push_back(new_node);
+      get_topology_version()++;
+      new_node->world_dirty = false;
+      new_node->mark_dirty();
     }
 
     /// Get the parent node of this node.
@@ -97,21 +142,58 @@ namespace octet { namespace scene {
       return children[index];
     }
 
-    // compute the scene_node to world matrix for an individual scene_node;
-    mat4t calcModelToWorld() {
-      mat4t result = nodeToParent;
-      for (scene_node *p = parent; p != NULL; p = p->parent) {
-        result = result * p->nodeToParent;
-      }
-      return result;
+    /// the scene_node to world matrix. Cached until this node or a parent moves.
+    const mat4t &calcModelToWorld() {
+      if (world_dirty) update_world();
+      return nodeToWorld;
     }
 
-    // calculate whether this node is enabled (recursively)
+    /// is this node and all of its parents enabled? Cached like the matrix.
     bool calcEnabled() {
-      for (scene_node *p = this; p != NULL; p = p->parent) {
-        if (!p->enabled) return false;
+      if (world_dirty) update_world();
+      return world_enabled;
+    }
+
+    /// store a world transform computed elsewhere, eg. by transform_hierarchy.
+    void set_world_transform(const mat4t &value, bool is_enabled) {
+      nodeToWorld = value;
+      world_enabled = is_enabled;
+      if (world_dirty) world_version++;
+      world_dirty = false;
+    }
+
+    /// changes whenever calcModelToWorld() may give a different answer.
+    unsigned get_world_version() {
+      if (world_dirty) update_world();
+      return world_version;
+    }
+
+    /// changes whenever a node is added anywhere, so that flattened copies of the tree know to rebuild.
+    static unsigned &get_topology_version() {
+      static unsigned version;
+      return version;
+    }
+
+    /// refresh the cached transforms of this node and everything under it, parents first.
+    /// Call once a frame after moving things; later queries are then just reads.
+    void update_world_transforms() {
+      if (world_dirty) update_world();
+      dynarray<scene_node*> stack;
+      stack.push_back(this);
+      while (!stack.empty()) {
+        scene_node *node = stack.back();
+        stack.pop_back();
+        for (unsigned i = 0; i != node->children.size(); ++i) {
+          scene_node *child = node->children[i];
+          if (child->world_dirty) {
+            child->nodeToWorld = child->nodeToParent * node->nodeToWorld;
+            child->world_enabled = child->enabled && node->world_enabled;
+            child->world_dirty = false;
+            child->world_version++;
+          }
+          stack.push_back(child);
+        }
       }
-      return true;
     }
 
     /// transform a point from model space to world space
@@ -134,7 +216,10 @@ namespace octet { namespace scene {
     }
 
     /// access the node to parent transform matrix for writing.
+    /// marks the world transforms of this node and its children out of date,
+    /// so use get_nodeToParent() if you only want to read it.
     mat4t &access_nodeToParent() {
+      mark_dirty();
       return nodeToParent;
     }
 
@@ -165,26 +250,31 @@ namespace octet { namespace scene {
 
     /// set enabled state
     void set_enabled(bool value) {
+      mark_dirty();
       enabled = value;
     }
 
     /// reset the matrix
     void loadIdentity() {
+      mark_dirty();
       nodeToParent.loadIdentity();
     }
 
     /// Translate the matrix
     void translate(vec3_in xyz) {
+      mark_dirty();
       nodeToParent.translate(xyz[0], xyz[1], xyz[2]);
     }
 
     /// Rotate the matrix
     void rotate(float angle, vec3_in axis) {
+      mark_dirty();
       nodeToParent.rotate(angle, axis[0], axis[1], axis[2]);
     }
 
     /// Scale the matrix
     void scale(vec3_in xyz) {
+      mark_dirty();
       nodeToParent.scale(xyz[0], xyz[1], xyz[2]);
     }
 
@@ -0,0 +1,413 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// texture atlas: many small images packed into a few large textures
+//
+// Images are packed with a skyline allocator, tallest first, into pages of a fixed size.
+// Each image is surrounded by a border of its own edge pixels so that bilinear filtering
+// and the first few mip levels do not pick up colours from its neighbours.
+//
+
+namespace octet { namespace scene {
+  /// Pack sprites, font pages and other small images into a few textures.
+  ///
+  /// Drawing a 2D scene from an atlas needs one texture bind per page instead of one per sprite.
+  ///
+  /// Example
+  ///
+  ///     texture_atlas *atlas = new texture_atlas();
+  ///     int ship = atlas->add("assets/invaderers/ship.gif");
+  ///     int bomb = atlas->add("assets/invaderers/bomb.gif");
+  ///     atlas->build();
+  ///     glBindTexture(GL_TEXTURE_2D, atlas->get_gl_texture(atlas->get_page_index(ship)));
+  ///     vec4 uvs = atlas->get_uv_rect(ship); // u0, v0, u1, v1
+  class texture_atlas : public resource {
+    // an image waiting to be packed. Always RGBA.
+    struct source {
+      dynarray<uint8_t> pixels;
+      unsigned width;
+      unsigned height;
+    };
+
+    // where an image ended up
+    struct entry {
+      unsigned page;
+      vec4 uv_rect;
+    };
+
+    // the top edge of the used space in a page from x to x + width.
+    struct skyline_node {
+      unsigned x;
+      unsigned y;
+      unsigned width;
+    };
+
+    struct page {
+      dynarray<skyline_node> skyline;
+      dynarray<uint8_t> pixels;
+    };
+
+    unsigned page_width;
+    unsigned page_height;
+    unsigned padding;
+    bool use_array;
+    bool srgb;
+    bool built;
+
+    dynarray<source*> sources;
+    dynarray<entry> entries;
+    dynarray<page*> pages;
+    dynarray<ref<image> > textures;
+
+    // slots are aligned so that box filtered mips of one image never straddle another.
+    unsigned get_alignment() const {
+      return 1 << (get_num_levels() - 1);
+    }
+
+    unsigned align(unsigned value) const {
+      unsigned alignment = get_alignment();
+      return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    // find the lowest place that a width * height slot fits in the skyline. returns the node index or -1.
+    int find_position(const page *p, unsigned width, unsigned height, unsigned &best_x, unsigned &best_y) const {
+      int best = -1;
+      unsigned best_top = ~0u;
+      for (unsigned i = 0; i != p->skyline.size(); ++i) {
+        unsigned x = p->skyline[i].x;
+        if (x + width > page_width) break;
+
+        // the slot sits on the highest node under it
+        unsigned y = 0;
+        unsigned covered = 0;
+        for (unsigned j = i; covered < width; ++j) {
+          y = p->skyline[j].y > y ? p->skyline[j].y : y;
+          covered += p->skyline[j].width;
+        }
+
+        if (y + height <= page_height && y + height < best_top) {
+          best = (int)i;
+          best_top = y + height;
+          best_x = x;
+          best_y = y;
+        }
+      }
+      return best;
+    }
+
+    // raise the skyline over a new slot at node index.
+    void add_level(page *p, unsigned index, unsigned x, unsigned y, unsigned width, unsigned height) {
+      dynarray<skyline_node> &skyline = p->skyline;
+      skyline_node node = { x, y + height, width };
+      skyline.resize(skyline.size() + 1);
+      for (unsigned i = skyline.size() - 1; i > index; --i) {
+        skyline[i] = skyline[i-1];
+      }
+      skyline[index] = node;
+
+      // trim or remove the nodes now under the new one.
+      unsigned i = index + 1;
+      while (i < skyline.size()) {
+        skyline_node &n = skyline[i];
+        unsigned end = x + width;
+        if (n.x >= end) break;
+        unsigned shrink = end - n.x;
+        if (shrink < n.width) {
+          n.x += shrink;
+          n.width -= shrink;
+          break;
+        }
+        for (unsigned j = i; j + 1 < skyline.size(); ++j) {
+          skyline[j] = skyline[j+1];
+        }
+        skyline.resize(skyline.size() - 1);
+      }
+
+      // merge neighbours of the same height.
+      for (unsigned i = 0; i + 1 < skyline.size(); ) {
+        if (skyline[i].y == skyline[i+1].y) {
+          skyline[i].width += skyline[i+1].width;
+          for (unsigned j = i + 1; j + 1 < skyline.size(); ++j) {
+            skyline[j] = skyline[j+1];
+          }
+          skyline.resize(skyline.size() - 1);
+        } else {
+          ++i;
+        }
+      }
+    }
+
+    page *new_page() {
+      page *p = new page();
+      skyline_node node = { 0, 0, page_width };
+      p->skyline.push_back(node);
+      p->pixels.resize(page_width * page_height * 4);
+      memset(&p->pixels[0], 0, p->pixels.size());
+      pages.push_back(p);
+      return p;
+    }
+
+    // copy an image into its slot, repeating the edge pixels into the padding.
+    void blit(page *p, const source *src, unsigned x, unsigned y, unsigned slot_width, unsigned slot_height) {
+      for (unsigned j = 0; j != slot_height; ++j) {
+        int sy = (int)j - (int)padding;
+        sy = sy < 0 ? 0 : sy >= (int)src->height ? src->height - 1 : sy;
+        uint32_t *dest = (uint32_t*)&p->pixels[((y + j) * page_width + x) * 4];
+        const uint32_t *row = (const uint32_t*)&src->pixels[sy * src->width * 4];
+        for (unsigned i = 0; i != slot_width; ++i) {
+          int sx = (int)i - (int)padding;
+          sx = sx < 0 ? 0 : sx >= (int)src->width ? src->width - 1 : sx;
+          dest[i] = row[sx];
+        }
+      }
+    }
+
+    // make a texture for each page, or one texture array for all of them.
+    void upload() {
+      unsigned num_levels = get_num_levels();
+      size_t page_bytes = 0;
+      for (unsigned level = 0, w = page_width, h = page_height; level != num_levels; ++level) {
+        page_bytes += w * h * 4;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+
+      GLenum target = use_array ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+      unsigned num_textures = use_array ? 1 : pages.size();
+      for (unsigned t = 0; t != num_textures; ++t) {
+        GLuint texture = 0;
+        glGenTextures(1, &texture);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(target, texture);
+
+        size_t offset = 0;
+        for (unsigned level = 0, w = page_width, h = page_height; level != num_levels; ++level) {
+          if (use_array) {
+            // all the layers of one level go up together.
+            dynarray<uint8_t> layers(w * h * 4 * pages.size());
+            for (unsigned i = 0; i != pages.size(); ++i) {
+              memcpy(&layers[w * h * 4 * i], &pages[i]->pixels[offset], w * h * 4);
+            }
+            glTexImage3D(target, level, GL_RGBA, w, h, pages.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)&layers[0]);
+          } else {
+            glTexImage2D(target, level, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)&pages[t]->pixels[offset]);
+          }
+          offset += w * h * 4;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
+        }
+        assert(offset == page_bytes);
+
+        glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        textures.push_back(new image(target, texture, page_width, page_height, use_array ? pages.size() : 1));
+      }
+    }
+
+  public:
+    /// Pages are page_width * page_height RGBA textures. padding is the border of repeated
+    /// edge pixels around each image; a padding of 2^n keeps n mip levels free of bleeding.
+    /// With use_array, the pages are the layers of a single GL_TEXTURE_2D_ARRAY.
+    texture_atlas(unsigned page_width = 1024, unsigned page_height = 1024, unsigned padding = 4, bool use_array = false) {
+      this->page_width = page_width;
+      this->page_height = page_height;
+      this->padding = padding;
+      this->use_array = use_array;
+      srgb = true;
+      built = false;
+    }
+
+    ~texture_atlas() {
+      for (unsigned i = 0; i != sources.size(); ++i) {
+        delete sources[i];
+      }
+      for (unsigned i = 0; i != pages.size(); ++i) {
+        delete pages[i];
+      }
+    }
+
+    /// mips are filtered in linear light unless this is set to false before build().
+    void set_srgb(bool value) {
+      srgb = value;
+    }
+
+    /// number of mip levels in each page, including level 0. Limited by the padding.
+    unsigned get_num_levels() const {
+      unsigned levels = 1;
+      while ((2u << (levels - 1)) <= padding && levels < mipmap_generator::get_num_levels(page_width, page_height)) {
+        levels++;
+      }
+      return levels;
+    }
+
+    /// add RGB or RGBA pixels, bottom row first. returns the index of the image in the atlas or -1.
+    int add(const uint8_t *pixels, unsigned width, unsigned height, unsigned num_comps) {
+      if (built) {
+        printf("warning: texture_atlas: add after build\n");
+        return -1;
+      }
+      if (num_comps != 3 && num_comps != 4) return -1;
+      if (align(width + padding * 2) > page_width || align(height + padding * 2) > page_height) {
+        printf("warning: texture_atlas: %dx%d image does not fit in a %dx%d page\n", width, height, page_width, page_height);
+        return -1;
+      }
+
+      source *src = new source();
+      src->width = width;
+      src->height = height;
+      src->pixels.resize(width * height * 4);
+      for (unsigned i = 0; i != width * height; ++i) {
+        uint8_t *dest = &src->pixels[i * 4];
+        dest[0] = pixels[0];
+        dest[1] = pixels[1];
+        dest[2] = pixels[2];
+        dest[3] = num_comps == 4 ? pixels[3] : 255;
+        pixels += num_comps;
+      }
+      sources.push_back(src);
+
+      entry e = { 0, vec4(0, 0, 0, 0) };
+      entries.push_back(e);
+      return (int)entries.size() - 1;
+    }
+
+    /// add the top level of an image. returns the index of the image in the atlas or -1.
+    int add(image *img) {
+      const dynarray<uint8_t> &bytes = img->get_bytes();
+      unsigned format = img->get_format();
+      unsigned width = img->get_width(), height = img->get_height();
+      if (bytes.size() == 0) return -1;
+
+      if (format == GL_RGB || format == GL_RGBA) {
+        return add(&bytes[0], width, height, format == GL_RGB ? 3 : 4);
+      }
+
+      dynarray<uint8_t> pixels;
+      if (dds_decoder::decompress(pixels, format, width, height, &bytes[0])) {
+        return add(&pixels[0], width, height, 4);
+      }
+      printf("warning: texture_atlas: format %04x not supported\n", format);
+      return -1;
+    }
+
+    /// load an image file and add it. returns the index of the image in the atlas or -1.
+    int add(const char *url) {
+      ref<image> img = new image(url);
+      return add(img);
+    }
+
+    /// pack all the images, make mips and upload the pages to GL.
+    void build() {
+      if (built) return;
+      built = true;
+
+      // tallest first keeps the skyline flat.
+      dynarray<unsigned> order(sources.size());
+      for (unsigned i = 0; i != order.size(); ++i) order[i] = i;
+      std::sort(order.data(), order.data() + order.size(), [this](unsigned a, unsigned b) {
+        return sources[a]->height != sources[b]->height ? sources[a]->height > sources[b]->height : sources[a]->width > sources[b]->width;
+      });
+
+      for (unsigned k = 0; k != order.size(); ++k) {
+        unsigned index = order[k];
+        const source *src = sources[index];
+        unsigned slot_width = align(src->width + padding * 2);
+        unsigned slot_height = align(src->height + padding * 2);
+
+        unsigned x = 0, y = 0;
+        int node = -1;
+        unsigned page_index = 0;
+        for (; page_index != pages.size(); ++page_index) {
+          node = find_position(pages[page_index], slot_width, slot_height, x, y);
+          if (node >= 0) break;
+        }
+        if (node < 0) {
+          new_page();
+          page_index = pages.size() - 1;
+          node = find_position(pages[page_index], slot_width, slot_height, x, y);
+        }
+
+        page *p = pages[page_index];
+        add_level(p, (unsigned)node, x, y, slot_width, slot_height);
+        blit(p, src, x, y, slot_width, slot_height);
+
+        entry &e = entries[index];
+        e.page = page_index;
+        e.uv_rect = vec4(
+          (float)(x + padding) / page_width, (float)(y + padding) / page_height,
+          (float)(x + padding + src->width) / page_width, (float)(y + padding + src->height) / page_height
+        );
+      }
+
+      // the sources are in the pages now.
+      for (unsigned i = 0; i != sources.size(); ++i) {
+        delete sources[i];
+      }
+      sources.reset();
+
+      // box filtered mips, cut short where the padding runs out.
+      mipmap_generator generator(mipmap_generator::filter_box, srgb);
+      unsigned num_levels = get_num_levels();
+      parallel_for(0, pages.size(), [&](unsigned i) {
+        dynarray<uint8_t> &pixels = pages[i]->pixels;
+        generator.generate(pixels, page_width, page_height, 4);
+        size_t size = 0;
+        for (unsigned level = 0, w = page_width, h = page_height; level != num_levels; ++level) {
+          size += w * h * 4;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
+        }
+        pixels.resize(size);
+      });
+
+      upload();
+
+      for (unsigned i = 0; i != pages.size(); ++i) {
+        pages[i]->pixels.reset();
+      }
+    }
+
+    /// number of images added.
+    unsigned get_num_images() const {
+      return entries.size();
+    }
+
+    /// number of pages. With a texture array, the number of layers.
+    unsigned get_num_pages() const {
+      return pages.size();
+    }
+
+    /// page (or array layer) that holds an image.
+    unsigned get_page_index(int index) const {
+      return entries[index].page;
+    }
+
+    /// texture coordinates of an image in its page: (u0, v0, u1, v1).
+    /// maps (0, 0) - (1, 1) in the original image.
+    vec4 get_uv_rect(int index) const {
+      return entries[index].uv_rect;
+    }
+
+    /// image wrapper for a page, for use in materials. With a texture array there is only one.
+    image *get_page(unsigned page_index) {
+      return textures[use_array ? 0 : page_index];
+    }
+
+    /// GL texture for a page. With a texture array, the array for every page.
+    GLuint get_gl_texture(unsigned page_index) {
+      return textures.size() ? get_page(page_index)->get_gl_texture() : 0;
+    }
+
+    /// GL_TEXTURE_2D or GL_TEXTURE_2D_ARRAY
+    GLenum get_gl_target() const {
+      return use_array ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    }
+  };
+}}
@@ -0,0 +1,152 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// flattened transform hierarchy
+//
+// The scene_node tree is laid out breadth first in flat arrays, so every parent comes
+// before its children and each level of the tree is a contiguous range. Updating the world
+// matrices is then one streaming pass per level, with each level split across the workers.
+//
+
+namespace octet { namespace scene {
+  /// World transforms for a whole scene_node tree, computed from contiguous arrays.
+  ///
+  /// The layout is rebuilt when nodes are added anywhere in the scene. update() writes
+  /// the results back to the nodes, so scene_node::calcModelToWorld() stays a lookup.
+  class transform_hierarchy {
+    // nodes in breadth first order
+    dynarray<scene_node*> nodes;
+
+    // index of each node's parent in nodes, -1 for the root
+    dynarray<int> parents;
+
+    // level l is nodes[level_start[l]] to nodes[level_start[l+1]]
+    dynarray<unsigned> level_start;
+
+    // node to parent and node to world matrices, same order as nodes
+    dynarray<mat4t> local;
+    dynarray<mat4t> world;
+    dynarray<uint8_t> enabled;
+
+    scene_node *root;
+    unsigned topology_version;
+
+    // nodes per job. Small levels run on the calling thread.
+    enum { batch_size = 256 };
+
+    template <class Fn> static void for_batches(unsigned begin, unsigned end, Fn fn) {
+      unsigned num_batches = (end - begin + batch_size - 1) / batch_size;
+      parallel_for(0, num_batches, [&](unsigned batch) {
+        unsigned first = begin + batch * batch_size;
+        unsigned last = first + batch_size < end ? first + batch_size : end;
+        for (unsigned i = first; i != last; ++i) {
+          fn(i);
+        }
+      });
+    }
+
+  public:
+    transform_hierarchy() {
+      root = 0;
+      topology_version = 0;
+    }
+
+    /// lay out the tree under new_root breadth first.
+    void build(scene_node *new_root) {
+      root = new_root;
+      topology_version = scene_node::get_topology_version();
+      nodes.resize(0);
+      parents.resize(0);
+      level_start.resize(0);
+      if (!root) return;
+
+      nodes.push_back(root);
+      parents.push_back(-1);
+      level_start.push_back(0);
+      unsigned begin = 0;
+      while (begin != nodes.size()) {
+        unsigned end = nodes.size();
+        level_start.push_back(end);
+        for (unsigned i = begin; i != end; ++i) {
+          scene_node *node = nodes[i];
+          for (int c = 0; c != node->get_num_children(); ++c) {
+            nodes.push_back(node->get_child(c));
+            parents.push_back((int)i);
+          }
+        }
+        begin = end;
+      }
+
+      local.resize(nodes.size());
+      world.resize(nodes.size());
+      enabled.resize(nodes.size());
+    }
+
+    /// recompute every world matrix under new_root and store them in the nodes.
+    void update(scene_node *new_root) {
+      if (new_root != root || topology_version != scene_node::get_topology_version()) {
+        build(new_root);
+      }
+      if (nodes.empty()) return;
+
+      // the root's own parents are outside the hierarchy.
+      scene_node *root_parent = root->get_parent();
+      mat4t base;
+      base.loadIdentity();
+      bool base_enabled = true;
+      if (root_parent) {
+        base = root_parent->calcModelToWorld();
+        base_enabled = root_parent->calcEnabled();
+      }
+
+      for_batches(0, nodes.size(), [&](unsigned i) {
+        local[i] = nodes[i]->get_nodeToParent();
+        enabled[i] = nodes[i]->get_enabled();
+      });
+
+      world[0] = local[0] * base;
+      enabled[0] = enabled[0] && base_enabled;
+
+      // each level only reads the one above it.
+      for (unsigned l = 1; l + 1 < level_start.size(); ++l) {
+        for_batches(level_start[l], level_start[l+1], [&](unsigned i) {
+          int p = parents[i];
+          world[i] = local[i] * world[p];
+          enabled[i] = enabled[i] && enabled[p];
+        });
+      }
+
+      for_batches(0, nodes.size(), [&](unsigned i) {
+        nodes[i]->set_world_transform(world[i], enabled[i] != 0);
+      });
+    }
+
+    /// number of nodes in the hierarchy.
+    unsigned get_num_nodes() const {
+      return nodes.size();
+    }
+
+    /// depth of the tree.
+    unsigned get_num_levels() const {
+      return level_start.size() ? level_start.size() - 1 : 0;
+    }
+
+    /// nodes in breadth first order.
+    scene_node *get_node(unsigned index) const {
+      return nodes[index];
+    }
+
+    /// index of a node's parent, or -1 for the root.
+    int get_parent_index(unsigned index) const {
+      return parents[index];
+    }
+
+    /// node to world matrix from the last update().
+    const mat4t &get_world(unsigned index) const {
+      return world[index];
+    }
+  };
+}}
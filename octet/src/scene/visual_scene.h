@@ -43,6 +43,89 @@ namespace octet { namespace scene {
 
     int frame_number;
 
+    /// flat copy of the node tree for updating world transforms
+    transform_hierarchy hierarchy;
+
+    /// where each mesh instance is in instance_tree and what its box was made from
+    struct instance_proxy {
+      int proxy;
+      bool always_visible;
+      unsigned world_version;
+      mesh *msh;
+      aabb mesh_aabb;
+    };
+
+    /// world boxes of the mesh instances for frustum culling
+    aabb_tree instance_tree;
+    dynarray<instance_proxy> instance_proxies;
+    dynarray<int> visible_instances;
+    bool frustum_culling;
+    unsigned num_visible;
+    unsigned num_culled;
+
+    /// depth buffer of the occluder instances (mesh_instance::flag_occluder) for occlusion culling
+    occlusion_buffer occlusion;
+    dynarray<uint8_t> occlusion_results;
+    bool occlusion_culling;
+    unsigned num_occluded;
+
+    /// per instance data for batched ray casts, made before the work is split between threads
+    struct ray_target {
+      mat4t worldToModel;
+      mesh_bvh *bvh;
+    };
+    dynarray<ray_target> ray_targets;
+    dynarray<int> ray_unboxed;
+
+    /// sort key: direction octant << 61 | origin morton code << 31 | ray index
+    dynarray<uint64_t> ray_order;
+
+    /// matrices for each draw in the render queue
+    struct draw_info {
+      mat4t modelToProjection;
+      mat4t modelToCamera;
+      int instance;
+
+      // entry in static_pool, or -1
+      int pool_entry;
+    };
+
+    /// draws sorted by state and depth
+    render_queue queue;
+    dynarray<draw_info> draws;
+    unsigned num_state_changes;
+    unsigned num_state_changes_saved;
+
+    /// model to camera matrices of every draw in queue order, for instanced draws
+    ref<gl_resource> instance_buffer;
+    dynarray<mat4t> instance_matrices;
+    bool instancing;
+    unsigned num_instanced_draws;
+    unsigned num_instances;
+
+    // shorter runs of the same mesh and material are drawn one at a time
+    enum { min_instances = 2 };
+
+    /// static meshes copied into shared buffers so that a material's draws can be one glMultiDrawElementsIndirect
+    mesh_pool static_pool;
+    ref<gl_resource> indirect_buffer;
+    dynarray<mesh_pool::draw_command> indirect_commands;
+
+    /// a run of draws in the queue with one material and one pool
+    struct draw_bucket {
+      unsigned first;
+      unsigned count;
+      unsigned first_command;
+      unsigned num_commands;
+      int pool;
+    };
+
+    dynarray<draw_bucket> buckets;
+    bool multi_draw;
+    int multi_draw_indirect;
+    unsigned num_multi_draws;
+    unsigned num_indirect_commands;
+
     /// shaders to draw triangles
     ref<bump_shader> object_shader;
     ref<bump_shader> skin_shader;
@@ -181,7 +264,299 @@ namespace octet { namespace scene {
       }
     }
 
+    // refit the tree for instances that have moved or changed mesh since the last frame.
+    void update_instance_tree() {
+      unsigned old_size = instance_proxies.size();
+      if (old_size < mesh_instances.size()) {
+        instance_proxies.resize(mesh_instances.size());
+        for (unsigned i = old_size; i != instance_proxies.size(); ++i) {
+          instance_proxy &ip = instance_proxies[i];
+          ip.proxy = -1;
+          ip.always_visible = true;
+          ip.world_version = 0;
+          ip.msh = 0;
+        }
+      }
+
+      for (unsigned i = 0; i != mesh_instances.size(); ++i) {
+        mesh_instance *mi = mesh_instances[i];
+        instance_proxy &ip = instance_proxies[i];
+        scene_node *node = mi ? mi->get_node() : 0;
+        mesh *msh = mi ? mi->get_mesh() : 0;
+
+        // skinned meshes move outside their bind pose box and meshes without a box can't be culled.
+        // streamed vertices (eg. particles) are rewritten every frame without updating the box.
+        aabb mesh_aabb = msh ? msh->get_aabb() : aabb();
+        bool streaming = msh && msh->get_vertices() && msh->get_vertices()->is_streaming();
+        bool cullable = node && msh && !streaming && !(mi->get_skeleton() && msh->get_skin()) && any(mesh_aabb.get_half_extent() != vec3(0, 0, 0));
+        if (!cullable) {
+          if (ip.proxy >= 0) instance_tree.remove(ip.proxy);
+          ip.proxy = -1;
+          ip.always_visible = true;
+          continue;
+        }
+
+        unsigned version = node->get_world_version();
+        if (ip.proxy >= 0 && ip.world_version == version && ip.msh == msh && !memcmp(&ip.mesh_aabb, &mesh_aabb, sizeof(aabb))) {
+          continue;
+        }
+
+        aabb world_aabb = mesh_aabb.get_transform(node->calcModelToWorld());
+        if (ip.proxy < 0) {
+          ip.proxy = instance_tree.insert(world_aabb, (int)i);
+        } else {
+          instance_tree.move(ip.proxy, world_aabb);
+        }
+        ip.always_visible = false;
+        ip.world_version = version;
+        ip.msh = msh;
+        ip.mesh_aabb = mesh_aabb;
+      }
+    }
+
+    // make a list of instances that may be on screen, in their original order.
+    void find_visible_instances(const mat4t &worldToProjection) {
+      visible_instances.resize(0);
+      if (frustum_culling) {
+        update_instance_tree();
+        frustum f(worldToProjection);
+        instance_tree.query(f, [this](int index) { visible_instances.push_back(index); });
+        for (unsigned i = 0; i != instance_proxies.size(); ++i) {
+          if (instance_proxies[i].always_visible) visible_instances.push_back((int)i);
+        }
+        std::sort(visible_instances.data(), visible_instances.data() + visible_instances.size());
+      } else {
+        for (unsigned i = 0; i != mesh_instances.size(); ++i) {
+          visible_instances.push_back((int)i);
+        }
+      }
+      num_culled = mesh_instances.size() - visible_instances.size();
+
+      // occlusion tests use the boxes in the tree.
+      num_occluded = 0;
+      if (frustum_culling && occlusion_culling) {
+        cull_occluded(worldToProjection);
+      }
+      num_visible = visible_instances.size();
+    }
+
+    // draw the visible occluders into the occlusion buffer and drop the instances hidden behind them.
+    void cull_occluded(const mat4t &worldToProjection) {
+      occlusion.begin(worldToProjection);
+      for (unsigned i = 0; i != visible_instances.size(); ++i) {
+        mesh_instance *mi = mesh_instances[visible_instances[i]];
+        if (!mi || !(mi->get_flags() & mesh_instance::flag_occluder) || !(mi->get_flags() & mesh_instance::flag_enabled)) continue;
+
+        scene_node *node = mi->get_node();
+        mesh *msh = mi->get_mesh();
+        if (node && msh && node->calcEnabled() && !(mi->get_skeleton() && msh->get_skin())) {
+          occlusion.add_occluder(msh, node->calcModelToWorld());
+        }
+      }
+      if (occlusion.get_num_occluders() == 0) return;
+
+      occlusion.render();
+
+      // test the boxes in batches across the workers; occluders are never culled.
+      enum { batch_size = 64 };
+      unsigned num_tests = visible_instances.size();
+      occlusion_results.resize(num_tests);
+      parallel_for(0, (num_tests + batch_size - 1) / batch_size, [&](unsigned batch) {
+        unsigned end = std::min(batch * batch_size + batch_size, num_tests);
+        for (unsigned i = batch * batch_size; i != end; ++i) {
+          int index = visible_instances[i];
+          mesh_instance *mi = mesh_instances[index];
+          const instance_proxy &ip = instance_proxies[index];
+          bool keep = !mi || (mi->get_flags() & mesh_instance::flag_occluder) || ip.proxy < 0;
+          occlusion_results[i] = keep || occlusion.is_visible(instance_tree.get_fat_aabb(ip.proxy));
+        }
+      });
+
+      unsigned n = 0;
+      for (unsigned i = 0; i != num_tests; ++i) {
+        if (occlusion_results[i]) visible_instances[n++] = visible_instances[i];
+      }
+      num_occluded = num_tests - n;
+      visible_instances.resize(n);
+    }
+
+    // spread the bottom ten bits of x out to every third bit for a morton code.
+    static uint32_t spread_bits(uint32_t x) {
+      x &= 0x3ff;
+      x = (x | x << 16) & 0x030000ff;
+      x = (x | x << 8) & 0x0300f00f;
+      x = (x | x << 4) & 0x030c30c3;
+      x = (x | x << 2) & 0x09249249;
+      return x;
+    }
+
+    // number of draws from queue position i that can go in one instanced draw.
+    unsigned find_instance_run(unsigned i) {
+      mesh_instance *mi = mesh_instances[draws[queue.get_index(i)].instance];
+      mesh *msh = mi->get_mesh();
+      material *mat = mi->get_material();
+      if ((mi->get_skeleton() && msh->get_skin()) || (mi->get_flags() & mesh_instance::flag_selected) || !mat->supports_instancing()) {
+        return 1;
+      }
+
+      unsigned j = i + 1;
+      while (j != queue.size()) {
+        mesh_instance *mj = mesh_instances[draws[queue.get_index(j)].instance];
+        if (
+          mj->get_mesh() != msh || mj->get_material() != mat ||
+          (mj->get_skeleton() && msh->get_skin()) || (mj->get_flags() & mesh_instance::flag_selected)
+        ) break;
+        ++j;
+      }
+      return j - i;
+    }
+
+    // copy the model to camera matrices to the instance buffer in queue order.
+    void upload_instance_matrices() {
+      unsigned n = queue.size();
+      instance_matrices.resize(n);
+      for (unsigned i = 0; i != n; ++i) {
+        instance_matrices[i] = draws[queue.get_index(i)].modelToCamera;
+      }
+
+      size_t bytes = n * sizeof(mat4t);
+      if (!instance_buffer) instance_buffer = new gl_resource();
+      if (instance_buffer->get_size() < bytes) {
+        instance_buffer->allocate(GL_ARRAY_BUFFER, bytes * 2, GL_STREAM_DRAW);
+      }
+      instance_buffer->assign(instance_matrices.data(), 0, bytes);
+    }
+
+    // point the per instance matrix attributes at the instance buffer from queue position first.
+    void set_instance_pointers(unsigned first) {
+      #ifndef OCTET_GLES2
+        instance_buffer->bind();
+        for (unsigned c = 0; c != 4; ++c) {
+          glVertexAttribPointer(attribute_instance + c, 4, GL_FLOAT, GL_FALSE, sizeof(mat4t), (void*)(first * sizeof(mat4t) + c * sizeof(vec4)));
+          glEnableVertexAttribArray(attribute_instance + c);
+          glVertexAttribDivisor(attribute_instance + c, 1);
+        }
+      #endif
+    }
+
+    void clear_instance_pointers() {
+      #ifndef OCTET_GLES2
+        for (unsigned c = 0; c != 4; ++c) {
+          glVertexAttribDivisor(attribute_instance + c, 0);
+          glDisableVertexAttribArray(attribute_instance + c);
+        }
+      #endif
+    }
+
+    // draw count instances of a mesh whose matrices start at queue position first.
+    void draw_instances(mesh *msh, unsigned first, unsigned count) {
+      #ifndef OCTET_GLES2
+        set_instance_pointers(first);
+        msh->draw_instanced(count);
+        clear_instance_pointers();
+      #endif
+    }
+
+    // number of draws from queue position i that can go in one multi draw.
+    unsigned find_bucket(unsigned i) {
+      const draw_info &d = draws[queue.get_index(i)];
+      if (d.pool_entry < 0) return 0;
+
+      mesh_instance *mi = mesh_instances[d.instance];
+      material *mat = mi->get_material();
+      if ((mi->get_flags() & mesh_instance::flag_selected) || !mat->supports_instancing()) return 0;
+
+      int pool = static_pool.get_entry(d.pool_entry).pool;
+      unsigned j = i + 1;
+      while (j != queue.size()) {
+        const draw_info &dj = draws[queue.get_index(j)];
+        if (dj.pool_entry < 0 || static_pool.get_entry(dj.pool_entry).pool != pool) break;
+        mesh_instance *mj = mesh_instances[dj.instance];
+        if (mj->get_material() != mat || (mj->get_flags() & mesh_instance::flag_selected)) break;
+        ++j;
+      }
+      return j - i;
+    }
+
+    // group the pooled draws into buckets and write their indirect commands.
+    // the instance matrices are in queue order, so base_instance is the queue position.
+    void build_buckets() {
+      buckets.resize(0);
+      indirect_commands.resize(0);
+      for (unsigned i = 0; i < queue.size(); ) {
+        unsigned count = find_bucket(i);
+        if (!count) {
+          ++i;
+          continue;
+        }
+
+        int last_entry = -1;
+        draw_bucket b = { i, count, indirect_commands.size(), 0, static_pool.get_entry(draws[queue.get_index(i)].pool_entry).pool };
+        for (unsigned j = i; j != i + count; ++j) {
+          int pool_entry = draws[queue.get_index(j)].pool_entry;
+          if (pool_entry == last_entry) {
+            // draws of the same mesh next to each other share a command.
+            indirect_commands.back().instance_count++;
+          } else {
+            const mesh_pool::entry &e = static_pool.get_entry(pool_entry);
+            mesh_pool::draw_command c = { e.num_indices, 1, e.first_index, e.base_vertex, j };
+            indirect_commands.push_back(c);
+            b.num_commands++;
+            last_entry = pool_entry;
+          }
+        }
+        buckets.push_back(b);
+        i += count;
+      }
+
+      // the fallback reads the commands on the CPU.
+      if (indirect_commands.empty() || !multi_draw_indirect) return;
+
+      size_t bytes = indirect_commands.size() * sizeof(mesh_pool::draw_command);
+      if (!indirect_buffer) indirect_buffer = new gl_resource();
+      if (indirect_buffer->get_size() < bytes) {
+        indirect_buffer->allocate(GL_DRAW_INDIRECT_BUFFER, bytes * 2, GL_STREAM_DRAW);
+      }
+      indirect_buffer->assign(indirect_commands.data(), 0, bytes);
+    }
+
+    // draw a bucket from its pool mesh, which must have its attributes enabled.
+    void draw_pooled(const draw_bucket &b) {
+      #ifndef OCTET_GLES2
+        const mesh_pool::draw_command *commands = indirect_commands.data() + b.first_command;
+        if (multi_draw_indirect) {
+          set_instance_pointers(0);
+          indirect_buffer->bind();
+          glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(b.first_command * sizeof(mesh_pool::draw_command)), b.num_commands, 0);
+          glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        } else {
+          // without ARB_multi_draw_indirect, draw the commands one at a time, moving the matrices along.
+          for (unsigned k = 0; k != b.num_commands; ++k) {
+            const mesh_pool::draw_command &c = commands[k];
+            set_instance_pointers(c.base_instance);
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, c.count, GL_UNSIGNED_INT, (void*)(c.first_index * sizeof(uint32_t)), c.instance_count, c.base_vertex);
+          }
+        }
+        clear_instance_pointers();
+      #endif
+    }
+
+    // enable the attributes of msh unless the last draw used the same mesh.
+    void use_mesh(mesh *msh, mesh *&last_msh) {
+      if (msh != last_msh) {
+        if (last_msh) last_msh->disable_attributes();
+        msh->enable_attributes();
+        last_msh = msh;
+        num_state_changes++;
+      } else {
+        num_state_changes_saved++;
+      }
+    }
+
     void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
+      // one streaming pass over the flattened hierarchy, then every world matrix below is a lookup.
+      hierarchy.update(this);
+
       mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
 
       mat4t worldToCamera;
@@ -194,8 +569,21 @@ namespace octet { namespace scene {
 
       draw_debug_data(cam);
 
-      for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
-        mesh_instance *mi = mesh_instances[mesh_index];
+      find_visible_instances(worldToCamera * cameraToProjection);
+
+      // pixels covered by one unit at distance one (perspective) or anywhere (ortho), for lod groups.
+      GLint viewport[4];
+      glGetIntegerv(GL_VIEWPORT, viewport);
+      float yscale = cam.get_yscale();
+      float lod_pixels = cam.get_is_ortho() ? viewport[3] * yscale : viewport[3] * 0.5f / yscale;
+
+      // work out what to draw, then sort it by state and depth.
+      queue.reset();
+      draws.resize(0);
+      for (unsigned visible_index = 0; visible_index != visible_instances.size(); ++visible_index) {
+        int instance_index = visible_instances[visible_index];
+        mesh_instance *mi = mesh_instances[instance_index];
+        if (!mi) continue;
 
         scene_node *node = mi->get_node();
         unsigned flags = mi->get_flags();
@@ -206,36 +594,118 @@ namespace octet { namespace scene {
         ) continue;
 
         mesh *msh = mi->get_mesh();
-        skin *skn = msh->get_skin();
-        skeleton *skel = mi->get_skeleton();
         material *mat = mi->get_material();
 
-        mat4t modelToWorld = node->calcModelToWorld();
-        mat4t modelToCamera;
-        mat4t modelToProjection;
-        cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
-        //printf("%d %f\n", mesh_index, modelToWorld.w().y());
+        draws.resize(draws.size() + 1);
+        draw_info &d = draws.back();
+        d.instance = instance_index;
+        d.pool_entry = -1;
+        cam.get_matrices(d.modelToProjection, d.modelToCamera, node->calcModelToWorld());
+        float distance = -d.modelToCamera.w().z();
 
-        // selecting LOD meshes by distance
+        // selecting LOD meshes by screen space error if they are in a group, otherwise by distance
         if (flags & mesh_instance::flag_lod) {
-          float distance = -modelToCamera.w().z();
           //printf("%f %f %f\n", distance, mi->get_min_draw_distance(), mi->get_max_draw_distance());
-          if (
-            distance < mi->get_min_draw_distance() ||
-            distance >= mi->get_max_draw_distance()
-          ) {
+          lod_group *group = mi->get_lod_group();
+          bool skip;
+          if (group) {
+            // model units become world units with the node's scale
+            float pixels_per_unit = lod_pixels * length(d.modelToCamera.x().xyz());
+            if (!cam.get_is_ortho()) pixels_per_unit /= max(distance, 1e-3f);
+            skip = group->select(pixels_per_unit) != mi->get_lod_level();
+          } else {
+            skip = distance < mi->get_min_draw_distance() || distance >= mi->get_max_draw_distance();
+          }
+          if (skip) {
+            draws.resize(draws.size() - 1);
             continue;
           }
         }
 
-        if (!skel || !skn) {
+        if (multi_draw && (flags & mesh_instance::flag_static) && !(mi->get_skeleton() && msh->get_skin())) {
+          d.pool_entry = static_pool.add(msh);
+        }
+
+        queue.add(draws.size() - 1, mi->get_layer(), mat->is_translucent(), (void*)(intptr_t)mat->get_program(), mat, msh, distance);
+      }
+      queue.sort();
+
+      // runs of draws with the same mesh and material become one instanced draw.
+      // OpenGLES2 has no instancing, so runs are drawn one at a time changing only the matrices.
+      bool use_instancing = false;
+      buckets.resize(0);
+      #ifndef OCTET_GLES2
+        // static meshes with the same material and vertex layout become one multi draw.
+        if (multi_draw) {
+          if (multi_draw_indirect < 0) multi_draw_indirect = mesh_pool::gl_supports_multi_draw_indirect();
+          build_buckets();
+        }
+
+        if (instancing) {
+          unsigned run = 1;
+          for (unsigned i = 0; i < queue.size() && !use_instancing; i += run) {
+            run = find_instance_run(i);
+            use_instancing = run >= min_instances;
+          }
+        }
+
+        if (use_instancing || !buckets.empty()) upload_instance_matrices();
+      #endif
+
+      // submit, skipping the material and mesh setup when the last draw used the same ones.
+      material *last_mat = 0;
+      mesh *last_msh = 0;
+      num_state_changes = 0;
+      num_state_changes_saved = 0;
+      num_instanced_draws = 0;
+      num_instances = 0;
+      num_multi_draws = 0;
+      num_indirect_commands = 0;
+      unsigned next_bucket = 0;
+      for (unsigned i = 0; i != queue.size(); ++i) {
+        const draw_info &d = draws[queue.get_index(i)];
+        mesh_instance *mi = mesh_instances[d.instance];
+        mesh *msh = mi->get_mesh();
+        skin *skn = msh->get_skin();
+        skeleton *skel = mi->get_skeleton();
+        material *mat = mi->get_material();
+
+        if (next_bucket != buckets.size() && buckets[next_bucket].first == i) {
+          const draw_bucket &b = buckets[next_bucket++];
+          mat->render_instanced(cameraToProjection, light_uniforms, num_light_uniforms, num_lights);
+          last_mat = 0;
+          num_state_changes++;
+          use_mesh(static_pool.get_pool_mesh(b.pool), last_msh);
+          draw_pooled(b);
+          num_multi_draws++;
+          num_indirect_commands += b.num_commands;
+          i += b.count - 1;
+          continue;
+        }
+
+        unsigned run = use_instancing ? find_instance_run(i) : 1;
+        if (run < min_instances) run = 1;
+
+        if (run != 1) {
+          // the instanced uniform must be cleared by the next draw with this material.
+          mat->render_instanced(cameraToProjection, light_uniforms, num_light_uniforms, num_lights);
+          last_mat = 0;
+          num_state_changes++;
+        } else if (!skel || !skn) {
           /// normal rendering for single matrix objects
           /// build a projection matrix: model -> world -> camera_instance -> projection
           /// the projection space is the cube -1 <= x/w, y/w, z/w <= 1
-          mat->render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
+          if (mat != last_mat) {
+            mat->render(d.modelToProjection, d.modelToCamera, light_uniforms, num_light_uniforms, num_lights);
+            last_mat = mat;
+            num_state_changes++;
+          } else {
+            mat->render_instance(d.modelToProjection, d.modelToCamera);
+            num_state_changes_saved++;
+          }
         } else {
           /// multi-matrix rendering
-          mat4t *transforms = skel->calc_transforms(modelToCamera, skn);
+          mat4t *transforms = skel->calc_transforms(d.modelToCamera, skn);
           int num_bones = skel->get_num_bones();
           if(num_bones > 192) {
             GLint mvuv = 0;
@@ -244,22 +714,37 @@ namespace octet { namespace scene {
           } else {
             mat->render_skinned(cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
           }
+          last_mat = 0;
         }
 
         /*if (true) {
           static bool dumped;
           if (!dumped) { msh->dump_transformed(modelToProjection); dumped = true; }
         }*/
-        msh->enable_attributes();
+        use_mesh(msh, last_msh);
+
+        if (run != 1) {
+          draw_instances(msh, i, run);
+          num_instanced_draws++;
+          num_instances += run;
+          i += run - 1;
+          continue;
+        }
+
         msh->draw();
-        msh->disable_attributes();
 
         if (mi->get_flags() & mesh_instance::flag_selected) {
+          // the debug box uses its own material and buffers.
+          msh->disable_attributes();
+          last_msh = 0;
+          last_mat = 0;
           aabb bb = mi->get_mesh()->get_aabb();
           bb = bb.get_transform(mi->get_node()->calcModelToWorld());
           draw_aabb(bb);
         }
       }
+      if (last_msh) last_msh->disable_attributes();
+
       frame_number++;
     }
   public:
@@ -268,6 +753,20 @@ namespace octet { namespace scene {
     /// Create an empty visual_scene; Use add_* functions to add components to the scene.
     visual_scene() {
       frame_number = 0;
+      frustum_culling = true;
+      num_visible = 0;
+      num_culled = 0;
+      occlusion_culling = true;
+      num_occluded = 0;
+      num_state_changes = 0;
+      num_state_changes_saved = 0;
+      instancing = true;
+      num_instanced_draws = 0;
+      num_instances = 0;
+      multi_draw = true;
+      multi_draw_indirect = -1;
+      num_multi_draws = 0;
+      num_indirect_commands = 0;
       num_light_uniforms = 0;
       num_lights = 0;
       render_aabbs = false;
@@ -346,6 +845,10 @@ namespace octet { namespace scene {
     /// reset the scene.
     void reset() {
       mesh_instances.reset();
+      instance_tree.reset();
+      instance_proxies.reset();
+      static_pool.reset();
+      occlusion.reset();
       animation_instances.reset();
       camera_instances.reset();
       light_instances.reset();
@@ -446,6 +949,20 @@ namespace octet { namespace scene {
       return inst;
     }
 
+    /// Add one mesh instance per level of detail on the same node, switching by screen space error.
+    /// errors are in model units, finest first, as made by mesh_simplifier::build_lod_chain.
+    /// pixel_error is the largest error allowed on the screen.
+    lod_group *add_lod_mesh_instances(scene_node *node, material *mat, mesh *const *meshes, const float *errors, unsigned num_levels, float pixel_error = 1.0f, float hysteresis = 0.25f) {
+      lod_group *group = new lod_group(pixel_error, hysteresis);
+      for (unsigned i = 0; i != num_levels; ++i) {
+        mesh_instance *mi = new mesh_instance(node, meshes[i], mat);
+        mi->set_flags(mesh_instance::flag_enabled | mesh_instance::flag_lod);
+        mi->set_lod(group, group->add_level(errors[i]));
+        add_mesh_instance(mi);
+      }
+      return group;
+    }
+
     animation_instance *add_animation_instance(animation_instance *inst) {
       animation_instances.push_back(inst);
       return inst;
@@ -511,6 +1028,78 @@ namespace octet { namespace scene {
       dump_vertices = value;
     }
 
+    /// skip mesh instances whose bounding boxes are outside the camera's view (default true)
+    void set_frustum_culling(bool value) {
+      frustum_culling = value;
+    }
+
+    /// number of mesh instances sent to GL in the last frame (before LOD and enabled checks)
+    unsigned get_num_visible_instances() const {
+      return num_visible;
+    }
+
+    /// number of mesh instances skipped by frustum culling in the last frame
+    unsigned get_num_culled_instances() const {
+      return num_culled;
+    }
+
+    /// skip mesh instances hidden behind occluders (see mesh_instance::flag_occluder).
+    /// Needs frustum culling. (default true)
+    void set_occlusion_culling(bool value) {
+      occlusion_culling = value;
+    }
+
+    /// resolution of the CPU depth buffer used for occlusion culling (default 256x128).
+    void set_occlusion_buffer_size(unsigned width, unsigned height) {
+      occlusion.set_size(width, height);
+    }
+
+    /// number of mesh instances skipped by occlusion culling in the last frame
+    unsigned get_num_occluded_instances() const {
+      return num_occluded;
+    }
+
+    /// number of material and mesh setups in the last frame
+    unsigned get_num_state_changes() const {
+      return num_state_changes;
+    }
+
+    /// number of material and mesh setups skipped in the last frame because the previous draw shared them
+    unsigned get_num_state_changes_saved() const {
+      return num_state_changes_saved;
+    }
+
+    /// draw mesh instances that share a mesh and material with glDrawElementsInstanced (default on).
+    void set_instancing(bool value) {
+      instancing = value;
+    }
+
+    /// number of instanced draws in the last frame
+    unsigned get_num_instanced_draws() const {
+      return num_instanced_draws;
+    }
+
+    /// number of mesh instances drawn by instanced draws in the last frame
+    unsigned get_num_instances() const {
+      return num_instances;
+    }
+
+    /// draw static mesh instances (see mesh_instance::flag_static) from shared buffers,
+    /// one glMultiDrawElementsIndirect per material (default on).
+    void set_multi_draw(bool value) {
+      multi_draw = value;
+    }
+
+    /// number of multi draws in the last frame
+    unsigned get_num_multi_draws() const {
+      return num_multi_draws;
+    }
+
+    /// number of indirect draw commands in the last frame
+    unsigned get_num_indirect_commands() const {
+      return num_indirect_commands;
+    }
+
     /// access camera_instance information
     camera_instance *get_camera_instance(int index) {
       return camera_instances[index];
@@ -613,40 +1202,189 @@ namespace octet { namespace scene {
     }
 
     struct cast_result {
+      /// nearest instance hit, or NULL
       mesh_instance *mi;
+
+      /// how far along the ray the hit is (0 = start, 1 = end)
       rational depth;
+
+      /// triangle number in the mesh (index in the index buffer / 3) or -1
+      int triangle;
+
+      /// vertex indices of the triangle
+      int indices[3];
+
+      /// weights of the three vertices at the hit point, for interpolating uvs etc.
+      vec3 barycentric;
+
+      /// hit point in world space
+      vec3 position;
     };
 
-    /// brute force & ignorance ray cast.
-    /// return the mesh instance and location of hits.
-    /// todo: build a kd tree for mesh instance bbs & mesh triangles
+    /// Find the nearest mesh instance hit by a ray between its start and end.
+    /// The instance tree finds candidate instances nearest first and each mesh's
+    /// triangle BVH (see mesh::get_bvh) finds the triangle.
     void cast_ray(cast_result &result, const ray &the_ray) {
       result.mi = 0;
       result.depth = rational(0, 0);
+      result.triangle = -1;
+      result.indices[0] = result.indices[1] = result.indices[2] = 0;
+      result.barycentric = vec3(0, 0, 0);
+      result.position = vec3(0, 0, 0);
+
+      update_instance_tree();
+
+      vec3 start = the_ray.get_start();
+      vec3 dir = the_ray.get_end() - start;
+      float u = 0, v = 0;
+
+      // t is the same in model space as the matrices are affine.
+      auto test = [&](int index, float &t_max) {
+        mesh_instance *mi = mesh_instances[index];
+        if (!mi || !mi->get_node() || !mi->get_mesh()) return;
+        mat4t worldToNode = mi->get_node()->calcModelToWorld().inverse3x4();
+        vec3 model_start = (start.xyz1() * worldToNode).xyz();
+        vec3 model_dir = (dir.xyz0() * worldToNode).xyz();
+        mesh_bvh::hit hit;
+        if (mi->get_mesh()->get_bvh()->intersect(model_start, model_dir, t_max, hit)) {
+          t_max = hit.t;
+          result.mi = mi;
+          result.triangle = hit.triangle;
+          u = hit.u;
+          v = hit.v;
+        }
+      };
 
-      for (int i = 0; i != mesh_instances.size(); ++i) {
+      float t_max = 1;
+      instance_tree.query(start, dir, t_max, [&](int index, float &t) {
+        test(index, t);
+        t_max = t;
+      });
+
+      // instances that are not in the tree (eg. skinned) are tested one at a time.
+      for (unsigned i = 0; i != instance_proxies.size(); ++i) {
+        if (instance_proxies[i].always_visible) test((int)i, t_max);
+      }
+
+      if (result.mi) {
+        result.mi->get_mesh()->get_bvh()->get_triangle(result.triangle, result.indices);
+        result.depth = rational(t_max);
+        result.barycentric = vec3(1 - u - v, u, v);
+        result.position = start + dir * t_max;
+      }
+    }
+
+    /// Cast many rays at once, eg. for AI line of sight, audio occlusion or light baking.
+    /// results[i] is filled in as cast_ray would for rays[i].
+    /// With any_hit, each ray stops at the first hit found, which is enough for visibility tests;
+    /// mi is set if something was hit but it may not be the nearest thing.
+    ///
+    /// Rays are sorted so that rays that start close together and point the same way
+    /// walk the trees together in packets of four, and the packets are shared between the workers.
+    /// The packets do not depend on the number of workers, so neither do the results.
+    void cast_rays(const ray *rays, cast_result *results, unsigned num_rays, bool any_hit = false) {
+      if (!num_rays) return;
+      assert(num_rays < 0x80000000u);
+      update_instance_tree();
+
+      // building a BVH reads the mesh's GL buffers, which only this thread may do.
+      ray_targets.resize(mesh_instances.size());
+      ray_unboxed.resize(0);
+      for (unsigned i = 0; i != mesh_instances.size(); ++i) {
         mesh_instance *mi = mesh_instances[i];
-        if (mi && mi->get_node()) {
-          mat4t nodeToWorld = mi->get_node()->calcModelToWorld();
-          mesh *mesh = mi->get_mesh();
-          aabb bb = mesh->get_aabb();
-          bb = bb.get_transform(nodeToWorld);
-          if (the_ray.intersects(bb)) {
-            mat4t worldToNode = nodeToWorld.inverse3x4();
-            //ray model_ray = ray(vec3(0, 0, -1), vec3(0, 0, 2)); //the_ray.get_transform(worldToNode);
-            ray model_ray = the_ray.get_transform(worldToNode);
-            int indices[3] = {0};
-            vec4 bary_numer(0, 0, 0, 0);
-            float bary_denom;
-            bool hit = mesh->ray_cast(model_ray, indices, bary_numer, bary_denom);
-            if (hit) {
-              rational depth(bary_numer.w() / bary_denom);
-              result.depth = min(depth, result.depth);
-            }
-            //printf("hit=%d %s %f\n", hit, (bary_numer/bary_denom).toString(tmp, sizeof(tmp)), (float)result.depth);
-          }
+        ray_target &target = ray_targets[i];
+        target.bvh = 0;
+        if (mi && mi->get_node() && mi->get_mesh()) {
+          target.bvh = mi->get_mesh()->get_bvh();
+          target.worldToModel = mi->get_node()->calcModelToWorld().inverse3x4();
         }
+        if (instance_proxies[i].always_visible) ray_unboxed.push_back((int)i);
+      }
+
+      // sort by direction octant and then by the morton code of the start point.
+      vec3 lo = rays[0].get_start(), hi = lo;
+      for (unsigned i = 1; i != num_rays; ++i) {
+        lo = lo.min(rays[i].get_start());
+        hi = hi.max(rays[i].get_start());
       }
+      vec3 extent = hi - lo;
+      vec3 scale(
+        extent.x() > 0 ? 1023.0f / extent.x() : 0,
+        extent.y() > 0 ? 1023.0f / extent.y() : 0,
+        extent.z() > 0 ? 1023.0f / extent.z() : 0
+      );
+
+      ray_order.resize(num_rays);
+      for (unsigned i = 0; i != num_rays; ++i) {
+        vec3 start = rays[i].get_start();
+        vec3 dir = rays[i].get_end() - start;
+        vec3 q = (start - lo) * scale;
+        uint32_t octant = (dir.x() < 0 ? 1 : 0) | (dir.y() < 0 ? 2 : 0) | (dir.z() < 0 ? 4 : 0);
+        uint32_t morton = spread_bits((uint32_t)q.x()) | spread_bits((uint32_t)q.y()) << 1 | spread_bits((uint32_t)q.z()) << 2;
+        ray_order[i] = (uint64_t)octant << 61 | (uint64_t)morton << 31 | i;
+      }
+      std::sort(ray_order.data(), ray_order.data() + num_rays);
+
+      // cast the rays in ray_order[first, first + count) as one packet of up to four.
+      auto cast_packet = [&](unsigned first, unsigned count) {
+        ray_packet packet;
+        unsigned ray_index[4];
+        int hit_instance[4];
+        for (unsigned l = 0; l != count; ++l) {
+          ray_index[l] = (unsigned)(ray_order[first + l] & 0x7fffffff);
+          hit_instance[l] = -1;
+          const ray &r = rays[ray_index[l]];
+          packet.set(l, r.get_start(), r.get_end() - r.get_start(), 1.0f);
+
+          cast_result &res = results[ray_index[l]];
+          res.mi = 0;
+          res.depth = rational(0, 0);
+          res.triangle = -1;
+          res.indices[0] = res.indices[1] = res.indices[2] = 0;
+          res.barycentric = vec3(0, 0, 0);
+          res.position = vec3(0, 0, 0);
+        }
+
+        auto test = [&](int index, unsigned mask) {
+          const ray_target &target = ray_targets[index];
+          if (!target.bvh) return;
+          mesh_bvh::hit hits[4];
+          unsigned found = target.bvh->intersect(packet.get_transform(target.worldToModel), mask, hits, any_hit);
+          for (unsigned l = 0; l != count; ++l) {
+            if (!(found & (1 << l))) continue;
+            cast_result &res = results[ray_index[l]];
+            packet.t_max[l] = hits[l].t;
+            hit_instance[l] = index;
+            res.triangle = hits[l].triangle;
+            res.barycentric = vec3(1 - hits[l].u - hits[l].v, hits[l].u, hits[l].v);
+            if (any_hit) packet.active &= ~(1 << l);
+          }
+        };
+
+        instance_tree.query(packet, test);
+        for (unsigned i = 0; i != ray_unboxed.size() && packet.active; ++i) {
+          test(ray_unboxed[i], packet.active);
+        }
+
+        for (unsigned l = 0; l != count; ++l) {
+          if (hit_instance[l] < 0) continue;
+          cast_result &res = results[ray_index[l]];
+          float t = packet.t_max[l];
+          res.mi = mesh_instances[hit_instance[l]];
+          ray_targets[hit_instance[l]].bvh->get_triangle(res.triangle, res.indices);
+          res.depth = rational(t);
+          res.position = packet.get_start(l) + packet.get_dir(l) * t;
+        }
+      };
+
+      enum { packets_per_job = 16 };
+      unsigned num_packets = (num_rays + 3) / 4;
+      parallel_for(0, (num_packets + packets_per_job - 1) / packets_per_job, [&](unsigned job) {
+        unsigned end = std::min(job * packets_per_job + packets_per_job, num_packets);
+        for (unsigned p = job * packets_per_job; p != end; ++p) {
+          cast_packet(p * 4, std::min(4u, num_rays - p * 4));
+        }
+      });
     }
 
     /// Debug rendering: add a new line in world space (old ones will be lost)
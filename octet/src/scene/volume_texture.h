@@ -0,0 +1,421 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bricked volume textures for ray casting
+//
+
+namespace octet { namespace scene {
+  /// A volume (eg. a NIFTI scan) that is streamed to the GPU a brick at a time.
+  ///
+  /// The file is memory mapped and each frame is cut into bricks of brick_size^3 texels.
+  /// Neighbouring bricks overlap by one voxel so that filtering works across brick edges.
+  /// Every brick keeps its min and max value. update() copies only the bricks whose range
+  /// reaches the ray caster's threshold into a 3D texture atlas.
+  ///
+  /// The index texture has one RGBA texel per brick. rgb is the atlas slot and alpha is 255
+  /// if the brick is in the atlas, or 0 if it is empty or still loading. A ray at voxel v
+  /// samples the atlas at (slot * brick_size + 1 + fract(v / stride) * stride) / atlas size,
+  /// where stride is get_brick_stride().
+  class volume_texture : public resource {
+  public:
+    /// value range of one brick of one frame
+    struct brick_range {
+      float min_value;
+      float max_value;
+    };
+
+  private:
+    enum { border = 1, no_slot = 0xffff };
+
+    string url;
+
+    // voxels, mapped if possible, read into memory otherwise (eg. zip files)
+    file_map *map;
+    dynarray<uint8_t> buffer;
+    const uint8_t *src;
+    const uint8_t *src_max;
+    loaders::nifti_decoder decoder;
+
+    unsigned brick_size;
+    unsigned brick_stride;
+    unsigned num_bricks[3];
+    unsigned bricks_per_frame;
+    unsigned num_components;
+
+    // scalar values map from [value_min, value_min + 255/value_scale] to [0, 255]
+    float value_min;
+    float value_scale;
+
+    // ranges for every brick of every frame, computed when a frame is first used.
+    dynarray<brick_range> ranges;
+    dynarray<uint8_t> frame_has_ranges;
+    unsigned frame;
+
+    // the atlas is atlas_slots^3 bricks.
+    GLuint atlas_texture;
+    GLuint index_texture;
+    unsigned atlas_slots;
+    dynarray<unsigned> slot_key;   // frame * bricks_per_frame + brick, ~0 if free
+    dynarray<unsigned> slot_used;  // update count when last needed
+    dynarray<uint16_t> brick_slot; // slot for each brick of the current frame
+    dynarray<uint8_t> index_data;
+    dynarray<uint8_t> staging;
+    unsigned update_count;
+
+    ref<image> atlas_image;
+    ref<image> index_image;
+
+    // first voxel of a brick, including the border.
+    void get_brick_origin(unsigned brick, int origin[3]) const {
+      unsigned bx = brick % num_bricks[0];
+      unsigned by = brick / num_bricks[0] % num_bricks[1];
+      unsigned bz = brick / num_bricks[0] / num_bricks[1];
+      origin[0] = (int)(bx * brick_stride) - border;
+      origin[1] = (int)(by * brick_stride) - border;
+      origin[2] = (int)(bz * brick_stride) - border;
+    }
+
+    static int clamp_coord(int x, unsigned size) {
+      return x < 0 ? 0 : x >= (int)size ? (int)size - 1 : x;
+    }
+
+    // find the value range of every brick in a frame.
+    void compute_ranges(unsigned new_frame) {
+      const uint8_t *voxels = decoder.get_frame(src, new_frame);
+      brick_range *frame_ranges = &ranges[new_frame * bricks_per_frame];
+      unsigned width = decoder.get_width(), height = decoder.get_height(), depth = decoder.get_depth();
+      unsigned bytes_per_voxel = decoder.get_bytes_per_voxel();
+
+      parallel_for(0, bricks_per_frame, [&](unsigned brick) {
+        int origin[3];
+        get_brick_origin(brick, origin);
+        int x0 = clamp_coord(origin[0], width), x1 = clamp_coord(origin[0] + brick_size - 1, width);
+        int y0 = clamp_coord(origin[1], height), y1 = clamp_coord(origin[1] + brick_size - 1, height);
+        int z0 = clamp_coord(origin[2], depth), z1 = clamp_coord(origin[2] + brick_size - 1, depth);
+        float lo = 1e37f, hi = -1e37f;
+        for (int z = z0; z <= z1; ++z) {
+          for (int y = y0; y <= y1; ++y) {
+            const uint8_t *row = voxels + (((size_t)z * height + y) * width + x0) * bytes_per_voxel;
+            for (int x = x0; x <= x1; ++x) {
+              float value = decoder.get_value(row);
+              lo = value < lo ? value : lo;
+              hi = value > hi ? value : hi;
+              row += bytes_per_voxel;
+            }
+          }
+        }
+        frame_ranges[brick].min_value = lo;
+        frame_ranges[brick].max_value = hi;
+      });
+
+      frame_has_ranges[new_frame] = 1;
+    }
+
+    // copy one brick, with its border, into staging memory as bytes.
+    void extract_brick(uint8_t *dest, unsigned brick, const uint8_t *voxels) const {
+      unsigned width = decoder.get_width(), height = decoder.get_height(), depth = decoder.get_depth();
+      unsigned bytes_per_voxel = decoder.get_bytes_per_voxel();
+      int origin[3];
+      get_brick_origin(brick, origin);
+      for (unsigned z = 0; z != brick_size; ++z) {
+        int sz = clamp_coord(origin[2] + (int)z, depth);
+        for (unsigned y = 0; y != brick_size; ++y) {
+          int sy = clamp_coord(origin[1] + (int)y, height);
+          const uint8_t *row = voxels + ((size_t)sz * height + sy) * width * bytes_per_voxel;
+          for (unsigned x = 0; x != brick_size; ++x) {
+            const uint8_t *voxel = row + clamp_coord(origin[0] + (int)x, width) * bytes_per_voxel;
+            if (num_components == 1) {
+              float value = (decoder.get_value(voxel) - value_min) * value_scale;
+              *dest++ = value <= 0 ? 0 : value >= 255 ? 255 : (uint8_t)(value + 0.5f);
+            } else {
+              dest[0] = voxel[0];
+              dest[1] = voxel[1];
+              dest[2] = voxel[2];
+              dest[3] = bytes_per_voxel == 4 ? voxel[3] : 0xff;
+              dest += 4;
+            }
+          }
+        }
+      }
+    }
+
+    // pick a free slot, or the least recently used one not needed by this update.
+    unsigned find_slot() const {
+      unsigned best = no_slot;
+      for (unsigned slot = 0; slot != slot_key.size(); ++slot) {
+        if (slot_used[slot] != update_count && (best == no_slot || slot_used[slot] < slot_used[best])) {
+          best = slot;
+        }
+      }
+      return best;
+    }
+
+    void create_textures() {
+      GLenum format = num_components == 1 ? GL_LUMINANCE : GL_RGBA;
+      unsigned atlas_size = atlas_slots * brick_size;
+
+      glGenTextures(1, &atlas_texture);
+      glBindTexture(GL_TEXTURE_3D, atlas_texture);
+      glTexImage3D(GL_TEXTURE_3D, 0, format, atlas_size, atlas_size, atlas_size, 0, format, GL_UNSIGNED_BYTE, NULL);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+      glGenTextures(1, &index_texture);
+      glBindTexture(GL_TEXTURE_3D, index_texture);
+      glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, num_bricks[0], num_bricks[1], num_bricks[2], 0, GL_RGBA, GL_UNSIGNED_BYTE, &index_data[0]);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+      atlas_image = new image(GL_TEXTURE_3D, atlas_texture, atlas_size, atlas_size, atlas_size);
+      index_image = new image(GL_TEXTURE_3D, index_texture, num_bricks[0], num_bricks[1], num_bricks[2]);
+    }
+
+    void release() {
+      if (atlas_texture) glDeleteTextures(1, &atlas_texture);
+      if (index_texture) glDeleteTextures(1, &index_texture);
+      atlas_texture = index_texture = 0;
+      atlas_image = 0;
+      index_image = 0;
+      delete map;
+      map = 0;
+    }
+
+  public:
+    RESOURCE_META(volume_texture)
+
+    /// open a volume. brick_size is rounded up to a multiple of four, so rows need no padding.
+    /// The atlas holds atlas_slots^3 bricks.
+    volume_texture(const char *url = "", unsigned brick_size = 64, unsigned atlas_slots = 4) {
+      this->url = url;
+      this->brick_size = brick_size < 8 ? 8 : (brick_size + 3) & ~3;
+      this->atlas_slots = atlas_slots ? atlas_slots : 1;
+      brick_stride = this->brick_size - 2 * border;
+      map = 0;
+      src = src_max = 0;
+      num_bricks[0] = num_bricks[1] = num_bricks[2] = 0;
+      bricks_per_frame = 0;
+      num_components = 1;
+      value_min = 0;
+      value_scale = 1;
+      frame = 0;
+      atlas_texture = index_texture = 0;
+      update_count = 0;
+      if (url[0]) load();
+    }
+
+    ~volume_texture() {
+      release();
+    }
+
+    /// map the file and find the value range of the first frame.
+    bool load() {
+      release();
+      src = src_max = 0;
+      bricks_per_frame = 0;
+
+      if (strncmp(url, "zip://", 6) && strncmp(url, "http://", 7)) {
+        map = new file_map(app_utils::get_path(url));
+        if (!map->get_error()) {
+          src = map->get_data();
+          src_max = src + map->get_size();
+        }
+      }
+
+      if (!src) {
+        app_utils::get_url(buffer, url);
+        if (buffer.size() == 0) return false;
+        src = &buffer[0];
+        src_max = src + buffer.size();
+      }
+
+      if (!decoder.get_header(src, src_max)) {
+        return false;
+      }
+
+      num_components = decoder.is_colour() ? 4 : 1;
+      num_bricks[0] = (decoder.get_width() + brick_stride - 1) / brick_stride;
+      num_bricks[1] = (decoder.get_height() + brick_stride - 1) / brick_stride;
+      num_bricks[2] = (decoder.get_depth() + brick_stride - 1) / brick_stride;
+      bricks_per_frame = num_bricks[0] * num_bricks[1] * num_bricks[2];
+
+      ranges.resize(bricks_per_frame * decoder.get_frames());
+      frame_has_ranges.resize(decoder.get_frames());
+      memset(&frame_has_ranges[0], 0, frame_has_ranges.size());
+      brick_slot.resize(bricks_per_frame);
+      index_data.resize(bricks_per_frame * 4);
+      memset(&index_data[0], 0, index_data.size());
+
+      unsigned num_slots = atlas_slots * atlas_slots * atlas_slots;
+      slot_key.resize(num_slots);
+      slot_used.resize(num_slots);
+      for (unsigned slot = 0; slot != num_slots; ++slot) {
+        slot_key[slot] = ~0u;
+        slot_used[slot] = 0;
+      }
+
+      // scalar values use the display range from the file or the range of the first frame.
+      compute_ranges(0);
+      float lo = decoder.get_cal_min(), hi = decoder.get_cal_max();
+      if (num_components != 1) {
+        lo = 0;
+        hi = 255;
+      } else if (hi <= lo) {
+        lo = 1e37f;
+        hi = -1e37f;
+        for (unsigned brick = 0; brick != bricks_per_frame; ++brick) {
+          lo = ranges[brick].min_value < lo ? ranges[brick].min_value : lo;
+          hi = ranges[brick].max_value > hi ? ranges[brick].max_value : hi;
+        }
+      }
+      value_min = lo;
+      value_scale = hi > lo ? 255.0f / (hi - lo) : 1.0f;
+
+      frame = ~0u;
+      set_frame(0);
+      return true;
+    }
+
+    /// switch to another frame of a time series. Bricks of the new frame that are
+    /// still in the atlas are used again; the rest stream in through update().
+    void set_frame(unsigned new_frame) {
+      if (new_frame >= decoder.get_frames() || new_frame == frame) return;
+      frame = new_frame;
+      if (!frame_has_ranges[frame]) {
+        compute_ranges(frame);
+      }
+      for (unsigned brick = 0; brick != bricks_per_frame; ++brick) {
+        brick_slot[brick] = no_slot;
+      }
+      for (unsigned slot = 0; slot != slot_key.size(); ++slot) {
+        if (slot_key[slot] != ~0u && slot_key[slot] / bricks_per_frame == frame) {
+          brick_slot[slot_key[slot] % bricks_per_frame] = (uint16_t)slot;
+        }
+      }
+    }
+
+    /// copy the bricks the ray caster needs, those with values at or above threshold,
+    /// into the atlas. At most max_uploads bricks are copied per call so that big frames
+    /// stream in over a few frames. Call on the main thread; returns the number of bricks still to come.
+    unsigned update(float threshold, unsigned max_uploads = 16) {
+      if (!bricks_per_frame) return 0;
+      if (!atlas_texture) create_textures();
+      update_count++;
+
+      const brick_range *frame_ranges = &ranges[frame * bricks_per_frame];
+      dynarray<unsigned> wanted;
+      for (unsigned brick = 0; brick != bricks_per_frame; ++brick) {
+        if (frame_ranges[brick].max_value >= threshold) {
+          if (brick_slot[brick] != no_slot) {
+            slot_used[brick_slot[brick]] = update_count;
+          } else {
+            wanted.push_back(brick);
+          }
+        }
+      }
+
+      // choose slots, evicting the least recently used bricks.
+      unsigned num_uploads = 0;
+      dynarray<unsigned> slots;
+      while (num_uploads < wanted.size() && num_uploads < max_uploads) {
+        unsigned slot = find_slot();
+        if (slot == no_slot) break;
+        unsigned old_key = slot_key[slot];
+        if (old_key != ~0u && old_key / bricks_per_frame == frame) {
+          brick_slot[old_key % bricks_per_frame] = no_slot;
+        }
+        slot_key[slot] = frame * bricks_per_frame + wanted[num_uploads];
+        slot_used[slot] = update_count;
+        brick_slot[wanted[num_uploads]] = (uint16_t)slot;
+        slots.push_back(slot);
+        num_uploads++;
+      }
+
+      // read and convert the bricks in parallel, upload them here.
+      unsigned brick_bytes = brick_size * brick_size * brick_size * num_components;
+      if (num_uploads) {
+        staging.resize(num_uploads * brick_bytes);
+        const uint8_t *voxels = decoder.get_frame(src, frame);
+        parallel_for(0, num_uploads, [&](unsigned i) {
+          extract_brick(&staging[i * brick_bytes], wanted[i], voxels);
+        });
+
+        GLenum format = num_components == 1 ? GL_LUMINANCE : GL_RGBA;
+        glBindTexture(GL_TEXTURE_3D, atlas_texture);
+        for (unsigned i = 0; i != num_uploads; ++i) {
+          unsigned slot = slots[i];
+          unsigned sx = slot % atlas_slots, sy = slot / atlas_slots % atlas_slots, sz = slot / atlas_slots / atlas_slots;
+          glTexSubImage3D(GL_TEXTURE_3D, 0, sx * brick_size, sy * brick_size, sz * brick_size, brick_size, brick_size, brick_size, format, GL_UNSIGNED_BYTE, &staging[i * brick_bytes]);
+        }
+      }
+
+      // only resident bricks that reach the threshold are marked in the index.
+      bool index_changed = false;
+      for (unsigned brick = 0; brick != bricks_per_frame; ++brick) {
+        unsigned slot = brick_slot[brick];
+        uint8_t texel[4] = { 0, 0, 0, 0 };
+        if (slot != no_slot && frame_ranges[brick].max_value >= threshold) {
+          texel[0] = (uint8_t)(slot % atlas_slots);
+          texel[1] = (uint8_t)(slot / atlas_slots % atlas_slots);
+          texel[2] = (uint8_t)(slot / atlas_slots / atlas_slots);
+          texel[3] = 0xff;
+        }
+        if (memcmp(&index_data[brick * 4], texel, 4)) {
+          memcpy(&index_data[brick * 4], texel, 4);
+          index_changed = true;
+        }
+      }
+      if (index_changed) {
+        glBindTexture(GL_TEXTURE_3D, index_texture);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, num_bricks[0], num_bricks[1], num_bricks[2], GL_RGBA, GL_UNSIGNED_BYTE, &index_data[0]);
+      }
+
+      return (unsigned)wanted.size() - num_uploads;
+    }
+
+    /// value range of a brick in the current frame, in file units (after scl_slope and scl_inter).
+    const brick_range &get_brick_range(unsigned bx, unsigned by, unsigned bz) const {
+      return ranges[frame * bricks_per_frame + (bz * num_bricks[1] + by) * num_bricks[0] + bx];
+    }
+
+    /// convert a value in file units to the 0..1 range stored in the atlas.
+    float get_normalized_value(float value) const {
+      return (value - value_min) * value_scale * (1.0f / 255);
+    }
+
+    /// the atlas of bricks as a 3D texture.
+    image *get_atlas_image() {
+      if (!atlas_texture && bricks_per_frame) create_textures();
+      return atlas_image;
+    }
+
+    /// the brick index as a 3D texture.
+    image *get_index_image() {
+      if (!index_texture && bricks_per_frame) create_textures();
+      return index_image;
+    }
+
+    unsigned get_width() const { return decoder.get_width(); }
+    unsigned get_height() const { return decoder.get_height(); }
+    unsigned get_depth() const { return decoder.get_depth(); }
+    unsigned get_frames() const { return decoder.get_frames(); }
+    unsigned get_frame() const { return frame; }
+    unsigned get_brick_size() const { return brick_size; }
+    unsigned get_brick_stride() const { return brick_stride; }
+    unsigned get_atlas_slots() const { return atlas_slots; }
+    unsigned get_num_bricks(unsigned axis) const { return num_bricks[axis]; }
+
+    /// access attributes by name
+    void visit(visitor &v) {
+      v.visit(url, atom_url);
+    }
+  };
+}}
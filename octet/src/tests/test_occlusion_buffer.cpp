@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// occlusion_buffer checks that run without a window
+//
+// The projection is the identity, so positions are clip space. An occluder at z = 0
+// covers the bottom two thirds of the screen; boxes are tested behind it at z = 0.5.
+//
+
+#include "../octet.h"
+
+using namespace octet;
+
+static int failures = 0;
+
+static void check(bool value, const char *what) {
+  printf("%s: %s\n", value ? "ok" : "FAILED", what);
+  if (!value) failures++;
+}
+
+// a box between (x0, y0) and (x1, y1) in clip space, behind the occluder.
+static bool box_visible(occlusion_buffer &occ, float x0, float y0, float x1, float y1) {
+  aabb bb(vec3((x0 + x1) * 0.5f, (y0 + y1) * 0.5f, 0.5f), vec3((x1 - x0) * 0.5f, (y1 - y0) * 0.5f, 0.1f));
+  return occ.is_visible(bb);
+}
+
+static void test_size(unsigned width, unsigned height) {
+  printf("%dx%d\n", width, height);
+  occlusion_buffer occ(width, height);
+
+  // y from -1 to 1/3, so the top third of the rows stay at the far plane.
+  vec4 positions[] = { vec4(-1, -1, 0, 1), vec4(1, -1, 0, 1), vec4(1, 1.0f / 3, 0, 1), vec4(-1, 1.0f / 3, 0, 1) };
+  uint32_t indices[] = { 0, 1, 2, 0, 2, 3 };
+  int quad = occ.add_occluder_mesh(positions, 4, indices, 6);
+
+  mat4t identity;
+  identity.loadIdentity();
+  occ.begin(identity);
+  occ.add_occluder(quad, identity);
+  occ.render();
+
+  check(!box_visible(occ, -0.4f, -0.9f, 0.4f, -0.5f), "box behind the occluder is hidden");
+  check(box_visible(occ, -0.9f, 0.5f, 0.9f, 0.9f), "box above the occluder is visible");
+  check(box_visible(occ, -0.99f, -0.99f, 0.99f, 0.99f), "box partly above the occluder is visible");
+  check(box_visible(occ, 0.8f, 0.5f, 0.99f, 0.99f), "box in the top right corner is visible");
+}
+
+int main(int argc, char **argv) {
+  // odd sized levels: 96x48 halves to 6x3 and then 3x2.
+  test_size(96, 48);
+  test_size(160, 80);
+  test_size(256, 128);
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}